@@ -32,6 +32,7 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <time.h>
 #include <stdlib.h>
@@ -40,6 +41,10 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 
 
 /* The filesystem you implement must support all the 13 operations
@@ -218,74 +223,117 @@
 /* Helper types and functions */
 
 #define NAME_MAX_LEN 255
+#define MYFS_BLOCK_SIZE 1024
 
 typedef size_t myfs_off_t;
 
+/* Called by __myfs_readdir_filler_implem for every entry; returns
+   nonzero once it cannot take any more entries, like fuse_fill_dir_t.
+*/
+typedef int (*myfs_fill_dir_t)(void *buf, const char *name, const struct stat *stbuf,
+                               off_t off);
+
+#define MYFS_FREE_CLASSES 64
+#define MYFS_FRAG_CLASSES 5  // Fragment blocks of 4, 8, 16, 32 and 64 slots, see Data zone
+
 struct myfs_super {
     uint32_t is_set;
     myfs_off_t root_dir;
-    myfs_off_t free_memory;
     size_t size;
+    myfs_off_t heap_start;                         // First block of the heap
+    myfs_off_t heap_end;                           // End-of-heap sentinel header
+    uint64_t free_map;                             // Bit c set iff free_lists[c] is non-empty
+    myfs_off_t free_lists[MYFS_FREE_CLASSES];      // Segregated free lists, by power of two
+    myfs_off_t slab_partial;                       // Node slabs with at least one free slot
+    size_t slab_nodes_total;                       // Node slots in all slabs
+    size_t slab_nodes_used;                        // Node slots holding a live node
+    size_t free_bytes;                             // Payload bytes of all free heap blocks
+    size_t data_block_size;                        // Block size of the data zone, 0 if none
+    size_t data_blocks;                            // Blocks in the region, zone or not
+    size_t data_first;                             // First block of the zone, the heap ends there
+    size_t data_free;                              // Free blocks in the zone
+    size_t data_hint;                              // Bitmap word where searches start
+    myfs_off_t data_bitmap;                        // Bit i set iff block i is not free zone space
+    myfs_off_t frag_lists[MYFS_FRAG_CLASSES];      // Fragment blocks with a free slot, by slot size
+    size_t frag_free_bytes;                        // Bytes in the free slots of fragment blocks
+    myfs_off_t slab_all;                           // All node slabs, newest first
+    myfs_off_t defrag_slab;                        // Slab the defragmenter looks at next
+    uint32_t defrag_slot;                          // Slot in that slab it looks at next
+    myfs_off_t snapshot_dir;                       // Directory of all snapshots
+    uint64_t journal_gen;                          // Generation of the image, see Journal
+    myfs_off_t dirty_map;                          // Pages changed since the last flush, 0 if none
+    uint64_t attach_key;                           // Process and mapping lock belongs to
+    pthread_rwlock_t lock;                         // See Region lock
+    pthread_mutex_t heap_lock;                     // Serializes the allocators, see Node locks
+    int journal_fd;                                // Journal file, -1 if none
+    int journal_syncing;                           // A thread is syncing the journal
+    uint64_t journal_end;                          // Bytes written to the journal
+    uint64_t journal_synced;                       // Bytes of the journal known to be on disk
+    pthread_mutex_t journal_mutex;                 // Protects the journal fields above
+    pthread_cond_t journal_cond;                   // Signalled when a sync finishes
+    uint64_t journal_base;                         // Bytes of the journal before its current start
+    myfs_off_t open_files;                         // See Open files, 0 if none
+    size_t open_files_capacity;                    // Slots of the open file table
+    myfs_off_t pins;                               // See Pinned reads, 0 if none
+    size_t pins_capacity;                          // Slots of the pin table
+    myfs_off_t retired;                            // Blocks waiting to be freed, see Node locks
+    int exclusive;                                 // The region lock is held exclusively
 };
 
-/* Superblock structure */
-typedef struct myfs_superblock {
-    size_t total_blocks;
-    size_t free_blocks;
-    size_t block_size;
-    size_t namemax;
-} myfs_superblock_t;
-
-/* Combined myfs_file_t structure */
-typedef struct myfs_file {
-    char name[NAME_MAX_LEN];         // Name of the file or directory
-    int is_directory;                // 1 if it's a directory, 0 if it's a file
-    size_t size;                     // Size of the file (in bytes)
-    char *data;                      // Pointer to file data (for files)
-    size_t children_offset;          // Offset to child files or directories
-    size_t next_offset;              // Offset to next sibling file or directory
-    time_t mtime;                    // Last modification time
-    time_t ctime;                    // Creation time
-    time_t atime;                    // Last access time
-} myfs_file_t;
+#define MYFS_INLINE_MAX ((size_t) 200)
 
 struct myfs_file_data {
-    size_t size;
-    size_t allocated;
-    myfs_off_t data;
-    myfs_off_t next_file_block;
+    size_t size;                     // Size of the file (in bytes)
+    union {
+        struct {                     // Used when size > MYFS_INLINE_MAX
+            size_t allocated;        // Sum of the capacities of all extents
+            myfs_off_t data;         // First extent of the file
+            myfs_off_t last_extent;  // Last extent of the file
+        };
+        char inline_data[MYFS_INLINE_MAX]; // Used when size <= MYFS_INLINE_MAX
+    };
 };
 
 struct myfs_dir {
-    size_t number_children;
+    uint32_t number_children;
+    uint32_t length;                 // Used entries of the children array, holes included
+    size_t capacity;                 // Entries the children array has room for
     myfs_off_t children;
+    myfs_off_t index;                // Hash index over the children, 0 if none
 };
 
+/* A node keeps names of up to MYFS_SHORT_NAME bytes in the node
+   itself; longer names go into a heap block of their own. The fields
+   looked at by lookups, directory scans and stat all come first,
+   inside the first 64 bytes of the node.
+*/
+#define MYFS_SHORT_NAME 23
+
+#define MYFS_NODE_SNAPSHOT     1   // Entry of the snapshot directory
+#define MYFS_NODE_SHARED_DATA  2   // Extents may be shared with a copy of the node
+
+#define MYFS_SNAPSHOT_DIR ".snapshots"
+
 struct myfs_node {
-    char name[NAME_MAX_LEN + 1];
     char is_file; // 0 is directory, 1 is file
+    uint8_t slab_slot; // Index of the node inside its slab
+    uint8_t name_len; // Length of the name, without the '\0'
+    uint8_t flags; // MYFS_NODE_* bits
+    uint32_t dir_seq; // Increases along the children array of the parent
+    union {
+        char short_name[MYFS_SHORT_NAME + 1]; // If name_len <= MYFS_SHORT_NAME
+        myfs_off_t long_name;                 // Heap block holding the name otherwise
+    } name;
     struct timespec times[2];
     union {
         struct myfs_file_data file;
         struct myfs_dir directory;
+        myfs_off_t snapshot_root; // Root directory of a snapshot
     } data;
+    uint32_t lock; // See Node locks
+    uint32_t seq;  // Odd while the node is being changed, see Node locks
 };
 
-static void update_time(struct myfs_node *node, int set_mod) {
-    if (node == NULL) {
-        return;
-    }
-
-    struct timespec ts;
-
-    if (clock_gettime(CLOCK_REALTIME, &ts) == 0) {
-        node->times[0] = ts;
-        if (set_mod) {
-            node->times[1] = ts;
-        }
-    }
-}
-
 static void *off_to_ptr(void *fsptr, myfs_off_t offset) {
     return (char *)fsptr + offset;
 }
@@ -294,1117 +342,6940 @@ static myfs_off_t ptr_to_off(void *fsptr, void *ptr) {
     return (myfs_off_t)((char *)ptr - (char *)fsptr);
 }
 
-struct myfs_super *initialize_myfs(void *fsptr, size_t fssize) {
-    struct myfs_super *super = (struct myfs_super *)fsptr;
-
-    // Check if the filesystem is already initialized
-    if (super->is_set != 1) {
-        super->is_set = 1;
-        super->size = fssize;
-        super->root_dir = sizeof(struct myfs_super);
-
-        // Initialize the root directory node
-        struct myfs_node *root = off_to_ptr(fsptr, super->root_dir);
-        memset(root->name, '\0', NAME_MAX_LEN + 1);
-        strcpy(root->name, "/");
-        update_time(root, 1);  // Mark the root directory creation time
-        root->is_file = 0;    // Mark as a directory
-
-        // Initialize root directory's children
-        root->data.directory.number_children = 0;
-        myfs_off_t *children = off_to_ptr(fsptr, super->root_dir + sizeof(struct myfs_node));
-        *children = 0;
-        root->data.directory.children = ptr_to_off(fsptr, children);
+/* Returns a pointer to the count objects of size bytes at offset, or
+   NULL if they do not lie inside the region. Readers that do not lock
+   what they read (see Node locks) may find any value in a node that
+   is being changed, and check every offset they follow with this.
+*/
+static void *region_ptr(void *fsptr, myfs_off_t offset, size_t count, size_t size) {
+    size_t fssize = ((struct myfs_super *)fsptr)->size;
 
-        // Set up free memory pointer
-        super->free_memory = ptr_to_off(fsptr, children + 1);
-        myfs_off_t *free_memory = off_to_ptr(fsptr, super->free_memory);
-        *free_memory = fssize - super->free_memory - sizeof(size_t);
+    if (offset > fssize || (size != 0 && count > (fssize - offset) / size)) {
+        return NULL;
     }
-
-    return super;
+    return off_to_ptr(fsptr, offset);
 }
 
-static struct myfs_node *find_node(void *fsptr, const char *path) {
-    struct myfs_super *super = (struct myfs_super *)fsptr;
-    struct myfs_node *current = off_to_ptr(fsptr, super->root_dir);
-
-    if (strcmp(path, "/") == 0) {
-        return current;
+/* Returns 1 if bits [first, first + n) of a bitmap are all clear */
+static int bitmap_is_clear(const uint64_t *bitmap, size_t first, size_t n) {
+    while (n > 0) {
+        size_t bit = first % 64;
+        size_t count = 64 - bit;
+        if (count > n) {
+            count = n;
+        }
+        uint64_t mask = (count == 64) ? ~(uint64_t)0 : (((uint64_t)1 << count) - 1) << bit;
+        if (bitmap[first / 64] & mask) {
+            return 0;
+        }
+        first += count;
+        n -= count;
     }
+    return 1;
+}
 
-    char *path_copy = strdup(path);
-    char *token = strtok(path_copy, "/");
-
-    while (token != NULL) {
-        int found = 0;
-        myfs_off_t *children = off_to_ptr(fsptr, current->data.directory.children);
-
-        for (size_t i = 0; i < current->data.directory.number_children; i++) {
-            struct myfs_node *child = off_to_ptr(fsptr, children[i]);
-            if (strcmp(child->name, token) == 0) {
-                current = child;
-                found = 1;
-                break;
-            }
+/* Sets (set != 0) or clears bits [first, first + n) of a bitmap */
+static void bitmap_mark(uint64_t *bitmap, size_t first, size_t n, int set) {
+    while (n > 0) {
+        size_t bit = first % 64;
+        size_t count = 64 - bit;
+        if (count > n) {
+            count = n;
         }
-
-        if (!found) {
-            free(path_copy);
-            return NULL;
+        uint64_t mask = (count == 64) ? ~(uint64_t)0 : (((uint64_t)1 << count) - 1) << bit;
+        if (set) {
+            // Writers running side by side mark the dirty map at the same
+            // time (see Node locks); bits only get cleared by flushes, under
+            // the exclusive region lock, and by the heap lock holder
+            if ((__atomic_load_n(&bitmap[first / 64], __ATOMIC_RELAXED) & mask) != mask) {
+                __atomic_fetch_or(&bitmap[first / 64], mask, __ATOMIC_RELAXED);
+            }
+        } else {
+            bitmap[first / 64] &= ~mask;
         }
-
-        token = strtok(NULL, "/");
+        first += count;
+        n -= count;
     }
-
-    free(path_copy);
-    return current;
 }
 
-static struct myfs_node *find_parent_node(void *fsptr, const char *path, char **last_token) {
-    struct myfs_super *super = (struct myfs_super *)fsptr;
-    struct myfs_node *current = off_to_ptr(fsptr, super->root_dir);
+/* Dirty tracking
 
-    if (strcmp(path, "/") == 0) {
-        *last_token = strdup("");
-        return current;
-    }
+   The backup-file need not be rewritten as a whole to catch up with
+   the region (see __myfs_flush_implem). Every change to the region
+   marks the pages of MYFS_DIRTY_PAGE bytes it touches in the dirty
+   map, a bitmap kept in the heap, and a flush writes just these pages
+   and clears their bits. The pages holding the superblock are written
+   by every flush, so changes to its fields need not be marked.
 
-    // Normalize path
-    char *path_copy = strdup(path);
-    if (!path_copy) return NULL;
-    while (path_copy[strlen(path_copy) - 1] == '/')
-        path_copy[strlen(path_copy) - 1] = '\0'; // Remove trailing slashes
+   A page is thus marked whenever it may differ from the backup-file.
+   A new mount starts out with a clear map, as the region has just been
+   read from the backup-file, and a region without a map (because
+   there was no space for it) is written as a whole by its first flush.
+*/
 
-    char *token = strtok(path_copy, "/");
-    char *prev_token = NULL;
+#define MYFS_DIRTY_SHIFT 12
+#define MYFS_DIRTY_PAGE  ((size_t) 1 << MYFS_DIRTY_SHIFT)
 
-    while (token != NULL) {
-        prev_token = token;
-        char *next_token = strtok(NULL, "/");
+/* Marks the pages holding the len bytes at ptr as changed */
+static void region_dirty(void *fsptr, const void *ptr, size_t len) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
 
-        if (!next_token) {
-            // Stop before the last token to find the parent
-            break;
-        }
+    if (super->dirty_map == 0 || len == 0) {
+        return;
+    }
 
-        int found = 0;
-        myfs_off_t *children = off_to_ptr(fsptr, current->data.directory.children);
+    size_t offset = (const char *)ptr - (const char *)fsptr;
+    size_t first = offset >> MYFS_DIRTY_SHIFT;
+    size_t last = (offset + len - 1) >> MYFS_DIRTY_SHIFT;
+    bitmap_mark(off_to_ptr(fsptr, super->dirty_map), first, last - first + 1, 1);
+}
 
-        for (size_t i = 0; i < current->data.directory.number_children; i++) {
-            struct myfs_node *child = off_to_ptr(fsptr, children[i]);
-            if (strcmp(child->name, token) == 0) {
-                current = child;
-                found = 1;
-                break;
-            }
-        }
+/* Node locks
+
+   Operations that only look at the tree take the region lock shared
+   (see Region lock), and so do writes, truncations, time changes and
+   creations on paths that no snapshot shares; everything else takes it
+   exclusively. Operations running side by side under the shared lock
+   synchronize on the nodes they touch: every node has a reader/writer
+   lock of its own, taken shared to look a name up in a directory, to
+   list it or to read a file or the attributes of a node, and
+   exclusively to add a child to a directory or to change a file. A
+   thread holds at most one node lock at a time, so node locks cannot
+   deadlock. Nodes only leave the tree under the exclusive region lock,
+   so a node found under the shared lock stays where it is.
+
+   The lock is a word of the node: MYFS_NODE_WRITER is set while a
+   writer holds or waits for the lock, which keeps new readers out, and
+   the bits below count the readers. Node locks are only held under the
+   region lock and are all free whenever it is held exclusively, which
+   is when nodes get copied, moved or flushed, so the word need not be
+   reset on mount.
+
+   Lookups, stat and reads, by far the most frequent operations, do not
+   take the lock at all but read optimistically: every node has a
+   sequence counter, which node_lock makes odd before a writer changes
+   the node, its directory index or its file contents and node_unlock
+   makes even again afterwards. A reader notes the counter, waiting
+   while it is odd, reads, and starts over if the counter has moved in
+   the meantime. What it reads may then be inconsistent, so it checks
+   every offset it follows (see region_ptr) and bounds every walk, and
+   uses nothing of it before the counter confirms it. After
+   MYFS_SEQ_TRIES failed attempts, it takes the lock shared instead,
+   so writers cannot starve it. The counter is even whenever the
+   region lock is held exclusively, so it need not be reset either.
+
+   Whatever an optimistic reader looks at, it loads atomically, and
+   the writers it may overlap with store it atomically, file contents
+   included (see region_load and region_store). Readers load with
+   __ATOMIC_ACQUIRE, which keeps every load ahead of the final look at
+   the counter without a fence, and writers store with
+   __ATOMIC_RELEASE, so a reader that sees a change sees the counter
+   made odd before it, too. On x86, both are plain moves. A reader may
+   also still be looking at a block a writer has just unlinked, so a
+   block freed under the shared region lock is only retired (see
+   region_retire) until no thread holds the region lock any more.
+
+   The allocators are shared by all nodes and get a lock of their own,
+   the heap lock in the superblock, which myfs_alloc, myfs_free, the
+   node and the extent allocators take around their work. It is
+   recursive, as they call each other.
+*/
 
-        if (!found) {
-            free(path_copy);
-            return NULL; // Child not found
-        }
+#define MYFS_NODE_WRITER 0x80000000u
+#define MYFS_LOCK_SPINS  100
+#define MYFS_SEQ_TRIES   4
 
-        token = next_token;
+/* Waits a moment for a node lock: spins at first, then yields */
+static void node_lock_wait(unsigned int *spinsptr) {
+    if (++*spinsptr >= MYFS_LOCK_SPINS) {
+        sched_yield();
     }
-
-    *last_token = strdup(prev_token);
-    free(path_copy);
-    return current;
 }
 
-static struct myfs_node *get_node(void *fsptr, struct myfs_dir *dir, const char *name) {
-    myfs_off_t *children = off_to_ptr(fsptr, dir->children);
-    for (size_t i = 0; i < dir->number_children; i++) {
-        struct myfs_node *child = off_to_ptr(fsptr, children[i]);
-        if (strcmp(child->name, name) == 0) {
-            return child;
+static void node_lock_shared(struct myfs_node *node) {
+    for (unsigned int spins = 0;; node_lock_wait(&spins)) {
+        uint32_t seen = __atomic_load_n(&node->lock, __ATOMIC_RELAXED);
+        if (!(seen & MYFS_NODE_WRITER) &&
+            __atomic_compare_exchange_n(&node->lock, &seen, seen + 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
         }
     }
-    return NULL;
 }
 
-size_t myfs_traverse_path(void *fsptr, const char *path) {
-    char *token, *path_copy;
-    size_t current_offset = 0;
+static void node_unlock_shared(struct myfs_node *node) {
+    __atomic_fetch_sub(&node->lock, 1, __ATOMIC_RELEASE);
+}
+
+static void node_lock(void *fsptr, struct myfs_node *node) {
+    for (unsigned int spins = 0;; node_lock_wait(&spins)) {
+        uint32_t seen = __atomic_load_n(&node->lock, __ATOMIC_RELAXED);
+        if (!(seen & MYFS_NODE_WRITER) &&
+            __atomic_compare_exchange_n(&node->lock, &seen, seen | MYFS_NODE_WRITER, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
 
-    if (path[0] == '/') {
-        current_offset = 0;
+    // No reader gets in any more; wait for those inside to leave
+    for (unsigned int spins = 0; __atomic_load_n(&node->lock, __ATOMIC_ACQUIRE) != MYFS_NODE_WRITER;
+         node_lock_wait(&spins)) {
     }
 
-    path_copy = strdup(path);
-    token = strtok(path_copy, "/");
+    // Optimistic readers see the odd counter before any change, as
+    // changes are stored with __ATOMIC_RELEASE
+    region_dirty(fsptr, &node->seq, sizeof(node->seq));
+    __atomic_store_n(&node->seq, node->seq + 1, __ATOMIC_RELAXED);
+}
 
-    while (token != NULL) {
-        myfs_file_t *current = (myfs_file_t *)((char *)fsptr + current_offset);
-        size_t next_offset = current->children_offset;
-        myfs_file_t *next = (next_offset != 0) ? (myfs_file_t *)((char *)fsptr + next_offset) : NULL;
+/* Unlocks a node locked with node_lock. Does nothing for NULL. */
+static void node_unlock(struct myfs_node *node) {
+    if (node != NULL) {
+        __atomic_store_n(&node->seq, node->seq + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&node->lock, 0, __ATOMIC_RELEASE);
+    }
+}
 
-        int found = 0;
-        while (next != NULL) {
-            if (strcmp(next->name, token) == 0) {
-                current_offset = next_offset;
-                found = 1;
-                break;
-            }
-            next_offset = next->next_offset;
-            next = (next_offset != 0) ? (myfs_file_t *)((char *)fsptr + next_offset) : NULL;
-        }
+/* Starts attempt number tries of a read of node. Returns the sequence
+   counter to hand to node_read_retry afterwards. The last attempt
+   takes the lock shared, which is marked by an odd result.
+*/
+static uint32_t node_read_begin(struct myfs_node *node, unsigned int tries) {
+    if (tries >= MYFS_SEQ_TRIES) {
+        node_lock_shared(node);
+        return 1;
+    }
 
-        if (!found) {
-            free(path_copy);
-            return (size_t)-1;
+    for (unsigned int spins = 0;; node_lock_wait(&spins)) {
+        uint32_t seq = __atomic_load_n(&node->seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1)) {
+            return seq;
         }
+    }
+}
 
-        token = strtok(NULL, "/");
+/* Ends a read of node started with node_read_begin. Returns 1 if the
+   node changed meanwhile, so that the read must be done again.
+*/
+static int node_read_retry(struct myfs_node *node, uint32_t seq) {
+    if (seq & 1) {
+        node_unlock_shared(node);
+        return 0;
     }
 
-    free(path_copy);
-    return current_offset;
+    // The reads were all __ATOMIC_ACQUIRE loads, which this cannot
+    // overtake
+    return __atomic_load_n(&node->seq, __ATOMIC_RELAXED) != seq;
 }
 
-/* End of helper functions */
+/* Copies n bytes at src in the region into buf, as optimistic readers
+   do: a word at a time, with atomic loads (see Node locks)
+*/
+static void region_load(void *buf, const void *src, size_t n) {
+    char *to = buf;
+    const char *from = src;
 
-/* Implements an emulation of the stat system call on the filesystem 
-   of size fssize pointed to by fsptr. 
-   
-   If path can be followed and describes a file or directory 
-   that exists and is accessable, the access information is 
-   put into stbuf. 
+    for (; n > 0 && (uintptr_t)from % sizeof(uint64_t) != 0; n--) {
+        *to++ = __atomic_load_n(from++, __ATOMIC_ACQUIRE);
+    }
+    for (; n >= sizeof(uint64_t); n -= sizeof(uint64_t)) {
+        uint64_t word = __atomic_load_n((const uint64_t *)from, __ATOMIC_ACQUIRE);
+        memcpy(to, &word, sizeof(word));
+        to += sizeof(word);
+        from += sizeof(word);
+    }
+    for (; n > 0; n--) {
+        *to++ = __atomic_load_n(from++, __ATOMIC_ACQUIRE);
+    }
+}
 
-   On success, 0 is returned. On failure, -1 is returned and 
-   the appropriate error code is put into *errnoptr.
+/* Copies n bytes from buf to dst in the region, as writers do where
+   optimistic readers may look: a word at a time, with atomic stores
+*/
+static void region_store(void *dst, const void *buf, size_t n) {
+    char *to = dst;
+    const char *from = buf;
 
-   man 2 stat documents all possible error codes and gives more detail
-   on what fields of stbuf need to be filled in. Essentially, only the
-   following fields need to be supported:
+    for (; n > 0 && (uintptr_t)to % sizeof(uint64_t) != 0; n--) {
+        __atomic_store_n(to++, *from++, __ATOMIC_RELEASE);
+    }
+    for (; n >= sizeof(uint64_t); n -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, from, sizeof(word));
+        __atomic_store_n((uint64_t *)to, word, __ATOMIC_RELEASE);
+        to += sizeof(word);
+        from += sizeof(word);
+    }
+    for (; n > 0; n--) {
+        __atomic_store_n(to++, *from++, __ATOMIC_RELEASE);
+    }
+}
 
-   st_uid      the value passed in argument
-   st_gid      the value passed in argument
-   st_mode     (as fixed values S_IFDIR | 0755 for directories,
-                                S_IFREG | 0755 for files)
-   st_nlink    (as many as there are subdirectories (not files) for directories
-                (including . and ..),
-                1 for files)
-   st_size     (supported only for files, where it is the real file size)
-   st_atim
-   st_mtim
+/* Like memset(dst, 0, n) for region_store */
+static void region_zero(void *dst, size_t n) {
+    char *to = dst;
 
-*/
-int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
-                          uid_t uid, gid_t gid,
-                          const char *path, struct stat *stbuf) {
-    struct myfs_node *node = find_node(fsptr, path);
+    for (; n > 0 && (uintptr_t)to % sizeof(uint64_t) != 0; n--) {
+        __atomic_store_n(to++, 0, __ATOMIC_RELEASE);
+    }
+    for (; n >= sizeof(uint64_t); n -= sizeof(uint64_t)) {
+        __atomic_store_n((uint64_t *)to, 0, __ATOMIC_RELEASE);
+        to += sizeof(uint64_t);
+    }
+    for (; n > 0; n--) {
+        __atomic_store_n(to++, 0, __ATOMIC_RELEASE);
+    }
+}
+
+static void update_time(void *fsptr, struct myfs_node *node, int set_mod) {
     if (node == NULL) {
-        *errnoptr = ENOENT;
-        return -1;
+        return;
     }
 
-    memset(stbuf, 0, sizeof(struct stat));
-    stbuf->st_uid = uid;
-    stbuf->st_gid = gid;
-    stbuf->st_atime = node->times[0].tv_sec;
-    stbuf->st_mtime = node->times[1].tv_sec;
+    struct timespec ts;
 
-    if (node->is_file) {
-        stbuf->st_mode = S_IFREG | 0644;
-        stbuf->st_nlink = 1;
-        stbuf->st_size = node->data.file.size;
-    } else {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-        stbuf->st_size = 0;
+    if (clock_gettime(CLOCK_REALTIME, &ts) == 0) {
+        region_dirty(fsptr, node->times, sizeof(node->times));
+        region_store(&node->times[0], &ts, sizeof(ts));
+        if (set_mod) {
+            region_store(&node->times[1], &ts, sizeof(ts));
+        }
     }
-
-    return 0;
 }
 
-/* Implements an emulation of the readdir system call on the filesystem 
-   of size fssize pointed to by fsptr. 
+static void heap_lock(void *fsptr) {
+    pthread_mutex_lock(&((struct myfs_super *)fsptr)->heap_lock);
+}
 
-   If path can be followed and describes a directory that exists and
-   is accessable, the names of the subdirectories and files 
-   contained in that directory are output into *namesptr. The . and ..
-   directories must not be included in that listing.
+static void heap_unlock(void *fsptr) {
+    pthread_mutex_unlock(&((struct myfs_super *)fsptr)->heap_lock);
+}
 
-   If it needs to output file and subdirectory names, the function
-   starts by allocating (with calloc) an array of pointers to
-   characters of the right size (n entries for n names). Sets
-   *namesptr to that pointer. It then goes over all entries
-   in that array and allocates, for each of them an array of
-   characters of the right size (to hold the i-th name, together 
-   with the appropriate '\0' terminator). It puts the pointer
-   into that i-th array entry and fills the allocated array
-   of characters with the appropriate name. The calling function
-   will call free on each of the entries of *namesptr and 
-   on *namesptr.
+/* Sets up the heap lock of a region */
+static void heap_lock_init(void *fsptr) {
+    pthread_mutexattr_t attr;
 
-   The function returns the number of names that have been 
-   put into namesptr. 
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&((struct myfs_super *)fsptr)->heap_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
 
-   If no name needs to be reported because the directory does
-   not contain any file or subdirectory besides . and .., 0 is 
-   returned and no allocation takes place.
+/* Data zone
+
+   File extents do not come from the heap but from a zone of
+   fixed-size blocks at the end of the region, managed by a bitmap
+   that is itself a heap block. The heap thus holds the metadata only
+   (the superblock, node slabs, directory arrays and indexes, long
+   names), and walking the tree does not drag file contents through
+   the cache. Extents only fall back to the heap when the zone is full
+   or the region has no zone. Block i of the zone starts at offset
+   i * data_block_size, so blocks are aligned to their size. Bit i of
+   the bitmap is set iff block i is in use or not part of the zone.
+   Free runs are found a 64-bit word at a time: whole words are
+   skipped with a single compare and runs inside a word are measured
+   with bit scans, so a search costs at most one pass over the bitmap.
+
+   The zone is filled from its end downwards, while the heap occupies
+   the beginning of the region. When the heap runs out of space, it
+   takes over free blocks at the front of the zone (see heap_grow), so
+   neither side has a fixed share of the region.
+
+   Extents of at most a quarter block are cut out of fragment blocks,
+   zone blocks split into 4 to 64 slots of one power-of-two size. Slot
+   0 of a fragment block holds a struct myfs_frag_block, whose bitmap
+   tells which slots are taken; blocks with a free slot are chained
+   into frag_lists by slot size, and a block goes back to the zone as
+   soon as its last extent is freed. The size of a slot follows from
+   the capacity of the extent in it, so freeing needs no lookup.
+
+   MYFS_DATA_BLOCK_SIZE sets the block size for newly formatted
+   regions; it must be a power of two between 1K and 64K. Regions
+   smaller than MYFS_DATA_ZONE_MIN have no data zone at all.
+
+   In regions of at least MYFS_HUGE_ZONE_MIN, the border between heap
+   and zone follows huge pages of MYFS_HUGE_PAGE bytes: it starts out
+   on a huge page boundary, and the heap grows and shrinks by whole
+   huge pages where it can. The superblock, the nodes and the
+   directories thus share a few huge pages at the start of the region
+   with nothing else. Extents of at least a quarter of a huge page go
+   at the end of a huge page that has room for them, so that reading
+   one of them never touches two. This only costs a little slack and
+   pays off once the region is backed by huge pages, see
+   __myfs_hugepages_implem.
+*/
 
-   On failure, -1 is returned and the *errnoptr is set to 
-   the appropriate error code. 
+#ifndef MYFS_DATA_BLOCK_SIZE
+#define MYFS_DATA_BLOCK_SIZE 4096
+#endif
 
-   The error codes are documented in man 2 readdir.
+#if MYFS_DATA_BLOCK_SIZE < 1024 || MYFS_DATA_BLOCK_SIZE > 65536 || \
+    (MYFS_DATA_BLOCK_SIZE & (MYFS_DATA_BLOCK_SIZE - 1)) != 0
+#error "MYFS_DATA_BLOCK_SIZE must be a power of two between 1024 and 65536"
+#endif
 
-   In the case memory allocation with malloc/calloc fails, failure is
-   indicated by returning -1 and setting *errnoptr to EINVAL.
+#define MYFS_DATA_ZONE_MIN    ((size_t) 1 << 20)
+#define MYFS_DATA_HEAP_SHARE  8    // The heap starts out with 1/8 of the region
+#define MYFS_FRAG_MIN         ((size_t) 64) // Smallest slot of a fragment block
+#define MYFS_HUGE_PAGE        ((size_t) 2 << 20)
+#define MYFS_HUGE_ZONE_MIN    ((size_t) 16 << 20)
 
+/* Returns the number of zone blocks in a huge page if the layout
+   follows huge pages, and 0 otherwise
 */
-int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
-                          const char *path, char ***namesptr) {
-    struct myfs_node *dir_node = find_node(fsptr, path);
-    if (dir_node == NULL || dir_node->is_file) {
-        *errnoptr = ENOENT;
-        return -1;
+static size_t data_huge_blocks(const struct myfs_super *super) {
+    if (super->data_block_size == 0 || super->size < MYFS_HUGE_ZONE_MIN) {
+        return 0;
     }
+    return MYFS_HUGE_PAGE / super->data_block_size;
+}
 
-    size_t count = dir_node->data.directory.number_children;
-    *namesptr = calloc(count, sizeof(char *));
-    if (*namesptr == NULL) {
-        *errnoptr = ENOMEM;
-        return -1;
-    }
+/* Sets (used != 0) or clears the bits of blocks [first, first + n) */
+static void data_mark(void *fsptr, size_t first, size_t n, int used) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    uint64_t *bitmap = off_to_ptr(fsptr, super->data_bitmap);
 
-    myfs_off_t *children = off_to_ptr(fsptr, dir_node->data.directory.children);
-    for (size_t i = 0; i < count; i++) {
-        struct myfs_node *child = off_to_ptr(fsptr, children[i]);
-        (*namesptr)[i] = strdup(child->name);
-        if ((*namesptr)[i] == NULL) {
-            for (size_t j = 0; j < i; j++) {
-                free((*namesptr)[j]);
-            }
-            free(*namesptr);
-            *errnoptr = ENOMEM;
-            return -1;
-        }
+    if (n > 0) {
+        size_t first_word = first / 64, last_word = (first + n - 1) / 64;
+        region_dirty(fsptr, &bitmap[first_word], (last_word - first_word + 1) * sizeof(uint64_t));
+        bitmap_mark(bitmap, first, n, used);
     }
-
-    return count;
 }
 
-/* Implements an emulation of the mknod system call for regular files
-   on the filesystem of size fssize pointed to by fsptr.
-
-   This function is called only for the creation of regular files.
-
-   If a file gets created, it is of size zero and has default
-   ownership and mode bits.
-
-   The call creates the file indicated by path.
+/* Finds the highest run of n free blocks in the zone and returns its
+   first block, or SIZE_MAX if there is none.
+*/
+static size_t data_find_run(void *fsptr, size_t n) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    uint64_t *bitmap = off_to_ptr(fsptr, super->data_bitmap);
+    size_t first_word = super->data_first / 64;
+    size_t run = 0, run_top = 0;
 
-   On success, 0 is returned.
+    for (size_t w = super->data_hint + 1; w-- > first_word;) {
+        uint64_t used = bitmap[w];
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
+        // Runs of 64 free or used blocks are the common case
+        if (used == 0) {
+            if (run == 0) {
+                run_top = w * 64 + 63;
+            }
+            run += 64;
+            if (run >= n) {
+                return run_top + 1 - n;
+            }
+            continue;
+        }
+        if (used == ~(uint64_t)0) {
+            run = 0;
+            if (w == super->data_hint && w > 0) {
+                super->data_hint--;
+            }
+            continue;
+        }
 
-   The error codes are documented in man 2 mknod.
+        // Walk the word from its top bit down, one run of equal bits
+        // at a time
+        int bit = 63;
+        while (bit >= 0) {
+            uint64_t top = used << (63 - bit);
+            int count;
+            if (top >> 63) {
+                count = (top == ~(uint64_t)0 << (63 - bit)) ? bit + 1 : __builtin_clzll(~top);
+                run = 0;
+            } else {
+                count = (top == 0) ? bit + 1 : __builtin_clzll(top);
+                if (count > bit + 1) {
+                    count = bit + 1;
+                }
+                if (run == 0) {
+                    run_top = w * 64 + bit;
+                }
+                run += count;
+                if (run >= n) {
+                    return run_top + 1 - n;
+                }
+            }
+            bit -= count;
+        }
+    }
+    return SIZE_MAX;
+}
 
+/* Finds the highest huge page of the zone whose last n blocks are
+   free and returns the first of them, or SIZE_MAX if there is none.
+   huge is the number of blocks in a huge page, at least n.
 */
-int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
-    struct myfs_super *super = initialize_myfs(fsptr, fssize);
+static size_t data_find_huge(void *fsptr, size_t n, size_t huge) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    uint64_t *bitmap = off_to_ptr(fsptr, super->data_bitmap);
+    size_t top = (super->data_hint * 64 + 64) / huge * huge;
 
-    struct myfs_node *parent_node;
-    char *last_token;
-    parent_node = find_parent_node(fsptr, path, &last_token);
-    if (parent_node == NULL) {
-        *errnoptr = ENOENT;
-        free(last_token);
-        return -1;
+    if (top > super->data_blocks) {
+        top = super->data_blocks / huge * huge;
     }
-
-    if (parent_node->is_file) {
-        *errnoptr = ENOTDIR;
-        free(last_token);
-        return -1;
+    while (top >= super->data_first + n) {
+        if (bitmap_is_clear(bitmap, top - n, n)) {
+            return top - n;
+        }
+        top -= huge;
     }
+    return SIZE_MAX;
+}
 
-    struct myfs_node *existing_node = get_node(fsptr, &parent_node->data.directory, last_token);
-    if (existing_node != NULL) {
-        update_time(existing_node, 1);
-        *errnoptr = EEXIST;
-        free(last_token);
-        return -1;
-    }
+/* Allocates n contiguous blocks of the data zone. Returns the offset
+   of the first one, or 0 if there is no data zone or no such run.
+*/
+static myfs_off_t data_alloc(void *fsptr, size_t n) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
 
-    if (strlen(last_token) > NAME_MAX_LEN) {
-        *errnoptr = ENAMETOOLONG;
-        free(last_token);
-        return -1;
+    if (super->data_block_size == 0 || n > super->data_free) {
+        return 0;
     }
 
-    // Validate path
-    if (strcmp(path, "/") == 0) {
-        *errnoptr = EINVAL; // Cannot create a file named "/"
-        return -1;
+    size_t huge = data_huge_blocks(super);
+    size_t first = SIZE_MAX;
+    if (huge != 0 && n >= huge / 4 && n <= huge) {
+        first = data_find_huge(fsptr, n, huge);
     }
-
-    // Check if file already exists
-    if (find_node(fsptr, path) != NULL) {
-        *errnoptr = EEXIST;
-        return -1;
+    if (first == SIZE_MAX) {
+        first = data_find_run(fsptr, n);
     }
-
-    // Find parent directory
-    char *path_copy = strdup(path);
-    if (path_copy == NULL) {
-        *errnoptr = ENOMEM;
-        return -1;
+    if (first == SIZE_MAX) {
+        return 0;
     }
 
-    // Get name 
-    char *save_name = strrchr(path_copy, '/');
-    save_name++; // Move to the name
-    char actual_name[NAME_MAX_LEN];
-    strncpy(actual_name, save_name, NAME_MAX_LEN);
-    actual_name[NAME_MAX_LEN - 1] = '\0'; // Ensure null termination
+    data_mark(fsptr, first, n, 1);
+    super->data_free -= n;
+    return first * super->data_block_size;
+}
+
+/* Frees the n blocks starting at offset */
+static void data_release(void *fsptr, myfs_off_t offset, size_t n) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    size_t first = offset / super->data_block_size;
 
-    char *file_name = strrchr(path_copy, '/');
-    if (file_name == NULL) {
-        free(path_copy);
-        *errnoptr = EINVAL; // Invalid path
-        return -1;
+    data_mark(fsptr, first, n, 0);
+    super->data_free += n;
+    if ((first + n - 1) / 64 > super->data_hint) {
+        super->data_hint = (first + n - 1) / 64;
     }
-    *file_name = '\0'; // Split path into parent and file
-    file_name++;
+}
 
-    struct myfs_node *parent_dir = find_node(fsptr, path_copy);
-    free(path_copy);
+/* Takes back the n blocks in front of the zone from the heap */
+static void data_give_front(void *fsptr, size_t n) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
 
-    if (parent_dir == NULL || parent_dir->is_file) {
-        *errnoptr = parent_dir == NULL ? ENOENT : ENOTDIR;
-        return -1;
-    }
+    super->data_first -= n;
+    data_release(fsptr, super->data_first * super->data_block_size, n);
+}
 
-    // Check available space
-    size_t required_space = sizeof(struct myfs_node) +
-                            (parent_dir->data.directory.number_children + 1) * sizeof(myfs_off_t);
+/* Gives the n blocks at the front of the zone to the heap if they are
+   all free. Returns 0 on success and -1 otherwise.
+*/
+static int data_take_front(void *fsptr, size_t n) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    uint64_t *bitmap = off_to_ptr(fsptr, super->data_bitmap);
 
-    if (super->free_memory + required_space > super->size) {
-        *errnoptr = ENOSPC;
+    if (super->data_block_size == 0 || n > super->data_free ||
+        !bitmap_is_clear(bitmap, super->data_first, n)) {
         return -1;
     }
 
-    // Allocate and initialize new file node
-    struct myfs_node *new_node = off_to_ptr(fsptr, super->free_memory);
-    super->free_memory += sizeof(struct myfs_node);
+    data_mark(fsptr, super->data_first, n, 1);
+    super->data_first += n;
+    super->data_free -= n;
+    return 0;
+}
 
-    memset(new_node, 0, sizeof(struct myfs_node));
-    strncpy(new_node->name, actual_name, NAME_MAX_LEN);
-    new_node->is_file = 1;
-    clock_gettime(CLOCK_REALTIME, &new_node->times[0]);
-    new_node->times[1] = new_node->times[0];
+struct myfs_frag_block {
+    myfs_off_t next;  // Next block with a free slot of the same size, 0 for the last
+    myfs_off_t prev;  // Previous such block, 0 for the first
+    uint64_t used;    // Bit i set iff slot i is taken or not part of the block
+};
 
-    // Initialize file data
-    new_node->data.file.size = 0;
-    new_node->data.file.allocated = 0;
-    new_node->data.file.data = 0;
-    new_node->data.file.next_file_block = 0;
+/* Returns the number of slots, 4 to 64, of the fragment blocks that
+   hold pieces of bytes bytes, or 0 if such pieces take whole blocks
+*/
+static size_t frag_slots(const struct myfs_super *super, size_t bytes) {
+    size_t slots = 4;
 
-    // Update parent directory children list
-    size_t child_array_size = (parent_dir->data.directory.number_children + 1) * sizeof(myfs_off_t);
+    if (bytes > super->data_block_size / slots) {
+        return 0;
+    }
+    while (slots < 64 && bytes <= super->data_block_size / (2 * slots) &&
+           super->data_block_size / (2 * slots) >= MYFS_FRAG_MIN) {
+        slots *= 2;
+    }
+    return slots;
+}
 
-    // Allocate new block for children
-    myfs_off_t new_children_offset = super->free_memory;
-    myfs_off_t *new_children = off_to_ptr(fsptr, new_children_offset);
+/* Unlinks a fragment block from the list of its slot size */
+static void frag_unlink(void *fsptr, myfs_off_t block, size_t class) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    struct myfs_frag_block *f = off_to_ptr(fsptr, block);
 
-    if (parent_dir->data.directory.number_children > 0) {
-        // Copy existing children data to the new block
-        myfs_off_t *old_children = off_to_ptr(fsptr, parent_dir->data.directory.children);
-        memcpy(new_children, old_children, parent_dir->data.directory.number_children * sizeof(myfs_off_t));
+    if (f->prev != 0) {
+        struct myfs_frag_block *prev = off_to_ptr(fsptr, f->prev);
+        region_dirty(fsptr, &prev->next, sizeof(prev->next));
+        prev->next = f->next;
+    } else {
+        region_dirty(fsptr, &super->frag_lists[class], sizeof(myfs_off_t));
+        super->frag_lists[class] = f->next;
     }
+    if (f->next != 0) {
+        struct myfs_frag_block *next = off_to_ptr(fsptr, f->next);
+        region_dirty(fsptr, &next->prev, sizeof(next->prev));
+        next->prev = f->prev;
+    }
+}
 
-    // Update the children list with the new child
-    new_children[parent_dir->data.directory.number_children] = ptr_to_off(fsptr, new_node);
-    parent_dir->data.directory.children = new_children_offset;
-    parent_dir->data.directory.number_children++;
-    super->free_memory += child_array_size;
-
-    free(last_token);
-    return 0;
+/* Puts a fragment block at the front of the list of its slot size */
+static void frag_push(void *fsptr, myfs_off_t block, size_t class) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    struct myfs_frag_block *f = off_to_ptr(fsptr, block);
+
+    region_dirty(fsptr, f, sizeof(*f));
+    f->prev = 0;
+    f->next = super->frag_lists[class];
+    if (f->next != 0) {
+        struct myfs_frag_block *next = off_to_ptr(fsptr, f->next);
+        region_dirty(fsptr, &next->prev, sizeof(next->prev));
+        next->prev = block;
+    }
+    region_dirty(fsptr, &super->frag_lists[class], sizeof(myfs_off_t));
+    super->frag_lists[class] = block;
 }
 
+/* Allocates a slot of at least bytes <= data_block_size / 4 bytes in a
+   fragment block and puts its size into *sizeptr. Returns its offset,
+   or 0 if there is no data zone or no free block for a new fragment
+   block.
+*/
+static myfs_off_t frag_alloc(void *fsptr, size_t bytes, size_t *sizeptr) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    size_t slots = frag_slots(super, bytes);
 
+    if (super->data_block_size == 0 || slots == 0) {
+        return 0;
+    }
+    size_t class = __builtin_ctzll(slots) - 2;
+    size_t size = super->data_block_size / slots;
+
+    myfs_off_t block = super->frag_lists[class];
+    if (block == 0) {
+        block = data_alloc(fsptr, 1);
+        if (block == 0) {
+            return 0;
+        }
+        struct myfs_frag_block *f = off_to_ptr(fsptr, block);
+        region_dirty(fsptr, f, sizeof(*f));
+        f->used = (slots == 64) ? 1 : ((~(uint64_t)0 << slots) | 1);
+        frag_push(fsptr, block, class);
+        super->frag_free_bytes += (slots - 1) * size;
+    }
 
+    struct myfs_frag_block *f = off_to_ptr(fsptr, block);
+    size_t slot = __builtin_ctzll(~f->used);
+    region_dirty(fsptr, &f->used, sizeof(f->used));
+    f->used |= (uint64_t)1 << slot;
+    if (f->used == ~(uint64_t)0) {
+        frag_unlink(fsptr, block, class);
+    }
+    super->frag_free_bytes -= size;
+    *sizeptr = size;
+    return block + slot * size;
+}
 
-/* Implements an emulation of the unlink system call for regular files
-   on the filesystem of size fssize pointed to by fsptr.
+/* Frees the slot of size bytes at offset in a fragment block */
+static void frag_release(void *fsptr, myfs_off_t offset, size_t size) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    size_t slots = super->data_block_size / size;
+    size_t class = __builtin_ctzll(slots) - 2;
+    myfs_off_t block = offset - offset % super->data_block_size;
+    struct myfs_frag_block *f = off_to_ptr(fsptr, block);
+    uint64_t empty = (slots == 64) ? 1 : ((~(uint64_t)0 << slots) | 1);
+
+    int was_full = (f->used == ~(uint64_t)0);
+    region_dirty(fsptr, &f->used, sizeof(f->used));
+    f->used &= ~((uint64_t)1 << ((offset - block) / size));
+    super->frag_free_bytes += size;
+
+    if (f->used == empty) {
+        if (!was_full) {
+            frag_unlink(fsptr, block, class);
+        }
+        super->frag_free_bytes -= (slots - 1) * size;
+        data_release(fsptr, block, 1);
+    } else if (was_full) {
+        frag_push(fsptr, block, class);
+    }
+}
 
-   This function is called only for the deletion of regular files.
+/* Free-space allocator
+
+   The heap spans [heap_start, heap_end) of the memory region and is
+   carved into blocks. Every block starts with a size_t header holding
+   the block size (header included, a multiple of MYFS_ALIGN) and, in
+   its low bits, whether the block is in use and whether the block
+   right before it is in use. Free blocks additionally repeat their
+   size in their last word (the footer), so that a block being freed
+   can find a free predecessor and coalesce with it, and carry two
+   offsets chaining them into one of the segregated free lists.
+
+   Free list c holds the free blocks whose size s satisfies
+   2^c <= s < 2^(c+1). Bit c of free_map is set iff list c is not
+   empty, so a list that is guaranteed to satisfy a request is found
+   with a single bit scan, which makes allocation and freeing O(1)
+   apart from the rare fallback scan in myfs_find_free_block.
+
+   A zero-sized header that is marked in use sits at heap_end and
+   stops coalescing at the end of the heap. As all of this is stored
+   as offsets inside the region, it survives remounting. If there is
+   a data zone, it starts right behind that header.
+*/
 
-   On success, 0 is returned.
+#define MYFS_ALIGN        ((size_t) 8)
+#define MYFS_BLOCK_USED   ((size_t) 1)
+#define MYFS_PREV_USED    ((size_t) 2)
+#define MYFS_BLOCK_FLAGS  (MYFS_BLOCK_USED | MYFS_PREV_USED)
+#define MYFS_HEADER_SIZE  sizeof(size_t)
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
+struct myfs_free_block {
+    size_t header;
+    myfs_off_t next;
+    myfs_off_t prev;
+};
 
-   The error codes are documented in man 2 unlink.
+#define MYFS_MIN_BLOCK    (sizeof(struct myfs_free_block) + sizeof(size_t))
 
-*/
-int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
-    struct myfs_super *super = (struct myfs_super *)fsptr;
-    
-    // Find the parent directory and the file name
-    char *file_name;
-    struct myfs_node *parent_node = find_parent_node(fsptr, path, &file_name);
-    
-    if (parent_node == NULL) {
-        *errnoptr = ENOENT;
-        free(file_name);
-        return -1;
-    }
-    
-    if (parent_node->is_file) {
-        *errnoptr = ENOTDIR;
-        free(file_name);
-        return -1;
-    }
-    
-    // Find the file node
-    struct myfs_node *file_node = get_node(fsptr, &parent_node->data.directory, file_name);
-    
-    if (file_node == NULL) {
-        *errnoptr = ENOENT;
-        free(file_name);
-        return -1;
-    }
-    
-    if (!file_node->is_file) {
-        *errnoptr = EISDIR;
-        free(file_name);
-        return -1;
-    }
-    
-    // Remove the file from the parent directory
-    myfs_off_t *children = off_to_ptr(fsptr, parent_node->data.directory.children);
-    size_t num_children = parent_node->data.directory.number_children;
-    
-    for (size_t i = 0; i < num_children; i++) {
-        if (children[i] == ptr_to_off(fsptr, file_node)) {
-            // Move the last child to this position and decrease the count
-            children[i] = children[num_children - 1];
-            parent_node->data.directory.number_children--;
-            break;
-        }
-    }
-    
-    // Free the file's data blocks
-    struct myfs_file_data *file = &file_node->data.file;
-    myfs_off_t current_block = file->data;
-    while (current_block != 0) {
-        myfs_off_t *next_block = off_to_ptr(fsptr, current_block);
-        current_block = *next_block;
-        // Mark the block as free
-        *next_block = super->free_memory;
-        super->free_memory = ptr_to_off(fsptr, next_block);
-    }
-    
-    // Mark the file node as free
-    memset(file_node, 0, sizeof(struct myfs_node));
-    *(myfs_off_t *)file_node = super->free_memory;
-    super->free_memory = ptr_to_off(fsptr, file_node);
-    
-    // Update parent directory's modification time
-    update_time(parent_node, 1);
-    
-    free(file_name);
-    return 0;
+static size_t align_up(size_t size) {
+    return (size + MYFS_ALIGN - 1) & ~(MYFS_ALIGN - 1);
 }
 
+static size_t *block_header(void *fsptr, myfs_off_t block) {
+    return off_to_ptr(fsptr, block);
+}
 
-/* Implements an emulation of the rmdir system call on the filesystem 
-   of size fssize pointed to by fsptr. 
+static size_t block_size(void *fsptr, myfs_off_t block) {
+    return *block_header(fsptr, block) & ~MYFS_BLOCK_FLAGS;
+}
 
-   The call deletes the directory indicated by path.
+static void set_block_header(void *fsptr, myfs_off_t block, size_t header) {
+    region_dirty(fsptr, block_header(fsptr, block), sizeof(size_t));
+    *block_header(fsptr, block) = header;
+}
 
-   On success, 0 is returned.
+static unsigned int size_class(size_t size) {
+    return 63 - __builtin_clzll((unsigned long long) size);
+}
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
+/* Writes header and footer of a free block */
+static void set_free_block(void *fsptr, myfs_off_t block, size_t size, size_t prev_used) {
+    set_block_header(fsptr, block, size | prev_used);
+    set_block_header(fsptr, block + size - sizeof(size_t), size);
+}
 
-   The function call must fail when the directory indicated by path is
-   not empty (if there are files or subdirectories other than . and ..).
+static void free_list_insert(void *fsptr, myfs_off_t block) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    struct myfs_free_block *free_block = off_to_ptr(fsptr, block);
+    unsigned int c = size_class(block_size(fsptr, block));
+
+    region_dirty(fsptr, free_block, sizeof(*free_block));
+    free_block->prev = 0;
+    free_block->next = super->free_lists[c];
+    if (free_block->next != 0) {
+        struct myfs_free_block *next = off_to_ptr(fsptr, free_block->next);
+        region_dirty(fsptr, &next->prev, sizeof(next->prev));
+        next->prev = block;
+    }
+    super->free_lists[c] = block;
+    super->free_map |= (uint64_t)1 << c;
+    super->free_bytes += block_size(fsptr, block) - MYFS_HEADER_SIZE;
+}
 
-   The error codes are documented in man 2 rmdir.
+static void free_list_remove(void *fsptr, myfs_off_t block) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    struct myfs_free_block *free_block = off_to_ptr(fsptr, block);
+    unsigned int c = size_class(block_size(fsptr, block));
 
-*/
-int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
-    
-    // Find the parent directory and the directory to be removed
-    char *dir_name;
-    struct myfs_node *parent_node = find_parent_node(fsptr, path, &dir_name);
-    
-    if (parent_node == NULL) {
-        *errnoptr = ENOENT;
-        free(dir_name);
-        return -1;
+    if (free_block->prev != 0) {
+        struct myfs_free_block *prev = off_to_ptr(fsptr, free_block->prev);
+        region_dirty(fsptr, &prev->next, sizeof(prev->next));
+        prev->next = free_block->next;
+    } else {
+        super->free_lists[c] = free_block->next;
     }
-    
-    if (parent_node->is_file) {
-        *errnoptr = ENOTDIR;
-        free(dir_name);
-        return -1;
+    if (free_block->next != 0) {
+        struct myfs_free_block *next = off_to_ptr(fsptr, free_block->next);
+        region_dirty(fsptr, &next->prev, sizeof(next->prev));
+        next->prev = free_block->prev;
     }
-    
-    // Find the directory node to be removed
-    struct myfs_node *dir_node = get_node(fsptr, &parent_node->data.directory, dir_name);
-    
-    if (dir_node == NULL) {
-        *errnoptr = ENOENT;
-        free(dir_name);
-        return -1;
+    if (super->free_lists[c] == 0) {
+        super->free_map &= ~((uint64_t)1 << c);
     }
-    
-    if (dir_node->is_file) {
-        *errnoptr = ENOTDIR;
-        free(dir_name);
-        return -1;
+    super->free_bytes -= block_size(fsptr, block) - MYFS_HEADER_SIZE;
+}
+
+/* Returns a free block of at least need bytes, or 0 */
+static myfs_off_t myfs_find_free_block(void *fsptr, size_t need) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    unsigned int c = size_class(need);
+
+    // Records of the same size are the common case: try the head of
+    // their own class first
+    myfs_off_t head = super->free_lists[c];
+    if (head != 0 && block_size(fsptr, head) >= need) {
+        return head;
     }
-    
-    // Check if the directory is empty
-    if (dir_node->data.directory.number_children > 0) {
-        *errnoptr = ENOTEMPTY;
-        free(dir_name);
-        return -1;
+
+    // Any block in a larger class fits
+    if (c + 1 < MYFS_FREE_CLASSES) {
+        uint64_t larger = super->free_map & (~(uint64_t)0 << (c + 1));
+        if (larger != 0) {
+            return super->free_lists[__builtin_ctzll(larger)];
+        }
     }
-    
-    // Remove the directory from the parent's children list
-    myfs_off_t *parent_children = off_to_ptr(fsptr, parent_node->data.directory.children);
-    size_t num_children = parent_node->data.directory.number_children;
-    
-    for (size_t i = 0; i < num_children; i++) {
-        if (parent_children[i] == ptr_to_off(fsptr, dir_node)) {
-            // Move the last child to this position and decrease the count
-            parent_children[i] = parent_children[num_children - 1];
-            parent_node->data.directory.number_children--;
-            break;
+
+    // Last resort: first fit among the blocks of the same class
+    for (myfs_off_t block = head; block != 0;
+         block = ((struct myfs_free_block *)off_to_ptr(fsptr, block))->next) {
+        if (block_size(fsptr, block) >= need) {
+            return block;
         }
     }
-    
-    // Free the directory node
-    memset(dir_node, 0, sizeof(struct myfs_node));
-    
-    // Update parent directory's modification time
-    update_time(parent_node, 1);
-    
-    free(dir_name);
     return 0;
 }
 
-
-/* Implements an emulation of the mkdir system call on the filesystem 
-   of size fssize pointed to by fsptr. 
-
-   The call creates the directory indicated by path.
-
-   On success, 0 is returned.
-
-   On failure, -1 is returned and *errnoptr is set appropriately.
-
-   The error codes are documented in man 2 mkdir.
-
+/* Extends the heap into the data zone so that its last block becomes
+   a free block of at least need bytes. Returns 0 on success and -1 if
+   the front of the data zone is not free.
 */
-int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
-    struct myfs_super *super = initialize_myfs(fsptr, fssize);
+static int heap_grow(void *fsptr, size_t need) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    size_t block_bytes = super->data_block_size;
 
-    // Find the parent directory and the last token (directory name)
-    char *last_token;
-    struct myfs_node *parent_node = find_parent_node(fsptr, path, &last_token);
-    if (parent_node == NULL) {
-        *errnoptr = ENOENT;
-        free(last_token);
+    if (block_bytes == 0) {
         return -1;
     }
 
-    if (parent_node->is_file) {
-        *errnoptr = ENOTDIR;
-        free(last_token);
-        return -1;
+    // A free block at the end of the heap already covers part of need
+    myfs_off_t block = super->heap_end;
+    size_t have = 0;
+    size_t prev_used = MYFS_PREV_USED;
+    if (!(*block_header(fsptr, super->heap_end) & MYFS_PREV_USED)) {
+        have = *block_header(fsptr, super->heap_end - sizeof(size_t));
+        block = super->heap_end - have;
+        prev_used = *block_header(fsptr, block) & MYFS_PREV_USED;
     }
 
-    // Check if the directory name already exists
-    struct myfs_node *existing_node = get_node(fsptr, &parent_node->data.directory, last_token);
-    if (existing_node != NULL) {
-        *errnoptr = EEXIST;
-        free(last_token);
+    // Move the border to the next huge page boundary if that is free
+    size_t n = (need - have + block_bytes - 1) / block_bytes;
+    size_t huge = data_huge_blocks(super);
+    size_t n_huge = (huge == 0) ? n : (super->data_first + n + huge - 1) / huge * huge - super->data_first;
+    if (data_take_front(fsptr, n_huge) == 0) {
+        n = n_huge;
+    } else if (n_huge == n || data_take_front(fsptr, n) < 0) {
         return -1;
     }
 
-    // Check if the directory name is too long
-    if (strlen(last_token) > NAME_MAX_LEN) {
-        *errnoptr = ENAMETOOLONG;
-        free(last_token);
-        return -1;
+    if (have != 0) {
+        free_list_remove(fsptr, block);
     }
+    super->heap_end += n * block_bytes;
+    set_block_header(fsptr, super->heap_end, MYFS_BLOCK_USED);
+    set_free_block(fsptr, block, super->heap_end - block, prev_used);
+    free_list_insert(fsptr, block);
+    return 0;
+}
 
-    // Check if the path is the root directory
-    if (strcmp(path, "/") == 0) {
-        *errnoptr = EEXIST; // Cannot create a directory named "/"
-        free(last_token);
-        return -1;
-    }
+/* Allocates size bytes inside the region. Returns the offset of the
+   allocated memory, or 0 when there is not enough free space.
+*/
+static myfs_off_t myfs_alloc(void *fsptr, size_t size) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
 
-    // Calculate the required space for the new directory node and its children list
-    size_t required_space = sizeof(struct myfs_node) + sizeof(myfs_off_t);
+    if (size > super->size) {
+        return 0;
+    }
 
-    if (super->free_memory + required_space > super->size) {
-        *errnoptr = ENOSPC;
-        free(last_token);
-        return -1;
+    size_t need = align_up(size + MYFS_HEADER_SIZE);
+    if (need < MYFS_MIN_BLOCK) {
+        need = MYFS_MIN_BLOCK;
     }
 
-    // Allocate and initialize the new directory node
-    struct myfs_node *new_dir = off_to_ptr(fsptr, super->free_memory);
-    super->free_memory += sizeof(struct myfs_node);
+    heap_lock(fsptr);
+    myfs_off_t block = myfs_find_free_block(fsptr, need);
+    if (block == 0) {
+        if (heap_grow(fsptr, need) < 0) {
+            heap_unlock(fsptr);
+            return 0;
+        }
+        block = myfs_find_free_block(fsptr, need);
+    }
+    free_list_remove(fsptr, block);
 
-    memset(new_dir, 0, sizeof(struct myfs_node));
-    strncpy(new_dir->name, last_token, NAME_MAX_LEN);
-    new_dir->is_file = 0;
-    update_time(new_dir, 1);
+    size_t have = block_size(fsptr, block);
+    size_t prev_used = *block_header(fsptr, block) & MYFS_PREV_USED;
 
-    // Initialize the new directory's children list
-    myfs_off_t *children = off_to_ptr(fsptr, super->free_memory);
-    *children = 0;
-    new_dir->data.directory.children = ptr_to_off(fsptr, children);
-    new_dir->data.directory.number_children = 0;
-    super->free_memory += sizeof(myfs_off_t);
+    if (have - need >= MYFS_MIN_BLOCK) {
+        // Split: the remainder stays free, its successor was already
+        // marked as having a free predecessor
+        set_block_header(fsptr, block, need | MYFS_BLOCK_USED | prev_used);
+        set_free_block(fsptr, block + need, have - need, MYFS_PREV_USED);
+        free_list_insert(fsptr, block + need);
+    } else {
+        set_block_header(fsptr, block, have | MYFS_BLOCK_USED | prev_used);
+        set_block_header(fsptr, block + have, *block_header(fsptr, block + have) | MYFS_PREV_USED);
+    }
 
-    // Update the parent directory's children list
-    size_t child_array_size = (parent_node->data.directory.number_children + 1) * sizeof(myfs_off_t);
+    heap_unlock(fsptr);
+    return block + MYFS_HEADER_SIZE;
+}
 
-    // Allocate new block for children
-    myfs_off_t new_children_offset = super->free_memory;
-    myfs_off_t *new_children = off_to_ptr(fsptr, new_children_offset);
+/* Hands the whole blocks at the end of a free last heap block back to
+   the data zone, leaving at least keep >= MYFS_MIN_BLOCK bytes of it.
+*/
+static void heap_trim(void *fsptr, size_t keep) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    size_t block_bytes = super->data_block_size;
 
-    if (parent_node->data.directory.number_children > 0) {
-        // Copy existing children data to the new block
-        myfs_off_t *old_children = off_to_ptr(fsptr, parent_node->data.directory.children);
-        memcpy(new_children, old_children, parent_node->data.directory.number_children * sizeof(myfs_off_t));
+    if (block_bytes == 0 || (*block_header(fsptr, super->heap_end) & MYFS_PREV_USED)) {
+        return;
     }
 
-    // Update the children list with the new child
-    new_children[parent_node->data.directory.number_children] = ptr_to_off(fsptr, new_dir);
-    parent_node->data.directory.children = new_children_offset;
-    parent_node->data.directory.number_children++;
-    super->free_memory += child_array_size;
-
-    // Update the parent directory's modification time
-    update_time(parent_node, 1);
+    size_t size = *block_header(fsptr, super->heap_end - sizeof(size_t));
+    myfs_off_t block = super->heap_end - size;
+    if (size < keep + block_bytes) {
+        return;
+    }
 
-    free(last_token);
-    return 0;
+    // Only stop at a huge page boundary
+    size_t n = (size - keep) / block_bytes;
+    size_t huge = data_huge_blocks(super);
+    if (huge != 0) {
+        size_t first = (super->data_first - n + huge - 1) / huge * huge;
+        if (first >= super->data_first) {
+            return;
+        }
+        n = super->data_first - first;
+    }
+    free_list_remove(fsptr, block);
+    size -= n * block_bytes;
+    myfs_off_t old_end = super->heap_end;
+    super->heap_end -= n * block_bytes;
+    set_block_header(fsptr, super->heap_end, MYFS_BLOCK_USED);
+    set_free_block(fsptr, block, size, *block_header(fsptr, block) & MYFS_PREV_USED);
+    free_list_insert(fsptr, block);
+
+    // The old footer and sentinel are zone space now; clear them so
+    // that nothing is left behind the heap (see __myfs_compact_implem)
+    char *stale = off_to_ptr(fsptr, old_end - sizeof(size_t));
+    region_dirty(fsptr, stale, sizeof(size_t) + MYFS_HEADER_SIZE);
+    memset(stale, 0, sizeof(size_t) + MYFS_HEADER_SIZE);
+    data_give_front(fsptr, n);
 }
 
+/* Gives memory obtained with myfs_alloc back to the heap, merging it
+   with free neighbors. Freeing offset 0 does nothing.
+*/
+static void myfs_free(void *fsptr, myfs_off_t offset) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
 
+    if (offset == 0) {
+        return;
+    }
 
-/* Implements an emulation of the rename system call on the filesystem 
-   of size fssize pointed to by fsptr. 
-
-   The call moves the file or directory indicated by from to to.
+    heap_lock(fsptr);
+    myfs_off_t block = offset - MYFS_HEADER_SIZE;
+    size_t header = *block_header(fsptr, block);
+    size_t size = header & ~MYFS_BLOCK_FLAGS;
 
-   On success, 0 is returned.
+    myfs_off_t next = block + size;
+    if (!(*block_header(fsptr, next) & MYFS_BLOCK_USED)) {
+        free_list_remove(fsptr, next);
+        size += block_size(fsptr, next);
+    }
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
+    if (!(header & MYFS_PREV_USED)) {
+        size_t prev_size = *block_header(fsptr, block - sizeof(size_t));
+        block -= prev_size;
+        free_list_remove(fsptr, block);
+        size += prev_size;
+        header = *block_header(fsptr, block);
+    }
 
-   Caution: the function does more than what is hinted to by its name.
-   In cases the from and to paths differ, the file is moved out of 
-   the from path and added to the to path.
+    set_free_block(fsptr, block, size, header & MYFS_PREV_USED);
+    set_block_header(fsptr, block + size, *block_header(fsptr, block + size) & ~MYFS_PREV_USED);
+    free_list_insert(fsptr, block);
 
-   The error codes are documented in man 2 rename.
+    // Keep at least one block's worth so that the border between heap
+    // and data zone does not move back and forth all the time
+    if (block + size == super->heap_end) {
+        heap_trim(fsptr, super->data_block_size);
+    }
+    heap_unlock(fsptr);
+}
 
+/* Frees the bytes bytes at offset: a block myfs_alloc returned, for
+   which bytes does not matter, or a fragment slot or blocks of the
+   data zone
 */
-int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
-                         const char *from, const char *to) {
-    if (!fsptr || !from || !to || from[0] == '\0' || to[0] == '\0') {
-        *errnoptr = EINVAL; // Invalid arguments
-        return -1;
-    }
+static void region_free(void *fsptr, myfs_off_t offset, size_t bytes) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
 
-    // Ensure paths are not identical
-    if (strcmp(from, to) == 0) {
-        *errnoptr = 0; // No error, nothing to do
-        return 0;
+    heap_lock(fsptr);
+    if (offset > super->heap_end) {
+        if (bytes < super->data_block_size) {
+            frag_release(fsptr, offset, bytes);
+        } else {
+            data_release(fsptr, offset, bytes / super->data_block_size);
+        }
+    } else {
+        myfs_free(fsptr, offset);
     }
+    heap_unlock(fsptr);
+}
 
-    // Locate the file or directory corresponding to `from`
-    size_t from_offset = myfs_traverse_path(fsptr, from);
-    if (from_offset == (size_t)-1) {
-        *errnoptr = ENOENT; // Source not found
-        return -1;
-    }
+/* Frees a block as region_free does, unless an optimistic reader may
+   still be looking at it (see Node locks), which is the case unless
+   the region lock is held exclusively. The block then goes on the
+   list of retired blocks instead, with the link and bytes in its first
+   two words, and region_reclaim frees it later. Does nothing for 0.
+*/
+static void region_retire(void *fsptr, myfs_off_t block, size_t bytes) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
 
-    // Ensure `to` does not already exist
-    size_t to_offset = myfs_traverse_path(fsptr, to);
-    if (to_offset != (size_t)-1) {
-        *errnoptr = EEXIST; // Target already exists
-        return -1;
+    if (block == 0) {
+        return;
+    }
+    if (super->exclusive) {
+        region_free(fsptr, block, bytes);
+        return;
     }
 
-    // Retrieve the source file/directory structure
-    myfs_file_t *source = (myfs_file_t *)((char *)fsptr + from_offset);
+    myfs_off_t *words = off_to_ptr(fsptr, block);
+    myfs_off_t head = __atomic_load_n(&super->retired, __ATOMIC_RELAXED);
+    __atomic_store_n(&words[1], bytes, __ATOMIC_RELEASE);
+    do {
+        __atomic_store_n(&words[0], head, __ATOMIC_RELEASE);
+    } while (!__atomic_compare_exchange_n(&super->retired, &head, block, 0,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    region_dirty(fsptr, words, 2 * sizeof(myfs_off_t));
+}
 
-    // Check if it's a non-empty directory
-    if (source->is_directory && source->children_offset != 0) {
-        *errnoptr = ENOTEMPTY; // Cannot rename non-empty directory
-        return -1;
-    }
+/* Frees the retired blocks. Must be called under the exclusive region
+   lock, which keeps readers out.
+*/
+static void region_reclaim(void *fsptr) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    myfs_off_t block = __atomic_exchange_n(&super->retired, 0, __ATOMIC_ACQUIRE);
 
-    // Update the name (using strcpy instead of assignment)
-    char *new_name = strdup(to + 1); // Extract name from the `to` path
-    if (!new_name) {
-        *errnoptr = ENOMEM; // Memory allocation failed
-        return -1;
+    while (block != 0) {
+        myfs_off_t *words = off_to_ptr(fsptr, block);
+        myfs_off_t next = words[0];
+        region_free(fsptr, block, words[1]);
+        block = next;
     }
+}
 
-    // Free the old name memory and copy the new name into the array
-    // Note: the `name` field is a fixed-size array, so it will be overwritten
-    strcpy(source->name, new_name); // Copy new name into the name array
+/* Node slabs
+
+   struct myfs_node records all have the same size and are by far the
+   most frequently allocated objects, so they do not go through
+   myfs_alloc one by one. Nodes are carved out of slabs instead: a
+   slab is one heap block holding a struct myfs_slab header followed
+   by up to MYFS_SLAB_NODES node records, with a bitmap of free slots.
+   Allocating or freeing a node is a bit flip in that bitmap, and
+   nodes created one after the other end up next to each other.
+
+   Slabs with at least one free slot are chained on the partial list
+   of the superblock. A node remembers its slot index, from which the
+   slab header is found again when the node is freed. A slab that
+   becomes empty is given back to the heap, unless it is the only
+   partial slab left. All slabs, full or not, are also chained on a
+   second list, along which the defragmenter visits every node.
+
+   Slabs play the part of cylinder groups: a new node goes close to a
+   node it will be visited together with, which for a new child is the
+   last child of its directory, or the directory itself if it has no
+   children. It takes the next free slot of that node's slab. Once
+   that slab is full, a directory of at least MYFS_SLAB_GROUP_MIN
+   children starts a new slab of its own, so that directories filled
+   side by side do not take turns in the same slab; smaller ones take
+   a slot in the partial slab at the nearest offset among the first
+   MYFS_SLAB_NEAR_SCAN ones on the partial list. Walks over a
+   directory, as done by find, du or ls -lR, thus mostly stay inside
+   a few slabs instead of jumping all over the region.
+*/
 
-    // Free the dynamically allocated memory for the new name
-    free(new_name);
+#define MYFS_SLAB_NODES 64
+#define MYFS_SLAB_NEAR_SCAN 16
+#define MYFS_SLAB_GROUP_MIN 8
+
+struct myfs_slab {
+    myfs_off_t next;           // Next slab on the partial list
+    myfs_off_t prev;           // Previous slab on the partial list
+    myfs_off_t all_next;       // Next slab on the list of all slabs
+    myfs_off_t all_prev;       // Previous slab on the list of all slabs
+    uint64_t free_slots;       // Bit i set iff slot i is free
+    uint32_t capacity;         // Number of node slots in this slab
+    uint32_t used;             // Number of slots holding a live node
+    uint16_t shared[MYFS_SLAB_NODES]; // References to the node in slot i beyond the first
+};
 
-    // Re-link the child in the parent directory's linked list (if needed)
-    size_t parent_offset = source->children_offset; // This will need to be determined based on your directory structure
-    if (parent_offset != 0) {
-        myfs_file_t *parent = (myfs_file_t *)((char *)fsptr + parent_offset);
-        
-        size_t next_offset = parent->children_offset;
-        myfs_file_t *child = (next_offset != 0) ? (myfs_file_t *)((char *)fsptr + next_offset) : NULL;
+static struct myfs_node *slab_node(void *fsptr, myfs_off_t slab, unsigned int slot) {
+    return off_to_ptr(fsptr, slab + sizeof(struct myfs_slab) + slot * sizeof(struct myfs_node));
+}
 
-        // Find and update the correct parent-child link in the linked list
-        while (child != NULL) {
-            if (child == source) {
-                break;
-            }
-            next_offset = child->next_offset;
-            child = (next_offset != 0) ? (myfs_file_t *)((char *)fsptr + next_offset) : NULL;
-        }
+static void slab_list_insert(void *fsptr, myfs_off_t slab) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    struct myfs_slab *s = off_to_ptr(fsptr, slab);
+
+    region_dirty(fsptr, s, sizeof(*s));
+    s->prev = 0;
+    s->next = super->slab_partial;
+    if (s->next != 0) {
+        struct myfs_slab *next = off_to_ptr(fsptr, s->next);
+        region_dirty(fsptr, &next->prev, sizeof(next->prev));
+        next->prev = slab;
     }
-
-    *errnoptr = 0; // Success
-    return 0;
+    super->slab_partial = slab;
 }
 
-/* Implements an emulation of the truncate system call on the filesystem 
-   of size fssize pointed to by fsptr. 
+static void slab_list_remove(void *fsptr, myfs_off_t slab) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    struct myfs_slab *s = off_to_ptr(fsptr, slab);
 
-   The call changes the size of the file indicated by path to offset
+    region_dirty(fsptr, s, sizeof(*s));
+    if (s->prev != 0) {
+        struct myfs_slab *prev = off_to_ptr(fsptr, s->prev);
+        region_dirty(fsptr, &prev->next, sizeof(prev->next));
+        prev->next = s->next;
+    } else {
+        super->slab_partial = s->next;
+    }
+    if (s->next != 0) {
+        struct myfs_slab *next = off_to_ptr(fsptr, s->next);
+        region_dirty(fsptr, &next->prev, sizeof(next->prev));
+        next->prev = s->prev;
+    }
+}
+
+/* Allocates a new slab, as large as possible up to MYFS_SLAB_NODES
+   nodes, and puts it on the partial list. Returns 0 if not even a
+   single node fits into the free space.
+*/
+static myfs_off_t slab_create(void *fsptr) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+
+    for (unsigned int capacity = MYFS_SLAB_NODES; capacity > 0; capacity /= 2) {
+        myfs_off_t slab = myfs_alloc(fsptr, sizeof(struct myfs_slab) +
+                                            capacity * sizeof(struct myfs_node));
+        if (slab == 0) {
+            continue;
+        }
+
+        struct myfs_slab *s = off_to_ptr(fsptr, slab);
+        region_dirty(fsptr, s, sizeof(*s));
+        s->capacity = capacity;
+        s->used = 0;
+        memset(s->shared, 0, sizeof(s->shared));
+        s->free_slots = (capacity == 64) ? ~(uint64_t)0 : ((uint64_t)1 << capacity) - 1;
+        slab_list_insert(fsptr, slab);
+        s->all_prev = 0;
+        s->all_next = super->slab_all;
+        if (s->all_next != 0) {
+            struct myfs_slab *next = off_to_ptr(fsptr, s->all_next);
+            region_dirty(fsptr, &next->all_prev, sizeof(next->all_prev));
+            next->all_prev = slab;
+        }
+        super->slab_all = slab;
+        super->slab_nodes_total += capacity;
+        return slab;
+    }
+    return 0;
+}
+
+/* Returns the slab holding the node at offset */
+static myfs_off_t node_slab(void *fsptr, myfs_off_t offset) {
+    struct myfs_node *node = off_to_ptr(fsptr, offset);
+    return offset - sizeof(struct myfs_slab) - node->slab_slot * sizeof(struct myfs_node);
+}
+
+/* Returns the partial slab a node close to the node at offset near
+   should go into (see Node slabs), or 0 if there is none
+*/
+static myfs_off_t slab_near(void *fsptr, myfs_off_t near) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+
+    if (near == 0 || super->slab_partial == 0) {
+        return super->slab_partial;
+    }
+    myfs_off_t home = node_slab(fsptr, near);
+    if (((struct myfs_slab *)off_to_ptr(fsptr, home))->free_slots != 0) {
+        return home;
+    }
+
+    myfs_off_t best = 0;
+    size_t best_distance = SIZE_MAX;
+    myfs_off_t slab = super->slab_partial;
+    for (int i = 0; slab != 0 && i < MYFS_SLAB_NEAR_SCAN; i++) {
+        size_t distance = slab > home ? slab - home : home - slab;
+        if (distance < best_distance) {
+            best = slab;
+            best_distance = distance;
+        }
+        slab = ((struct myfs_slab *)off_to_ptr(fsptr, slab))->next;
+    }
+    return best;
+}
+
+/* Allocates a zeroed node, close to the node at offset near unless
+   near is 0. If group is nonzero and the slab of near is full, the
+   node goes into a new slab rather than a shared one, space
+   permitting. Returns its offset, or 0 when there is no space left.
+*/
+static myfs_off_t myfs_node_alloc(void *fsptr, myfs_off_t near, int group) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+
+    heap_lock(fsptr);
+    myfs_off_t slab = slab_near(fsptr, near);
+    if (slab == 0 || (group && near != 0 && slab != node_slab(fsptr, near))) {
+        myfs_off_t created = slab_create(fsptr);
+        if (created != 0) {
+            slab = created;
+        } else if (slab == 0) {
+            heap_unlock(fsptr);
+            return 0;
+        }
+    }
+
+    // In the slab of near, take the first free slot behind it if any
+    struct myfs_slab *s = off_to_ptr(fsptr, slab);
+    unsigned int slot = __builtin_ctzll(s->free_slots);
+    if (near != 0 && slab == node_slab(fsptr, near)) {
+        unsigned int near_slot = ((struct myfs_node *)off_to_ptr(fsptr, near))->slab_slot;
+        uint64_t behind = s->free_slots & (~(uint64_t)0 << near_slot);
+        if (behind != 0) {
+            slot = __builtin_ctzll(behind);
+        }
+    }
+    region_dirty(fsptr, s, sizeof(*s));
+    s->free_slots &= ~((uint64_t)1 << slot);
+    s->used++;
+    super->slab_nodes_used++;
+    if (s->free_slots == 0) {
+        slab_list_remove(fsptr, slab);
+    }
+
+    struct myfs_node *node = slab_node(fsptr, slab, slot);
+    region_dirty(fsptr, node, sizeof(struct myfs_node));
+    memset(node, 0, sizeof(struct myfs_node));
+    node->slab_slot = slot;
+    heap_unlock(fsptr);
+    return ptr_to_off(fsptr, node);
+}
+
+static void myfs_node_free(void *fsptr, myfs_off_t offset) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    struct myfs_node *node = off_to_ptr(fsptr, offset);
+    unsigned int slot = node->slab_slot;
+
+    heap_lock(fsptr);
+    if (node->name_len > MYFS_SHORT_NAME) {
+        myfs_free(fsptr, node->name.long_name);
+    }
+    myfs_off_t slab = node_slab(fsptr, offset);
+    struct myfs_slab *s = off_to_ptr(fsptr, slab);
+
+    region_dirty(fsptr, s, sizeof(*s));
+    if (s->free_slots == 0) {
+        slab_list_insert(fsptr, slab);
+    }
+    s->free_slots |= (uint64_t)1 << slot;
+    s->used--;
+    super->slab_nodes_used--;
+
+    // Keep one empty slab around so that a create/delete cycle does
+    // not allocate and free a whole slab every time
+    if (s->used == 0 && (s->prev != 0 || s->next != 0)) {
+        slab_list_remove(fsptr, slab);
+        if (s->all_prev != 0) {
+            struct myfs_slab *prev = off_to_ptr(fsptr, s->all_prev);
+            region_dirty(fsptr, &prev->all_next, sizeof(prev->all_next));
+            prev->all_next = s->all_next;
+        } else {
+            super->slab_all = s->all_next;
+        }
+        if (s->all_next != 0) {
+            struct myfs_slab *next = off_to_ptr(fsptr, s->all_next);
+            region_dirty(fsptr, &next->all_prev, sizeof(next->all_prev));
+            next->all_prev = s->all_prev;
+        }
+        if (super->defrag_slab == slab) {
+            super->defrag_slab = s->all_next;
+            super->defrag_slot = 0;
+        }
+        super->slab_nodes_total -= s->capacity;
+        myfs_free(fsptr, slab);
+    }
+    heap_unlock(fsptr);
+}
+
+/* Returns the number of words of the dirty map of a region */
+static size_t dirty_map_words(size_t fssize) {
+    size_t pages = (fssize + MYFS_DIRTY_PAGE - 1) >> MYFS_DIRTY_SHIFT;
+    return (pages + 63) / 64;
+}
+
+/* Allocates a clear dirty map. Returns 0 on success and -1 if there
+   is no space for it.
+*/
+static int dirty_map_create(void *fsptr) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    size_t bytes = dirty_map_words(super->size) * sizeof(uint64_t);
+
+    myfs_off_t map = myfs_alloc(fsptr, bytes);
+    if (map == 0) {
+        return -1;
+    }
+    memset(off_to_ptr(fsptr, map), 0, bytes);
+    super->dirty_map = map;
+
+    // The block of the map and the free block split off behind it were
+    // set up before there was a map
+    myfs_off_t block = map - MYFS_HEADER_SIZE;
+    region_dirty(fsptr, block_header(fsptr, block), MYFS_HEADER_SIZE);
+    myfs_off_t next = block + block_size(fsptr, block);
+    if (*block_header(fsptr, next) & MYFS_BLOCK_USED) {
+        region_dirty(fsptr, block_header(fsptr, next), MYFS_HEADER_SIZE);
+    } else {
+        size_t size = block_size(fsptr, next);
+        region_dirty(fsptr, block_header(fsptr, next), sizeof(struct myfs_free_block));
+        region_dirty(fsptr, block_header(fsptr, next + size - sizeof(size_t)), sizeof(size_t));
+    }
+    return 0;
+}
+
+struct myfs_super *initialize_myfs(void *fsptr, size_t fssize) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+
+    // Check if the filesystem is already initialized
+    if (super->is_set != 1) {
+        super->is_set = 1;
+        super->size = fssize;
+        heap_lock_init(fsptr);
+
+        // The region may hold anything; nothing gets marked or retired
+        // before the heap is set up
+        super->dirty_map = 0;
+        super->retired = 0;
+        super->journal_gen = 0;
+
+        // Large regions get a data zone behind the heap
+        size_t heap_bytes = fssize & ~(MYFS_ALIGN - 1);
+        super->data_block_size = 0;
+        super->data_blocks = 0;
+        super->data_first = 0;
+        super->data_free = 0;
+        super->data_hint = 0;
+        super->data_bitmap = 0;
+        memset(super->frag_lists, 0, sizeof(super->frag_lists));
+        super->frag_free_bytes = 0;
+        if (fssize >= MYFS_DATA_ZONE_MIN) {
+            super->data_block_size = MYFS_DATA_BLOCK_SIZE;
+            super->data_blocks = fssize / MYFS_DATA_BLOCK_SIZE;
+            super->data_first = (super->data_blocks + MYFS_DATA_HEAP_SHARE - 1) / MYFS_DATA_HEAP_SHARE;
+            size_t huge = data_huge_blocks(super);
+            if (huge != 0) {
+                super->data_first = (super->data_first + huge - 1) / huge * huge;
+            }
+            super->data_free = super->data_blocks - super->data_first;
+            super->data_hint = (super->data_blocks - 1) / 64;
+            heap_bytes = super->data_first * MYFS_DATA_BLOCK_SIZE;
+        }
+
+        // Set up the heap as one free block followed by the sentinel
+        super->heap_start = align_up(sizeof(struct myfs_super));
+        super->heap_end = heap_bytes - MYFS_HEADER_SIZE;
+        super->free_map = 0;
+        memset(super->free_lists, 0, sizeof(super->free_lists));
+        super->free_bytes = 0;
+        set_block_header(fsptr, super->heap_end, MYFS_BLOCK_USED);
+        set_free_block(fsptr, super->heap_start, super->heap_end - super->heap_start,
+                       MYFS_PREV_USED);
+        free_list_insert(fsptr, super->heap_start);
+
+        // From here on, every change gets marked; a region too small for
+        // a dirty map goes without one
+        if (dirty_map_create(fsptr) == 0) {
+            region_dirty(fsptr, block_header(fsptr, super->heap_end), MYFS_HEADER_SIZE);
+        }
+
+        if (super->data_block_size != 0) {
+            // Blocks of the heap and past the end of the region are
+            // never free zone space
+            size_t words = (super->data_blocks + 63) / 64;
+            super->data_bitmap = myfs_alloc(fsptr, words * sizeof(uint64_t));
+            region_dirty(fsptr, off_to_ptr(fsptr, super->data_bitmap), words * sizeof(uint64_t));
+            memset(off_to_ptr(fsptr, super->data_bitmap), 0, words * sizeof(uint64_t));
+            data_mark(fsptr, 0, super->data_first, 1);
+            data_mark(fsptr, super->data_blocks, words * 64 - super->data_blocks, 1);
+        }
+
+        super->slab_partial = 0;
+        super->slab_all = 0;
+        super->slab_nodes_total = 0;
+        super->slab_nodes_used = 0;
+        super->defrag_slab = 0;
+        super->defrag_slot = 0;
+        super->open_files = 0;
+        super->open_files_capacity = 0;
+        super->pins = 0;
+        super->pins_capacity = 0;
+
+        // Initialize the root directory node
+        super->root_dir = myfs_node_alloc(fsptr, 0, 0);
+        struct myfs_node *root = off_to_ptr(fsptr, super->root_dir);
+        strcpy(root->name.short_name, "/");
+        root->name_len = 1;
+        update_time(fsptr, root, 1);  // Mark the root directory creation time
+        root->is_file = 0;    // Mark as a directory
+
+        // The root directory starts without a children array
+        root->data.directory.number_children = 0;
+        root->data.directory.length = 0;
+        root->data.directory.capacity = 0;
+        root->data.directory.children = 0;
+
+        // The snapshot directory is not linked into the tree but found
+        // by name (see path_start)
+        super->snapshot_dir = myfs_node_alloc(fsptr, 0, 0);
+        struct myfs_node *snapshots = off_to_ptr(fsptr, super->snapshot_dir);
+        strcpy(snapshots->name.short_name, MYFS_SNAPSHOT_DIR);
+        snapshots->name_len = sizeof(MYFS_SNAPSHOT_DIR) - 1;
+        snapshots->times[0] = root->times[0];
+        snapshots->times[1] = root->times[1];
+        snapshots->is_file = 0;
+    }
+
+    return super;
+}
+
+/* Directory index
+
+   A directory keeps its children in a plain array of node offsets.
+   New children are appended at the end and removed children leave a
+   hole (offset 0) behind, so that children never change places and
+   a directory listing can be resumed where it stopped (see
+   __myfs_readdir_filler_implem). Holes are squeezed out, keeping the
+   order of the children, whenever the array gets reallocated.
+
+   Once a directory has more than MYFS_DIR_INDEX_MIN children, it additionally
+   gets a hash index, so that looking up a name does not compare it
+   against every child. The index is an open addressing table with
+   linear probing. A slot holds the hash of a child's name and the
+   child's position in the children array (plus one, so that zero
+   marks an empty slot), which keeps slots at 8 bytes and lets
+   removal find the array position of a child in O(1).
+
+   The table never gets rehashed in one go. When it is too full, a
+   table of twice the size becomes the current one and the old table
+   is kept around; every following insertion or removal moves
+   MYFS_DIR_MIGRATE slots of the old table over, until it is empty and
+   gets freed. In the meantime, lookups probe both tables.
+
+   The index only speeds up lookups. If there is no space for it, it
+   is dropped and the directory falls back to scanning the children
+   array until the index can be built again.
+*/
+
+#define MYFS_DIR_MIN_CAPACITY 4
+#define MYFS_DIR_INDEX_MIN    8
+#define MYFS_DIR_INDEX_SLOTS  32
+#define MYFS_DIR_MIGRATE      16
+#define MYFS_DIR_TOMBSTONE    UINT32_MAX
+
+struct myfs_dir_slot {
+    uint32_t hash;             // Hash of the child's name
+    uint32_t pos;              // Position in the children array plus one, or 0 or tombstone
+};
+
+struct myfs_dir_index {
+    myfs_off_t table;          // Current table
+    size_t capacity;           // Slots in the current table, a power of two
+    size_t used;               // Slots of the current table holding an entry or tombstone
+    myfs_off_t old_table;      // Table being migrated, 0 if none
+    size_t old_capacity;       // Slots in the old table
+    size_t migrated;           // Slots of the old table already moved
+};
+
+static uint32_t name_hash(const char *name, size_t len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static const char *node_name(void *fsptr, struct myfs_node *node) {
+    if (node->name_len > MYFS_SHORT_NAME) {
+        return off_to_ptr(fsptr, node->name.long_name);
+    }
+    return node->name.short_name;
+}
+
+static uint32_t node_name_hash(void *fsptr, struct myfs_node *node) {
+    return name_hash(node_name(fsptr, node), node->name_len);
+}
+
+/* Compares the name of a node with the len bytes at name, which need
+   not be '\0'-terminated. Names of different length never get read.
+   A NULL node has no name.
+*/
+static int name_equals(void *fsptr, struct myfs_node *node, const char *name, size_t len) {
+    if (node == NULL || node->name_len != len) {
+        return 0;
+    }
+    const char *node_name = len > MYFS_SHORT_NAME ? region_ptr(fsptr, node->name.long_name, len, 1) :
+                                                    node->name.short_name;
+    return node_name != NULL && memcmp(node_name, name, len) == 0;
+}
+
+/* Returns the child at position pos of the children array, or NULL if
+   there is no such position, which only optimistic readers see
+*/
+static struct myfs_node *dir_child(void *fsptr, struct myfs_dir *dir, size_t pos) {
+    // The array before its length, as dir_resize shortens it before
+    // it switches arrays
+    myfs_off_t *children = region_ptr(fsptr, __atomic_load_n(&dir->children, __ATOMIC_ACQUIRE),
+                                      pos + 1, sizeof(myfs_off_t));
+    if (children == NULL || pos >= __atomic_load_n(&dir->length, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return region_ptr(fsptr, __atomic_load_n(&children[pos], __ATOMIC_ACQUIRE), 1,
+                      sizeof(struct myfs_node));
+}
+
+/* Finds the slot of the child called name in one table, or NULL */
+static struct myfs_dir_slot *dir_table_find(void *fsptr, struct myfs_dir *dir,
+                                            myfs_off_t table, size_t capacity,
+                                            uint32_t hash, const char *name, size_t len) {
+    struct myfs_dir_slot *slots = region_ptr(fsptr, table, capacity, sizeof(struct myfs_dir_slot));
+    size_t mask = capacity - 1;
+
+    if (slots == NULL || capacity == 0) {
+        return NULL;
+    }
+    size_t i = hash & mask;
+    for (size_t probes = 0; probes < capacity; probes++) {
+        uint32_t pos = __atomic_load_n(&slots[i].pos, __ATOMIC_ACQUIRE);
+        if (pos == 0) {
+            break;
+        }
+        if (pos != MYFS_DIR_TOMBSTONE && __atomic_load_n(&slots[i].hash, __ATOMIC_ACQUIRE) == hash &&
+            name_equals(fsptr, dir_child(fsptr, dir, pos - 1), name, len)) {
+            return &slots[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/* Finds the slot that refers to children array position pos, or NULL */
+static struct myfs_dir_slot *dir_table_find_pos(void *fsptr, myfs_off_t table, size_t capacity,
+                                                uint32_t hash, size_t pos) {
+    struct myfs_dir_slot *slots = off_to_ptr(fsptr, table);
+    size_t mask = capacity - 1;
+
+    for (size_t i = hash & mask; slots[i].pos != 0; i = (i + 1) & mask) {
+        if (slots[i].pos == pos + 1) {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+/* Looks a slot up in the current and, during a migration, the old table */
+static struct myfs_dir_slot *dir_index_find(void *fsptr, struct myfs_dir *dir,
+                                            uint32_t hash, const char *name, size_t len) {
+    struct myfs_dir_index *index = region_ptr(fsptr, __atomic_load_n(&dir->index, __ATOMIC_ACQUIRE),
+                                              1, sizeof(*index));
+    if (index == NULL) {
+        return NULL;
+    }
+    // Capacities before tables, as dir_index_insert changes them the
+    // other way round, so that no table is taken for larger than it is
+    size_t capacity = __atomic_load_n(&index->capacity, __ATOMIC_ACQUIRE);
+    myfs_off_t table = __atomic_load_n(&index->table, __ATOMIC_ACQUIRE);
+    struct myfs_dir_slot *slot = dir_table_find(fsptr, dir, table, capacity, hash, name, len);
+    if (slot == NULL) {
+        capacity = __atomic_load_n(&index->old_capacity, __ATOMIC_ACQUIRE);
+        table = __atomic_load_n(&index->old_table, __ATOMIC_ACQUIRE);
+        if (table != 0) {
+            slot = dir_table_find(fsptr, dir, table, capacity, hash, name, len);
+        }
+    }
+    return slot;
+}
+
+static struct myfs_dir_slot *dir_index_find_pos(void *fsptr, struct myfs_dir *dir,
+                                                uint32_t hash, size_t pos) {
+    struct myfs_dir_index *index = off_to_ptr(fsptr, dir->index);
+    struct myfs_dir_slot *slot = dir_table_find_pos(fsptr, index->table, index->capacity,
+                                                    hash, pos);
+    if (slot == NULL && index->old_table != 0) {
+        slot = dir_table_find_pos(fsptr, index->old_table, index->old_capacity, hash, pos);
+    }
+    return slot;
+}
+
+/* Puts an entry into the current table, which must have a free slot */
+static void dir_table_insert(void *fsptr, struct myfs_dir_index *index, uint32_t hash, uint32_t pos) {
+    struct myfs_dir_slot *slots = off_to_ptr(fsptr, index->table);
+    size_t mask = index->capacity - 1;
+    size_t i = hash & mask;
+
+    while (slots[i].pos != 0 && slots[i].pos != MYFS_DIR_TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    if (slots[i].pos == 0) {
+        region_dirty(fsptr, index, sizeof(*index));
+        index->used++;
+    }
+    region_dirty(fsptr, &slots[i], sizeof(slots[i]));
+    __atomic_store_n(&slots[i].hash, hash, __ATOMIC_RELEASE);
+    __atomic_store_n(&slots[i].pos, pos, __ATOMIC_RELEASE);
+}
+
+/* Moves up to max slots of the old table into the current one */
+static void dir_index_migrate(void *fsptr, struct myfs_dir_index *index, size_t max) {
+    if (index->old_table == 0) {
+        return;
+    }
+
+    struct myfs_dir_slot *old = off_to_ptr(fsptr, index->old_table);
+    region_dirty(fsptr, index, sizeof(*index));
+    for (; max > 0 && index->migrated < index->old_capacity; max--, index->migrated++) {
+        struct myfs_dir_slot *slot = &old[index->migrated];
+        if (slot->pos != 0 && slot->pos != MYFS_DIR_TOMBSTONE) {
+            dir_table_insert(fsptr, index, slot->hash, slot->pos);
+        }
+    }
+
+    if (index->migrated == index->old_capacity) {
+        region_retire(fsptr, index->old_table, 0);
+        __atomic_store_n(&index->old_table, 0, __ATOMIC_RELEASE);
+    }
+}
+
+static void dir_index_drop(void *fsptr, struct myfs_dir *dir) {
+    if (dir->index == 0) {
+        return;
+    }
+
+    struct myfs_dir_index *index = off_to_ptr(fsptr, dir->index);
+    region_dirty(fsptr, &dir->index, sizeof(dir->index));
+    __atomic_store_n(&dir->index, 0, __ATOMIC_RELEASE);
+    region_retire(fsptr, index->table, 0);
+    region_retire(fsptr, index->old_table, 0);
+    region_retire(fsptr, ptr_to_off(fsptr, index), 0);
+}
+
+/* Allocates an empty table of capacity slots, returns 0 on failure */
+static myfs_off_t dir_table_alloc(void *fsptr, size_t capacity) {
+    myfs_off_t table = myfs_alloc(fsptr, capacity * sizeof(struct myfs_dir_slot));
+    if (table != 0) {
+        region_dirty(fsptr, off_to_ptr(fsptr, table), capacity * sizeof(struct myfs_dir_slot));
+        memset(off_to_ptr(fsptr, table), 0, capacity * sizeof(struct myfs_dir_slot));
+    }
+    return table;
+}
+
+/* Builds the index of a directory from its children array */
+static void dir_index_build(void *fsptr, struct myfs_dir *dir) {
+    size_t capacity = MYFS_DIR_INDEX_SLOTS;
+    while (capacity < 2 * dir->number_children) {
+        capacity *= 2;
+    }
+
+    myfs_off_t index_offset = myfs_alloc(fsptr, sizeof(struct myfs_dir_index));
+    myfs_off_t table = dir_table_alloc(fsptr, capacity);
+    if (index_offset == 0 || table == 0) {
+        myfs_free(fsptr, index_offset);
+        myfs_free(fsptr, table);
+        return;
+    }
+
+    struct myfs_dir_index *index = off_to_ptr(fsptr, index_offset);
+    region_dirty(fsptr, index, sizeof(*index));
+    region_dirty(fsptr, &dir->index, sizeof(dir->index));
+    index->table = table;
+    index->capacity = capacity;
+    index->used = 0;
+    index->old_table = 0;
+    index->old_capacity = 0;
+    index->migrated = 0;
+    __atomic_store_n(&dir->index, index_offset, __ATOMIC_RELEASE);
+
+    myfs_off_t *children = off_to_ptr(fsptr, dir->children);
+    for (size_t pos = 0; pos < dir->length; pos++) {
+        if (children[pos] != 0) {
+            dir_table_insert(fsptr, index, node_name_hash(fsptr, dir_child(fsptr, dir, pos)), pos + 1);
+        }
+    }
+}
+
+/* Enters the child at children array position pos into the index */
+static void dir_index_insert(void *fsptr, struct myfs_dir *dir, size_t pos) {
+    if (dir->index == 0) {
+        if (dir->number_children > MYFS_DIR_INDEX_MIN) {
+            dir_index_build(fsptr, dir);
+        }
+        return;
+    }
+
+    struct myfs_dir_index *index = off_to_ptr(fsptr, dir->index);
+    dir_index_migrate(fsptr, index, MYFS_DIR_MIGRATE);
+
+    // Keep the load factor at 3/4 at most by switching to a new table
+    if (4 * (index->used + 1) > 3 * index->capacity) {
+        dir_index_migrate(fsptr, index, index->old_capacity);
+
+        size_t capacity = index->capacity;
+        while (capacity < 2 * dir->number_children) {
+            capacity *= 2;
+        }
+
+        myfs_off_t table = dir_table_alloc(fsptr, capacity);
+        if (table == 0) {
+            dir_index_drop(fsptr, dir);
+            return;
+        }
+
+        // Tables before capacities, see dir_index_find
+        region_dirty(fsptr, index, sizeof(*index));
+        __atomic_store_n(&index->old_table, index->table, __ATOMIC_RELEASE);
+        __atomic_store_n(&index->old_capacity, index->capacity, __ATOMIC_RELEASE);
+        index->migrated = 0;
+        __atomic_store_n(&index->table, table, __ATOMIC_RELEASE);
+        __atomic_store_n(&index->capacity, capacity, __ATOMIC_RELEASE);
+        index->used = 0;
+        dir_index_migrate(fsptr, index, MYFS_DIR_MIGRATE);
+    }
+
+    dir_table_insert(fsptr, index, node_name_hash(fsptr, dir_child(fsptr, dir, pos)), pos + 1);
+}
+
+/* Returns the child of a directory called by the len bytes at name,
+   or NULL */
+static struct myfs_node *dir_lookup(void *fsptr, struct myfs_dir *dir, const char *name, size_t len) {
+    if (__atomic_load_n(&dir->index, __ATOMIC_ACQUIRE) != 0) {
+        struct myfs_dir_slot *slot = dir_index_find(fsptr, dir, name_hash(name, len), name, len);
+        return slot == NULL ? NULL :
+               dir_child(fsptr, dir, __atomic_load_n(&slot->pos, __ATOMIC_ACQUIRE) - 1);
+    }
+
+    myfs_off_t children_offset = __atomic_load_n(&dir->children, __ATOMIC_ACQUIRE);
+    size_t length = __atomic_load_n(&dir->length, __ATOMIC_ACQUIRE);
+    myfs_off_t *children = region_ptr(fsptr, children_offset, length, sizeof(myfs_off_t));
+    for (size_t i = 0; children != NULL && i < length; i++) {
+        myfs_off_t child_offset = __atomic_load_n(&children[i], __ATOMIC_ACQUIRE);
+        if (child_offset != 0) {
+            struct myfs_node *child = region_ptr(fsptr, child_offset, 1, sizeof(struct myfs_node));
+            if (name_equals(fsptr, child, name, len)) {
+                return child;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Moves the children array of a directory into a new array with
+   room for capacity >= number_children entries, squeezing out the
+   holes. The children keep their order; the index is updated with
+   their new positions. Returns -1 if there is no space for the new
+   array.
+*/
+static int dir_resize(void *fsptr, struct myfs_dir *dir, size_t capacity) {
+    myfs_off_t new_children_offset = myfs_alloc(fsptr, capacity * sizeof(myfs_off_t));
+    if (new_children_offset == 0) {
+        return -1;
+    }
+
+    // Copy existing children data to the new block. Positions only
+    // ever move down, so a slot that has already been updated cannot
+    // be mistaken for one that still has to be.
+    myfs_off_t *new_children = off_to_ptr(fsptr, new_children_offset);
+    myfs_off_t *old_children = off_to_ptr(fsptr, dir->children);
+    size_t n = 0;
+    region_dirty(fsptr, new_children, dir->number_children * sizeof(myfs_off_t));
+    for (size_t pos = 0; pos < dir->length; pos++) {
+        if (old_children[pos] == 0) {
+            continue;
+        }
+        if (n != pos && dir->index != 0) {
+            uint32_t hash = node_name_hash(fsptr, dir_child(fsptr, dir, pos));
+            struct myfs_dir_slot *slot = dir_index_find_pos(fsptr, dir, hash, pos);
+            region_dirty(fsptr, slot, sizeof(*slot));
+            __atomic_store_n(&slot->pos, n + 1, __ATOMIC_RELEASE);
+        }
+        new_children[n++] = old_children[pos];
+    }
+
+    // The length before the array, see dir_child
+    region_retire(fsptr, dir->children, 0);
+    region_dirty(fsptr, dir, sizeof(*dir));
+    __atomic_store_n(&dir->length, n, __ATOMIC_RELEASE);
+    __atomic_store_n(&dir->children, new_children_offset, __ATOMIC_RELEASE);
+    dir->capacity = capacity;
+    return 0;
+}
+
+/* Makes sure the children array of a directory has room for one
+   more child at its end. If at least half of a full array are holes,
+   it gets compacted; otherwise it doubles in size, so that adding n
+   children costs O(n) overall. Close to a full filesystem, it grows
+   by just what is needed. Returns 0 on success and -1 if there is no
+   space left for a grown children array.
+*/
+static int dir_reserve(void *fsptr, struct myfs_dir *dir) {
+    if (dir->length < dir->capacity) {
+        return 0;
+    }
+
+    size_t capacity;
+    if (dir->capacity < MYFS_DIR_MIN_CAPACITY) {
+        capacity = MYFS_DIR_MIN_CAPACITY;
+    } else if (2 * (dir->number_children + 1) <= dir->capacity) {
+        capacity = dir->capacity;
+    } else {
+        capacity = 2 * dir->capacity;
+    }
+
+    if (dir_resize(fsptr, dir, capacity) == 0) {
+        return 0;
+    }
+    return dir_resize(fsptr, dir, dir->number_children + 1);
+}
+
+/* Adds the node at offset child to a directory. Returns 0 on success
+   and -1 if there is no space left for the grown children array.
+*/
+static int dir_add_child(void *fsptr, struct myfs_dir *dir, myfs_off_t child) {
+    if (dir_reserve(fsptr, dir) < 0) {
+        return -1;
+    }
+
+    // The new child gets the next sequence number after the last one.
+    // After 2^32 insertions, the children are simply numbered afresh.
+    myfs_off_t *children = off_to_ptr(fsptr, dir->children);
+    uint32_t seq = 1;
+    if (dir->length > 0) {
+        seq = dir_child(fsptr, dir, dir->length - 1)->dir_seq + 1;
+        if (seq == 0) {
+            seq = 1;
+            for (size_t pos = 0; pos < dir->length; pos++) {
+                if (children[pos] != 0) {
+                    struct myfs_node *child_node = dir_child(fsptr, dir, pos);
+                    region_dirty(fsptr, &child_node->dir_seq, sizeof(child_node->dir_seq));
+                    child_node->dir_seq = seq++;
+                }
+            }
+        }
+    }
+    struct myfs_node *child_node = off_to_ptr(fsptr, child);
+    region_dirty(fsptr, &child_node->dir_seq, sizeof(child_node->dir_seq));
+    child_node->dir_seq = seq;
+
+    // Update the children list with the new child
+    region_dirty(fsptr, &children[dir->length], sizeof(myfs_off_t));
+    region_dirty(fsptr, dir, sizeof(*dir));
+    __atomic_store_n(&children[dir->length], child, __ATOMIC_RELEASE);
+    __atomic_store_n(&dir->length, dir->length + 1, __ATOMIC_RELEASE);
+    dir->number_children++;
+
+    dir_index_insert(fsptr, dir, dir->length - 1);
+    return 0;
+}
+
+/* Puts the node at offset new_child where child was in the directory.
+   Both must have the same name, so that the index stays valid.
+*/
+static void dir_replace_child(void *fsptr, struct myfs_dir *dir, struct myfs_node *child,
+                              myfs_off_t new_child) {
+    myfs_off_t *children = off_to_ptr(fsptr, dir->children);
+    myfs_off_t child_offset = ptr_to_off(fsptr, child);
+    size_t pos = 0;
+
+    if (dir->index != 0) {
+        const char *name = node_name(fsptr, child);
+        size_t len = child->name_len;
+        pos = dir_index_find(fsptr, dir, name_hash(name, len), name, len)->pos - 1;
+    } else {
+        while (children[pos] != child_offset) {
+            pos++;
+        }
+    }
+    struct myfs_node *new_node = off_to_ptr(fsptr, new_child);
+    region_dirty(fsptr, &children[pos], sizeof(myfs_off_t));
+    region_dirty(fsptr, &new_node->dir_seq, sizeof(new_node->dir_seq));
+    children[pos] = new_child;
+    new_node->dir_seq = child->dir_seq;
+}
+
+/* Removes a child from a directory, leaving a hole in the children
+   array unless it was the last entry.
+*/
+static void dir_remove_child(void *fsptr, struct myfs_dir *dir, struct myfs_node *child) {
+    myfs_off_t *children = off_to_ptr(fsptr, dir->children);
+    myfs_off_t child_offset = ptr_to_off(fsptr, child);
+    size_t pos = 0;
+
+    if (dir->index != 0) {
+        struct myfs_dir_index *index = off_to_ptr(fsptr, dir->index);
+        dir_index_migrate(fsptr, index, MYFS_DIR_MIGRATE);
+
+        const char *name = node_name(fsptr, child);
+        size_t len = child->name_len;
+        struct myfs_dir_slot *slot = dir_index_find(fsptr, dir, name_hash(name, len), name, len);
+        pos = slot->pos - 1;
+        region_dirty(fsptr, slot, sizeof(*slot));
+        slot->pos = MYFS_DIR_TOMBSTONE;
+    } else {
+        while (children[pos] != child_offset) {
+            pos++;
+        }
+    }
+
+    // Leave a hole and decrease the count; trailing holes are cut off
+    region_dirty(fsptr, &children[pos], sizeof(myfs_off_t));
+    region_dirty(fsptr, dir, sizeof(*dir));
+    children[pos] = 0;
+    dir->number_children--;
+    while (dir->length > 0 && children[dir->length - 1] == 0) {
+        dir->length--;
+    }
+
+    // Give memory back once the array is mostly empty. Halving only at
+    // a quarter full keeps alternating adds and removes from resizing
+    // the array every time. If there is no space, keep the big array.
+    if (dir->capacity > MYFS_DIR_MIN_CAPACITY && 4 * dir->number_children <= dir->capacity) {
+        dir_resize(fsptr, dir, dir->capacity / 2);
+    }
+}
+
+/* Frees the children array and the index of an empty directory */
+static void dir_free(void *fsptr, struct myfs_dir *dir) {
+    dir_index_drop(fsptr, dir);
+    myfs_free(fsptr, dir->children);
+    region_dirty(fsptr, dir, sizeof(*dir));
+    dir->children = 0;
+    dir->length = 0;
+    dir->capacity = 0;
+}
+
+/* Path resolution
+
+   Paths are walked in place: path_next_component steps over one
+   component of a path at a time and hands it out as a (name, len)
+   pair pointing into the path, so resolving a path neither copies nor
+   allocates. Repeated slashes and trailing slashes are skipped.
+
+   Paths starting with /.snapshots lead into the snapshot directory
+   instead of the root directory, and from an entry there on into the
+   tree of that snapshot (see Snapshots below).
+*/
+
+struct myfs_name {
+    const char *name;          // Start of the component inside the path
+    size_t len;                // Length of the component
+};
+
+/* Puts the component of the path starting at *pathptr into *component
+   and advances *pathptr past it. Returns 0 when there are no more
+   components.
+*/
+static int path_next_component(const char **pathptr, struct myfs_name *component) {
+    const char *path = *pathptr;
+
+    while (*path == '/') {
+        path++;
+    }
+    if (*path == '\0') {
+        *pathptr = path;
+        return 0;
+    }
+
+    component->name = path;
+    while (*path != '\0' && *path != '/') {
+        path++;
+    }
+    component->len = path - component->name;
+    *pathptr = path;
+    return 1;
+}
+
+/* Looks up one component in the directory node dir. Returns NULL and
+   sets *errnoptr if it does not exist.
+*/
+static struct myfs_node *find_child(void *fsptr, struct myfs_node *dir,
+                                    const struct myfs_name *component, int *errnoptr) {
+    if (component->len > NAME_MAX_LEN) {
+        *errnoptr = ENAMETOOLONG;
+        return NULL;
+    }
+
+    struct myfs_node *child;
+    myfs_off_t snapshot_root;
+    int error;
+    for (unsigned int tries = 0;; tries++) {
+        uint32_t seq = node_read_begin(dir, tries);
+        child = NULL;
+        snapshot_root = 0;
+        error = 0;
+        if (__atomic_load_n(&dir->is_file, __ATOMIC_ACQUIRE)) {
+            error = ENOTDIR;
+        } else if ((child = dir_lookup(fsptr, &dir->data.directory, component->name,
+                                       component->len)) == NULL) {
+            error = ENOENT;
+        } else if (__atomic_load_n(&child->flags, __ATOMIC_ACQUIRE) & MYFS_NODE_SNAPSHOT) {
+            snapshot_root = __atomic_load_n(&child->data.snapshot_root, __ATOMIC_ACQUIRE);
+        }
+        if (!node_read_retry(dir, seq)) {
+            break;
+        }
+    }
+    if (error != 0) {
+        *errnoptr = error;
+        return NULL;
+    }
+    if (snapshot_root != 0) {
+        child = off_to_ptr(fsptr, snapshot_root);
+    }
+    return child;
+}
+
+/* Returns 1 if the first component of path is the snapshot directory */
+static int path_in_snapshots(const char *path) {
+    struct myfs_name component;
+
+    return path_next_component(&path, &component) &&
+           component.len == sizeof(MYFS_SNAPSHOT_DIR) - 1 &&
+           memcmp(component.name, MYFS_SNAPSHOT_DIR, component.len) == 0;
+}
+
+/* Returns the directory path gets resolved from, which is the root
+   directory or the snapshot directory. In the latter case, *pathptr is
+   advanced past the first component.
+*/
+static struct myfs_node *path_start(void *fsptr, const char **pathptr) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    struct myfs_name component;
+
+    if (path_in_snapshots(*pathptr)) {
+        path_next_component(pathptr, &component);
+        return off_to_ptr(fsptr, super->snapshot_dir);
+    }
+    return off_to_ptr(fsptr, super->root_dir);
+}
+
+/* Returns the node path refers to, or NULL with *errnoptr set */
+static struct myfs_node *find_node(void *fsptr, const char *path, int *errnoptr) {
+    struct myfs_node *current = path_start(fsptr, &path);
+    struct myfs_name component;
+
+    while (current != NULL && path_next_component(&path, &component)) {
+        current = find_child(fsptr, current, &component, errnoptr);
+    }
+    return current;
+}
+
+/* Returns the directory that contains the last component of path and
+   puts that component into *last. For the root directory itself, the
+   root is returned and last->len is 0. Returns NULL with *errnoptr
+   set if the parent does not exist or is not a directory.
+*/
+static struct myfs_node *find_parent_node(void *fsptr, const char *path,
+                                          struct myfs_name *last, int *errnoptr) {
+    struct myfs_node *current = path_start(fsptr, &path);
+    struct myfs_name component;
+
+    last->name = path;
+    last->len = 0;
+    if (!path_next_component(&path, last)) {
+        return current;
+    }
+
+    while (path_next_component(&path, &component)) {
+        current = find_child(fsptr, current, last, errnoptr);
+        if (current == NULL) {
+            return NULL;
+        }
+        *last = component;
+    }
+
+    if (current->is_file) {
+        *errnoptr = ENOTDIR;
+        return NULL;
+    }
+    return current;
+}
+
+static struct myfs_node *get_node(void *fsptr, struct myfs_dir *dir, const struct myfs_name *name) {
+    return dir_lookup(fsptr, dir, name->name, name->len);
+}
+
+/* Returns 1 if path lies strictly below the directory dir_path */
+static int path_is_below(const char *dir_path, const char *path) {
+    struct myfs_name dir_component, component;
+
+    while (path_next_component(&dir_path, &dir_component)) {
+        if (!path_next_component(&path, &component) ||
+            component.len != dir_component.len ||
+            memcmp(component.name, dir_component.name, component.len) != 0) {
+            return 0;
+        }
+    }
+    return path_next_component(&path, &component);
+}
+
+/* Allocates the heap block a name too long for a node needs and puts
+   it into *blockptr, or 0 if the name fits into the node. Returns -1
+   if there is no space for the block.
+*/
+static int name_alloc(void *fsptr, const struct myfs_name *name, myfs_off_t *blockptr) {
+    *blockptr = 0;
+    if (name->len <= MYFS_SHORT_NAME) {
+        return 0;
+    }
+
+    *blockptr = myfs_alloc(fsptr, name->len + 1);
+    if (*blockptr == 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Gives a node the name of a path component, stored in the block
+   name_alloc returned for it, and frees the node's previous name.
+*/
+static void set_node_name(void *fsptr, struct myfs_node *node, const struct myfs_name *name,
+                          myfs_off_t block) {
+    if (node->name_len > MYFS_SHORT_NAME) {
+        myfs_free(fsptr, node->name.long_name);
+    }
+
+    char *dest = node->name.short_name;
+    region_dirty(fsptr, node, offsetof(struct myfs_node, times));
+    if (block != 0) {
+        node->name.long_name = block;
+        dest = off_to_ptr(fsptr, block);
+    }
+    region_dirty(fsptr, dest, name->len + 1);
+    memcpy(dest, name->name, name->len);
+    dest[name->len] = '\0';
+    node->name_len = name->len;
+}
+
+/* Returns the node a new child of the directory node parent should go
+   close to: its last child, or parent itself if it has no children
+*/
+static myfs_off_t dir_near(void *fsptr, struct myfs_node *parent) {
+    struct myfs_dir *dir = &parent->data.directory;
+
+    if (dir->length > 0) {
+        myfs_off_t last = ((myfs_off_t *)off_to_ptr(fsptr, dir->children))[dir->length - 1];
+        if (last != 0) {
+            return last;
+        }
+    }
+    return ptr_to_off(fsptr, parent);
+}
+
+/* Creates an empty file (is_file != 0) or directory called name in the
+   directory parent, which has no child of that name. Returns 0 on
+   success and -1 with *errnoptr set to ENOSPC if there is no space.
+*/
+static int dir_create(void *fsptr, struct myfs_node *parent, const struct myfs_name *name,
+                      int is_file, int *errnoptr) {
+    // Allocate the new node and, for a long name, its name block
+    myfs_off_t name_block;
+    if (name_alloc(fsptr, name, &name_block) < 0) {
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+    myfs_off_t new_node_offset =
+        myfs_node_alloc(fsptr, dir_near(fsptr, parent),
+                        parent->data.directory.number_children >= MYFS_SLAB_GROUP_MIN);
+    if (new_node_offset == 0) {
+        if (name_block != 0) {
+            myfs_free(fsptr, name_block);
+        }
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+
+    // The node comes zeroed: an empty file, or a directory without a
+    // children array
+    struct myfs_node *new_node = off_to_ptr(fsptr, new_node_offset);
+    set_node_name(fsptr, new_node, name, name_block);
+    new_node->is_file = is_file != 0;
+    update_time(fsptr, new_node, 1);
+
+    // Update the parent directory's children list
+    if (dir_add_child(fsptr, &parent->data.directory, new_node_offset) < 0) {
+        myfs_node_free(fsptr, new_node_offset);
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+
+    // Update the parent directory's modification time
+    update_time(fsptr, parent, 1);
+    return 0;
+}
+
+/* File data
+
+   The contents of a file live in a list of extents inside the region.
+   An extent is one heap block: a struct myfs_extent header followed
+   by capacity bytes of file data. It holds the bytes of the file from
+   position start on, of which the first length are in use. The list is
+   ordered by start and extents never overlap.
+
+   Ranges of the file no extent holds are holes and read as zeros, so
+   extending a file with truncate or writing past its end costs no
+   memory at all. Writing into a hole fills up the extent before it as
+   far as its capacity allows and otherwise links in a new extent.
+
+   file.data is the first extent and file.last_extent the last one.
+   Appending fills up the last extent and then links new extents
+   behind it, so existing data never moves and appending costs
+   O(appended bytes). New extents grow with the file, up to
+   MYFS_EXTENT_MAX bytes including their header, which keeps the
+   extent count of large files low; the largest extents thus fill
+   whole blocks of the data zone and pack into huge pages.
+   Room can also be reserved ahead, for fallocate and for writes read
+   from a file descriptor (see file_reserve): an extent then has more
+   capacity than length, and the rest reads as a hole until written.
+
+   Files of at most MYFS_INLINE_MAX bytes have no extents at all: their
+   contents are kept in the node itself, in file.inline_data, which
+   shares its space with the extent fields. Whether a file is inline
+   thus follows from its size alone. A file moves to extents when it
+   grows past MYFS_INLINE_MAX and back into the node when it shrinks.
+*/
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01 // As in <linux/falloc.h>
+#endif
+
+#define MYFS_EXTENT_MIN ((size_t) 64)
+#define MYFS_EXTENT_MAX ((size_t) 1 << 20)
+
+struct myfs_extent {
+    myfs_off_t next;        // Next extent of the file, 0 for the last one
+    size_t start;           // File position of the first byte of the extent
+    size_t capacity;        // Bytes of file data the extent can hold
+    size_t length;          // Bytes of file data stored in the extent
+    size_t shared;          // References to the extent beyond the first
+};
+
+#define MYFS_EXTENT_CAPACITY_MAX (MYFS_EXTENT_MAX - sizeof(struct myfs_extent))
+
+static char *extent_data(void *fsptr, myfs_off_t extent) {
+    return (char *)off_to_ptr(fsptr, extent) + sizeof(struct myfs_extent);
+}
+
+/* Allocates an extent with room for *capacityptr bytes of data. An
+   extent goes into the data zone if possible, with its capacity
+   rounded up to a slot of a fragment block or to whole blocks (see
+   Data zone); it only comes from the heap when the zone has no room.
+   Returns 0 if there is no space.
+*/
+static myfs_off_t extent_alloc(void *fsptr, size_t *capacityptr) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    size_t bytes = sizeof(struct myfs_extent) + *capacityptr;
+    size_t block_bytes = super->data_block_size;
+
+    myfs_off_t extent = 0;
+    heap_lock(fsptr);
+    if (block_bytes != 0 && frag_slots(super, bytes) != 0) {
+        size_t size;
+        extent = frag_alloc(fsptr, bytes, &size);
+        if (extent != 0) {
+            *capacityptr = size - sizeof(struct myfs_extent);
+        }
+    } else if (block_bytes != 0) {
+        size_t n = (bytes + block_bytes - 1) / block_bytes;
+        extent = data_alloc(fsptr, n);
+        if (extent != 0) {
+            *capacityptr = n * block_bytes - sizeof(struct myfs_extent);
+        }
+    }
+    if (extent == 0) {
+        extent = myfs_alloc(fsptr, bytes);
+    }
+    heap_unlock(fsptr);
+    return extent;
+}
+
+/* Frees an extent, in the data zone or in the heap */
+static void extent_free(void *fsptr, myfs_off_t extent) {
+    struct myfs_extent *e = off_to_ptr(fsptr, extent);
+    region_free(fsptr, extent, sizeof(struct myfs_extent) + e->capacity);
+}
+
+/* Like extent_free for an extent of a file that optimistic readers
+   may still be looking at, see region_retire
+*/
+static void extent_retire(void *fsptr, myfs_off_t extent) {
+    struct myfs_extent *e = off_to_ptr(fsptr, extent);
+    region_retire(fsptr, extent, sizeof(struct myfs_extent) + e->capacity);
+}
+
+static int file_is_inline(const struct myfs_file_data *file) {
+    return __atomic_load_n(&file->size, __ATOMIC_ACQUIRE) <= MYFS_INLINE_MAX;
+}
+
+/* Returns the last extent of a file that starts at or before position
+   pos, or 0 if there is none, i.e. pos lies in a hole at the start.
+*/
+static myfs_off_t file_find_extent(void *fsptr, struct myfs_file_data *file, size_t pos) {
+    // Accesses at the end of a file are the common case
+    myfs_off_t last_extent = __atomic_load_n(&file->last_extent, __ATOMIC_ACQUIRE);
+    if (last_extent != 0) {
+        struct myfs_extent *last = region_ptr(fsptr, last_extent, 1, sizeof(struct myfs_extent));
+        if (last != NULL && pos >= __atomic_load_n(&last->start, __ATOMIC_ACQUIRE)) {
+            return last_extent;
+        }
+    }
+
+    // A file has fewer extents than fit into the region; an optimistic
+    // reader (see Node locks) may otherwise find a cycle
+    size_t steps = ((struct myfs_super *)fsptr)->size / sizeof(struct myfs_extent);
+    myfs_off_t found = 0;
+    myfs_off_t extent = __atomic_load_n(&file->data, __ATOMIC_ACQUIRE);
+    while (extent != 0 && steps-- > 0) {
+        struct myfs_extent *e = region_ptr(fsptr, extent, 1, sizeof(struct myfs_extent));
+        if (e == NULL || __atomic_load_n(&e->start, __ATOMIC_ACQUIRE) > pos) {
+            break;
+        }
+        found = extent;
+        extent = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE);
+    }
+    return found;
+}
+
+/* Copies len bytes at position pos of the file into buf, with zeros
+   for holes. The range must lie inside the file. An optimistic reader
+   (see Node locks) may find the file changing under it; the copy then
+   stops early rather than leave the region or loop forever.
+*/
+static void file_read(void *fsptr, struct myfs_file_data *file, size_t pos,
+                      char *buf, size_t len) {
+    size_t fssize = ((struct myfs_super *)fsptr)->size;
+
+    if (file_is_inline(file)) {
+        if (pos <= MYFS_INLINE_MAX && len <= MYFS_INLINE_MAX - pos) {
+            region_load(buf, file->inline_data + pos, len);
+        }
+        return;
+    }
+
+    myfs_off_t extent = file_find_extent(fsptr, file, pos);
+    size_t steps = fssize / sizeof(struct myfs_extent);
+
+    while (len > 0) {
+        struct myfs_extent *e = NULL;
+        size_t start = 0, length = 0;
+        myfs_off_t next;
+        if (extent != 0) {
+            if ((e = region_ptr(fsptr, extent, 1, sizeof(struct myfs_extent))) == NULL) {
+                return;
+            }
+            next = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE);
+            start = __atomic_load_n(&e->start, __ATOMIC_ACQUIRE);
+            length = __atomic_load_n(&e->length, __ATOMIC_ACQUIRE);
+        } else {
+            next = __atomic_load_n(&file->data, __ATOMIC_ACQUIRE);
+        }
+        size_t next_start = SIZE_MAX;
+        if (next != 0) {
+            struct myfs_extent *following = region_ptr(fsptr, next, 1, sizeof(struct myfs_extent));
+            if (following == NULL) {
+                return;
+            }
+            next_start = __atomic_load_n(&following->start, __ATOMIC_ACQUIRE);
+        }
+        size_t n = len;
+
+        if (e != NULL && pos >= start && pos - start < length) {
+            // Inside the used part of an extent
+            if (n > length - (pos - start)) {
+                n = length - (pos - start);
+            }
+            char *data = NULL;
+            if (pos - start < fssize) {
+                data = region_ptr(fsptr, extent + sizeof(struct myfs_extent) + (pos - start), n, 1);
+            }
+            if (data == NULL) {
+                return;
+            }
+            region_load(buf, data, n);
+        } else {
+            // In a hole, which lasts up to the next extent
+            if (n > next_start - pos) {
+                n = next_start - pos;
+            }
+            memset(buf, 0, n);
+        }
+
+        buf += n;
+        pos += n;
+        len -= n;
+        if (pos == next_start) {
+            extent = next;
+        }
+        if (n == 0 && steps-- == 0) {
+            return;
+        }
+    }
+}
+
+#define MYFS_ZERO_CHUNK ((size_t) 65536) // Most a hole iovec of file_map covers
+
+/* Describes the len bytes at position pos of the file, which must lie
+   inside it, by iovecs pointing straight at its contents in the
+   region, and at zeros, at most MYFS_ZERO_CHUNK of them, for holes.
+   Returns the number of iovecs needed; they are only filled in if iov
+   is not NULL. Sets *holesptr to 1 if there is a hole in the range.
+*/
+static size_t file_map(void *fsptr, struct myfs_file_data *file, size_t pos, size_t len,
+                       struct iovec *iov, const char *zeros, int *holesptr) {
+    size_t count = 0;
+
+    *holesptr = 0;
+    if (file_is_inline(file)) {
+        if (len > 0 && iov != NULL) {
+            iov[0].iov_base = file->inline_data + pos;
+            iov[0].iov_len = len;
+        }
+        return len > 0;
+    }
+
+    myfs_off_t extent = file_find_extent(fsptr, file, pos);
+
+    while (len > 0) {
+        struct myfs_extent *e = extent != 0 ? off_to_ptr(fsptr, extent) : NULL;
+        myfs_off_t next = e != NULL ? e->next : file->data;
+        size_t next_start = SIZE_MAX;
+        if (next != 0) {
+            next_start = ((struct myfs_extent *)off_to_ptr(fsptr, next))->start;
+        }
+        size_t n = len;
+        char *base;
+
+        if (e != NULL && pos < e->start + e->length) {
+            if (n > e->start + e->length - pos) {
+                n = e->start + e->length - pos;
+            }
+            base = extent_data(fsptr, extent) + (pos - e->start);
+        } else {
+            if (n > next_start - pos) {
+                n = next_start - pos;
+            }
+            if (n > MYFS_ZERO_CHUNK) {
+                n = MYFS_ZERO_CHUNK;
+            }
+            base = (char *)zeros;
+            *holesptr = 1;
+        }
+
+        if (n > 0) {
+            if (iov != NULL) {
+                iov[count].iov_base = base;
+                iov[count].iov_len = n;
+            }
+            count++;
+        }
+        pos += n;
+        len -= n;
+        if (pos == next_start) {
+            extent = next;
+        }
+    }
+    return count;
+}
+
+/* Links a new, empty extent starting at position start behind the
+   extent prev of the file, or at the front if prev is 0. Its capacity
+   is at least want bytes if space permits, but may be smaller when the
+   heap is short on large blocks. Only the first limit bytes of it will
+   ever be used, so it is not made larger than that on purpose.
+   Returns 0 if not even a tiny extent can be allocated.
+*/
+static myfs_off_t file_add_extent(void *fsptr, struct myfs_file_data *file, myfs_off_t prev,
+                                  size_t start, size_t want, size_t limit) {
+    // Only extents appended at the end grow with the file
+    size_t capacity = want;
+    if (prev == file->last_extent && capacity < file->allocated) {
+        capacity = file->allocated;
+    }
+    if (capacity < MYFS_EXTENT_MIN) {
+        capacity = MYFS_EXTENT_MIN;
+    }
+    if (capacity > MYFS_EXTENT_CAPACITY_MAX) {
+        capacity = MYFS_EXTENT_CAPACITY_MAX;
+    }
+    if (capacity > limit) {
+        capacity = limit;
+    }
+
+    myfs_off_t extent = 0;
+    for (; capacity > 0; capacity /= 2) {
+        extent = extent_alloc(fsptr, &capacity);
+        if (extent != 0) {
+            break;
+        }
+    }
+    if (extent == 0) {
+        return 0;
+    }
+
+    struct myfs_extent *e = off_to_ptr(fsptr, extent);
+    region_dirty(fsptr, e, sizeof(*e));
+    region_dirty(fsptr, file, sizeof(*file));
+    e->start = start;
+    e->capacity = capacity;
+    e->length = 0;
+    e->shared = 0;
+
+    if (prev != 0) {
+        struct myfs_extent *p = off_to_ptr(fsptr, prev);
+        region_dirty(fsptr, &p->next, sizeof(p->next));
+        e->next = p->next;
+        __atomic_store_n(&p->next, extent, __ATOMIC_RELEASE);
+    } else {
+        e->next = file->data;
+        __atomic_store_n(&file->data, extent, __ATOMIC_RELEASE);
+    }
+    if (e->next == 0) {
+        __atomic_store_n(&file->last_extent, extent, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&file->allocated, file->allocated + capacity, __ATOMIC_RELEASE);
+    return extent;
+}
+
+/* Drops a reference to the list of extents starting at extent. The
+   list may continue into extents shared with copies of the file or
+   pinned by a read (see Snapshots and Pinned reads below); the first
+   of these just loses a reference, while those before it are freed.
+   Pins go away under the shared lock, so references drop atomically.
+*/
+static void extent_list_release(void *fsptr, myfs_off_t extent) {
+    while (extent != 0) {
+        struct myfs_extent *e = off_to_ptr(fsptr, extent);
+        size_t refs = __atomic_load_n(&e->shared, __ATOMIC_ACQUIRE);
+        while (refs > 0 && !__atomic_compare_exchange_n(&e->shared, &refs, refs - 1, 0,
+                                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        }
+        if (refs > 0) {
+            region_dirty(fsptr, &e->shared, sizeof(e->shared));
+            return;
+        }
+        myfs_off_t next = e->next;
+        extent_retire(fsptr, extent);
+        extent = next;
+    }
+}
+
+/* Frees the extent list of a file, whatever its size claims */
+static void file_free_extents(void *fsptr, struct myfs_file_data *file) {
+    extent_list_release(fsptr, file->data);
+}
+
+/* Frees all extents of the file, leaving it empty */
+static void file_free_data(void *fsptr, struct myfs_file_data *file) {
+    if (!file_is_inline(file)) {
+        file_free_extents(fsptr, file);
+    }
+
+    region_dirty(fsptr, &file->size, sizeof(file->size));
+    __atomic_store_n(&file->size, 0, __ATOMIC_RELEASE);
+}
+
+/* Where the bytes of a write come from: the iovcnt buffers at iov, one
+   after the other, or, if fd is not -1, a file descriptor, such as the
+   pipe FUSE splices a request into, which is read straight into the
+   extents. The file descriptor is read with the locks held, so it must
+   be non-blocking; the bytes it has not got yet are not waited for.
+*/
+struct myfs_source {
+    const struct iovec *iov;
+    int iovcnt;
+    size_t skip;                // Bytes of iov[0] already taken
+    int fd;
+    int error;                  // Why fd ran dry: errno, or EIO at its end
+};
+
+static struct myfs_source source_buffer(struct iovec *iov, const char *buf, size_t len) {
+    iov->iov_base = (void *)buf;
+    iov->iov_len = len;
+    return (struct myfs_source) { iov, 1, 0, -1, 0 };
+}
+
+/* Takes the next n bytes of src into dst. Returns the number of bytes
+   taken, which is less than n only if the buffers ran out or the file
+   descriptor reached its end, had no more bytes ready or failed.
+*/
+static size_t source_take(struct myfs_source *src, char *dst, size_t n) {
+    size_t done = 0;
+
+    if (src->fd >= 0) {
+        while (done < n) {
+            ssize_t got = read(src->fd, dst + done, n - done);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                src->error = got < 0 ? errno : EIO;
+                break;
+            }
+            done += got;
+        }
+        return done;
+    }
+
+    while (done < n && src->iovcnt > 0) {
+        size_t k = src->iov->iov_len - src->skip;
+        if (k > n - done) {
+            k = n - done;
+        }
+        region_store(dst + done, (const char *)src->iov->iov_base + src->skip, k);
+        done += k;
+        src->skip += k;
+        if (src->skip == src->iov->iov_len) {
+            src->iov++;
+            src->iovcnt--;
+            src->skip = 0;
+        }
+    }
+    return done;
+}
+
+/* Copies len bytes from src to position pos of a file that keeps its
+   contents in extents, allocating extents for the holes written to.
+   Returns the number of bytes written, which is less than len only
+   when the filesystem is full or src runs dry. Does not change the
+   size of the file.
+*/
+static size_t file_write_extents(void *fsptr, struct myfs_file_data *file, size_t pos,
+                                 struct myfs_source *src, size_t len) {
+    size_t done = 0;
+    myfs_off_t extent = file_find_extent(fsptr, file, pos);
+
+    while (done < len) {
+        struct myfs_extent *e = extent != 0 ? off_to_ptr(fsptr, extent) : NULL;
+        myfs_off_t next = e != NULL ? e->next : file->data;
+        size_t next_start = SIZE_MAX;
+        if (next != 0) {
+            next_start = ((struct myfs_extent *)off_to_ptr(fsptr, next))->start;
+        }
+
+        if (e == NULL || pos >= e->start + e->capacity) {
+            // pos lies in a hole no extent has room for: link in a new one
+            extent = file_add_extent(fsptr, file, extent, pos, len - done, next_start - pos);
+            if (extent == 0) {
+                break;
+            }
+            continue;
+        }
+
+        size_t n = e->start + e->capacity;
+        if (n > next_start) {
+            n = next_start;
+        }
+        n -= pos;
+        if (n > len - done) {
+            n = len - done;
+        }
+
+        // Bytes between the used part of the extent and pos were a hole
+        char *data = extent_data(fsptr, extent);
+        size_t in_extent = pos - e->start;
+        size_t from = in_extent < e->length ? in_extent : e->length;
+        region_dirty(fsptr, &e->length, sizeof(e->length));
+        region_dirty(fsptr, data + from, in_extent + n - from);
+        if (in_extent > e->length) {
+            region_zero(data + e->length, in_extent - e->length);
+        }
+        size_t taken = source_take(src, data + in_extent, n);
+        if (in_extent + taken > e->length) {
+            __atomic_store_n(&e->length, in_extent + taken, __ATOMIC_RELEASE);
+        }
+
+        pos += taken;
+        done += taken;
+        if (taken < n) {
+            break;
+        }
+        if (pos == next_start) {
+            extent = next;
+        }
+    }
+
+    return done;
+}
+
+/* Makes sure that the len bytes at position pos of a file that keeps
+   its contents in extents have room in extents, linking in new ones
+   for the holes in the range. Nothing gets written, so the holes
+   still read as zeros. Returns the number of bytes from pos on that
+   have room, which is less than len only when the filesystem is full.
+*/
+static size_t file_reserve(void *fsptr, struct myfs_file_data *file, size_t pos, size_t len) {
+    size_t done = 0;
+    myfs_off_t extent = file_find_extent(fsptr, file, pos);
+
+    while (done < len) {
+        struct myfs_extent *e = extent != 0 ? off_to_ptr(fsptr, extent) : NULL;
+        myfs_off_t next = e != NULL ? e->next : file->data;
+        size_t next_start = SIZE_MAX;
+        if (next != 0) {
+            next_start = ((struct myfs_extent *)off_to_ptr(fsptr, next))->start;
+        }
+
+        if (e == NULL || pos >= e->start + e->capacity) {
+            extent = file_add_extent(fsptr, file, extent, pos, len - done, next_start - pos);
+            if (extent == 0) {
+                break;
+            }
+            continue;
+        }
+
+        size_t n = e->start + e->capacity;
+        if (n > next_start) {
+            n = next_start;
+        }
+        n -= pos;
+        if (n > len - done) {
+            n = len - done;
+        }
+        pos += n;
+        done += n;
+        if (pos == next_start) {
+            extent = next;
+        }
+    }
+
+    return done;
+}
+
+/* Moves the first size <= MYFS_INLINE_MAX bytes of a file that keeps
+   its contents in extents into the node, freeing all the extents.
+   file->size is not looked at, as it may already be small enough to
+   claim the file is inline.
+*/
+static void file_make_inline(void *fsptr, struct myfs_file_data *file, size_t size) {
+    char contents[MYFS_INLINE_MAX];
+    memset(contents, 0, size);
+
+    myfs_off_t extent = file->data;
+    while (extent != 0) {
+        struct myfs_extent *e = off_to_ptr(fsptr, extent);
+        if (e->start >= size) {
+            break;
+        }
+        size_t n = e->length;
+        if (n > size - e->start) {
+            n = size - e->start;
+        }
+        memcpy(contents + e->start, extent_data(fsptr, extent), n);
+        extent = e->next;
+    }
+    file_free_extents(fsptr, file);
+
+    region_dirty(fsptr, file, sizeof(*file));
+    region_store(file->inline_data, contents, size);
+    __atomic_store_n(&file->size, size, __ATOMIC_RELEASE);
+}
+
+/* Moves the contents of an inline file into an extent, leaving it as
+   an empty extent list of the same size if there were no contents.
+   Returns -1, with the file unchanged, if there is no space.
+*/
+static int file_make_extents(void *fsptr, struct myfs_file_data *file) {
+    char contents[MYFS_INLINE_MAX];
+    size_t size = file->size;
+    memcpy(contents, file->inline_data, size);
+
+    region_dirty(fsptr, file, sizeof(*file));
+    __atomic_store_n(&file->allocated, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&file->data, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&file->last_extent, 0, __ATOMIC_RELEASE);
+    struct iovec iov;
+    struct myfs_source src = source_buffer(&iov, contents, size);
+    if (file_write_extents(fsptr, file, 0, &src, size) < size) {
+        file_free_extents(fsptr, file);
+        region_store(file->inline_data, contents, size);
+        return -1;
+    }
+    return 0;
+}
+
+/* Copies len bytes from src to position pos of the file, which may lie
+   beyond its end; the file is extended as needed and the bytes in
+   between become a hole. Returns the number of bytes written, which is
+   less than len only when the filesystem is full or src runs dry.
+*/
+static size_t file_write(void *fsptr, struct myfs_file_data *file, size_t pos,
+                         struct myfs_source *src, size_t len) {
+    size_t size = file->size;
+
+    region_dirty(fsptr, file, sizeof(*file));
+    if (file_is_inline(file)) {
+        if (pos <= MYFS_INLINE_MAX && len <= MYFS_INLINE_MAX - pos) {
+            if (pos > size) {
+                region_zero(file->inline_data + size, pos - size);
+            }
+            len = source_take(src, file->inline_data + pos, len);
+            if (len > 0 && pos + len > size) {
+                __atomic_store_n(&file->size, pos + len, __ATOMIC_RELEASE);
+            }
+            return len;
+        }
+
+        // Too large for the node
+        if (file_make_extents(fsptr, file) < 0) {
+            return 0;
+        }
+    }
+
+    // What is read from a file descriptor cannot be put back, so only
+    // as much is read as there is room for
+    if (src->fd >= 0) {
+        len = file_reserve(fsptr, file, pos, len);
+    }
+    size_t done = file_write_extents(fsptr, file, pos, src, len);
+    if (done > 0 && pos + done > file->size) {
+        __atomic_store_n(&file->size, pos + done, __ATOMIC_RELEASE);
+    }
+
+    // With a full filesystem, a file that was just moved to extents
+    // may have grown by too little to stay there
+    if (file->size <= MYFS_INLINE_MAX) {
+        file_make_inline(fsptr, file, file->size);
+    }
+    return done;
+}
+
+/* Changes the size of the file to new_size. Growing a file just adds
+   a hole at its end; shrinking it frees the extents that are no
+   longer needed. Returns -1 if an inline file cannot be moved to
+   extents for lack of space.
+*/
+static int file_resize(void *fsptr, struct myfs_file_data *file, size_t new_size) {
+    region_dirty(fsptr, file, sizeof(*file));
+    if (new_size == 0) {
+        file_free_data(fsptr, file);
+        return 0;
+    }
+
+    if (file_is_inline(file)) {
+        if (new_size <= MYFS_INLINE_MAX) {
+            if (new_size > file->size) {
+                region_zero(file->inline_data + file->size, new_size - file->size);
+            }
+            __atomic_store_n(&file->size, new_size, __ATOMIC_RELEASE);
+            return 0;
+        }
+        if (file_make_extents(fsptr, file) < 0) {
+            return -1;
+        }
+        __atomic_store_n(&file->size, new_size, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    if (new_size <= MYFS_INLINE_MAX) {
+        file_make_inline(fsptr, file, new_size);
+        return 0;
+    }
+
+    if (new_size < file->size) {
+        // Cut the extent holding the new end and free all behind it
+        myfs_off_t extent = file_find_extent(fsptr, file, new_size - 1);
+        myfs_off_t next;
+        if (extent != 0) {
+            struct myfs_extent *e = off_to_ptr(fsptr, extent);
+            region_dirty(fsptr, e, sizeof(*e));
+            if (e->length > new_size - e->start) {
+                __atomic_store_n(&e->length, new_size - e->start, __ATOMIC_RELEASE);
+            }
+            next = e->next;
+            __atomic_store_n(&e->next, 0, __ATOMIC_RELEASE);
+        } else {
+            next = file->data;
+            __atomic_store_n(&file->data, 0, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&file->last_extent, extent, __ATOMIC_RELEASE);
+
+        // Extents from the first one shared with a copy of the file on
+        // just lose that reference
+        int shared = 0;
+        while (next != 0) {
+            struct myfs_extent *n = off_to_ptr(fsptr, next);
+            myfs_off_t after = n->next;
+            __atomic_store_n(&file->allocated, file->allocated - n->capacity, __ATOMIC_RELEASE);
+            if (!shared && n->shared > 0) {
+                region_dirty(fsptr, &n->shared, sizeof(n->shared));
+                n->shared--;
+                shared = 1;
+            }
+            if (!shared) {
+                extent_retire(fsptr, next);
+            }
+            next = after;
+        }
+    }
+
+    __atomic_store_n(&file->size, new_size, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Open files
+
+   Opening a file hands out a handle, which FUSE passes back with every
+   read, write and truncation of the open file, so that these need not
+   look the path up again. The handle is 1 + the index of a slot of the
+   open file table, a heap block holding the offset of the node of
+   each open file; a free slot holds 0. Nodes only move or go away
+   under the exclusive region lock, so a node found through a slot
+   under the shared lock stays valid for the operation.
+
+   A file that gets copied out of a snapshot (see dir_unshare_child)
+   takes its slots along to the copy. A file that goes away has its
+   slots set to MYFS_OPEN_FILE_GONE until they are released, and
+   operations on those handles look the path up as before. Files opened
+   through the snapshot directory get no handle, as their nodes are the
+   ones a copy replaces in the live tree.
+
+   Slots are taken under the shared lock, by an atomic compare and
+   swap; the table only grows, doubling, under the exclusive lock. The
+   table belongs to the mount and is emptied on attach.
+*/
+
+#define MYFS_OPEN_FILES_MIN 16
+#define MYFS_OPEN_FILE_GONE ((myfs_off_t) 1) // No node starts there
+
+/* Returns the node of the file handle fh refers to, or NULL if it
+   refers to none
+*/
+static struct myfs_node *open_file_node(void *fsptr, uint64_t fh) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+
+    if (fh == 0 || fh > super->open_files_capacity) {
+        return NULL;
+    }
+    myfs_off_t *slots = off_to_ptr(fsptr, super->open_files);
+    myfs_off_t node = __atomic_load_n(&slots[fh - 1], __ATOMIC_ACQUIRE);
+    return node == 0 || node == MYFS_OPEN_FILE_GONE ? NULL : off_to_ptr(fsptr, node);
+}
+
+/* Puts value into a free slot of the table at *tableptr, with
+   *capacityptr slots, and returns 1 + the index of the slot. If all
+   slots are taken, grows the table, which needs the region lock held
+   exclusively, if grow is 1. Returns 0 if there is no free slot or no
+   space to grow.
+*/
+static uint64_t slots_add(void *fsptr, myfs_off_t *tableptr, size_t *capacityptr,
+                          myfs_off_t value, int grow) {
+    myfs_off_t *slots = off_to_ptr(fsptr, *tableptr);
+
+    for (size_t i = 0; i < *capacityptr; i++) {
+        myfs_off_t seen = 0;
+        if (__atomic_load_n(&slots[i], __ATOMIC_RELAXED) == 0) {
+            region_dirty(fsptr, &slots[i], sizeof(myfs_off_t));
+            if (__atomic_compare_exchange_n(&slots[i], &seen, value, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                return i + 1;
+            }
+        }
+    }
+    if (!grow) {
+        return 0;
+    }
+
+    size_t old_capacity = *capacityptr;
+    size_t capacity = old_capacity == 0 ? MYFS_OPEN_FILES_MIN : 2 * old_capacity;
+    myfs_off_t table = myfs_alloc(fsptr, capacity * sizeof(myfs_off_t));
+    if (table == 0) {
+        return 0;
+    }
+
+    myfs_off_t *new_slots = off_to_ptr(fsptr, table);
+    region_dirty(fsptr, new_slots, capacity * sizeof(myfs_off_t));
+    memcpy(new_slots, slots, old_capacity * sizeof(myfs_off_t));
+    memset(new_slots + old_capacity, 0, (capacity - old_capacity) * sizeof(myfs_off_t));
+    new_slots[old_capacity] = value;
+    myfs_free(fsptr, *tableptr);
+    region_dirty(fsptr, tableptr, sizeof(*tableptr));
+    region_dirty(fsptr, capacityptr, sizeof(*capacityptr));
+    *tableptr = table;
+    *capacityptr = capacity;
+    return old_capacity + 1;
+}
+
+/* Puts the node at offset into a free slot of the open file table and
+   returns the handle for it, or 0, see slots_add
+*/
+static uint64_t open_file_add(void *fsptr, myfs_off_t offset, int grow) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    return slots_add(fsptr, &super->open_files, &super->open_files_capacity, offset, grow);
+}
+
+/* Frees the slot of the file handle fh */
+static void open_file_remove(void *fsptr, uint64_t fh) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+
+    if (fh != 0 && fh <= super->open_files_capacity) {
+        myfs_off_t *slots = off_to_ptr(fsptr, super->open_files);
+        region_dirty(fsptr, &slots[fh - 1], sizeof(myfs_off_t));
+        __atomic_store_n(&slots[fh - 1], 0, __ATOMIC_RELEASE);
+    }
+}
+
+/* Points the slots of the node at offset to the node at new_offset,
+   or marks them MYFS_OPEN_FILE_GONE if new_offset is 0
+*/
+static void open_files_move(void *fsptr, myfs_off_t offset, myfs_off_t new_offset) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    myfs_off_t *slots = off_to_ptr(fsptr, super->open_files);
+
+    for (size_t i = 0; i < super->open_files_capacity; i++) {
+        if (slots[i] == offset) {
+            region_dirty(fsptr, &slots[i], sizeof(myfs_off_t));
+            slots[i] = new_offset != 0 ? new_offset : MYFS_OPEN_FILE_GONE;
+        }
+    }
+}
+
+static void open_files_forget(void *fsptr, myfs_off_t offset) {
+    open_files_move(fsptr, offset, 0);
+}
+
+/* Empties the open file table, when the region gets attached */
+static void open_files_reset(void *fsptr) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+
+    if (super->open_files != 0) {
+        myfs_free(fsptr, super->open_files);
+        region_dirty(fsptr, &super->open_files, sizeof(super->open_files));
+        region_dirty(fsptr, &super->open_files_capacity, sizeof(super->open_files_capacity));
+        super->open_files = 0;
+        super->open_files_capacity = 0;
+    }
+}
+
+/* Pinned reads
+
+   __myfs_read_iov_implem hands out iovecs pointing straight at the
+   contents of a file, which must stay as they are until the caller has
+   passed them on, without the caller holding a lock in between. The
+   read therefore pins the extents it describes: it takes a reference
+   to the extent list of the file from the first of them on, as a copy
+   of the file would (see Snapshots), and marks the file
+   MYFS_NODE_SHARED_DATA. A change to the file then copies the extents
+   it touches first, and extents the file lets go of stay around until
+   __myfs_read_iov_done_implem drops the reference. The contents of
+   small files live in their node and get copied out instead.
+
+   The references are kept in the pin table, a heap block with a slot
+   per pinned read holding the first extent it pinned, or 0 if free;
+   the pin handed out is 1 + the index of the slot. Pins are taken and
+   dropped under the shared lock, and the table grows like the open
+   file table. Pins of a mount that went away are dropped on attach.
+*/
+
+/* Pins the extent list of the file node from extent on, see Pinned
+   reads. Returns the pin, or 0 if the pin table is full and cannot
+   grow, see slots_add.
+*/
+static uint64_t pin_add(void *fsptr, struct myfs_node *node, myfs_off_t extent, int grow) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+
+    uint64_t pin = slots_add(fsptr, &super->pins, &super->pins_capacity, extent, grow);
+    if (pin == 0) {
+        return 0;
+    }
+    struct myfs_extent *e = off_to_ptr(fsptr, extent);
+    region_dirty(fsptr, &e->shared, sizeof(e->shared));
+    __atomic_add_fetch(&e->shared, 1, __ATOMIC_ACQ_REL);
+    region_dirty(fsptr, &node->flags, sizeof(node->flags));
+    __atomic_or_fetch(&node->flags, MYFS_NODE_SHARED_DATA, __ATOMIC_RELEASE);
+    return pin;
+}
+
+/* Drops the pin pin_add handed out. Returns 0 on success and EINVAL if
+   pin is not one of the region or has been dropped before.
+*/
+static int pin_remove(void *fsptr, uint64_t pin) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+
+    if (pin == 0 || pin > super->pins_capacity) {
+        return EINVAL;
+    }
+    myfs_off_t *slots = off_to_ptr(fsptr, super->pins);
+    myfs_off_t extent = __atomic_exchange_n(&slots[pin - 1], 0, __ATOMIC_ACQ_REL);
+    if (extent == 0) {
+        return EINVAL;
+    }
+    region_dirty(fsptr, &slots[pin - 1], sizeof(myfs_off_t));
+    extent_list_release(fsptr, extent);
+    return 0;
+}
+
+/* Drops all pins and the pin table, when the region gets attached */
+static void pins_reset(void *fsptr) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+
+    if (super->pins != 0) {
+        myfs_off_t *slots = off_to_ptr(fsptr, super->pins);
+        for (size_t i = 0; i < super->pins_capacity; i++) {
+            extent_list_release(fsptr, slots[i]);
+        }
+        myfs_free(fsptr, super->pins);
+        region_dirty(fsptr, &super->pins, sizeof(super->pins));
+        region_dirty(fsptr, &super->pins_capacity, sizeof(super->pins_capacity));
+        super->pins = 0;
+        super->pins_capacity = 0;
+    }
+}
+
+/* Snapshots
+
+   A snapshot is a read-only view of the whole tree as it was when the
+   snapshot was taken. Snapshots are entries of the snapshot directory,
+   which is reached as /.snapshots but is not listed in the root
+   directory: mkdir /.snapshots/name takes a snapshot, rmdir removes
+   it, and the tree of a snapshot can be browsed below its entry.
+
+   Taking a snapshot costs O(1): its entry just refers to the current
+   root directory, which from then on is shared by the live tree and
+   the snapshot. Nodes and extents can be shared by several trees and
+   count the references they have beyond the first (struct
+   myfs_slab.shared and struct myfs_extent.shared). A shared node must
+   not be changed in place. Operations that change the tree therefore
+   resolve their paths with find_node_private and find_parent_private,
+   which replace every shared node on the way by a private copy
+   (copy-on-write). A copied directory gets its own children array but
+   shares its children, which gain a reference each; a copied file
+   shares its extents.
+
+   The extents of a file form a list, so sharing the first extent of a
+   list shares all of it. Before a file's contents change, the shared
+   extents up to the last one the change touches are copied (see
+   file_unshare_data); the copy of that one links to the rest of the
+   list, which stays shared and gains a reference. A small write to a
+   large file thus copies little more than the extent it writes to.
+   Copies of a node are marked with MYFS_NODE_SHARED_DATA as long as
+   some of their extents may be shared, so files whose extents are
+   their own skip that step.
+
+   Removing a node or a snapshot drops a reference; only what is no
+   longer referenced at all gets freed. Snapshots thus cost only the
+   space of what has changed since they were taken.
+*/
+
+#define MYFS_SNAPSHOTS_MAX 1024   // Keeps reference counts within 16 bits
+
+static uint16_t *node_shared(void *fsptr, struct myfs_node *node) {
+    myfs_off_t slab = ptr_to_off(fsptr, node) - sizeof(struct myfs_slab) -
+                      node->slab_slot * sizeof(struct myfs_node);
+    return &((struct myfs_slab *)off_to_ptr(fsptr, slab))->shared[node->slab_slot];
+}
+
+/* Drops a reference to the node at offset. When it was the last one,
+   frees the node and drops its references to its children, its
+   extents or the root of its snapshot.
+*/
+static void node_release(void *fsptr, myfs_off_t offset) {
+    struct myfs_node *node = off_to_ptr(fsptr, offset);
+    uint16_t *shared = node_shared(fsptr, node);
+
+    if (*shared > 0) {
+        region_dirty(fsptr, shared, sizeof(*shared));
+        (*shared)--;
+        return;
+    }
+
+    if (node->flags & MYFS_NODE_SNAPSHOT) {
+        node_release(fsptr, node->data.snapshot_root);
+    } else if (node->is_file) {
+        open_files_forget(fsptr, offset);
+        file_free_data(fsptr, &node->data.file);
+    } else {
+        struct myfs_dir *dir = &node->data.directory;
+        myfs_off_t *children = off_to_ptr(fsptr, dir->children);
+        for (size_t pos = 0; pos < dir->length; pos++) {
+            if (children[pos] != 0) {
+                node_release(fsptr, children[pos]);
+            }
+        }
+        dir_free(fsptr, dir);
+    }
+    myfs_node_free(fsptr, offset);
+}
+
+/* Makes a copy of the node at offset that shares its children or
+   extents with it. Returns the offset of the copy, or 0 if there is no
+   space.
+*/
+static myfs_off_t node_copy(void *fsptr, myfs_off_t offset) {
+    struct myfs_node *node = off_to_ptr(fsptr, offset);
+    struct myfs_name name = { node_name(fsptr, node), node->name_len };
+
+    myfs_off_t name_block;
+    if (name_alloc(fsptr, &name, &name_block) < 0) {
+        return 0;
+    }
+    myfs_off_t copy_offset = myfs_node_alloc(fsptr, offset, 0);
+    if (copy_offset == 0) {
+        if (name_block != 0) {
+            myfs_free(fsptr, name_block);
+        }
+        return 0;
+    }
+
+    struct myfs_node *copy = off_to_ptr(fsptr, copy_offset);
+    set_node_name(fsptr, copy, &name, name_block);
+    copy->is_file = node->is_file;
+    copy->flags = node->flags;
+    copy->dir_seq = node->dir_seq;
+    copy->times[0] = node->times[0];
+    copy->times[1] = node->times[1];
+
+    if (node->is_file) {
+        copy->data.file = node->data.file;
+        if (!file_is_inline(&node->data.file) && node->data.file.data != 0) {
+            struct myfs_extent *first = off_to_ptr(fsptr, node->data.file.data);
+            region_dirty(fsptr, &first->shared, sizeof(first->shared));
+            region_dirty(fsptr, &node->flags, sizeof(node->flags));
+            first->shared++;
+            node->flags |= MYFS_NODE_SHARED_DATA;
+            copy->flags |= MYFS_NODE_SHARED_DATA;
+        }
+        return copy_offset;
+    }
+
+    // The copy gets a children array of its own, without holes
+    struct myfs_dir *dir = &node->data.directory;
+    struct myfs_dir *copy_dir = &copy->data.directory;
+    if (dir->number_children > 0) {
+        size_t capacity = dir->number_children;
+        if (capacity < MYFS_DIR_MIN_CAPACITY) {
+            capacity = MYFS_DIR_MIN_CAPACITY;
+        }
+        copy_dir->children = myfs_alloc(fsptr, capacity * sizeof(myfs_off_t));
+        if (copy_dir->children == 0) {
+            myfs_node_free(fsptr, copy_offset);
+            return 0;
+        }
+        copy_dir->capacity = capacity;
+
+        myfs_off_t *children = off_to_ptr(fsptr, dir->children);
+        myfs_off_t *copy_children = off_to_ptr(fsptr, copy_dir->children);
+        region_dirty(fsptr, copy_children, dir->number_children * sizeof(myfs_off_t));
+        for (size_t pos = 0; pos < dir->length; pos++) {
+            if (children[pos] != 0) {
+                uint16_t *shared = node_shared(fsptr, off_to_ptr(fsptr, children[pos]));
+                region_dirty(fsptr, shared, sizeof(*shared));
+                (*shared)++;
+                copy_children[copy_dir->length++] = children[pos];
+            }
+        }
+        copy_dir->number_children = copy_dir->length;
+        if (dir->index != 0) {
+            dir_index_build(fsptr, copy_dir);
+        }
+    }
+    return copy_offset;
+}
+
+/* Returns child, a child of the directory dir, if it is not shared.
+   Otherwise puts a private copy of it into its place and returns that
+   copy. Returns NULL with *errnoptr set to ENOSPC if there is no space
+   for the copy.
+*/
+static struct myfs_node *dir_unshare_child(void *fsptr, struct myfs_dir *dir,
+                                           struct myfs_node *child, int *errnoptr) {
+    uint16_t *shared = node_shared(fsptr, child);
+    if (*shared == 0) {
+        return child;
+    }
+
+    myfs_off_t copy = node_copy(fsptr, ptr_to_off(fsptr, child));
+    if (copy == 0) {
+        *errnoptr = ENOSPC;
+        return NULL;
+    }
+    dir_replace_child(fsptr, dir, child, copy);
+    open_files_move(fsptr, ptr_to_off(fsptr, child), copy);
+    region_dirty(fsptr, shared, sizeof(*shared));
+    (*shared)--;
+    return off_to_ptr(fsptr, copy);
+}
+
+/* Returns the root directory, after replacing it by a private copy if
+   a snapshot shares it. Returns NULL with *errnoptr set to ENOSPC if
+   there is no space for the copy.
+*/
+static struct myfs_node *unshare_root(void *fsptr, int *errnoptr) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    struct myfs_node *root = off_to_ptr(fsptr, super->root_dir);
+    uint16_t *shared = node_shared(fsptr, root);
+
+    if (*shared > 0) {
+        myfs_off_t copy = node_copy(fsptr, super->root_dir);
+        if (copy == 0) {
+            *errnoptr = ENOSPC;
+            return NULL;
+        }
+        super->root_dir = copy;
+        region_dirty(fsptr, shared, sizeof(*shared));
+        (*shared)--;
+        root = off_to_ptr(fsptr, copy);
+    }
+    return root;
+}
+
+/* Like find_node, but the node returned and all directories on the way
+   to it are private to the live tree and may be changed. Fails with
+   EROFS for paths inside the snapshot directory.
+*/
+static struct myfs_node *find_node_private(void *fsptr, const char *path, int *errnoptr) {
+    if (path_in_snapshots(path)) {
+        *errnoptr = EROFS;
+        return NULL;
+    }
+
+    struct myfs_node *current = unshare_root(fsptr, errnoptr);
+    struct myfs_name component;
+    while (current != NULL && path_next_component(&path, &component)) {
+        struct myfs_node *child = find_child(fsptr, current, &component, errnoptr);
+        current = child == NULL ? NULL :
+                  dir_unshare_child(fsptr, &current->data.directory, child, errnoptr);
+    }
+    return current;
+}
+
+/* Like find_parent_node, but the directory returned and all
+   directories on the way to it are private to the live tree. Fails
+   with EROFS for paths inside the snapshot directory.
+*/
+static struct myfs_node *find_parent_private(void *fsptr, const char *path,
+                                             struct myfs_name *last, int *errnoptr) {
+    if (path_in_snapshots(path)) {
+        *errnoptr = EROFS;
+        return NULL;
+    }
+
+    struct myfs_node *current = unshare_root(fsptr, errnoptr);
+    struct myfs_name component;
+    if (current == NULL) {
+        return NULL;
+    }
+
+    last->name = path;
+    last->len = 0;
+    if (!path_next_component(&path, last)) {
+        return current;
+    }
+
+    while (path_next_component(&path, &component)) {
+        struct myfs_node *child = find_child(fsptr, current, last, errnoptr);
+        if (child == NULL) {
+            return NULL;
+        }
+        current = dir_unshare_child(fsptr, &current->data.directory, child, errnoptr);
+        if (current == NULL) {
+            return NULL;
+        }
+        *last = component;
+    }
+
+    if (current->is_file) {
+        *errnoptr = ENOTDIR;
+        return NULL;
+    }
+    return current;
+}
+
+/* Prepares the file node for a change of its contents before position
+   end: every extent that starts before end becomes the file's own,
+   copying those still shared with a copy of the node, so that they
+   and their links to the extents behind them can be changed. The
+   extents from end on are left as they are, shared or not. Only once
+   no extent is shared any more does the node lose its
+   MYFS_NODE_SHARED_DATA mark. Returns -1 if there is no space left;
+   the contents of the file stay the same then.
+*/
+static int file_unshare_data(void *fsptr, struct myfs_node *node, size_t end) {
+    struct myfs_file_data *file = &node->data.file;
+
+    if (!(node->flags & MYFS_NODE_SHARED_DATA)) {
+        return 0;
+    }
+
+    region_dirty(fsptr, node, sizeof(*node));
+    if (!file_is_inline(file)) {
+        myfs_off_t *link = &file->data;
+        while (*link != 0) {
+            myfs_off_t extent = *link;
+            struct myfs_extent *e = off_to_ptr(fsptr, extent);
+            if (e->start >= end) {
+                break;
+            }
+            if (e->shared > 0) {
+                size_t capacity = e->capacity;
+                myfs_off_t copy = extent_alloc(fsptr, &capacity);
+                if (copy == 0) {
+                    return -1;
+                }
+                struct myfs_extent *c = off_to_ptr(fsptr, copy);
+                region_dirty(fsptr, c, sizeof(*c) + e->length);
+                region_dirty(fsptr, &e->shared, sizeof(e->shared));
+                region_dirty(fsptr, link, sizeof(*link));
+                c->next = e->next;
+                c->start = e->start;
+                c->capacity = capacity;
+                c->length = e->length;
+                c->shared = 0;
+                memcpy(extent_data(fsptr, copy), extent_data(fsptr, extent), e->length);
+
+                // The rest of the list is now reached from the copy too
+                if (e->next != 0) {
+                    struct myfs_extent *rest = off_to_ptr(fsptr, e->next);
+                    region_dirty(fsptr, &rest->shared, sizeof(rest->shared));
+                    rest->shared++;
+                }
+                e->shared--;
+                *link = copy;
+                file->allocated += capacity - e->capacity;
+                if (file->last_extent == extent) {
+                    file->last_extent = copy;
+                }
+                e = c;
+            }
+            link = &e->next;
+        }
+
+        // The rest of the list may still be shared, in which case its
+        // first shared extent comes soon after the last one copied
+        for (myfs_off_t extent = *link; extent != 0;) {
+            struct myfs_extent *e = off_to_ptr(fsptr, extent);
+            if (e->shared > 0) {
+                return 0;
+            }
+            extent = e->next;
+        }
+    }
+
+    node->flags &= ~MYFS_NODE_SHARED_DATA;
+    return 0;
+}
+
+/* Takes a snapshot of the live tree, as an entry called name in the
+   snapshot directory. Returns 0 on success and -1 with *errnoptr set
+   on failure.
+*/
+static int snapshot_create(void *fsptr, const struct myfs_name *name, int *errnoptr) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    struct myfs_node *snapshots = off_to_ptr(fsptr, super->snapshot_dir);
+    struct myfs_dir *dir = &snapshots->data.directory;
+
+    if (name->len > NAME_MAX_LEN) {
+        *errnoptr = ENAMETOOLONG;
+        return -1;
+    }
+    if (get_node(fsptr, dir, name) != NULL) {
+        *errnoptr = EEXIST;
+        return -1;
+    }
+    if (dir->number_children >= MYFS_SNAPSHOTS_MAX) {
+        *errnoptr = EMLINK;
+        return -1;
+    }
+
+    myfs_off_t name_block;
+    if (name_alloc(fsptr, name, &name_block) < 0) {
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+    myfs_off_t entry_offset = myfs_node_alloc(fsptr, dir_near(fsptr, snapshots), 0);
+    if (entry_offset == 0) {
+        if (name_block != 0) {
+            myfs_free(fsptr, name_block);
+        }
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+
+    struct myfs_node *entry = off_to_ptr(fsptr, entry_offset);
+    set_node_name(fsptr, entry, name, name_block);
+    entry->is_file = 0;
+    entry->flags = MYFS_NODE_SNAPSHOT;
+    update_time(fsptr, entry, 1);
+    entry->data.snapshot_root = super->root_dir;
+
+    if (dir_add_child(fsptr, dir, entry_offset) < 0) {
+        myfs_node_free(fsptr, entry_offset);
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+    uint16_t *shared = node_shared(fsptr, off_to_ptr(fsptr, super->root_dir));
+    region_dirty(fsptr, shared, sizeof(*shared));
+    (*shared)++;
+
+    update_time(fsptr, snapshots, 1);
+    return 0;
+}
+
+/* Removes the snapshot called name. Returns 0 on success and -1 with
+   *errnoptr set on failure.
+*/
+static int snapshot_remove(void *fsptr, const struct myfs_name *name, int *errnoptr) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    struct myfs_node *snapshots = off_to_ptr(fsptr, super->snapshot_dir);
+    struct myfs_dir *dir = &snapshots->data.directory;
+
+    struct myfs_node *entry = get_node(fsptr, dir, name);
+    if (entry == NULL) {
+        *errnoptr = ENOENT;
+        return -1;
+    }
+
+    dir_remove_child(fsptr, dir, entry);
+    node_release(fsptr, ptr_to_off(fsptr, entry));
+
+    update_time(fsptr, snapshots, 1);
+    return 0;
+}
+
+/* Compaction
+
+   An image that has seen a lot of churn has its nodes, children
+   arrays and extents spread all over the region, with free space in
+   between. Compaction copies the tree into a freshly formatted region
+   in breadth-first order: first all metadata, each directory's
+   children array and index followed by its children's nodes, then
+   the contents of all files, each run of data as a single exactly
+   sized extent. Everything ends up in the heap, at the beginning of
+   the region, and the heap is trimmed to what it holds, so the rest
+   of the region is zero and need not be stored in the image. Only the
+   live tree is copied; snapshots do not carry over.
+
+   The image comes from a file and may be truncated or corrupt, so
+   every offset and length taken from it is checked with region_ptr
+   before it is followed, and a bad one fails the compaction with
+   EINVAL.
+*/
+
+struct myfs_compact_pair {
+    myfs_off_t old_node;       // Node in the region being compacted
+    myfs_off_t new_node;       // Its copy in the new region
+};
+
+/* Returns the count structures of the given size at offset of the
+   region at oldptr, or NULL if they lie outside of it or offset is not
+   aligned for them, as in a corrupt image
+*/
+static void *compact_old_ptr(void *oldptr, myfs_off_t offset, size_t count, size_t size) {
+    if (offset % sizeof(myfs_off_t) != 0) {
+        return NULL;
+    }
+    return region_ptr(oldptr, offset, count, size);
+}
+
+/* Copies name, type and times of the node at old_offset of the region
+   at oldptr into a new node of the region at fsptr, placed close to
+   the children of parent so far; group is passed on to
+   myfs_node_alloc. Puts the offset of the new node into *offsetptr.
+   Returns 0 on success, EINVAL if the old node or its name lies
+   outside of its region and ENOSPC when out of space.
+*/
+static int compact_copy_node(void *fsptr, void *oldptr, myfs_off_t old_offset,
+                             struct myfs_node *parent, int group, myfs_off_t *offsetptr) {
+    struct myfs_node *old_node = compact_old_ptr(oldptr, old_offset, 1, sizeof(struct myfs_node));
+    if (old_node == NULL) {
+        return EINVAL;
+    }
+    struct myfs_name name = { old_node->name.short_name, old_node->name_len };
+    if (name.len > MYFS_SHORT_NAME) {
+        name.name = region_ptr(oldptr, old_node->name.long_name, name.len, 1);
+        if (name.name == NULL) {
+            return EINVAL;
+        }
+    }
+
+    myfs_off_t name_block;
+    if (name_alloc(fsptr, &name, &name_block) < 0) {
+        return ENOSPC;
+    }
+    myfs_off_t offset = myfs_node_alloc(fsptr, dir_near(fsptr, parent), group);
+    if (offset == 0) {
+        if (name_block != 0) {
+            myfs_free(fsptr, name_block);
+        }
+        return ENOSPC;
+    }
+
+    struct myfs_node *node = off_to_ptr(fsptr, offset);
+    set_node_name(fsptr, node, &name, name_block);
+    node->is_file = old_node->is_file != 0;
+    node->times[0] = old_node->times[0];
+    node->times[1] = old_node->times[1];
+    *offsetptr = offset;
+    return 0;
+}
+
+/* Gives the empty directory node of the region at fsptr copies of the
+   children of the directory old_dir of the region at oldptr, and
+   appends their pairs to *pairsptr. Returns 0 on success, EINVAL if
+   old_dir is corrupt, ENOMEM when out of memory and ENOSPC when out
+   of space.
+*/
+static int compact_copy_dir(void *fsptr, void *oldptr, struct myfs_dir *old_dir,
+                            struct myfs_node *node, struct myfs_compact_pair **pairsptr,
+                            size_t *countptr, size_t *capacityptr) {
+    struct myfs_dir *dir = &node->data.directory;
+
+    if (old_dir->number_children == 0) {
+        return 0;
+    }
+    myfs_off_t *old_children = compact_old_ptr(oldptr, old_dir->children, old_dir->length,
+                                               sizeof(myfs_off_t));
+    if (old_children == NULL || old_dir->number_children > old_dir->length) {
+        return EINVAL;
+    }
+
+    size_t capacity = old_dir->number_children;
+    if (capacity < MYFS_DIR_MIN_CAPACITY) {
+        capacity = MYFS_DIR_MIN_CAPACITY;
+    }
+    if (dir_resize(fsptr, dir, capacity) < 0) {
+        return ENOSPC;
+    }
+
+    if (*countptr + old_dir->number_children > *capacityptr) {
+        size_t new_capacity = 2 * (*countptr + old_dir->number_children);
+        struct myfs_compact_pair *pairs = realloc(*pairsptr, new_capacity * sizeof(*pairs));
+        if (pairs == NULL) {
+            return ENOMEM;
+        }
+        *pairsptr = pairs;
+        *capacityptr = new_capacity;
+    }
+
+    // The children of a large directory get slabs of their own
+    int group = old_dir->number_children >= MYFS_SLAB_GROUP_MIN;
+    myfs_off_t *children = off_to_ptr(fsptr, dir->children);
+    for (size_t pos = 0; pos < old_dir->length; pos++) {
+        if (old_children[pos] == 0) {
+            continue;
+        }
+        if (dir->number_children == old_dir->number_children) {
+            return EINVAL; // More children than the directory counts
+        }
+        myfs_off_t child;
+        int error = compact_copy_node(fsptr, oldptr, old_children[pos], node, group, &child);
+        if (error != 0) {
+            return error;
+        }
+
+        ((struct myfs_node *)off_to_ptr(fsptr, child))->dir_seq = dir->length + 1;
+        children[dir->length++] = child;
+        dir->number_children++;
+
+        (*pairsptr)[*countptr].old_node = old_children[pos];
+        (*pairsptr)[*countptr].new_node = child;
+        (*countptr)++;
+    }
+
+    if (dir->number_children > MYFS_DIR_INDEX_MIN) {
+        dir_index_build(fsptr, dir);
+    }
+    return 0;
+}
+
+/* Returns the extent at offset of the region at oldptr of a file of
+   size bytes, or NULL if it or its data lie outside of the region or
+   of the file
+*/
+static struct myfs_extent *compact_old_extent(void *oldptr, myfs_off_t offset, size_t size) {
+    struct myfs_extent *e = compact_old_ptr(oldptr, offset, 1, sizeof(struct myfs_extent));
+    if (e == NULL || e->start > size || e->length > size - e->start ||
+        region_ptr(oldptr, offset + sizeof(struct myfs_extent), e->length, 1) == NULL) {
+        return NULL;
+    }
+    return e;
+}
+
+/* Copies the contents of the file old_file of the region at oldptr
+   into the empty file file of the region at fsptr, with one extent for
+   every run of data. Returns 0 on success, EINVAL if the extent list
+   of old_file is corrupt and ENOSPC when out of space.
+*/
+static int compact_copy_file(void *fsptr, void *oldptr, struct myfs_file_data *old_file,
+                             struct myfs_file_data *file) {
+    if (file_is_inline(old_file)) {
+        *file = *old_file;
+        return 0;
+    }
+
+    file->allocated = 0;
+    file->data = 0;
+    file->last_extent = 0;
+    file->size = old_file->size;
+
+    // A list with more extents than fit into the region has a cycle
+    size_t extents_left = ((struct myfs_super *)oldptr)->size / sizeof(struct myfs_extent);
+    myfs_off_t extent = old_file->data;
+    while (extent != 0) {
+        // Extents whose data continue each other form one run
+        struct myfs_extent *e = compact_old_extent(oldptr, extent, old_file->size);
+        if (e == NULL) {
+            return EINVAL;
+        }
+        size_t start = e->start;
+        size_t length = 0;
+        myfs_off_t end = extent;
+        while (end != 0) {
+            struct myfs_extent *n = compact_old_extent(oldptr, end, old_file->size);
+            if (n == NULL || extents_left == 0) {
+                return EINVAL;
+            }
+            if (n->start != start + length) {
+                break;
+            }
+            extents_left--;
+            length += n->length;
+            end = n->next;
+        }
+
+        myfs_off_t run = myfs_alloc(fsptr, sizeof(struct myfs_extent) + length);
+        if (run == 0) {
+            return ENOSPC;
+        }
+        struct myfs_extent *r = off_to_ptr(fsptr, run);
+        r->next = 0;
+        r->start = start;
+        r->capacity = length;
+        r->length = length;
+        r->shared = 0;
+
+        char *data = extent_data(fsptr, run);
+        for (; extent != end; extent = e->next) {
+            e = off_to_ptr(oldptr, extent);
+            memcpy(data, extent_data(oldptr, extent), e->length);
+            data += e->length;
+        }
+
+        if (file->last_extent != 0) {
+            ((struct myfs_extent *)off_to_ptr(fsptr, file->last_extent))->next = run;
+        } else {
+            file->data = run;
+        }
+        file->last_extent = run;
+        file->allocated += length;
+    }
+    return 0;
+}
+
+/* Copies the whole tree of the region at oldptr into the freshly
+   formatted region at fsptr. Returns 0 on success, EINVAL if the tree
+   is corrupt, ENOMEM when out of memory and ENOSPC when out of space.
+*/
+static int compact_copy_tree(void *fsptr, void *oldptr) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    struct myfs_super *old_super = (struct myfs_super *)oldptr;
+    struct myfs_node *old_root = compact_old_ptr(oldptr, old_super->root_dir, 1,
+                                                 sizeof(struct myfs_node));
+    struct myfs_node *root = off_to_ptr(fsptr, super->root_dir);
+    if (old_root == NULL || old_root->is_file) {
+        return EINVAL;
+    }
+
+    size_t count = 1, capacity = 64;
+    struct myfs_compact_pair *pairs = malloc(capacity * sizeof(*pairs));
+    if (pairs == NULL) {
+        return ENOMEM;
+    }
+    pairs[0].old_node = old_super->root_dir;
+    pairs[0].new_node = super->root_dir;
+    root->times[0] = old_root->times[0];
+    root->times[1] = old_root->times[1];
+
+    // A journal left behind by the old image still applies to the new one
+    super->journal_gen = old_super->journal_gen;
+
+    // First all metadata, breadth-first, which keeps the nodes of the
+    // children of a directory next to each other
+    int result = 0;
+    for (size_t i = 0; i < count && result == 0; i++) {
+        struct myfs_node *old_node = off_to_ptr(oldptr, pairs[i].old_node);
+        if (!old_node->is_file) {
+            struct myfs_node *node = off_to_ptr(fsptr, pairs[i].new_node);
+            result = compact_copy_dir(fsptr, oldptr, &old_node->data.directory, node,
+                                      &pairs, &count, &capacity);
+        }
+    }
+
+    // Then the contents of the files, in the same order
+    for (size_t i = 0; i < count && result == 0; i++) {
+        struct myfs_node *old_node = off_to_ptr(oldptr, pairs[i].old_node);
+        if (old_node->is_file) {
+            struct myfs_node *node = off_to_ptr(fsptr, pairs[i].new_node);
+            result = compact_copy_file(fsptr, oldptr, &old_node->data.file, &node->data.file);
+        }
+    }
+
+    free(pairs);
+    return result;
+}
+
+/* Defragmentation
+
+   A long-running mount accumulates small extents: a file that was
+   written in many small pieces, or whose holes were filled in later,
+   keeps one extent per piece, and so do directories whose children
+   arrays are mostly holes after many removals. The defragmenter
+   repairs this a little at a time while the filesystem stays mounted.
+
+   It walks all nodes along the list of all slabs, resuming where it
+   stopped the last time. In a file, it replaces each run of adjacent
+   extents without holes in between by a single extent, up to
+   MYFS_EXTENT_MAX bytes with its header; a last extent that is still
+   being filled up is left alone. An extent that had to go into the
+   heap because the data zone was full, or that a compacted image keeps
+   there, moves into the zone once it has room again. A directory whose
+   children array is at least half holes gets a new, compacted array.
+   Only offsets inside the node and the extent list change, and the old
+   memory is freed right after the copy, so nothing else has to be
+   updated.
+
+   Each tick looks at no more than a given number of nodes and copies
+   no more than a given number of bytes, which bounds both the time it
+   holds the region lock and the memory traffic it causes. Only a run
+   or children array larger than the whole budget is copied anyway, as
+   the first and only one of its tick.
+*/
+
+struct myfs_defrag_budget {
+    size_t nodes;               // Nodes looked at per tick
+    size_t bytes;               // Bytes copied per tick
+    unsigned int interval_ms;   // Pause between two ticks of the defrag thread
+};
+
+/* Merges runs of adjacent extents of a file that keeps its contents
+   in extents and moves single extents out of the heap, copying no
+   more than the *bytesptr bytes left of a tick's budget of budget
+   bytes; *bytesptr is reduced by what was copied. Returns 1 when the
+   whole file has been looked at and 0 when the budget ran out before.
+*/
+static int defrag_file(void *fsptr, struct myfs_file_data *file, size_t *bytesptr,
+                       size_t budget) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    myfs_off_t prev = 0;
+    myfs_off_t extent = file->data;
+
+    while (extent != 0) {
+        struct myfs_extent *e = off_to_ptr(fsptr, extent);
+
+        // Find the run starting at extent
+        size_t count = 1, length = e->length, capacity = e->capacity;
+        myfs_off_t end = e->next;
+        while (end != 0) {
+            struct myfs_extent *n = off_to_ptr(fsptr, end);
+            if (n->start != e->start + length || length + n->length > MYFS_EXTENT_CAPACITY_MAX ||
+                (end == file->last_extent && n->length < n->capacity)) {
+                break;
+            }
+            count++;
+            length += n->length;
+            capacity += n->capacity;
+            end = n->next;
+        }
+        // A single extent keeps its capacity, room reserved ahead included
+        int move = (count < 2 && super->data_block_size != 0 && extent < super->heap_end);
+        if (count < 2 && !move) {
+            prev = extent;
+            extent = end;
+            continue;
+        }
+        if (length > *bytesptr && *bytesptr < budget) {
+            return 0;
+        }
+
+        size_t new_capacity = move ? capacity : length;
+        myfs_off_t merged = extent_alloc(fsptr, &new_capacity);
+        if (merged == 0) {
+            // Out of space; there is nothing to gain here for now
+            return 1;
+        }
+        if (move && merged < super->heap_end) {
+            // The zone is still full
+            extent_free(fsptr, merged);
+            return 1;
+        }
+
+        struct myfs_extent *m = off_to_ptr(fsptr, merged);
+        region_dirty(fsptr, m, sizeof(*m) + length);
+        region_dirty(fsptr, file, sizeof(*file));
+        m->start = e->start;
+        m->capacity = new_capacity;
+        m->length = length;
+        m->shared = 0;
+        m->next = end;
+        size_t done = 0;
+        myfs_off_t old = extent;
+        while (old != end) {
+            struct myfs_extent *o = off_to_ptr(fsptr, old);
+            myfs_off_t next = o->next;
+            memcpy(extent_data(fsptr, merged) + done, extent_data(fsptr, old), o->length);
+            done += o->length;
+            extent_free(fsptr, old);
+            old = next;
+        }
+
+        if (prev != 0) {
+            struct myfs_extent *p = off_to_ptr(fsptr, prev);
+            region_dirty(fsptr, &p->next, sizeof(p->next));
+            p->next = merged;
+        } else {
+            file->data = merged;
+        }
+        if (end == 0) {
+            file->last_extent = merged;
+        }
+        file->allocated = file->allocated - capacity + new_capacity;
+        *bytesptr -= length < *bytesptr ? length : *bytesptr;
+
+        prev = merged;
+        extent = end;
+    }
+    return 1;
+}
+
+/* Gives a directory whose children array is at least half holes a
+   compacted array, within the budget as for defrag_file. Returns 1
+   when done with the directory and 0 when the budget ran out.
+*/
+static int defrag_dir(void *fsptr, struct myfs_dir *dir, size_t *bytesptr, size_t budget) {
+    if (dir->length < MYFS_DIR_MIN_CAPACITY || 2 * dir->number_children > dir->length) {
+        return 1;
+    }
+
+    size_t bytes = dir->number_children * sizeof(myfs_off_t);
+    if (bytes > *bytesptr && *bytesptr < budget) {
+        return 0;
+    }
+    size_t capacity = 2 * (size_t)dir->number_children;
+    if (capacity < MYFS_DIR_MIN_CAPACITY) {
+        capacity = MYFS_DIR_MIN_CAPACITY;
+    }
+    if (dir_resize(fsptr, dir, capacity) == 0) {
+        *bytesptr -= bytes < *bytesptr ? bytes : *bytesptr;
+    }
+    return 1;
+}
+
+/* Does one tick of defragmentation within the given budget. Returns
+   the number of bytes moved.
+*/
+static size_t defrag_tick(void *fsptr, const struct myfs_defrag_budget *budget) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    size_t nodes = budget->nodes;
+    size_t bytes = budget->bytes;
+
+    while (nodes > 0 && bytes > 0 && super->slab_all != 0) {
+        if (super->defrag_slab == 0) {
+            // Start over with the next round
+            super->defrag_slab = super->slab_all;
+            super->defrag_slot = 0;
+        }
+        struct myfs_slab *s = off_to_ptr(fsptr, super->defrag_slab);
+        if (super->defrag_slot >= s->capacity) {
+            super->defrag_slab = s->all_next;
+            super->defrag_slot = 0;
+            nodes--;
+            continue;
+        }
+
+        unsigned int slot = super->defrag_slot;
+        if (!(s->free_slots & ((uint64_t)1 << slot))) {
+            struct myfs_node *node = slab_node(fsptr, super->defrag_slab, slot);
+            int done = 1;
+            if (node->flags & MYFS_NODE_SNAPSHOT) {
+                // Nothing to do, the snapshot's tree has nodes of its own
+            } else if (!node->is_file) {
+                done = defrag_dir(fsptr, &node->data.directory, &bytes, budget->bytes);
+            } else if (!file_is_inline(&node->data.file)) {
+                // Extents shared with a snapshot or pinned by a read stay
+                // where they are. A file whose last pin is gone loses its
+                // mark here, rather than only on its next change.
+                file_unshare_data(fsptr, node, 0);
+                if (!(node->flags & MYFS_NODE_SHARED_DATA)) {
+                    done = defrag_file(fsptr, &node->data.file, &bytes, budget->bytes);
+                }
+            }
+            if (!done) {
+                // Go on with this node in the next tick
+                break;
+            }
+        }
+        super->defrag_slot++;
+        nodes--;
+    }
+    return budget->bytes - bytes;
+}
+
+/* Region lock
+
+   All operations and the defragmenter take a reader/writer lock kept
+   in the superblock, so that FUSE may call into the filesystem from
+   several threads and the defragmenter can run in a thread of its own.
+   Operations that keep to the nodes they lock take it shared and run
+   side by side (see Node locks); all others take it exclusively. A
+   lock is only valid in the process and at the address it was set up
+   at, while the superblock comes back from the backup-file with
+   whatever the last mount left there. The superblock therefore
+   records which process and mapping the lock belongs to, and the
+   first thread to find that it belongs to another one sets it up
+   afresh, along with the other per-mount state of the superblock. It
+   also formats a fresh region, which operations under the shared lock
+   could not do. Flushes write the superblock without that state (see
+   flush_super), so a region read back from its backup-file is set up
+   afresh even by the process that flushed it.
+*/
+
+#define MYFS_ATTACHING ((uint64_t) 1)
+
+/* Returns the key of the current process and mapping, which is never
+   0, the key of a fresh region, and has MYFS_ATTACHING clear
+*/
+static uint64_t attach_key(void *fsptr) {
+    uint64_t key = ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)fsptr;
+    return (key & ~MYFS_ATTACHING) | 2;
+}
+
+/* Sets the region lock up if it belongs to another process or
+   mapping. Returns the superblock, or NULL if there is no region to
+   lock.
+*/
+static struct myfs_super *myfs_attach(void *fsptr, size_t fssize) {
+    if (fsptr == NULL || fssize < sizeof(struct myfs_super)) {
+        return NULL;
+    }
+
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    uint64_t key = attach_key(fsptr);
+    uint64_t seen = __atomic_load_n(&super->attach_key, __ATOMIC_ACQUIRE);
+    while (seen != key) {
+        if (seen == (key | MYFS_ATTACHING)) {
+            // Another thread of this mount is setting the lock up
+            sched_yield();
+            seen = __atomic_load_n(&super->attach_key, __ATOMIC_ACQUIRE);
+        } else if (__atomic_compare_exchange_n(&super->attach_key, &seen, key | MYFS_ATTACHING, 0,
+                                               __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            pthread_rwlock_init(&super->lock, NULL);
+            heap_lock_init(fsptr);
+            pthread_mutex_init(&super->journal_mutex, NULL);
+            pthread_cond_init(&super->journal_cond, NULL);
+            super->journal_fd = -1;
+            super->journal_syncing = 0;
+
+            // The region has just been read from the backup-file
+            if (super->is_set == 1 && super->dirty_map != 0) {
+                memset(off_to_ptr(fsptr, super->dirty_map), 0,
+                       dirty_map_words(super->size) * sizeof(uint64_t));
+            }
+            initialize_myfs(fsptr, fssize);
+            open_files_reset(fsptr);
+
+            // Blocks retired or pinned by another mount are no one's
+            // any more
+            super->exclusive = 1;
+            pins_reset(fsptr);
+            region_reclaim(fsptr);
+            super->exclusive = 0;
+            __atomic_store_n(&super->attach_key, key, __ATOMIC_RELEASE);
+            seen = key;
+        }
+    }
+    return super;
+}
+
+/* Locks the region exclusively. Returns the superblock, or NULL with
+   *errnoptr set to EFAULT if there is no region to lock and to the
+   error of pthread_rwlock_wrlock if it cannot be locked.
+*/
+static struct myfs_super *myfs_lock(void *fsptr, size_t fssize, int *errnoptr) {
+    struct myfs_super *super = myfs_attach(fsptr, fssize);
+    if (super == NULL) {
+        *errnoptr = EFAULT;
+        return NULL;
+    }
+    int error = pthread_rwlock_wrlock(&super->lock);
+    if (error != 0) {
+        *errnoptr = error;
+        return NULL;
+    }
+    super->exclusive = 1;
+    region_reclaim(fsptr);
+    return super;
+}
+
+/* Locks the region shared. Returns the superblock, or NULL with
+   *errnoptr set as for myfs_lock.
+*/
+static struct myfs_super *myfs_lock_shared(void *fsptr, size_t fssize, int *errnoptr) {
+    struct myfs_super *super = myfs_attach(fsptr, fssize);
+    if (super == NULL) {
+        *errnoptr = EFAULT;
+        return NULL;
+    }
+
+    // Running out of reader slots only lasts until some reader leaves
+    int error;
+    while ((error = pthread_rwlock_rdlock(&super->lock)) == EAGAIN) {
+        sched_yield();
+    }
+    if (error != 0) {
+        *errnoptr = error;
+        return NULL;
+    }
+    return super;
+}
+
+static void myfs_unlock(struct myfs_super *super) {
+    if (super == NULL) {
+        return;
+    }
+    if (super->exclusive) {
+        super->exclusive = 0;
+        pthread_rwlock_unlock(&super->lock);
+        return;
+    }
+    pthread_rwlock_unlock(&super->lock);
+
+    // Blocks retired under the shared lock can go once no thread holds
+    // it any more, which a thread leaving last finds out by taking it
+    if (__atomic_load_n(&super->retired, __ATOMIC_RELAXED) != 0 &&
+        pthread_rwlock_trywrlock(&super->lock) == 0) {
+        super->exclusive = 1;
+        region_reclaim(super);
+        super->exclusive = 0;
+        pthread_rwlock_unlock(&super->lock);
+    }
+}
+
+/* Returns the node path refers to if it and all directories on the way
+   to it belong to the live tree alone, so that they can be changed in
+   place, and NULL otherwise, whatever the reason. A file whose extents
+   may be shared does not count as private.
+*/
+static struct myfs_node *find_node_live(void *fsptr, const char *path) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    struct myfs_node *current = off_to_ptr(fsptr, super->root_dir);
+    struct myfs_name component;
+    int error;
+
+    if (path_in_snapshots(path)) {
+        return NULL;
+    }
+    while (*node_shared(fsptr, current) == 0) {
+        if (!path_next_component(&path, &component)) {
+            return (current->flags & MYFS_NODE_SHARED_DATA) ? NULL : current;
+        }
+        current = find_child(fsptr, current, &component, &error);
+        if (current == NULL) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/* Returns the node of the file handle fh refers to if find_node_live
+   would return it for its path, and NULL otherwise. As long as there
+   are no snapshots, nothing but a file's own extents can be shared.
+*/
+static struct myfs_node *open_file_live(void *fsptr, uint64_t fh) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    struct myfs_node *snapshots = off_to_ptr(fsptr, super->snapshot_dir);
+    struct myfs_node *node = open_file_node(fsptr, fh);
+
+    if (node == NULL || snapshots->data.directory.number_children != 0 ||
+        *node_shared(fsptr, node) != 0 || (node->flags & MYFS_NODE_SHARED_DATA)) {
+        return NULL;
+    }
+    return node;
+}
+
+/* Like find_node_live for the directory containing the last component
+   of path, which is put into *last. Returns NULL for the root
+   directory and for names too long, too.
+*/
+static struct myfs_node *find_parent_live(void *fsptr, const char *path, struct myfs_name *last) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    struct myfs_node *current = off_to_ptr(fsptr, super->root_dir);
+    struct myfs_name component;
+    int error;
+
+    if (path_in_snapshots(path) || !path_next_component(&path, last)) {
+        return NULL;
+    }
+    while (*node_shared(fsptr, current) == 0) {
+        if (!path_next_component(&path, &component)) {
+            return (current->is_file || last->len > NAME_MAX_LEN) ? NULL : current;
+        }
+        current = find_child(fsptr, current, last, &error);
+        if (current == NULL) {
+            return NULL;
+        }
+        *last = component;
+    }
+    return NULL;
+}
+
+/* Locks the region for an operation that changes the node path refers
+   to, or the file handle fh refers to if it is not 0 (see Open files).
+   If open_file_live or find_node_live finds it, the region is locked
+   shared and the node exclusively and the node is returned. Otherwise,
+   the region is locked exclusively and NULL is returned. Either way,
+   the superblock goes into *superptr, for myfs_unlock; it is NULL,
+   with *errnoptr set, if the region could not be locked.
+*/
+static struct myfs_node *lock_node_live(void *fsptr, size_t fssize, int *errnoptr,
+                                        const char *path, uint64_t fh,
+                                        struct myfs_super **superptr) {
+    *superptr = myfs_lock_shared(fsptr, fssize, errnoptr);
+    if (*superptr == NULL) {
+        return NULL;
+    }
+
+    struct myfs_node *node = open_file_live(fsptr, fh);
+    if (node == NULL) {
+        node = find_node_live(fsptr, path);
+    }
+    if (node != NULL) {
+        node_lock(fsptr, node);
+
+        // A pinned read may have come in between, see Pinned reads
+        if (!(node->flags & MYFS_NODE_SHARED_DATA)) {
+            return node;
+        }
+        node_unlock(node);
+    }
+    myfs_unlock(*superptr);
+    *superptr = myfs_lock(fsptr, fssize, errnoptr);
+    return NULL;
+}
+
+/* Like lock_node_live for an operation that creates the last component
+   of path, which is put into *last. The directory that is to contain
+   it is returned locked, unless it already has a child of that name.
+*/
+static struct myfs_node *lock_parent_live(void *fsptr, size_t fssize, int *errnoptr,
+                                          const char *path, struct myfs_name *last,
+                                          struct myfs_super **superptr) {
+    *superptr = myfs_lock_shared(fsptr, fssize, errnoptr);
+    if (*superptr == NULL) {
+        return NULL;
+    }
+
+    struct myfs_node *parent = find_parent_live(fsptr, path, last);
+    if (parent != NULL) {
+        node_lock(fsptr, parent);
+        if (get_node(fsptr, &parent->data.directory, last) == NULL) {
+            return parent;
+        }
+        node_unlock(parent);
+    }
+    myfs_unlock(*superptr);
+    *superptr = myfs_lock(fsptr, fssize, errnoptr);
+    return NULL;
+}
+
+/* Reads up to size bytes at position offset of the file node into buf.
+   Returns the number of bytes read, or -1 with *errnoptr set.
+*/
+static int node_read(void *fsptr, struct myfs_node *node, char *buf, size_t size,
+                     off_t offset, int *errnoptr) {
+    if (offset < 0) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    if (!node->is_file) {
+        *errnoptr = EISDIR;
+        return -1;
+    }
+
+    struct myfs_file_data *file = &node->data.file;
+    size_t read_size;
+    for (unsigned int tries = 0;; tries++) {
+        uint32_t seq = node_read_begin(node, tries);
+        size_t file_size = __atomic_load_n(&file->size, __ATOMIC_ACQUIRE);
+        read_size = 0;
+        if ((size_t)offset < file_size) {
+            read_size = size < file_size - offset ? size : file_size - offset;
+            file_read(fsptr, file, offset, buf, read_size);
+        }
+        if (!node_read_retry(node, seq)) {
+            break;
+        }
+    }
+    return read_size;
+}
+
+/* Writes size bytes from src to position offset of the file node,
+   which must be private. Returns the number of bytes written, or -1
+   with *errnoptr set.
+*/
+static int node_write_source(void *fsptr, struct myfs_node *node, struct myfs_source *src,
+                             size_t size, off_t offset, int *errnoptr) {
+    if (offset < 0) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    if (!node->is_file) {
+        *errnoptr = EISDIR;
+        return -1;
+    }
+
+    if (size == 0) {
+        return 0;
+    }
+
+    if (file_unshare_data(fsptr, node, (size_t)offset + size) < 0) {
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+
+    // A write beyond the end of the file leaves a hole, which reads as zeros
+    size_t written = file_write(fsptr, &node->data.file, offset, src, size);
+    if (written == 0) {
+        *errnoptr = src->error != 0 ? src->error : ENOSPC;
+        return -1;
+    }
+
+    update_time(fsptr, node, 1);
+    return written;
+}
+
+static int node_write(void *fsptr, struct myfs_node *node, const char *buf, size_t size,
+                      off_t offset, int *errnoptr) {
+    struct iovec iov;
+    struct myfs_source src = source_buffer(&iov, buf, size);
+    return node_write_source(fsptr, node, &src, size, offset, errnoptr);
+}
+
+/* Changes the size of the file node, which must be private, to offset
+   bytes. Returns 0 on success and -1 with *errnoptr set on failure.
+*/
+static int node_truncate(void *fsptr, struct myfs_node *node, off_t offset, int *errnoptr) {
+    if (offset < 0) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    if (!node->is_file) {
+        *errnoptr = EISDIR;
+        return -1;
+    }
+
+    // Growing a file leaves a hole at its end, which takes no space and
+    // changes no extent; shrinking it cuts the extent holding the new
+    // end, unless the rest moves into the node
+    size_t end = 0;
+    if ((size_t)offset < node->data.file.size && (size_t)offset > MYFS_INLINE_MAX) {
+        end = (size_t)offset;
+    }
+    if (file_unshare_data(fsptr, node, end) < 0 ||
+        file_resize(fsptr, &node->data.file, (size_t)offset) < 0) {
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+
+    update_time(fsptr, node, 1);
+    return 0;
+}
+
+/* Gives the file node, which must be private, room in extents for the
+   len bytes at position offset, as fallocate does, and grows it to
+   offset + len unless mode is FALLOC_FL_KEEP_SIZE. The reserved bytes
+   read as zeros until they are written. A file kept in the node has
+   no extents to reserve, so only its size changes. Puts the new size
+   into *grownptr, or 0 if the size did not change. Returns 0 on
+   success and -1 with *errnoptr set on failure.
+*/
+static int node_fallocate(void *fsptr, struct myfs_node *node, int mode, off_t offset,
+                          off_t len, size_t *grownptr, int *errnoptr) {
+    *grownptr = 0;
+    if (offset < 0 || len <= 0) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    if (offset > LLONG_MAX - len) {
+        *errnoptr = EFBIG;
+        return -1;
+    }
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {
+        *errnoptr = EOPNOTSUPP;
+        return -1;
+    }
+
+    if (!node->is_file) {
+        *errnoptr = EISDIR;
+        return -1;
+    }
+
+    struct myfs_file_data *file = &node->data.file;
+    size_t size = file->size;
+    size_t end = (size_t)offset + (size_t)len;
+    int grow = !(mode & FALLOC_FL_KEEP_SIZE) && end > size;
+    if (file_unshare_data(fsptr, node, end) < 0 || (grow && file_resize(fsptr, file, end) < 0)) {
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+    if (!file_is_inline(file) && file_reserve(fsptr, file, offset, len) < (size_t)len) {
+        if (grow) {
+            file_resize(fsptr, file, size);
+        }
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+
+    if (grow) {
+        update_time(fsptr, node, 1);
+        *grownptr = end;
+    }
+    return 0;
+}
+
+/* Sets the times of node, which must be private, as utimensat does.
+   Returns 0 on success and -1 with *errnoptr set on failure.
+*/
+static int node_set_times(void *fsptr, struct myfs_node *node, const struct timespec ts[2],
+                          int *errnoptr) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    region_dirty(fsptr, node->times, sizeof(node->times));
+
+    if (!ts) {
+        region_store(&node->times[0], &now, sizeof(now));
+        region_store(&node->times[1], &now, sizeof(now));
+        return 0;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (ts[i].tv_nsec != UTIME_NOW && ts[i].tv_nsec != UTIME_OMIT &&
+            (ts[i].tv_nsec < 0 || ts[i].tv_nsec >= 1000000000)) {
+            *errnoptr = EINVAL;
+            return -1;
+        }
+    }
+
+    // times[0] is the access time, times[1] the modification time
+    for (int i = 0; i < 2; i++) {
+        if (ts[i].tv_nsec == UTIME_NOW) {
+            region_store(&node->times[i], &now, sizeof(now));
+        } else if (ts[i].tv_nsec != UTIME_OMIT) {
+            region_store(&node->times[i], &ts[i], sizeof(ts[i]));
+        }
+    }
+
+    return 0;
+}
+
+/* Waits, with mutex locked, until *stopptr is set, which is signalled
+   on wakeup, or until interval_ms milliseconds have passed
+*/
+static void thread_pause(pthread_mutex_t *mutex, pthread_cond_t *wakeup, const int *stopptr,
+                         unsigned int interval_ms) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += interval_ms / 1000;
+    until.tv_nsec += (long)(interval_ms % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    while (!*stopptr && pthread_cond_timedwait(wakeup, mutex, &until) != ETIMEDOUT) {
+    }
+}
+
+/* A defrag thread; the handle lives outside the region, with whoever
+   started the thread.
+*/
+struct myfs_defrag {
+    void *fsptr;
+    size_t fssize;
+    struct myfs_defrag_budget budget;
+    pthread_mutex_t mutex;          // Protects stop
+    pthread_cond_t wakeup;          // Signalled when stop is set
+    int stop;
+    pthread_t thread;
+};
+
+/* Runs ticks under the region lock, pausing in between, until told
+   to stop
+*/
+static void *defrag_thread(void *arg) {
+    struct myfs_defrag *defrag = arg;
+
+    pthread_mutex_lock(&defrag->mutex);
+    while (!defrag->stop) {
+        pthread_mutex_unlock(&defrag->mutex);
+        int error;
+        struct myfs_super *super = myfs_lock(defrag->fsptr, defrag->fssize, &error);
+        if (super != NULL) {
+            defrag_tick(defrag->fsptr, &defrag->budget);
+            myfs_unlock(super);
+        }
+        pthread_mutex_lock(&defrag->mutex);
+        thread_pause(&defrag->mutex, &defrag->wakeup, &defrag->stop, defrag->budget.interval_ms);
+    }
+    pthread_mutex_unlock(&defrag->mutex);
+    return NULL;
+}
+
+/* Journal
+
+   The region only reaches the backup-file when the filesystem is
+   unmounted, so a crash would lose every change since the mount. With
+   a journal (see __myfs_journal_open_implem), every operation that
+   changes the tree appends a redo record to a journal file next to the
+   backup-file before it returns: the operation and its arguments, with
+   the data for writes. Records are logical, naming paths rather than
+   offsets, and are replayed through the operations themselves.
+
+   Records are written under the region lock, so the journal has the
+   order in which the operations were applied, but synced without it.
+   Operations running side by side under the shared region lock write
+   theirs under the node lock that orders them (see Node locks): a
+   name cannot be looked up before the record creating it is written.
+   An operation waits until the journal is on disk up to its record.
+   Whichever waiting thread comes first syncs the journal for all
+   records written so far, so that operations running at the same time
+   share one fdatasync (group commit).
+
+   The journal belongs to one image of the region, identified by
+   journal_gen. Closing the journal before the region is written back
+   increments journal_gen, and so does a flush (see Write-back), after
+   which the journal starts over. Records in the journal that the
+   image on disk already contains are thus recognized as stale and
+   skipped instead of being replayed. Each record carries a checksum;
+   replay stops at the first record that does not match, which is
+   where a crash cut the journal off.
+*/
+
+#define MYFS_JOURNAL_MAGIC 0x4d594a4eu   // "MYJN"
+
+#define MYFS_JOURNAL_MKNOD     1
+#define MYFS_JOURNAL_MKDIR     2
+#define MYFS_JOURNAL_UNLINK    3
+#define MYFS_JOURNAL_RMDIR     4
+#define MYFS_JOURNAL_RENAME    5
+#define MYFS_JOURNAL_TRUNCATE  6
+#define MYFS_JOURNAL_WRITE     7
+#define MYFS_JOURNAL_UTIMENS   8
+
+struct myfs_journal_record {
+    uint32_t magic;            // MYFS_JOURNAL_MAGIC
+    uint32_t type;             // MYFS_JOURNAL_*
+    uint64_t gen;              // journal_gen of the image the record belongs to
+    uint64_t arg;              // Offset of a write, size of a truncate
+    uint32_t path_len;         // Length of the path, without '\0'
+    uint32_t path2_len;        // Length of the second path of a rename
+    uint64_t data_len;         // Bytes of data following the paths
+    uint32_t checksum;         // FNV-1a over record and payload, this field 0
+    uint32_t reserved;
+};
+
+static uint32_t journal_checksum(uint32_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+#define MYFS_IOV_MAX 1024 // IOV_MAX of Linux
+
+/* Like writev, for any number of iovecs. Returns the number of bytes
+   written, which is less than asked for only if writing failed, or -1
+   if nothing could be written.
+*/
+static ssize_t journal_writev(int fd, const struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+
+    while (iovcnt > 0) {
+        int n = iovcnt < MYFS_IOV_MAX ? iovcnt : MYFS_IOV_MAX;
+        size_t want = 0;
+        for (int i = 0; i < n; i++) {
+            want += iov[i].iov_len;
+        }
+        ssize_t done = writev(fd, iov, n);
+        if (done < 0) {
+            return total > 0 ? total : -1;
+        }
+        total += done;
+        if ((size_t)done != want) {
+            break;
+        }
+        iov += n;
+        iovcnt -= n;
+    }
+    return total;
+}
+
+/* Appends a record to the journal, if there is one, and puts the
+   journal length up to its end into *lsnptr, or 0 without journal.
+   The data of the record is made up of the datacnt buffers at data.
+   Must be called under the region lock and, if that is held shared,
+   under the lock of the node the operation changed. Returns 0 on
+   success and -1 with *errnoptr set to EIO if the record could not be
+   written, or ENOMEM.
+*/
+static int journal_logv(struct myfs_super *super, uint32_t type, const char *path,
+                        const char *path2, uint64_t arg, const struct iovec *data, int datacnt,
+                        uint64_t *lsnptr, int *errnoptr) {
+    *lsnptr = 0;
+    if (super == NULL || super->journal_fd < 0) {
+        return 0;
+    }
+
+    struct iovec small[4];
+    struct iovec *iov = small;
+    if (datacnt > 1) {
+        iov = malloc((3 + datacnt) * sizeof(struct iovec));
+        if (iov == NULL) {
+            *errnoptr = ENOMEM;
+            return -1;
+        }
+    }
+
+    struct myfs_journal_record record;
+    memset(&record, 0, sizeof(record));
+    record.magic = MYFS_JOURNAL_MAGIC;
+    record.type = type;
+    record.gen = super->journal_gen;
+    record.arg = arg;
+    record.path_len = strlen(path);
+    record.path2_len = path2 != NULL ? strlen(path2) : 0;
+
+    iov[0] = (struct iovec) { &record, sizeof(record) };
+    iov[1] = (struct iovec) { (void *)path, record.path_len };
+    iov[2] = (struct iovec) { (void *)path2, record.path2_len };
+    memcpy(iov + 3, data, datacnt * sizeof(struct iovec));
+    int iovcnt = 3 + datacnt;
+    for (int i = 3; i < iovcnt; i++) {
+        record.data_len += iov[i].iov_len;
+    }
+    uint32_t checksum = 2166136261u;
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        checksum = journal_checksum(checksum, iov[i].iov_base, iov[i].iov_len);
+        total += iov[i].iov_len;
+    }
+    record.checksum = checksum;
+
+    // A record written only in part would hide all records behind it
+    // from replay, so it is cut off again
+    pthread_mutex_lock(&super->journal_mutex);
+    ssize_t n = journal_writev(super->journal_fd, iov, iovcnt);
+    if (iov != small) {
+        free(iov);
+    }
+    if (n < 0 || (size_t)n != total) {
+        if (n > 0 && ftruncate(super->journal_fd, super->journal_end - super->journal_base) < 0) {
+            // Replay stops at the torn record anyway
+        }
+        pthread_mutex_unlock(&super->journal_mutex);
+        *errnoptr = EIO;
+        return -1;
+    }
+
+    super->journal_end += total;
+    *lsnptr = super->journal_end;
+    pthread_mutex_unlock(&super->journal_mutex);
+    return 0;
+}
+
+/* Like journal_logv, with data_len bytes of data at data */
+static int journal_log(struct myfs_super *super, uint32_t type, const char *path,
+                       const char *path2, uint64_t arg, const void *data, size_t data_len,
+                       uint64_t *lsnptr, int *errnoptr) {
+    struct iovec iov = { (void *)data, data_len };
+    return journal_logv(super, type, path, path2, arg, &iov, 1, lsnptr, errnoptr);
+}
+
+/* Logs a write of the len bytes at position offset of the file node,
+   taking them from where they landed in the file, see journal_logv
+*/
+static int journal_log_written(struct myfs_super *super, const char *path,
+                               struct myfs_node *node, off_t offset, size_t len,
+                               uint64_t *lsnptr, int *errnoptr) {
+    *lsnptr = 0;
+    if (super == NULL || super->journal_fd < 0) {
+        return 0;
+    }
+
+    // Any hole in the range reads from zeros behind the array, as in
+    // __myfs_read_iov_implem
+    int holes;
+    size_t count = file_map(super, &node->data.file, offset, len, NULL, NULL, &holes);
+    size_t zeros_len = holes ? (len < MYFS_ZERO_CHUNK ? len : MYFS_ZERO_CHUNK) : 0;
+    struct iovec *iov = malloc(count * sizeof(struct iovec) + zeros_len);
+    if (iov == NULL) {
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+    char *zeros = (char *)(iov + count);
+    memset(zeros, 0, zeros_len);
+    file_map(super, &node->data.file, offset, len, iov, zeros, &holes);
+    int result = journal_logv(super, MYFS_JOURNAL_WRITE, path, NULL, (uint64_t)offset,
+                              iov, count, lsnptr, errnoptr);
+    free(iov);
+    return result;
+}
+
+/* Waits until the journal is on disk up to lsn, syncing it if no other
+   thread is doing so already. Must be called without the region lock.
+   Returns 0 on success and -1 with *errnoptr set to EIO if the sync
+   failed.
+*/
+static int journal_commit(struct myfs_super *super, uint64_t lsn, int *errnoptr) {
+    if (lsn == 0) {
+        return 0;
+    }
+
+    int result = 0;
+    pthread_mutex_lock(&super->journal_mutex);
+    while (super->journal_synced < lsn && result == 0) {
+        if (super->journal_syncing) {
+            pthread_cond_wait(&super->journal_cond, &super->journal_mutex);
+            continue;
+        }
+
+        // Sync everything written so far on behalf of all waiters
+        super->journal_syncing = 1;
+        uint64_t end = super->journal_end;
+        int fd = super->journal_fd;
+        pthread_mutex_unlock(&super->journal_mutex);
+        result = fdatasync(fd);
+        pthread_mutex_lock(&super->journal_mutex);
+        super->journal_syncing = 0;
+        if (result == 0 && end > super->journal_synced) {
+            super->journal_synced = end;
+        }
+        pthread_cond_broadcast(&super->journal_cond);
+    }
+    pthread_mutex_unlock(&super->journal_mutex);
+
+    if (result != 0) {
+        *errnoptr = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/* Write-back
+
+   A flush brings the backup-file up to date with the region by
+   writing the pages marked in the dirty map (see Dirty tracking), so
+   it costs time proportional to what changed since the last flush,
+   not to the size of the region. The pages of the superblock go last,
+   once everything they refer to is in place.
+
+   Once the backup-file is synced, everything in the journal is part of
+   the image on disk. The flush therefore increments journal_gen and
+   starts the journal over. The region lock is held throughout, so no
+   operation runs in the middle of a flush. A crash during a flush may
+   leave the backup-file with some of the pages written and others
+   not; the journal only covers crashes between flushes.
+*/
+
+/* Finds the first run of set bits at or after bit *firstptr among the
+   nbits bits of a bitmap. Puts its first bit into *firstptr and its
+   length into *countptr and returns 1, or returns 0 if there is none.
+*/
+static int bitmap_next_run(const uint64_t *bitmap, size_t nbits, size_t *firstptr,
+                           size_t *countptr) {
+    size_t first = *firstptr;
+    while (first < nbits) {
+        uint64_t word = bitmap[first / 64] >> (first % 64);
+        if (word != 0) {
+            first += __builtin_ctzll(word);
+            break;
+        }
+        first = (first / 64 + 1) * 64;
+    }
+    if (first >= nbits) {
+        return 0;
+    }
+
+    size_t end = first;
+    while (end < nbits) {
+        uint64_t clear = ~bitmap[end / 64] >> (end % 64);
+        if (clear != 0) {
+            end += __builtin_ctzll(clear);
+            break;
+        }
+        end = (end / 64 + 1) * 64;
+    }
+    if (end > nbits) {
+        end = nbits;
+    }
+
+    *firstptr = first;
+    *countptr = end - first;
+    return 1;
+}
+
+/* Writes count pages of the region, from page first on, to the same
+   place in the file open at fd. Returns 0 on success and -1 with
+   errno set on failure.
+*/
+static int flush_pages(void *fsptr, int fd, size_t first, size_t count) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    size_t offset = first << MYFS_DIRTY_SHIFT;
+    size_t len = count << MYFS_DIRTY_SHIFT;
+
+    if (len > super->size - offset) {
+        len = super->size - offset;
+    }
+    while (len > 0) {
+        ssize_t n = pwrite(fd, (char *)fsptr + offset, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Writes the first count pages of the region, which hold the
+   superblock, like flush_pages, but from a copy without the per-mount
+   state: the region lock, which the caller holds, the heap and journal
+   locks and the attach key. A region read back from the file is thus
+   always set up afresh by myfs_attach, even in the process and at the
+   address that flushed it. Returns 0 on success and -1 with errno set
+   on failure.
+*/
+static int flush_super(void *fsptr, int fd, size_t count) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    size_t len = count << MYFS_DIRTY_SHIFT;
+
+    if (len > super->size) {
+        len = super->size;
+    }
+    char *copy = malloc(len);
+    if (copy == NULL) {
+        return -1;
+    }
+    memcpy(copy, fsptr, len);
+
+    struct myfs_super *image = (struct myfs_super *)copy;
+    image->attach_key = 0;
+    memset(&image->lock, 0, sizeof(image->lock));
+    memset(&image->heap_lock, 0, sizeof(image->heap_lock));
+    memset(&image->journal_mutex, 0, sizeof(image->journal_mutex));
+    memset(&image->journal_cond, 0, sizeof(image->journal_cond));
+    image->journal_fd = -1;
+    image->journal_syncing = 0;
+    image->exclusive = 0;
+
+    size_t offset = 0;
+    int result = 0;
+    while (offset < len) {
+        ssize_t n = pwrite(fd, copy + offset, len - offset, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            result = -1;
+            break;
+        }
+        offset += n;
+    }
+    free(copy);
+    return result;
+}
+
+/* Starts the journal over after a flush, as all records in it are
+   part of the image on disk now. Must be called under the region lock.
+*/
+static void journal_checkpoint(struct myfs_super *super) {
+    pthread_mutex_lock(&super->journal_mutex);
+    while (super->journal_syncing) {
+        pthread_cond_wait(&super->journal_cond, &super->journal_mutex);
+    }
+
+    // Should the journal not shrink, its records are stale all the same
+    if (ftruncate(super->journal_fd, 0) == 0 && lseek(super->journal_fd, 0, SEEK_SET) == 0) {
+        super->journal_base = super->journal_end;
+    }
+    super->journal_synced = super->journal_end;
+    pthread_cond_broadcast(&super->journal_cond);
+    pthread_mutex_unlock(&super->journal_mutex);
+}
+
+/* Writes everything that changed since the last flush to the
+   backup-file open at fd and syncs it. Must be called under the region
+   lock. Returns 0 on success and -1 with *errnoptr set to the error of
+   pwrite or fdatasync otherwise; pages not written stay marked then.
+*/
+static int region_flush(void *fsptr, int fd, int *errnoptr) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    size_t pages = (super->size + MYFS_DIRTY_PAGE - 1) >> MYFS_DIRTY_SHIFT;
+    size_t super_pages = (sizeof(struct myfs_super) + MYFS_DIRTY_PAGE - 1) >> MYFS_DIRTY_SHIFT;
+
+    // Without a map, nothing is known about what changed
+    if (super->dirty_map == 0 && dirty_map_create(fsptr) == 0) {
+        region_dirty(fsptr, fsptr, super->size);
+    }
+
+    int journaled = super->journal_fd >= 0;
+    if (journaled) {
+        super->journal_gen++;
+    }
+
+    int result = 0;
+    if (super->dirty_map == 0) {
+        result = flush_pages(fsptr, fd, super_pages, pages - super_pages);
+    } else {
+        uint64_t *map = off_to_ptr(fsptr, super->dirty_map);
+        size_t first = super_pages, count;
+        while (result == 0 && bitmap_next_run(map, pages, &first, &count)) {
+            result = flush_pages(fsptr, fd, first, count);
+            if (result == 0) {
+                bitmap_mark(map, first, count, 0);
+                first += count;
+            }
+        }
+    }
+    if (result == 0) {
+        result = flush_super(fsptr, fd, super_pages);
+    }
+    if (result == 0) {
+        result = fdatasync(fd);
+    }
+
+    if (result != 0) {
+        *errnoptr = errno;
+        if (journaled) {
+            super->journal_gen--;
+        }
+        return -1;
+    }
+    if (journaled) {
+        journal_checkpoint(super);
+    }
+    return 0;
+}
+
+/* A flush thread; the handle lives outside the region, like that of a
+   defrag thread.
+*/
+struct myfs_flusher {
+    void *fsptr;
+    size_t fssize;
+    int fd;                         // Backup-file
+    unsigned int interval_ms;       // Pause between two flushes
+    pthread_mutex_t mutex;          // Protects stop
+    pthread_cond_t wakeup;          // Signalled when stop is set
+    int stop;
+    pthread_t thread;
+};
+
+/* Flushes under the region lock, pausing in between, until told to
+   stop. A flush that fails is retried the next time.
+*/
+static void *flush_thread(void *arg) {
+    struct myfs_flusher *flusher = arg;
+
+    pthread_mutex_lock(&flusher->mutex);
+    while (!flusher->stop) {
+        pthread_mutex_unlock(&flusher->mutex);
+        int error;
+        struct myfs_super *super = myfs_lock(flusher->fsptr, flusher->fssize, &error);
+        if (super != NULL) {
+            region_flush(flusher->fsptr, flusher->fd, &error);
+            myfs_unlock(super);
+        }
+        pthread_mutex_lock(&flusher->mutex);
+        thread_pause(&flusher->mutex, &flusher->wakeup, &flusher->stop, flusher->interval_ms);
+    }
+    pthread_mutex_unlock(&flusher->mutex);
+    return NULL;
+}
+
+/* End of helper functions */
+
+/* Implements an emulation of the stat system call on the filesystem 
+   of size fssize pointed to by fsptr. 
+   
+   If path can be followed and describes a file or directory 
+   that exists and is accessable, the access information is 
+   put into stbuf. 
+
+   On success, 0 is returned. On failure, -1 is returned and 
+   the appropriate error code is put into *errnoptr.
+
+   man 2 stat documents all possible error codes and gives more detail
+   on what fields of stbuf need to be filled in. Essentially, only the
+   following fields need to be supported:
+
+   st_uid      the value passed in argument
+   st_gid      the value passed in argument
+   st_mode     (as fixed values S_IFDIR | 0755 for directories,
+                                S_IFREG | 0755 for files)
+   st_nlink    (as many as there are subdirectories (not files) for directories
+                (including . and ..),
+                1 for files)
+   st_size     (supported only for files, where it is the real file size)
+   st_blocks   (for files, the 512-byte blocks actually allocated to them)
+   st_atim
+   st_mtim
+
+*/
+static int myfs_getattr(void *fsptr, size_t fssize, int *errnoptr,
+                        uid_t uid, gid_t gid,
+                        const char *path, struct stat *stbuf) {
+    initialize_myfs(fsptr, fssize);
+
+    struct myfs_node *node = find_node(fsptr, path, errnoptr);
+    if (node == NULL) {
+        return -1;
+    }
+
+    for (unsigned int tries = 0;; tries++) {
+        uint32_t seq = node_read_begin(node, tries);
+        memset(stbuf, 0, sizeof(struct stat));
+        stbuf->st_uid = uid;
+        stbuf->st_gid = gid;
+        stbuf->st_atime = __atomic_load_n(&node->times[0].tv_sec, __ATOMIC_ACQUIRE);
+        stbuf->st_mtime = __atomic_load_n(&node->times[1].tv_sec, __ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&node->is_file, __ATOMIC_ACQUIRE)) {
+            size_t size = __atomic_load_n(&node->data.file.size, __ATOMIC_ACQUIRE);
+            stbuf->st_mode = S_IFREG | 0644;
+            stbuf->st_nlink = 1;
+            stbuf->st_size = size;
+            // Holes and inline contents take up no blocks of their own
+            if (size > MYFS_INLINE_MAX) {
+                size_t allocated = __atomic_load_n(&node->data.file.allocated, __ATOMIC_ACQUIRE);
+                stbuf->st_blocks = (allocated + 511) / 512;
+            }
+        } else {
+            stbuf->st_mode = S_IFDIR | 0755;
+            stbuf->st_nlink = 2;
+            stbuf->st_size = 0;
+        }
+        if (!node_read_retry(node, seq)) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/* Implements an emulation of the readdir system call on the filesystem 
+   of size fssize pointed to by fsptr. 
+
+   If path can be followed and describes a directory that exists and
+   is accessable, the names of the subdirectories and files 
+   contained in that directory are output into *namesptr. The . and ..
+   directories must not be included in that listing.
+
+   If it needs to output file and subdirectory names, the function
+   starts by allocating (with calloc) an array of pointers to
+   characters of the right size (n entries for n names). Sets
+   *namesptr to that pointer. It then goes over all entries
+   in that array and allocates, for each of them an array of
+   characters of the right size (to hold the i-th name, together 
+   with the appropriate '\0' terminator). It puts the pointer
+   into that i-th array entry and fills the allocated array
+   of characters with the appropriate name. The calling function
+   will call free on each of the entries of *namesptr and 
+   on *namesptr.
+
+   The function returns the number of names that have been 
+   put into namesptr. 
+
+   If no name needs to be reported because the directory does
+   not contain any file or subdirectory besides . and .., 0 is 
+   returned and no allocation takes place.
+
+   On failure, -1 is returned and the *errnoptr is set to 
+   the appropriate error code. 
+
+   The error codes are documented in man 2 readdir.
+
+   In the case memory allocation with malloc/calloc fails, failure is
+   indicated by returning -1 and setting *errnoptr to EINVAL.
+
+*/
+static int myfs_readdir(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, char ***namesptr) {
+    initialize_myfs(fsptr, fssize);
+
+    struct myfs_node *dir_node = find_node(fsptr, path, errnoptr);
+    if (dir_node == NULL) {
+        return -1;
+    }
+
+    if (dir_node->is_file) {
+        *errnoptr = ENOTDIR;
+        return -1;
+    }
+
+    struct myfs_dir *dir = &dir_node->data.directory;
+    node_lock_shared(dir_node);
+    size_t count = dir->number_children;
+    if (count == 0) {
+        node_unlock_shared(dir_node);
+        return 0;
+    }
+
+    *namesptr = calloc(count, sizeof(char *));
+    if (*namesptr == NULL) {
+        node_unlock_shared(dir_node);
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+
+    myfs_off_t *children = off_to_ptr(fsptr, dir->children);
+    size_t i = 0;
+    for (size_t pos = 0; pos < dir->length; pos++) {
+        if (children[pos] == 0) {
+            continue;
+        }
+        struct myfs_node *child = off_to_ptr(fsptr, children[pos]);
+        (*namesptr)[i] = strdup(node_name(fsptr, child));
+        if ((*namesptr)[i] == NULL) {
+            for (size_t j = 0; j < i; j++) {
+                free((*namesptr)[j]);
+            }
+            free(*namesptr);
+            node_unlock_shared(dir_node);
+            *errnoptr = ENOMEM;
+            return -1;
+        }
+        i++;
+    }
+    node_unlock_shared(dir_node);
+
+    return count;
+}
+
+/* Implements a streaming variant of readdir on the filesystem of size
+   fssize pointed to by fsptr, without any allocation.
+
+   If path can be followed and describes a directory that exists and
+   is accessable, filler is called with buf, the name, a struct stat
+   with st_mode filled in and a cookie for every file and subdirectory
+   in that directory, in a stable order. The . and .. directories are
+   not reported. The name passed to filler points into the filesystem
+   and is only valid for the duration of the call.
+
+   The listing starts after the entry whose cookie is offset, or at
+   the first entry if offset is 0. Entries added or removed in the
+   meantime do not cause other entries to be skipped or repeated, so
+   a listing can be continued in a later call once filler returns
+   nonzero to indicate that its buffer is full.
+
+   The function returns 0 on success. On failure, -1 is returned and
+   *errnoptr is set to the appropriate error code.
+
+   The error codes are documented in man 2 readdir.
+
+*/
+static int myfs_readdir_filler(void *fsptr, size_t fssize, int *errnoptr,
+                               const char *path, void *buf, myfs_fill_dir_t filler,
+                               off_t offset) {
+    initialize_myfs(fsptr, fssize);
+
+    struct myfs_node *dir_node = find_node(fsptr, path, errnoptr);
+    if (dir_node == NULL) {
+        return -1;
+    }
+
+    if (dir_node->is_file) {
+        *errnoptr = ENOTDIR;
+        return -1;
+    }
+
+    if (offset < 0) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    // Children are ordered by dir_seq, so the entry after the cookie
+    // can be found with a binary search that steps over holes.
+    struct myfs_dir *dir = &dir_node->data.directory;
+    node_lock_shared(dir_node);
+    myfs_off_t *children = off_to_ptr(fsptr, dir->children);
+    size_t lo = 0, hi = dir->length;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        size_t pos = mid;
+        while (pos < hi && children[pos] == 0) {
+            pos++;
+        }
+        if (pos == hi) {
+            hi = mid;
+        } else if (((struct myfs_node *)off_to_ptr(fsptr, children[pos]))->dir_seq <= offset) {
+            lo = pos + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(stbuf));
+    for (size_t pos = lo; pos < dir->length; pos++) {
+        if (children[pos] == 0) {
+            continue;
+        }
+        struct myfs_node *child = off_to_ptr(fsptr, children[pos]);
+        stbuf.st_mode = child->is_file ? S_IFREG | 0644 : S_IFDIR | 0755;
+        if (filler(buf, node_name(fsptr, child), &stbuf, child->dir_seq) != 0) {
+            break;
+        }
+    }
+    node_unlock_shared(dir_node);
+
+    return 0;
+}
+
+/* Implements an emulation of the mknod system call for regular files
+   on the filesystem of size fssize pointed to by fsptr.
+
+   This function is called only for the creation of regular files.
+
+   If a file gets created, it is of size zero and has default
+   ownership and mode bits.
+
+   The call creates the file indicated by path.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 mknod.
+
+*/
+static int myfs_mknod(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+    initialize_myfs(fsptr, fssize);
+
+    // An existing file fails before anything on its path is unshared
+    int error;
+    if (find_node(fsptr, path, &error) != NULL) {
+        *errnoptr = EEXIST;
+        return -1;
+    }
+
+    // Find the parent directory and the name of the new file
+    struct myfs_name name;
+    struct myfs_node *parent_node = find_parent_private(fsptr, path, &name, errnoptr);
+    if (parent_node == NULL) {
+        return -1;
+    }
+
+    if (name.len > NAME_MAX_LEN) {
+        *errnoptr = ENAMETOOLONG;
+        return -1;
+    }
+
+    return dir_create(fsptr, parent_node, &name, 1, errnoptr);
+}
+
+/* Implements an emulation of the unlink system call for regular files
+   on the filesystem of size fssize pointed to by fsptr.
+
+   This function is called only for the deletion of regular files.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 unlink.
+
+*/
+static int myfs_unlink(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+    initialize_myfs(fsptr, fssize);
+
+    // Find the parent directory and the file name
+    struct myfs_name file_name;
+    struct myfs_node *parent_node = find_parent_private(fsptr, path, &file_name, errnoptr);
+    
+    if (parent_node == NULL) {
+        return -1;
+    }
+    
+    // Find the file node
+    struct myfs_node *file_node = file_name.len == 0 ? parent_node :
+                                  get_node(fsptr, &parent_node->data.directory, &file_name);
+    
+    if (file_node == NULL) {
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    
+    if (!file_node->is_file) {
+        *errnoptr = EISDIR;
+        return -1;
+    }
+    
+    // Remove the file from the parent directory
+    dir_remove_child(fsptr, &parent_node->data.directory, file_node);
+    
+    // Give the file's data and the file node back to the allocator,
+    // unless a snapshot still has them
+    node_release(fsptr, ptr_to_off(fsptr, file_node));
+    
+    // Update parent directory's modification time
+    update_time(fsptr, parent_node, 1);
+    
+    return 0;
+}
+
+
+/* Implements an emulation of the rmdir system call on the filesystem 
+   of size fssize pointed to by fsptr. 
+
+   The call deletes the directory indicated by path.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The function call must fail when the directory indicated by path is
+   not empty (if there are files or subdirectories other than . and ..).
+
+   The error codes are documented in man 2 rmdir.
+
+*/
+static int myfs_rmdir(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+    struct myfs_super *super = initialize_myfs(fsptr, fssize);
+
+    // Find the parent directory and the directory to be removed
+    struct myfs_name dir_name;
+    struct myfs_node *parent_node;
+    if (path_in_snapshots(path)) {
+        parent_node = find_parent_node(fsptr, path, &dir_name, errnoptr);
+    } else {
+        parent_node = find_parent_private(fsptr, path, &dir_name, errnoptr);
+    }
+    
+    if (parent_node == NULL) {
+        return -1;
+    }
+    
+    // The root directory cannot be removed
+    if (dir_name.len == 0) {
+        *errnoptr = EBUSY;
+        return -1;
+    }
+
+    // Removing an entry of the snapshot directory removes that
+    // snapshot; the trees of snapshots cannot be changed
+    if (parent_node == off_to_ptr(fsptr, super->snapshot_dir)) {
+        return snapshot_remove(fsptr, &dir_name, errnoptr);
+    }
+    if (path_in_snapshots(path)) {
+        *errnoptr = EROFS;
+        return -1;
+    }
+    
+    // Find the directory node to be removed
+    struct myfs_node *dir_node = get_node(fsptr, &parent_node->data.directory, &dir_name);
+    
+    if (dir_node == NULL) {
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    
+    if (dir_node->is_file) {
+        *errnoptr = ENOTDIR;
+        return -1;
+    }
+    
+    // Check if the directory is empty
+    if (dir_node->data.directory.number_children > 0) {
+        *errnoptr = ENOTEMPTY;
+        return -1;
+    }
+    
+    // Remove the directory from the parent's children list
+    dir_remove_child(fsptr, &parent_node->data.directory, dir_node);
+    
+    // Free the directory's children array and index and the directory
+    // node, unless a snapshot still has them
+    node_release(fsptr, ptr_to_off(fsptr, dir_node));
+    
+    // Update parent directory's modification time
+    update_time(fsptr, parent_node, 1);
+    
+    return 0;
+}
+
+
+/* Implements an emulation of the mkdir system call on the filesystem 
+   of size fssize pointed to by fsptr. 
+
+   The call creates the directory indicated by path.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 mkdir.
+
+*/
+static int myfs_mkdir(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+    struct myfs_super *super = initialize_myfs(fsptr, fssize);
+
+    // Find the parent directory and the name of the new directory
+    struct myfs_name name;
+    struct myfs_node *parent_node;
+    if (path_in_snapshots(path)) {
+        parent_node = find_parent_node(fsptr, path, &name, errnoptr);
+    } else {
+        parent_node = find_parent_private(fsptr, path, &name, errnoptr);
+    }
+    if (parent_node == NULL) {
+        return -1;
+    }
+
+    // Check if the path is the root directory
+    if (name.len == 0) {
+        *errnoptr = EEXIST; // Cannot create a directory named "/"
+        return -1;
+    }
+
+    // Creating an entry of the snapshot directory takes a snapshot; the
+    // trees of snapshots cannot be changed
+    if (parent_node == off_to_ptr(fsptr, super->snapshot_dir)) {
+        return snapshot_create(fsptr, &name, errnoptr);
+    }
+    if (path_in_snapshots(path)) {
+        *errnoptr = EROFS;
+        return -1;
+    }
+
+    // Check if the directory name is too long
+    if (name.len > NAME_MAX_LEN) {
+        *errnoptr = ENAMETOOLONG;
+        return -1;
+    }
+
+    // Check if the directory name already exists
+    struct myfs_node *existing_node = get_node(fsptr, &parent_node->data.directory, &name);
+    if (existing_node != NULL) {
+        *errnoptr = EEXIST;
+        return -1;
+    }
+
+    return dir_create(fsptr, parent_node, &name, 0, errnoptr);
+}
+
+
+
+/* Implements an emulation of the rename system call on the filesystem 
+   of size fssize pointed to by fsptr. 
+
+   The call moves the file or directory indicated by from to to.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   Caution: the function does more than what is hinted to by its name.
+   In cases the from and to paths differ, the file is moved out of 
+   the from path and added to the to path.
+
+   The error codes are documented in man 2 rename.
+
+*/
+static int myfs_rename(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *from, const char *to) {
+    if (!fsptr || !from || !to || from[0] == '\0' || to[0] == '\0') {
+        *errnoptr = EINVAL; // Invalid arguments
+        return -1;
+    }
+
+    initialize_myfs(fsptr, fssize);
+
+    // Locate the directories holding `from` and `to`
+    struct myfs_name from_name, to_name;
+    struct myfs_node *from_parent = find_parent_private(fsptr, from, &from_name, errnoptr);
+    if (from_parent == NULL) {
+        return -1;
+    }
+    struct myfs_node *to_parent = find_parent_private(fsptr, to, &to_name, errnoptr);
+    if (to_parent == NULL) {
+        return -1;
+    }
+
+    // The root directory can neither be moved nor replaced
+    if (from_name.len == 0 || to_name.len == 0) {
+        *errnoptr = EBUSY;
+        return -1;
+    }
+
+    if (to_name.len > NAME_MAX_LEN) {
+        *errnoptr = ENAMETOOLONG;
+        return -1;
+    }
+
+    struct myfs_node *source = get_node(fsptr, &from_parent->data.directory, &from_name);
+    if (source == NULL) {
+        *errnoptr = ENOENT; // Source not found
+        return -1;
+    }
+
+    // Renaming something onto itself does nothing
+    struct myfs_node *target = get_node(fsptr, &to_parent->data.directory, &to_name);
+    if (target == source) {
+        return 0;
+    }
+
+    // A directory cannot be moved below itself
+    if (!source->is_file && path_is_below(from, to)) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    // An existing target gets replaced if it is of the same kind and,
+    // for directories, empty. Otherwise make sure the source will fit
+    // into its new directory before touching anything; the same goes
+    // for the new name.
+    myfs_off_t name_block;
+    if (target != NULL) {
+        if (!source->is_file && target->is_file) {
+            *errnoptr = ENOTDIR;
+            return -1;
+        }
+        if (source->is_file && !target->is_file) {
+            *errnoptr = EISDIR;
+            return -1;
+        }
+        if (!target->is_file && target->data.directory.number_children > 0) {
+            *errnoptr = ENOTEMPTY;
+            return -1;
+        }
+    } else if (dir_reserve(fsptr, &to_parent->data.directory) < 0) {
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+    source = dir_unshare_child(fsptr, &from_parent->data.directory, source, errnoptr);
+    if (source == NULL) {
+        return -1;
+    }
+    if (name_alloc(fsptr, &to_name, &name_block) < 0) {
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+
+    // Take the source out of its directory and give it its new name
+    dir_remove_child(fsptr, &from_parent->data.directory, source);
+    set_node_name(fsptr, source, &to_name, name_block);
+
+    if (target != NULL) {
+        // The source takes the place of the target, which has the same name
+        dir_replace_child(fsptr, &to_parent->data.directory, target, ptr_to_off(fsptr, source));
+        node_release(fsptr, ptr_to_off(fsptr, target));
+    } else {
+        // Cannot fail, room has been reserved above
+        dir_add_child(fsptr, &to_parent->data.directory, ptr_to_off(fsptr, source));
+    }
+
+    update_time(fsptr, from_parent, 1);
+    update_time(fsptr, to_parent, 1);
+    return 0;
+}
+
+/* Implements an emulation of the truncate system call on the filesystem 
+   of size fssize pointed to by fsptr. 
+
+   The call changes the size of the file indicated by path to offset
    bytes.
 
-   When the file becomes smaller due to the call, the extending bytes are
-   removed. When it becomes larger, zeros are appended.
+   When the file becomes smaller due to the call, the extending bytes are
+   removed. When it becomes larger, zeros are appended.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 truncate.
+
+*/
+static int myfs_truncate(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *path, off_t offset) {
+    initialize_myfs(fsptr, fssize);
+
+    if (offset < 0) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    struct myfs_node *node = find_node_private(fsptr, path, errnoptr);
+    if (node == NULL) {
+        return -1;
+    }
+
+    return node_truncate(fsptr, node, offset, errnoptr);
+}
+
+/* Implements an emulation of the open system call on the filesystem 
+   of size fssize pointed to by fsptr, without actually performing the opening
+   of the file (no file descriptor is returned).
+
+   The call just checks if the file (or directory) indicated by path
+   can be accessed, i.e. if the path can be followed to an existing
+   object for which the access rights are granted.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The two only interesting error codes are 
+
+   * EFAULT: the filesystem is in a bad state, we can't do anything
+
+   * ENOENT: the file that we are supposed to open doesn't exist (or a
+             subpath).
+
+   It is possible to restrict ourselves to only these two error
+   conditions. It is also possible to implement more detailed error
+   condition answers.
+
+   The error codes are documented in man 2 open.
+
+*/
+static int myfs_open(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+    if (!fsptr || fssize <= 0) {
+        if (errnoptr) *errnoptr = EFAULT;
+        return -1;
+    }
+
+    initialize_myfs(fsptr, fssize);
+
+    struct myfs_node *node = find_node(fsptr, path, errnoptr);
+    if (node == NULL) {
+        return -1;
+    }
+
+    if (strcmp(path, "/") == 0 && !node->is_file) {
+        return 0;
+    }
+
+    if (!node->is_file) {
+        if (errnoptr) *errnoptr = EISDIR;
+        return -1;
+    }
+
+    return 0;
+}
 
-   On success, 0 is returned.
+/* Like myfs_open, and puts a handle for the file path refers to into
+   *fhptr (see Open files), or 0 if it gets none, as directories, files
+   in the snapshot directory and files opened when the open file table
+   is full and cannot grow do. If the table is full and grow is 0, the
+   region lock being held shared only, returns 1 and leaves it alone.
+*/
+static int myfs_open_fh(void *fsptr, size_t fssize, int *errnoptr, const char *path,
+                        uint64_t *fhptr, int grow) {
+    *fhptr = 0;
+    if (myfs_open(fsptr, fssize, errnoptr, path) < 0) {
+        return -1;
+    }
+
+    struct myfs_node *node = find_node(fsptr, path, errnoptr);
+    if (!node->is_file || path_in_snapshots(path)) {
+        return 0;
+    }
+    *fhptr = open_file_add(fsptr, ptr_to_off(fsptr, node), grow);
+    return *fhptr == 0 && !grow ? 1 : 0;
+}
+
+/* Implements an emulation of the release call, which FUSE makes when
+   the last descriptor of an open file gets closed, for the handle fh
+   myfs_open_fh handed out. Always succeeds.
+*/
+static int myfs_release(void *fsptr, size_t fssize, int *errnoptr, uint64_t fh) {
+    (void)errnoptr;
+    if (!fsptr || fssize <= 0) {
+        return 0;
+    }
+
+    open_file_remove(fsptr, fh);
+    return 0;
+}
+
+/* Implements an emulation of the read system call on the filesystem 
+   of size fssize pointed to by fsptr.
+
+   The call copies up to size bytes from the file indicated by 
+   path into the buffer, starting to read at offset. See the man page
+   for read for the details when offset is beyond the end of the file etc.
+   
+   On success, the appropriate number of bytes read into the buffer is
+   returned. The value zero is returned on an end-of-file condition.
 
    On failure, -1 is returned and *errnoptr is set appropriately.
 
-   The error codes are documented in man 2 truncate.
+   The error codes are documented in man 2 read.
 
 */
-int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
-                           const char *path, off_t offset) {
+static int myfs_read(void *fsptr, size_t fssize, int *errnoptr,
+                     const char *path, char *buf, size_t size, off_t offset) {
+    if (!fsptr || fssize <= 0) {
+        if (errnoptr) *errnoptr = EFAULT;
+        return -1;
+    }
+
+    initialize_myfs(fsptr, fssize);
+
+    if (offset < 0) {
+        if (errnoptr) *errnoptr = EINVAL;
+        return -1;
+    }
+
+    struct myfs_node *node = find_node(fsptr, path, errnoptr);
+    if (node == NULL) {
+        return -1;
+    }
+
+    return node_read(fsptr, node, buf, size, offset, errnoptr);
+}
+
+/* Like myfs_read, but instead of copying the contents, describes them
+   by an array of iovecs, allocated with malloc and put into *iovptr,
+   with their number in *iovcntptr. The iovecs point straight into the
+   region, except for holes, which read from zeros kept behind the
+   array, and for small files, whose contents get copied there. The
+   caller frees the array, with what is behind it, when done.
+
+   The file comes from the handle fh if it is not 0 and still leads to
+   a file, see Open files, and from path otherwise. On success, the
+   extents the iovecs point into are pinned, see Pinned reads, and the
+   pin goes into *pinptr; it is 0 if nothing needed pinning. If the pin
+   table is full and grow is 0, the region lock being held shared only,
+   fails with EAGAIN.
+*/
+static int myfs_read_iov(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *path, uint64_t fh, size_t size, off_t offset,
+                         struct iovec **iovptr, int *iovcntptr, uint64_t *pinptr, int grow) {
+    if (!fsptr || fssize <= 0) {
+        if (errnoptr) *errnoptr = EFAULT;
+        return -1;
+    }
+
+    initialize_myfs(fsptr, fssize);
+
+    if (offset < 0) {
+        if (errnoptr) *errnoptr = EINVAL;
+        return -1;
+    }
+
+    struct myfs_node *node = open_file_node(fsptr, fh);
+    if (node == NULL) {
+        node = find_node(fsptr, path, errnoptr);
+        if (node == NULL) {
+            return -1;
+        }
+    }
+
+    if (!node->is_file) {
+        if (errnoptr) *errnoptr = EISDIR;
+        return -1;
+    }
+
+    struct myfs_file_data *file = &node->data.file;
+    node_lock_shared(node);
+    size_t read_size = 0;
+    if ((size_t)offset < file->size) {
+        read_size = size < file->size - offset ? size : file->size - offset;
+    }
+
+    // Small files get copied behind the array, as if into zeros
+    int holes = 0;
+    int inline_data = file_is_inline(file);
+    size_t count = inline_data ? read_size > 0 :
+                   file_map(fsptr, file, offset, read_size, NULL, NULL, &holes);
+    size_t zeros_len = holes ? (read_size < MYFS_ZERO_CHUNK ? read_size : MYFS_ZERO_CHUNK) : 0;
+    if (inline_data) {
+        zeros_len = read_size;
+    }
+    struct iovec *iov = malloc(count * sizeof(struct iovec) + zeros_len);
+    if (iov == NULL) {
+        node_unlock_shared(node);
+        if (errnoptr) *errnoptr = ENOMEM;
+        return -1;
+    }
+    char *zeros = (char *)(iov + count);
+    memset(zeros, 0, zeros_len);
+
+    // A read from a hole at the start may go on into the first extent
+    uint64_t pin = 0;
+    if (inline_data) {
+        if (count > 0) {
+            memcpy(zeros, file->inline_data + offset, read_size);
+            iov[0].iov_base = zeros;
+            iov[0].iov_len = read_size;
+        }
+    } else if (read_size > 0) {
+        myfs_off_t first = file_find_extent(fsptr, file, offset);
+        if (first == 0) {
+            first = file->data;
+        }
+        if (first != 0 && (pin = pin_add(fsptr, node, first, grow)) == 0) {
+            node_unlock_shared(node);
+            free(iov);
+            if (errnoptr) *errnoptr = grow ? ENOMEM : EAGAIN;
+            return -1;
+        }
+        file_map(fsptr, file, offset, read_size, iov, zeros, &holes);
+    }
+    node_unlock_shared(node);
+
+    *iovptr = iov;
+    *iovcntptr = (int)count;
+    *pinptr = pin;
+    return read_size;
+}
+
+/* Does the work of myfs_write below, with the bytes coming from src */
+static int myfs_write_source(void *fsptr, size_t fssize, int *errnoptr, const char *path,
+                             struct myfs_source *src, size_t size, off_t offset) {
+    if (!fsptr) {
+        return -1;
+    }
+
+    initialize_myfs(fsptr, fssize);
+
     if (offset < 0) {
+        if (errnoptr) *errnoptr = EINVAL;
+        return -1;
+    }
+
+    struct myfs_node *node = find_node_private(fsptr, path, errnoptr);
+    if (node == NULL) {
+        return -1;
+    }
+
+    return node_write_source(fsptr, node, src, size, offset, errnoptr);
+}
+
+/* Implements an emulation of the write system call on the filesystem 
+   of size fssize pointed to by fsptr.
+
+   The call copies up to size bytes to the file indicated by 
+   path into the buffer, starting to write at offset. See the man page
+   for write for the details when offset is beyond the end of the file etc.
+   
+   On success, the appropriate number of bytes written into the file is
+   returned. The value zero is returned on an end-of-file condition.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 write.
+
+*/
+static int myfs_write(void *fsptr, size_t fssize, int *errnoptr,
+                      const char *path, const char *buf, size_t size, off_t offset) {
+    struct iovec iov;
+    struct myfs_source src = source_buffer(&iov, buf, size);
+    return myfs_write_source(fsptr, fssize, errnoptr, path, &src, size, offset);
+}
+
+/* Implements an emulation of the fallocate system call, for the file
+   path refers to, see node_fallocate
+*/
+static int myfs_fallocate(void *fsptr, size_t fssize, int *errnoptr, const char *path,
+                          int mode, off_t offset, off_t len, size_t *grownptr) {
+    *grownptr = 0;
+    initialize_myfs(fsptr, fssize);
+
+    struct myfs_node *node = find_node_private(fsptr, path, errnoptr);
+    if (node == NULL) {
+        return -1;
+    }
+
+    return node_fallocate(fsptr, node, mode, offset, len, grownptr, errnoptr);
+}
+
+/* Implements an emulation of the utimensat system call on the filesystem 
+   of size fssize pointed to by fsptr.
+
+   The call changes the access and modification times of the file
+   or directory indicated by path to the values in ts.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 utimensat.
+
+*/
+static int myfs_utimens(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const struct timespec ts[2]) {
+    if (!fsptr || fssize <= 0 || !path || !errnoptr) {
+        if (errnoptr) *errnoptr = EFAULT;
+        return -1;
+    }
+
+    initialize_myfs(fsptr, fssize);
+
+    struct myfs_node *node = find_node_private(fsptr, path, errnoptr);
+    if (node == NULL) {
+        return -1;
+    }
+
+    return node_set_times(fsptr, node, ts, errnoptr);
+}
+
+/* Implements an emulation of the statfs system call on the filesystem 
+   of size fssize pointed to by fsptr.
+
+   The call gets information of the filesystem usage and puts in 
+   into stbuf.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 statfs.
+
+   Essentially, only the following fields of struct statvfs need to be
+   supported:
+
+   f_bsize   fill with what you call a block (typically 1024 bytes)
+   f_blocks  fill with the total number of blocks in the filesystem
+   f_bfree   fill with the free number of blocks in the filesystem
+   f_bavail  fill with same value as f_bfree
+   f_namemax fill with your maximum file/directory name, if your
+             filesystem has such a maximum
+
+*/
+static int myfs_statfs(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf) {
+    if (fsptr == NULL || stbuf == NULL) {
+        if (errnoptr != NULL) {
+            *errnoptr = EFAULT;
+        }
+        return -1;
+    }
+
+    struct myfs_super *super = initialize_myfs(fsptr, fssize);
+
+    // The allocators keep all counts up to date, so this takes O(1).
+    // Blocks are those of the data zone, if there is one.
+    heap_lock(fsptr);
+    size_t block_bytes = super->data_block_size != 0 ? super->data_block_size : MYFS_BLOCK_SIZE;
+    size_t free_bytes = super->free_bytes + super->data_free * super->data_block_size +
+                        super->frag_free_bytes;
+    size_t nodes_total = super->slab_nodes_total;
+
+    // Nodes can go into the free slots of the slabs or into new slabs
+    size_t free_slots = super->slab_nodes_total - super->slab_nodes_used;
+    size_t new_nodes = free_bytes / sizeof(struct myfs_node);
+    heap_unlock(fsptr);
+
+    memset(stbuf, 0, sizeof(struct statvfs));
+    stbuf->f_bsize = block_bytes;
+    stbuf->f_frsize = block_bytes;
+    stbuf->f_blocks = super->size / block_bytes;
+    stbuf->f_bfree = free_bytes / block_bytes;
+    stbuf->f_bavail = stbuf->f_bfree;
+    stbuf->f_files = nodes_total + new_nodes;
+    stbuf->f_ffree = free_slots + new_nodes;
+    stbuf->f_favail = stbuf->f_ffree;
+    stbuf->f_namemax = NAME_MAX_LEN;
+
+    return 0;
+}
+
+/* Compacts the filesystem stored in the image of image_len bytes at
+   image, which holds the first image_len bytes of a region. Images
+   may be shorter than their region, in which case the rest of the
+   region reads as zero-bytes.
+
+   On success, a compacted image is allocated (with malloc) and put
+   into *newptr, its length into *new_len, and 0 is returned. The
+   compacted image describes a region of the same size, holds the same
+   tree, without snapshots, and is usually much shorter. The calling
+   function will call free on *newptr.
+
+   On failure, -1 is returned and *errnoptr is set to EINVAL if the
+   image does not hold a filesystem or is corrupt, ENOMEM if memory
+   allocation with malloc/calloc fails and ENOSPC if the tree does not
+   fit into a fresh region.
+
+*/
+int __myfs_compact_implem(const void *image, size_t image_len, void **newptr,
+                          size_t *new_len, int *errnoptr) {
+    const struct myfs_super *image_super = image;
+    if (image_len < sizeof(struct myfs_super) || image_super->is_set != 1 ||
+        image_super->size < image_len) {
         *errnoptr = EINVAL;
         return -1;
     }
 
-    size_t file_offset = myfs_traverse_path(fsptr, path);
-    if (file_offset == (size_t)-1) {
-        *errnoptr = ENOENT;
+    size_t fssize = image_super->size;
+    void *oldptr = calloc(1, fssize);
+    void *fsptr = calloc(1, fssize);
+    if (oldptr == NULL || fsptr == NULL) {
+        free(oldptr);
+        free(fsptr);
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+    memcpy(oldptr, image, image_len);
+
+    initialize_myfs(fsptr, fssize);
+    int error = compact_copy_tree(fsptr, oldptr);
+    if (error != 0) {
+        free(oldptr);
+        free(fsptr);
+        *errnoptr = error;
+        return -1;
+    }
+    free(oldptr);
+
+    // Give all the space behind the data back to the data zone; the
+    // image ends with the heap or with the last zone block in use
+    heap_trim(fsptr, MYFS_MIN_BLOCK);
+
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    size_t len = super->heap_end + MYFS_HEADER_SIZE;
+    if (super->data_block_size != 0) {
+        const uint64_t *bitmap = off_to_ptr(fsptr, super->data_bitmap);
+        for (size_t i = super->data_blocks; i-- > super->data_first;) {
+            if (bitmap[i / 64] & ((uint64_t)1 << (i % 64))) {
+                len = (i + 1) * super->data_block_size;
+                break;
+            }
+        }
+    }
+    while (len > 0 && ((char *)fsptr)[len - 1] == 0) {
+        len--;
+    }
+    *newptr = fsptr;
+    *new_len = len;
+    return 0;
+}
+
+/* Does a write for the entry points that take their bytes from
+   somewhere else than a single buffer, as __myfs_write_fh_implem does
+   for that one. The journal record takes the bytes from the file, as
+   a file descriptor cannot be read twice.
+*/
+static int write_source(void *fsptr, size_t fssize, int *errnoptr, const char *path,
+                        uint64_t fh, struct myfs_source *src, size_t size, off_t offset) {
+    uint64_t lsn = 0;
+    struct myfs_super *super;
+    struct myfs_node *node = lock_node_live(fsptr, fssize, errnoptr, path, fh, &super);
+    if (super == NULL) {
+        return -1;
+    }
+    int result = node != NULL ? node_write_source(fsptr, node, src, size, offset, errnoptr) :
+                                myfs_write_source(fsptr, fssize, errnoptr, path, src, size, offset);
+    if (result > 0) {
+        struct myfs_node *changed = node != NULL ? node : find_node(fsptr, path, errnoptr);
+        if (journal_log_written(super, path, changed, offset, result, &lsn, errnoptr) < 0) {
+            result = -1;
+        }
+    }
+    node_unlock(node);
+    myfs_unlock(super);
+    if (result > 0 && journal_commit(super, lsn, errnoptr) < 0) {
+        result = -1;
+    }
+    return result;
+}
+
+/* Entry points
+
+   The functions above do the work of the operations; the ones FUSE
+   calls take the region lock around them, so that they can run from
+   several threads and next to the defragmenter (see
+   __myfs_defrag_start_implem). Lookups, reads and statfs take it
+   shared. Writes, truncations, time changes and creations take it
+   shared as well, along with the lock of the node they change, when
+   lock_node_live or lock_parent_live find that node private; they fall
+   back to the exclusive lock and the functions above otherwise.
+   Operations that change the tree log a record for the journal, if
+   there is one, and return once it is on disk. The _fh variants of
+   read, write and truncate take the handle __myfs_open_fh_implem gave
+   out and only look path up when the handle no longer leads to the
+   file (see Open files); path is still needed, for that and for the
+   journal. Their documentation is with the functions they call.
+*/
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf) {
+    struct myfs_super *super = myfs_lock_shared(fsptr, fssize, errnoptr);
+    if (super == NULL) {
+        return -1;
+    }
+    int result = myfs_getattr(fsptr, fssize, errnoptr, uid, gid, path, stbuf);
+    myfs_unlock(super);
+    return result;
+}
+
+int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, char ***namesptr) {
+    struct myfs_super *super = myfs_lock_shared(fsptr, fssize, errnoptr);
+    if (super == NULL) {
+        return -1;
+    }
+    int result = myfs_readdir(fsptr, fssize, errnoptr, path, namesptr);
+    myfs_unlock(super);
+    return result;
+}
+
+int __myfs_readdir_filler_implem(void *fsptr, size_t fssize, int *errnoptr,
+                                 const char *path, void *buf, myfs_fill_dir_t filler,
+                                 off_t offset) {
+    struct myfs_super *super = myfs_lock_shared(fsptr, fssize, errnoptr);
+    if (super == NULL) {
+        return -1;
+    }
+    int result = myfs_readdir_filler(fsptr, fssize, errnoptr, path, buf, filler, offset);
+    myfs_unlock(super);
+    return result;
+}
+
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+    uint64_t lsn = 0;
+    struct myfs_super *super;
+    struct myfs_name name;
+    struct myfs_node *parent = lock_parent_live(fsptr, fssize, errnoptr, path, &name, &super);
+    if (super == NULL) {
+        return -1;
+    }
+    int result = parent != NULL ? dir_create(fsptr, parent, &name, 1, errnoptr) :
+                                  myfs_mknod(fsptr, fssize, errnoptr, path);
+    if (result == 0) {
+        result = journal_log(super, MYFS_JOURNAL_MKNOD, path, NULL, 0, NULL, 0, &lsn, errnoptr);
+    }
+    node_unlock(parent);
+    myfs_unlock(super);
+    if (result == 0) {
+        result = journal_commit(super, lsn, errnoptr);
+    }
+    return result;
+}
+
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+    uint64_t lsn = 0;
+    struct myfs_super *super = myfs_lock(fsptr, fssize, errnoptr);
+    if (super == NULL) {
+        return -1;
+    }
+    int result = myfs_unlink(fsptr, fssize, errnoptr, path);
+    if (result == 0) {
+        result = journal_log(super, MYFS_JOURNAL_UNLINK, path, NULL, 0, NULL, 0, &lsn, errnoptr);
+    }
+    myfs_unlock(super);
+    if (result == 0) {
+        result = journal_commit(super, lsn, errnoptr);
+    }
+    return result;
+}
+
+int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+    uint64_t lsn = 0;
+    struct myfs_super *super = myfs_lock(fsptr, fssize, errnoptr);
+    if (super == NULL) {
+        return -1;
+    }
+    int result = myfs_rmdir(fsptr, fssize, errnoptr, path);
+    if (result == 0) {
+        result = journal_log(super, MYFS_JOURNAL_RMDIR, path, NULL, 0, NULL, 0, &lsn, errnoptr);
+    }
+    myfs_unlock(super);
+    if (result == 0) {
+        result = journal_commit(super, lsn, errnoptr);
+    }
+    return result;
+}
+
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+    uint64_t lsn = 0;
+    struct myfs_super *super;
+    struct myfs_name name;
+    struct myfs_node *parent = lock_parent_live(fsptr, fssize, errnoptr, path, &name, &super);
+    if (super == NULL) {
+        return -1;
+    }
+    int result = parent != NULL ? dir_create(fsptr, parent, &name, 0, errnoptr) :
+                                  myfs_mkdir(fsptr, fssize, errnoptr, path);
+    if (result == 0) {
+        result = journal_log(super, MYFS_JOURNAL_MKDIR, path, NULL, 0, NULL, 0, &lsn, errnoptr);
+    }
+    node_unlock(parent);
+    myfs_unlock(super);
+    if (result == 0) {
+        result = journal_commit(super, lsn, errnoptr);
+    }
+    return result;
+}
+
+int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *from, const char *to) {
+    uint64_t lsn = 0;
+    struct myfs_super *super = myfs_lock(fsptr, fssize, errnoptr);
+    if (super == NULL) {
         return -1;
     }
+    int result = myfs_rename(fsptr, fssize, errnoptr, from, to);
+    if (result == 0) {
+        result = journal_log(super, MYFS_JOURNAL_RENAME, from, to, 0, NULL, 0, &lsn, errnoptr);
+    }
+    myfs_unlock(super);
+    if (result == 0) {
+        result = journal_commit(super, lsn, errnoptr);
+    }
+    return result;
+}
 
-    myfs_file_t *file = (myfs_file_t *)((char *)fsptr + file_offset);
-
-    if (file->is_directory) {
-        *errnoptr = EISDIR;
+int __myfs_truncate_fh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                              const char *path, uint64_t fh, off_t offset) {
+    uint64_t lsn = 0;
+    struct myfs_super *super;
+    struct myfs_node *node = lock_node_live(fsptr, fssize, errnoptr, path, fh, &super);
+    if (super == NULL) {
         return -1;
     }
+    int result = node != NULL ? node_truncate(fsptr, node, offset, errnoptr) :
+                                myfs_truncate(fsptr, fssize, errnoptr, path, offset);
+    if (result == 0) {
+        result = journal_log(super, MYFS_JOURNAL_TRUNCATE, path, NULL, (uint64_t)offset,
+                             NULL, 0, &lsn, errnoptr);
+    }
+    node_unlock(node);
+    myfs_unlock(super);
+    if (result == 0) {
+        result = journal_commit(super, lsn, errnoptr);
+    }
+    return result;
+}
 
-    size_t current_size = file->size;
+int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, off_t offset) {
+    return __myfs_truncate_fh_implem(fsptr, fssize, errnoptr, path, 0, offset);
+}
 
-    if ((uintptr_t)fsptr + fssize < (uintptr_t)fsptr + file_offset + offset) {
-        *errnoptr = ENOSPC;
+int __myfs_open_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+    struct myfs_super *super = myfs_lock_shared(fsptr, fssize, errnoptr);
+    if (super == NULL) {
         return -1;
     }
+    int result = myfs_open(fsptr, fssize, errnoptr, path);
+    myfs_unlock(super);
+    return result;
+}
 
-    if (offset > current_size) {
-        char *new_data = realloc(file->data, offset);
-        if (!new_data) {
-            *errnoptr = ENOMEM;
-            return -1;
-        }
-
-        memset(new_data + current_size, 0, offset - current_size);
-        file->data = new_data;
-    } else if (offset < current_size) {
-        char *new_data = realloc(file->data, offset);
-        if (!new_data && offset > 0) {
-            *errnoptr = ENOMEM;
+int __myfs_open_fh_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path,
+                          uint64_t *fhptr) {
+    struct myfs_super *super = myfs_lock_shared(fsptr, fssize, errnoptr);
+    if (super == NULL) {
+        return -1;
+    }
+    int result = myfs_open_fh(fsptr, fssize, errnoptr, path, fhptr, 0);
+    myfs_unlock(super);
+    if (result == 1) {
+        // The open file table is full and has to grow
+        super = myfs_lock(fsptr, fssize, errnoptr);
+        if (super == NULL) {
             return -1;
         }
-        file->data = new_data;
+        result = myfs_open_fh(fsptr, fssize, errnoptr, path, fhptr, 1);
+        myfs_unlock(super);
     }
-
-    file->size = offset;
-    file->mtime = time(NULL);
-
-    *errnoptr = 0;
-    return 0;
+    return result;
 }
 
-/* Implements an emulation of the open system call on the filesystem 
-   of size fssize pointed to by fsptr, without actually performing the opening
-   of the file (no file descriptor is returned).
-
-   The call just checks if the file (or directory) indicated by path
-   can be accessed, i.e. if the path can be followed to an existing
-   object for which the access rights are granted.
-
-   On success, 0 is returned.
-
-   On failure, -1 is returned and *errnoptr is set appropriately.
-
-   The two only interesting error codes are 
-
-   * EFAULT: the filesystem is in a bad state, we can't do anything
-
-   * ENOENT: the file that we are supposed to open doesn't exist (or a
-             subpath).
+int __myfs_release_implem(void *fsptr, size_t fssize, int *errnoptr, uint64_t fh) {
+    struct myfs_super *super = myfs_lock_shared(fsptr, fssize, errnoptr);
+    if (super == NULL) {
+        return -1;
+    }
+    int result = myfs_release(fsptr, fssize, errnoptr, fh);
+    myfs_unlock(super);
+    return result;
+}
 
-   It is possible to restrict ourselves to only these two error
-   conditions. It is also possible to implement more detailed error
-   condition answers.
+int __myfs_read_fh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, uint64_t fh, char *buf, size_t size, off_t offset) {
+    struct myfs_super *super = myfs_lock_shared(fsptr, fssize, errnoptr);
+    if (super == NULL) {
+        return -1;
+    }
+    struct myfs_node *node = open_file_node(fsptr, fh);
+    int result = node != NULL ? node_read(fsptr, node, buf, size, offset, errnoptr) :
+                                myfs_read(fsptr, fssize, errnoptr, path, buf, size, offset);
+    myfs_unlock(super);
+    return result;
+}
 
-   The error codes are documented in man 2 open.
+int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path, char *buf, size_t size, off_t offset) {
+    return __myfs_read_fh_implem(fsptr, fssize, errnoptr, path, 0, buf, size, offset);
+}
 
+/* Like __myfs_read_fh_implem, but hands out the contents in place, as
+   myfs_read_iov describes. No lock is held on return; instead, what
+   the iovecs point at stays as it is, whatever happens to the file,
+   until the caller passes *pinptr to __myfs_read_iov_done_implem, for
+   instance once FUSE has spliced the buffers into its reply. Every
+   successful call needs exactly one such call, on the same region.
 */
-int __myfs_open_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
-    if (!fsptr || fssize <= 0) {
-        if (errnoptr) *errnoptr = EFAULT;
+int __myfs_read_iov_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, uint64_t fh, size_t size, off_t offset,
+                           struct iovec **iovptr, int *iovcntptr, void **pinptr) {
+    struct myfs_super *super = myfs_lock_shared(fsptr, fssize, errnoptr);
+    if (super == NULL) {
         return -1;
     }
-
-    size_t file_offset = myfs_traverse_path(fsptr, path);
-    if (file_offset == (size_t)-1) {
-        if (errnoptr) *errnoptr = ENOENT;
+    uint64_t pin = 0;
+    int error = 0;
+    int result = myfs_read_iov(fsptr, fssize, &error, path, fh, size, offset,
+                               iovptr, iovcntptr, &pin, 0);
+    myfs_unlock(super);
+    if (result < 0 && error == EAGAIN) {
+        // The pin table is full and has to grow
+        super = myfs_lock(fsptr, fssize, errnoptr);
+        if (super == NULL) {
+            return -1;
+        }
+        result = myfs_read_iov(fsptr, fssize, &error, path, fh, size, offset,
+                               iovptr, iovcntptr, &pin, 1);
+        myfs_unlock(super);
+    }
+    if (result < 0) {
+        if (errnoptr) *errnoptr = error;
         return -1;
     }
+    *pinptr = (void *)(uintptr_t)pin;
+    return result;
+}
 
-    myfs_file_t *file = (myfs_file_t *)((char *)fsptr + file_offset);
-
-    if (strcmp(path, "/") == 0 && file->is_directory) {
+/* Drops the pin __myfs_read_iov_implem handed out, after which the
+   iovecs it described may no longer be used. Returns 0 on success and
+   -1 with *errnoptr set to EINVAL if pin is not a pin of the region
+   or was dropped before. A NULL pin, as small files get, is fine.
+*/
+int __myfs_read_iov_done_implem(void *fsptr, size_t fssize, int *errnoptr, void *pin) {
+    if (pin == NULL) {
         return 0;
     }
-
-    if (file->is_directory) {
-        if (errnoptr) *errnoptr = EISDIR;
+    struct myfs_super *super = myfs_lock_shared(fsptr, fssize, errnoptr);
+    if (super == NULL) {
+        return -1;
+    }
+    int error = pin_remove(fsptr, (uint64_t)(uintptr_t)pin);
+    myfs_unlock(super);
+    if (error != 0) {
+        if (errnoptr) *errnoptr = error;
         return -1;
     }
-
     return 0;
 }
 
-/* Implements an emulation of the read system call on the filesystem 
-   of size fssize pointed to by fsptr.
+int __myfs_write_fh_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path,
+                           uint64_t fh, const char *buf, size_t size, off_t offset) {
+    uint64_t lsn = 0;
+    struct myfs_super *super;
+    struct myfs_node *node = lock_node_live(fsptr, fssize, errnoptr, path, fh, &super);
+    if (super == NULL) {
+        return -1;
+    }
+    int result = node != NULL ? node_write(fsptr, node, buf, size, offset, errnoptr) :
+                                myfs_write(fsptr, fssize, errnoptr, path, buf, size, offset);
+    if (result > 0 && journal_log(super, MYFS_JOURNAL_WRITE, path, NULL, (uint64_t)offset,
+                                  buf, result, &lsn, errnoptr) < 0) {
+        result = -1;
+    }
+    node_unlock(node);
+    myfs_unlock(super);
+    if (result > 0 && journal_commit(super, lsn, errnoptr) < 0) {
+        result = -1;
+    }
+    return result;
+}
 
-   The call copies up to size bytes from the file indicated by 
-   path into the buffer, starting to read at offset. See the man page
-   for read for the details when offset is beyond the end of the file etc.
-   
-   On success, the appropriate number of bytes read into the buffer is
-   returned. The value zero is returned on an end-of-file condition.
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset) {
+    return __myfs_write_fh_implem(fsptr, fssize, errnoptr, path, 0, buf, size, offset);
+}
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
+/* Like __myfs_write_fh_implem, with the bytes taken from the iovcnt
+   buffers at iov, one after the other, such as those of a FUSE buffer
+   vector. Each byte is copied once, straight into the extents.
+*/
+int __myfs_write_iov_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path,
+                            uint64_t fh, const struct iovec *iov, int iovcnt, off_t offset) {
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
 
-   The error codes are documented in man 2 read.
+    struct myfs_source src = { iov, iovcnt, 0, -1, 0 };
+    return write_source(fsptr, fssize, errnoptr, path, fh, &src, size, offset);
+}
 
+/* Like __myfs_write_fh_implem, with size bytes read from the file
+   descriptor fd, such as the pipe FUSE splices a request into. They
+   are read straight into extents reserved for them beforehand, with
+   the locks held, so fd must have O_NONBLOCK set; otherwise, -1 is
+   returned with *errnoptr set to EINVAL. If fd ends early, has no more
+   bytes ready or fails, what was read is kept; if nothing was, -1 is
+   returned, with *errnoptr set to EIO, EAGAIN or the error of the read.
 */
-int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
-                       const char *path, char *buf, size_t size, off_t offset) {
-    if (!fsptr || fssize <= 0) {
-        if (errnoptr) *errnoptr = EFAULT;
+int __myfs_write_fd_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path,
+                           uint64_t fh, int fd, size_t size, off_t offset) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || !(flags & O_NONBLOCK)) {
+        if (errnoptr) *errnoptr = flags < 0 ? errno : EINVAL;
         return -1;
     }
 
-    size_t file_offset = myfs_traverse_path(fsptr, path);
-    if (file_offset == (size_t)-1) {
-        if (errnoptr) *errnoptr = ENOENT;
+    struct myfs_source src = { NULL, 0, 0, fd, 0 };
+    return write_source(fsptr, fssize, errnoptr, path, fh, &src, size, offset);
+}
+
+int __myfs_fallocate_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path,
+                            uint64_t fh, int mode, off_t offset, off_t len) {
+    uint64_t lsn = 0;
+    size_t grown = 0;
+    struct myfs_super *super;
+    struct myfs_node *node = lock_node_live(fsptr, fssize, errnoptr, path, fh, &super);
+    if (super == NULL) {
         return -1;
     }
+    int result = node != NULL ? node_fallocate(fsptr, node, mode, offset, len, &grown, errnoptr) :
+                                myfs_fallocate(fsptr, fssize, errnoptr, path, mode, offset, len,
+                                               &grown);
+    if (result == 0 && grown != 0) {
+        // Replay need not reserve anything, only grow the file again
+        result = journal_log(super, MYFS_JOURNAL_TRUNCATE, path, NULL, grown,
+                             NULL, 0, &lsn, errnoptr);
+    }
+    node_unlock(node);
+    myfs_unlock(super);
+    if (result == 0) {
+        result = journal_commit(super, lsn, errnoptr);
+    }
+    return result;
+}
 
-    myfs_file_t *file = (myfs_file_t *)((char *)fsptr + file_offset);
-    if (file->is_directory) {
-        if (errnoptr) *errnoptr = EISDIR;
+int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, const struct timespec ts[2]) {
+    uint64_t lsn = 0;
+    struct myfs_super *super;
+    struct myfs_node *node = lock_node_live(fsptr, fssize, errnoptr, path, 0, &super);
+    if (super == NULL) {
         return -1;
     }
+    int result = node != NULL ? node_set_times(fsptr, node, ts, errnoptr) :
+                                myfs_utimens(fsptr, fssize, errnoptr, path, ts);
+    if (result == 0) {
+        // The record holds the times that were set, not UTIME_NOW
+        struct myfs_node *changed = node != NULL ? node : find_node(fsptr, path, errnoptr);
+        result = journal_log(super, MYFS_JOURNAL_UTIMENS, path, NULL, 0,
+                             changed->times, sizeof(changed->times), &lsn, errnoptr);
+    }
+    node_unlock(node);
+    myfs_unlock(super);
+    if (result == 0) {
+        result = journal_commit(super, lsn, errnoptr);
+    }
+    return result;
+}
 
-    if (offset >= file->size) {
-        if (errnoptr) *errnoptr = 0;
-        return 0;
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf) {
+    struct myfs_super *super = myfs_lock_shared(fsptr, fssize, errnoptr);
+    if (super == NULL) {
+        return -1;
     }
+    int result = myfs_statfs(fsptr, fssize, errnoptr, stbuf);
+    myfs_unlock(super);
+    return result;
+}
+
+/* Asks the kernel to back the filesystem of size fssize pointed to by
+   fsptr with transparent huge pages. The layout keeps the metadata in
+   the first huge pages of the region and large extents inside single
+   huge pages (see Data zone), which only helps if the region starts
+   on a huge page boundary, as mappings made with MAP_HUGETLB do;
+   those are backed by huge pages already and need no advice.
+
+   On success, 0 is returned. On failure, -1 is returned and
+   *errnoptr is set to EFAULT if there is no filesystem, EINVAL if
+   the platform has no transparent huge pages and to the error of
+   madvise otherwise.
 
-    size_t readable_size = file->size - offset;
-    if (size > readable_size) {
-        size = readable_size;
+*/
+int __myfs_hugepages_implem(void *fsptr, size_t fssize, int *errnoptr) {
+    struct myfs_super *super = myfs_lock_shared(fsptr, fssize, errnoptr);
+    if (super == NULL) {
+        return -1;
     }
 
-    memcpy(buf, (char *)fsptr + file_offset + sizeof(myfs_file_t) + offset, size);
-    return size;
+    int result = 0;
+#ifdef MADV_HUGEPAGE
+    // Only whole huge pages inside the region can be backed by one
+    uintptr_t start = ((uintptr_t)fsptr + MYFS_HUGE_PAGE - 1) & ~(uintptr_t)(MYFS_HUGE_PAGE - 1);
+    uintptr_t end = ((uintptr_t)fsptr + fssize) & ~(uintptr_t)(MYFS_HUGE_PAGE - 1);
+    if (end > start && madvise((void *)start, end - start, MADV_HUGEPAGE) < 0) {
+        *errnoptr = errno;
+        result = -1;
+    }
+#else
+    *errnoptr = EINVAL;
+    result = -1;
+#endif
+    myfs_unlock(super);
+    return result;
 }
 
-/* Implements an emulation of the write system call on the filesystem 
-   of size fssize pointed to by fsptr.
-
-   The call copies up to size bytes to the file indicated by 
-   path into the buffer, starting to write at offset. See the man page
-   for write for the details when offset is beyond the end of the file etc.
-   
-   On success, the appropriate number of bytes written into the file is
-   returned. The value zero is returned on an end-of-file condition.
+/* Does one tick of online defragmentation on the filesystem of size
+   fssize pointed to by fsptr, looking at no more than budget->nodes
+   nodes and copying no more than about budget->bytes bytes of file
+   data and directory arrays. Successive ticks pick up where the last
+   one stopped and cycle through the whole filesystem. The number of
+   bytes copied is put into *movedptr unless movedptr is NULL.
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
+   This is for callers that want to schedule the work themselves,
+   e.g. while FUSE is idle; __myfs_defrag_start_implem runs ticks in a
+   thread of their own.
 
-   The error codes are documented in man 2 write.
+   On success, 0 is returned. On failure, -1 is returned and
+   *errnoptr is set to EFAULT if there is no filesystem.
 
 */
-int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
-                        const char *path, const char *buf, size_t size, off_t offset) {
-    if (!fsptr) {
+int __myfs_defrag_tick_implem(void *fsptr, size_t fssize, int *errnoptr,
+                              const struct myfs_defrag_budget *budget, size_t *movedptr) {
+    struct myfs_super *super = myfs_lock(fsptr, fssize, errnoptr);
+    if (super == NULL) {
         return -1;
     }
 
-    size_t file_offset = myfs_traverse_path(fsptr, path);
-    if (file_offset == (size_t)-1) {
-        if (errnoptr) *errnoptr = ENOENT;
-        return -1;
+    initialize_myfs(fsptr, fssize);
+    size_t moved = defrag_tick(fsptr, budget);
+    myfs_unlock(super);
+
+    if (movedptr != NULL) {
+        *movedptr = moved;
     }
+    return 0;
+}
 
-    myfs_file_t *file = (myfs_file_t *)((char *)fsptr + file_offset);
+/* Starts a thread that defragments the mounted filesystem of size
+   fssize pointed to by fsptr in the background, doing one tick with
+   the given budget (see __myfs_defrag_tick_implem) every
+   budget->interval_ms milliseconds. Ticks hold the region lock and
+   thus never run in the middle of an operation.
 
-    if (file->is_directory) {
-        if (errnoptr) *errnoptr = EISDIR;
-        return -1;
+   On success, a handle for the thread is returned, which must be
+   passed to __myfs_defrag_stop_implem before the region is unmapped.
+   On failure, NULL is returned and *errnoptr is set to EFAULT if
+   there is no filesystem, ENOMEM if memory allocation fails and to
+   the error of pthread_create otherwise.
+
+*/
+struct myfs_defrag *__myfs_defrag_start_implem(void *fsptr, size_t fssize, int *errnoptr,
+                                               const struct myfs_defrag_budget *budget) {
+    if (fsptr == NULL || fssize < sizeof(struct myfs_super)) {
+        *errnoptr = EFAULT;
+        return NULL;
+    }
+
+    struct myfs_defrag *defrag = malloc(sizeof(struct myfs_defrag));
+    if (defrag == NULL) {
+        *errnoptr = ENOMEM;
+        return NULL;
+    }
+    defrag->fsptr = fsptr;
+    defrag->fssize = fssize;
+    defrag->budget = *budget;
+    defrag->stop = 0;
+    pthread_mutex_init(&defrag->mutex, NULL);
+    pthread_cond_init(&defrag->wakeup, NULL);
+
+    int error = pthread_create(&defrag->thread, NULL, defrag_thread, defrag);
+    if (error != 0) {
+        pthread_cond_destroy(&defrag->wakeup);
+        pthread_mutex_destroy(&defrag->mutex);
+        free(defrag);
+        *errnoptr = error;
+        return NULL;
+    }
+    return defrag;
+}
+
+/* Stops a thread started with __myfs_defrag_start_implem, waiting for
+   a tick in progress to finish, and frees its handle.
+*/
+void __myfs_defrag_stop_implem(struct myfs_defrag *defrag) {
+    if (defrag == NULL) {
+        return;
     }
 
-    // If the new data size exceeds the current file size, resize the data buffer
-    if (offset + size > file->size) {
-        file->size = offset + size;
+    pthread_mutex_lock(&defrag->mutex);
+    defrag->stop = 1;
+    pthread_cond_signal(&defrag->wakeup);
+    pthread_mutex_unlock(&defrag->mutex);
+    pthread_join(defrag->thread, NULL);
+
+    pthread_cond_destroy(&defrag->wakeup);
+    pthread_mutex_destroy(&defrag->mutex);
+    free(defrag);
+}
 
-        // Reallocate the 'data' field to hold the new size of data
-        file->data = (char *)realloc(file->data, file->size);
-        if (file->data == NULL) {
-            if (errnoptr) *errnoptr = ENOMEM;
+/* Reads exactly len bytes from fd into buf. Returns 0 on success, -1
+   if the file ends before or reading fails.
+*/
+static int journal_read(int fd, void *buf, size_t len) {
+    char *bytes = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, bytes, len);
+        if (n <= 0) {
             return -1;
         }
+        bytes += n;
+        len -= n;
     }
-
-    // Write the data to the file at the specified offset
-    memcpy(file->data + offset, buf, size);
-    file->mtime = time(NULL); // Update the modification time
-    return size;
+    return 0;
 }
 
-/* Implements an emulation of the utimensat system call on the filesystem 
-   of size fssize pointed to by fsptr.
+/* Applies the records of the journal open at fd that belong to the
+   current image, in order, and puts the length of the journal up to
+   the last of them into *endptr. Stale records are skipped. Returns 0
+   on success. If a record cannot be applied, replay stops there:
+   *endptr is the length of the journal before that record, and -1 is
+   returned with *errnoptr set to the error of its operation. Must be
+   called under the region lock, before the journal is attached.
+*/
+static int journal_replay(void *fsptr, size_t fssize, int fd, uint64_t *endptr,
+                          int *errnoptr) {
+    struct myfs_super *super = (struct myfs_super *)fsptr;
+    uint64_t pos = 0;
 
-   The call changes the access and modification times of the file
-   or directory indicated by path to the values in ts.
+    *endptr = 0;
 
-   On success, 0 is returned.
+    for (;;) {
+        struct myfs_journal_record record;
+        if (journal_read(fd, &record, sizeof(record)) < 0 ||
+            record.magic != MYFS_JOURNAL_MAGIC ||
+            record.path_len > PATH_MAX || record.path2_len > PATH_MAX ||
+            record.data_len > super->size) {
+            break;
+        }
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
+        size_t payload_len = record.path_len + 1 + record.path2_len + 1 + record.data_len;
+        char *payload = malloc(payload_len);
+        if (payload == NULL) {
+            break;
+        }
+        char *path = payload;
+        char *path2 = path + record.path_len + 1;
+        char *data = path2 + record.path2_len + 1;
+        if (journal_read(fd, path, record.path_len) < 0 ||
+            journal_read(fd, path2, record.path2_len) < 0 ||
+            journal_read(fd, data, record.data_len) < 0) {
+            free(payload);
+            break;
+        }
+        path[record.path_len] = '\0';
+        path2[record.path2_len] = '\0';
+
+        uint32_t checksum = record.checksum;
+        record.checksum = 0;
+        uint32_t hash = journal_checksum(2166136261u, &record, sizeof(record));
+        hash = journal_checksum(hash, path, record.path_len);
+        hash = journal_checksum(hash, path2, record.path2_len);
+        hash = journal_checksum(hash, data, record.data_len);
+        if (hash != checksum) {
+            free(payload);
+            break;
+        }
 
-   The error codes are documented in man 2 utimensat.
+        // Operations that succeeded when they were logged succeed
+        // again; one that does not leaves the region behind what was
+        // acknowledged, so nothing after it may be applied
+        int result = 0;
+        switch (record.gen == super->journal_gen ? record.type : 0) {
+        case MYFS_JOURNAL_MKNOD:
+            result = myfs_mknod(fsptr, fssize, errnoptr, path);
+            break;
+        case MYFS_JOURNAL_MKDIR:
+            result = myfs_mkdir(fsptr, fssize, errnoptr, path);
+            break;
+        case MYFS_JOURNAL_UNLINK:
+            result = myfs_unlink(fsptr, fssize, errnoptr, path);
+            break;
+        case MYFS_JOURNAL_RMDIR:
+            result = myfs_rmdir(fsptr, fssize, errnoptr, path);
+            break;
+        case MYFS_JOURNAL_RENAME:
+            result = myfs_rename(fsptr, fssize, errnoptr, path, path2);
+            break;
+        case MYFS_JOURNAL_TRUNCATE:
+            result = myfs_truncate(fsptr, fssize, errnoptr, path, (off_t)record.arg);
+            break;
+        case MYFS_JOURNAL_WRITE:
+            result = myfs_write(fsptr, fssize, errnoptr, path, data, record.data_len,
+                                (off_t)record.arg);
+            break;
+        case MYFS_JOURNAL_UTIMENS:
+            if (record.data_len != 2 * sizeof(struct timespec)) {
+                *errnoptr = EINVAL;
+                result = -1;
+            } else {
+                struct timespec ts[2];
+                memcpy(ts, data, sizeof(ts));
+                result = myfs_utimens(fsptr, fssize, errnoptr, path, ts);
+            }
+            break;
+        }
+        free(payload);
+        if (result < 0) {
+            return -1;
+        }
+        pos += sizeof(record) + record.path_len + record.path2_len + record.data_len;
+        if (record.gen == super->journal_gen) {
+            *endptr = pos;
+        }
+    }
+    return 0;
+}
+
+/* Opens the journal of the filesystem of size fssize pointed to by
+   fsptr at journal_path, creating it if needed, and replays the
+   records in it that the region does not contain yet. Replay reads
+   the journal once and takes time proportional to its length, not to
+   the size of the region. From then on, every operation that changes
+   the tree is on disk in the journal before it returns, even though
+   the region is only written back at unmount.
+
+   Call this at mount, after the region has been read from the
+   backup-file and before FUSE starts calling in. At unmount, call
+   __myfs_journal_close_implem before the region is written back.
+
+   On success, 0 is returned. On failure, -1 is returned and *errnoptr
+   is set to EFAULT if there is no filesystem, EBUSY if a journal is
+   open already and to the error of open or ftruncate otherwise. If a
+   record cannot be replayed, the region keeps the records before it,
+   the journal is cut off in front of it, and -1 is returned with
+   *errnoptr set to the error of the failed operation, e.g. ENOSPC;
+   the journal is not opened then. Reading the region from the
+   backup-file again and calling this once more replays what is left.
 
 */
-int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr,
-                          const char *path, const struct timespec ts[2]) {
-    if (!fsptr || fssize <= 0 || !path || !errnoptr) {
-        if (errnoptr) *errnoptr = EFAULT;
+int __myfs_journal_open_implem(void *fsptr, size_t fssize, int *errnoptr,
+                               const char *journal_path) {
+    struct myfs_super *super = myfs_lock(fsptr, fssize, errnoptr);
+    if (super == NULL) {
         return -1;
     }
-
-    if (strlen(path) == 0 || strcmp(path, "/") == 0) {
-        *errnoptr = EINVAL;
+    if (super->journal_fd >= 0) {
+        myfs_unlock(super);
+        *errnoptr = EBUSY;
         return -1;
     }
 
-    size_t file_offset = myfs_traverse_path(fsptr, path);
-    if (file_offset == (size_t)-1) {
-        *errnoptr = ENOENT;
+    initialize_myfs(fsptr, fssize);
+
+    int fd = open(journal_path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        *errnoptr = errno;
+        myfs_unlock(super);
         return -1;
     }
 
-    myfs_file_t *file = (myfs_file_t *)((char *)fsptr + file_offset);
-
-    if (file->is_directory) {
-        *errnoptr = EISDIR;
+    // Records behind the replayed ones are torn, stale or could not be
+    // applied; new records go in their place
+    uint64_t end;
+    int replay_error = 0;
+    journal_replay(fsptr, fssize, fd, &end, &replay_error);
+    if (ftruncate(fd, end) < 0 || lseek(fd, end, SEEK_SET) < 0 || replay_error != 0) {
+        *errnoptr = replay_error != 0 ? replay_error : errno;
+        close(fd);
+        myfs_unlock(super);
         return -1;
     }
 
-    time_t now = time(NULL);
-    if (!ts) {
-        file->atime = file->mtime = now;
-    } else {
-        for (int i = 0; i < 2; i++) {
-            if (ts[i].tv_nsec != UTIME_NOW && ts[i].tv_nsec != UTIME_OMIT &&
-                (ts[i].tv_nsec < 0 || ts[i].tv_nsec >= 1000000000)) {
-                *errnoptr = EINVAL;
-                return -1;
-            }
-        }
+    pthread_mutex_lock(&super->journal_mutex);
+    super->journal_fd = fd;
+    super->journal_base = 0;
+    super->journal_end = end;
+    super->journal_synced = end;
+    pthread_mutex_unlock(&super->journal_mutex);
+    myfs_unlock(super);
+    return 0;
+}
 
-        if (ts[0].tv_nsec != UTIME_OMIT) {
-            file->atime = (ts[0].tv_nsec == UTIME_NOW) ? now : ts[0].tv_sec;
-        }
-        if (ts[1].tv_nsec != UTIME_OMIT) {
-            file->mtime = (ts[1].tv_nsec == UTIME_NOW) ? now : ts[1].tv_sec;
-        }
+/* Closes the journal of the filesystem of size fssize pointed to by
+   fsptr, if there is one. This marks all records in it as contained
+   in the region, so it must be called right before the region is
+   written back to the backup-file; the journal file may be removed
+   once that is done. Operations after this call are not journaled.
+
+   On success, 0 is returned. On failure, -1 is returned and *errnoptr
+   is set to EFAULT if there is no filesystem and to EIO if the
+   journal could not be synced; it is closed all the same.
+
+*/
+int __myfs_journal_close_implem(void *fsptr, size_t fssize, int *errnoptr) {
+    struct myfs_super *super = myfs_lock(fsptr, fssize, errnoptr);
+    if (super == NULL) {
+        return -1;
+    }
+    if (super->journal_fd < 0) {
+        myfs_unlock(super);
+        return 0;
     }
 
-    file->ctime = now;
-    return 0;
+    // Operations still waiting for their records find them synced
+    int result = 0;
+    pthread_mutex_lock(&super->journal_mutex);
+    while (super->journal_syncing) {
+        pthread_cond_wait(&super->journal_cond, &super->journal_mutex);
+    }
+    if (fdatasync(super->journal_fd) < 0) {
+        *errnoptr = EIO;
+        result = -1;
+    }
+    close(super->journal_fd);
+    super->journal_fd = -1;
+    super->journal_synced = super->journal_end;
+    pthread_cond_broadcast(&super->journal_cond);
+    pthread_mutex_unlock(&super->journal_mutex);
+
+    super->journal_gen++;
+    myfs_unlock(super);
+    return result;
 }
 
-/* Implements an emulation of the statfs system call on the filesystem 
-   of size fssize pointed to by fsptr.
+/* Brings the backup-file open at fd up to date with the mounted
+   filesystem of size fssize pointed to by fsptr, writing only the
+   pages that changed since the last flush or since the mount, and
+   syncs it. The region appears at offset 0 of the backup-file. If a
+   journal is open, it starts over, as its records are part of the
+   backup-file now.
 
-   The call gets information of the filesystem usage and puts in 
-   into stbuf.
+   The time a flush takes grows with the amount of changes, not with
+   the size of the region, so flushing now and then bounds what a crash
+   can lose even without a journal. __myfs_flush_start_implem flushes
+   periodically in a thread of its own.
 
-   On success, 0 is returned.
+   On success, 0 is returned. On failure, -1 is returned and *errnoptr
+   is set to EFAULT if there is no filesystem and to the error of
+   pwrite or fdatasync otherwise; the pages that were not written are
+   written by the next flush.
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
+*/
+int __myfs_flush_implem(void *fsptr, size_t fssize, int *errnoptr, int fd) {
+    struct myfs_super *super = myfs_lock(fsptr, fssize, errnoptr);
+    if (super == NULL) {
+        return -1;
+    }
 
-   The error codes are documented in man 2 statfs.
+    initialize_myfs(fsptr, fssize);
+    int result = region_flush(fsptr, fd, errnoptr);
+    myfs_unlock(super);
+    return result;
+}
 
-   Essentially, only the following fields of struct statvfs need to be
-   supported:
+/* Starts a thread that flushes the mounted filesystem of size fssize
+   pointed to by fsptr to the backup-file open at fd every interval_ms
+   milliseconds (see __myfs_flush_implem). Flushes hold the region lock
+   and thus never run in the middle of an operation.
 
-   f_bsize   fill with what you call a block (typically 1024 bytes)
-   f_blocks  fill with the total number of blocks in the filesystem
-   f_bfree   fill with the free number of blocks in the filesystem
-   f_bavail  fill with same value as f_bfree
-   f_namemax fill with your maximum file/directory name, if your
-             filesystem has such a maximum
+   On success, a handle for the thread is returned, which must be
+   passed to __myfs_flush_stop_implem before fd is closed and the
+   region is unmapped. On failure, NULL is returned and *errnoptr is
+   set to EFAULT if there is no filesystem, ENOMEM if memory allocation
+   fails and to the error of pthread_create otherwise.
 
 */
-int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf) {
-    if (fsptr == NULL || stbuf == NULL) {
-        if (errnoptr != NULL) {
-            *errnoptr = EFAULT;
-        }
-        return -1;
+struct myfs_flusher *__myfs_flush_start_implem(void *fsptr, size_t fssize, int *errnoptr,
+                                               int fd, unsigned int interval_ms) {
+    if (fsptr == NULL || fssize < sizeof(struct myfs_super)) {
+        *errnoptr = EFAULT;
+        return NULL;
+    }
+
+    struct myfs_flusher *flusher = malloc(sizeof(struct myfs_flusher));
+    if (flusher == NULL) {
+        *errnoptr = ENOMEM;
+        return NULL;
     }
+    flusher->fsptr = fsptr;
+    flusher->fssize = fssize;
+    flusher->fd = fd;
+    flusher->interval_ms = interval_ms;
+    flusher->stop = 0;
+    pthread_mutex_init(&flusher->mutex, NULL);
+    pthread_cond_init(&flusher->wakeup, NULL);
+
+    int error = pthread_create(&flusher->thread, NULL, flush_thread, flusher);
+    if (error != 0) {
+        pthread_cond_destroy(&flusher->wakeup);
+        pthread_mutex_destroy(&flusher->mutex);
+        free(flusher);
+        *errnoptr = error;
+        return NULL;
+    }
+    return flusher;
+}
 
-    myfs_superblock_t *fs = (myfs_superblock_t *)fsptr;
+/* Stops a thread started with __myfs_flush_start_implem, waiting for a
+   flush in progress to finish, and frees its handle. Changes made
+   since the last flush are not written; a final __myfs_flush_implem
+   takes care of them.
+*/
+void __myfs_flush_stop_implem(struct myfs_flusher *flusher) {
+    if (flusher == NULL) {
+        return;
+    }
 
-    stbuf->f_bsize = fs->block_size;
-    stbuf->f_blocks = fs->total_blocks;
-    stbuf->f_bfree = fs->free_blocks;
-    stbuf->f_bavail = fs->free_blocks;
-    stbuf->f_namemax = fs->namemax;
+    pthread_mutex_lock(&flusher->mutex);
+    flusher->stop = 1;
+    pthread_cond_signal(&flusher->wakeup);
+    pthread_mutex_unlock(&flusher->mutex);
+    pthread_join(flusher->thread, NULL);
 
-    return 0;
+    pthread_cond_destroy(&flusher->wakeup);
+    pthread_mutex_destroy(&flusher->mutex);
+    free(flusher);
 }
@@ -0,0 +1,132 @@
+/*
+
+  myfs-compact: rewrites a MyFS backup-file into a dense layout
+
+  Reads the backup-file of a MyFS filesystem that is not mounted,
+  copies the tree into a fresh region with all nodes, directory arrays
+  and file contents packed together, and writes the result to a new
+  backup-file, which can be mounted in place of the old one.
+
+  gcc -Wall -pthread myfs_compact.c implementation.c -o myfs-compact
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+int __myfs_compact_implem(const void *image, size_t image_len, void **newptr,
+                          size_t *new_len, int *errnoptr);
+
+/* Reads the whole file at path into a malloc'ed buffer */
+static void *read_image(const char *path, size_t *lenptr) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t len = (size_t)st.st_size;
+    char *image = malloc(len > 0 ? len : 1);
+    if (image == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, image + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(image);
+            close(fd);
+            return NULL;
+        }
+        done += n;
+    }
+
+    close(fd);
+    *lenptr = len;
+    return image;
+}
+
+/* Writes len bytes from image to a new file at path */
+static int write_image(const char *path, const void *image, size_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const char *)image + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+
+    if (fsync(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Arguments needed: <backup-file> <compacted-backup-file>\n");
+        return -1;
+    }
+
+    const char *in_path = argv[1];
+    const char *out_path = argv[2];
+
+    size_t in_len;
+    void *image = read_image(in_path, &in_len);
+    if (image == NULL) {
+        fprintf(stderr, "Could not read %s: %s\n", in_path, strerror(errno));
+        return -1;
+    }
+
+    void *compacted;
+    size_t out_len;
+    int error;
+    if (__myfs_compact_implem(image, in_len, &compacted, &out_len, &error) < 0) {
+        fprintf(stderr, "Could not compact %s: %s\n", in_path,
+                error == EINVAL ? "not a MyFS backup-file" : strerror(error));
+        free(image);
+        return -1;
+    }
+    free(image);
+
+    if (write_image(out_path, compacted, out_len) < 0) {
+        fprintf(stderr, "Could not write %s: %s\n", out_path, strerror(errno));
+        free(compacted);
+        return -1;
+    }
+    free(compacted);
+
+    // Report what the new layout saved
+    size_t reclaimed = in_len > out_len ? in_len - out_len : 0;
+    printf("%s: %zu bytes\n", in_path, in_len);
+    printf("%s: %zu bytes\n", out_path, out_len);
+    printf("Reclaimed %zu bytes (%.1f%%)\n", reclaimed,
+           in_len > 0 ? 100.0 * reclaimed / in_len : 0.0);
+    return 0;
+}
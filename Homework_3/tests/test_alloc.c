@@ -0,0 +1,119 @@
+/*
+
+  Checks that the allocator of the region gives back every block it
+  frees and merges neighbouring free blocks, so that space freed in
+  small pieces can serve large allocations later on
+
+  gcc -Wall -pthread test_alloc.c ../implementation.c -o test_alloc
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/statvfs.h>
+
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf);
+
+// Too small for a data zone, so that everything comes from the heap
+#define FS_SIZE ((size_t)512 << 10)
+#define FILE_SIZE 1000
+#define DIR_FILES 1500
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+static size_t free_blocks(void *fsptr) {
+    struct statvfs st;
+    int err;
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &st);
+    return st.f_bfree;
+}
+
+/* Creates files of len bytes in the new directory dir until the region
+   is full. Returns the number of files created.
+*/
+static int fill(void *fsptr, const char *dir, size_t len) {
+    static char data[FILE_SIZE];
+    char path[64];
+    int err;
+
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, dir);
+    for (int n = 0;; n++) {
+        sprintf(path, "%s/file%d", dir, n);
+        if (__myfs_mknod_implem(fsptr, FS_SIZE, &err, path) < 0) {
+            return n;
+        }
+        if (len > 0 && __myfs_write_implem(fsptr, FS_SIZE, &err, path, data, len, 0) != (int)len) {
+            __myfs_unlink_implem(fsptr, FS_SIZE, &err, path);
+            return n;
+        }
+    }
+}
+
+/* Removes the n files fill created in dir, and dir */
+static void empty(void *fsptr, const char *dir, int n) {
+    char path[64];
+    int err;
+
+    for (int i = 0; i < n; i++) {
+        sprintf(path, "%s/file%d", dir, i);
+        __myfs_unlink_implem(fsptr, FS_SIZE, &err, path);
+    }
+    __myfs_rmdir_implem(fsptr, FS_SIZE, &err, dir);
+}
+
+void test_free_and_reuse(void *fsptr) {
+    size_t before = free_blocks(fsptr);
+
+    int first = fill(fsptr, "/a", FILE_SIZE);
+    check(first > 0 && free_blocks(fsptr) < before / 10, "files fill the region");
+    empty(fsptr, "/a", first);
+    check(free_blocks(fsptr) == before, "removing them frees all their space");
+
+    int second = fill(fsptr, "/a", FILE_SIZE);
+    check(second == first, "freed space is reused in full");
+    empty(fsptr, "/a", second);
+    check(free_blocks(fsptr) == before, "and freed again");
+}
+
+void test_free_blocks_merge(void *fsptr) {
+    char path[64];
+    int err;
+
+    // Every block freed by test_free_and_reuse is small; the children
+    // array of a large directory needs one block holding all entries
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/b");
+    int created = 0;
+    for (int i = 0; i < DIR_FILES; i++) {
+        sprintf(path, "/b/file%d", i);
+        created += __myfs_mknod_implem(fsptr, FS_SIZE, &err, path) == 0;
+    }
+    check(created == DIR_FILES, "space freed in small blocks serves a large directory");
+    empty(fsptr, "/b", DIR_FILES);
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+
+    test_free_and_reuse(fsptr);
+    test_free_blocks_merge(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
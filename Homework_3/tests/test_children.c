@@ -0,0 +1,121 @@
+/*
+
+  Checks that the children array of a directory grows geometrically,
+  so that creating many files in one directory takes space linear in
+  their number, and that holes left by removals are squeezed out
+  before the array grows again
+
+  gcc -Wall -pthread test_children.c ../implementation.c -o test_children
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/statvfs.h>
+
+int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, char ***namesptr);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf);
+
+#define FS_SIZE ((size_t)32 << 20)
+#define FILES 50000
+#define ROUNDS 10
+// Node, array entry and index slots, with room to spare
+#define MAX_BYTES_PER_FILE 512
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+static size_t used_bytes(void *fsptr) {
+    struct statvfs st;
+    int err;
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &st);
+    return (st.f_blocks - st.f_bfree) * st.f_bsize;
+}
+
+static int create(void *fsptr, int from, int to) {
+    char path[32];
+    int err, created = 0;
+    for (int i = from; i < to; i++) {
+        sprintf(path, "/big/file%d", i);
+        created += __myfs_mknod_implem(fsptr, FS_SIZE, &err, path) == 0;
+    }
+    return created;
+}
+
+static int remove_files(void *fsptr, int from, int to) {
+    char path[32];
+    int err, removed = 0;
+    for (int i = from; i < to; i++) {
+        sprintf(path, "/big/file%d", i);
+        removed += __myfs_unlink_implem(fsptr, FS_SIZE, &err, path) == 0;
+    }
+    return removed;
+}
+
+static int count_children(void *fsptr) {
+    char **names = NULL;
+    int err;
+    int n = __myfs_readdir_implem(fsptr, FS_SIZE, &err, "/big", &names);
+    for (int i = 0; i < n; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return n;
+}
+
+void test_many_children_take_linear_space(void *fsptr) {
+    int err;
+
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/big");
+    size_t before = used_bytes(fsptr);
+    check(create(fsptr, 0, FILES) == FILES, "many files fit into one directory");
+    size_t used = used_bytes(fsptr) - before;
+    check(used <= (size_t)FILES * MAX_BYTES_PER_FILE, "they take space linear in their number");
+    check(count_children(fsptr) == FILES, "readdir lists them all");
+}
+
+void test_holes_are_squeezed_out(void *fsptr) {
+    static int live[FILES];
+    size_t before = used_bytes(fsptr);
+    int next = FILES, wrong = 0;
+
+    for (int i = 0; i < FILES; i++) {
+        live[i] = i;
+    }
+    // Remove every other child, then put as many back at the end of the
+    // array, again and again: the array must be compacted, not grown
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = round % 2; i < FILES; i += 2) {
+            wrong += remove_files(fsptr, live[i], live[i] + 1) != 1;
+            live[i] = next++;
+            wrong += create(fsptr, live[i], live[i] + 1) != 1;
+        }
+    }
+    check(wrong == 0, "removals and creations succeed round after round");
+    check(count_children(fsptr) == FILES, "readdir lists every child left");
+    check(used_bytes(fsptr) <= before + before / 8, "the directory does not grow with churn");
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+
+    test_many_children_take_linear_space(fsptr);
+    test_holes_are_squeezed_out(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
@@ -0,0 +1,175 @@
+/*
+
+  Checks that myfs-compact output is short and holds the same tree
+
+  gcc -Wall -pthread test_compact.c ../implementation.c -o test_compact
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path, char *buf, size_t size, off_t offset);
+int __myfs_compact_implem(const void *image, size_t image_len, void **newptr,
+                          size_t *new_len, int *errnoptr);
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+/* Fills buf with size bytes derived from seed */
+static void fill(char *buf, size_t size, int seed) {
+    for (size_t i = 0; i < size; i++) {
+        buf[i] = (char)(seed * 31 + i * 7);
+    }
+}
+
+/* Compacts the region at fsptr, mounts the result in a fresh region
+   and checks the files /d/f0 .. /d/f(count - 1) of size bytes each.
+   Returns the length of the compacted image, or 0 on failure.
+*/
+static size_t compact_and_check(void *fsptr, size_t fssize, int count, size_t size) {
+    void *image;
+    size_t image_len;
+    int err;
+
+    if (__myfs_compact_implem(fsptr, fssize, &image, &image_len, &err) < 0) {
+        printf("Compaction failed with error %d\n", err);
+        return 0;
+    }
+
+    void *copy = calloc(1, fssize);
+    char *expected = malloc(size + 1);
+    char *buf = malloc(size + 1);
+    memcpy(copy, image, image_len);
+    int same = 1;
+    for (int i = 0; i < count && same; i++) {
+        char path[32];
+        sprintf(path, "/d/f%d", i);
+        fill(expected, size, i);
+        int n = __myfs_read_implem(copy, fssize, &err, path, buf, size + 1, 0);
+        same = n == (int)size && memcmp(buf, expected, size) == 0;
+    }
+    check(same, "compacted image holds the same files");
+
+    free(buf);
+    free(expected);
+    free(copy);
+    free(image);
+    return image_len;
+}
+
+/* Creates count files of size bytes under /d, plus some churn */
+static void populate(void *fsptr, size_t fssize, int count, size_t size) {
+    char *buf = malloc(size);
+    char path[32];
+    int err;
+
+    __myfs_mkdir_implem(fsptr, fssize, &err, "/d");
+    for (int i = 0; i < count; i++) {
+        sprintf(path, "/d/f%d", i);
+        fill(buf, size, i);
+        __myfs_mknod_implem(fsptr, fssize, &err, path);
+        __myfs_write_implem(fsptr, fssize, &err, path, buf, size, 0);
+        sprintf(path, "/d/tmp%d", i);
+        __myfs_mknod_implem(fsptr, fssize, &err, path);
+        __myfs_write_implem(fsptr, fssize, &err, path, buf, size, 0);
+    }
+    for (int i = 0; i < count; i++) {
+        sprintf(path, "/d/tmp%d", i);
+        __myfs_unlink_implem(fsptr, fssize, &err, path);
+    }
+    free(buf);
+}
+
+void test_tiny_files_in_large_region() {
+    size_t fssize = (size_t)512 << 20;
+    void *fsptr = calloc(1, fssize);
+
+    populate(fsptr, fssize, 10, 100);
+    size_t len = compact_and_check(fsptr, fssize, 10, 100);
+    printf("512 MiB region, 10 tiny files: %zu bytes\n", len);
+    check(len > 0 && len <= ((size_t)4 << 20), "image of tiny files is at most 4 MiB");
+    free(fsptr);
+}
+
+void test_megabytes_in_small_region() {
+    size_t fssize = (size_t)64 << 20;
+    void *fsptr = calloc(1, fssize);
+
+    populate(fsptr, fssize, 100, 15000);
+    size_t len = compact_and_check(fsptr, fssize, 100, 15000);
+    printf("64 MiB region, 1.5 MB of files: %zu bytes\n", len);
+    check(len > 0 && len <= ((size_t)4 << 20), "image of 1.5 MB of files is at most 4 MiB");
+    free(fsptr);
+}
+
+void test_corrupt_images() {
+    size_t fssize = (size_t)8 << 20;
+    void *fsptr = calloc(1, fssize);
+    void *corrupt = malloc(fssize);
+    unsigned int seed = 1;
+    int rejected = 0, crashed = 0;
+
+    populate(fsptr, fssize, 40, 1000);
+    for (int round = 0; round < 200; round++) {
+        // Overwrite words behind the superblock with random values,
+        // some of them small enough to look like offsets
+        memcpy(corrupt, fsptr, fssize);
+        for (int i = 0; i < 32; i++) {
+            size_t pos = 4096 + (size_t)rand_r(&seed) % (((size_t)1 << 20) - 4096);
+            size_t value = rand_r(&seed) % 2 ? (size_t)rand_r(&seed) * 4096 :
+                                               (size_t)rand_r(&seed) % fssize;
+            memcpy((char *)corrupt + (pos & ~(size_t)7), &value, sizeof(value));
+        }
+
+        void *image;
+        size_t image_len;
+        int err = 0;
+        if (__myfs_compact_implem(corrupt, fssize, &image, &image_len, &err) == 0) {
+            free(image);
+        } else if (err == EINVAL) {
+            rejected++;
+        } else if (err != ENOSPC && err != ENOMEM) {
+            crashed++;
+        }
+    }
+    printf("200 corrupt images, %d rejected\n", rejected);
+    check(crashed == 0, "corrupt images compact or fail with EINVAL, ENOSPC or ENOMEM");
+
+    // A truncated image reads as zero-bytes behind its end
+    void *image;
+    size_t image_len;
+    int err;
+    int res = __myfs_compact_implem(fsptr, 8192, &image, &image_len, &err);
+    if (res == 0) {
+        free(image);
+    }
+    check(res == 0 || err == EINVAL, "truncated image compacts or fails with EINVAL");
+
+    free(corrupt);
+    free(fsptr);
+}
+
+int main() {
+    test_tiny_files_in_large_region();
+    test_megabytes_in_small_region();
+    test_corrupt_images();
+    return failures != 0;
+}
@@ -0,0 +1,188 @@
+/*
+
+  Checks that file contents go into runs of whole blocks of the data
+  zone, one contiguous run per extent, for runs of any length up to and
+  across the words of the free-block bitmap, and that freed runs are
+  given back block for block. Passes with any block size the
+  implementation is built for:
+
+  gcc -Wall -pthread test_data_zone.c ../implementation.c -o test_data_zone
+  gcc -Wall -pthread -DMYFS_DATA_BLOCK_SIZE=1024 test_data_zone.c ../implementation.c -o test_data_zone
+  gcc -Wall -pthread -DMYFS_DATA_BLOCK_SIZE=65536 test_data_zone.c ../implementation.c -o test_data_zone
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/statvfs.h>
+
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, off_t offset);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_read_iov_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, uint64_t fh, size_t size, off_t offset,
+                           struct iovec **iovptr, int *iovcntptr, void **pinptr);
+int __myfs_read_iov_done_implem(void *fsptr, size_t fssize, int *errnoptr, void *pin);
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf);
+
+#ifndef MYFS_DATA_BLOCK_SIZE
+#define MYFS_DATA_BLOCK_SIZE 4096
+#endif
+
+#define FS_SIZE ((size_t)32 << 20)
+#define SLACK 64                  // Room for the header of an extent
+#define EXTENT_MAX ((size_t)1 << 20)  // Largest extent, header included
+#define FILES 200
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+static size_t free_blocks(void *fsptr) {
+    struct statvfs st;
+    int err;
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &st);
+    return st.f_bfree;
+}
+
+/* Returns the number of pieces the len bytes of the file at path are
+   kept in, or -1 if they do not hold expected
+*/
+static int pieces(void *fsptr, const char *path, const char *expected, size_t len) {
+    struct iovec *iov;
+    int cnt, err;
+    void *pin;
+
+    if (__myfs_read_iov_implem(fsptr, FS_SIZE, &err, path, 0, len, 0, &iov, &cnt, &pin) !=
+        (int)len) {
+        return -1;
+    }
+    size_t pos = 0;
+    for (int i = 0; i < cnt && pos <= len; i++) {
+        if (pos + iov[i].iov_len > len ||
+            memcmp(iov[i].iov_base, expected + pos, iov[i].iov_len) != 0) {
+            pos = len + 1;
+        }
+        pos += iov[i].iov_len;
+    }
+    __myfs_read_iov_done_implem(fsptr, FS_SIZE, &err, pin);
+    free(iov);
+    return pos == len ? cnt : -1;
+}
+
+void test_block_size(void *fsptr) {
+    struct statvfs st;
+    int err;
+
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &st);
+    check(st.f_bsize == MYFS_DATA_BLOCK_SIZE, "statfs reports the block size of the data zone");
+    check(st.f_blocks == FS_SIZE / MYFS_DATA_BLOCK_SIZE, "and the blocks of the region");
+}
+
+void test_runs(void *fsptr) {
+    // Runs within one bitmap word, filling one and reaching into the
+    // next, as far as they fit into one extent
+    static const size_t runs[] = { 1, 2, 7, 16, 63, 64, 65, 129, 256 };
+    int err, wrong_blocks = 0, wrong_pieces = 0;
+
+    for (size_t r = 0; r < sizeof(runs) / sizeof(runs[0]); r++) {
+        if (runs[r] * MYFS_DATA_BLOCK_SIZE > EXTENT_MAX) {
+            continue;
+        }
+        size_t len = runs[r] * MYFS_DATA_BLOCK_SIZE - SLACK;
+        char *data = malloc(len);
+        for (size_t i = 0; i < len; i++) {
+            data[i] = (char)(i * 13 + r);
+        }
+
+        size_t before = free_blocks(fsptr);
+        __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/run");
+        __myfs_write_implem(fsptr, FS_SIZE, &err, "/run", data, len, 0);
+        wrong_blocks += before - free_blocks(fsptr) != runs[r];
+        wrong_pieces += pieces(fsptr, "/run", data, len) != 1;
+        __myfs_unlink_implem(fsptr, FS_SIZE, &err, "/run");
+        wrong_blocks += free_blocks(fsptr) != before;
+        free(data);
+    }
+    check(wrong_blocks == 0, "a file takes just the blocks it needs, and gives them back");
+    check(wrong_pieces == 0, "it is kept in one contiguous run");
+
+    // Larger files take extents of whole blocks
+    size_t len = 4 * EXTENT_MAX;
+    char *data = calloc(1, len);
+    size_t before = free_blocks(fsptr);
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/large");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/large", data, len - 4 * SLACK, 0);
+    check(before - free_blocks(fsptr) == len / MYFS_DATA_BLOCK_SIZE &&
+          pieces(fsptr, "/large", data, len - 4 * SLACK) == 4,
+          "a large file takes no more blocks than its largest extents fill");
+    __myfs_unlink_implem(fsptr, FS_SIZE, &err, "/large");
+    free(data);
+}
+
+void test_runs_between_holes(void *fsptr) {
+    size_t blocks = EXTENT_MAX / MYFS_DATA_BLOCK_SIZE;
+    if (blocks > 50) {
+        blocks = 50;
+    }
+    size_t len = blocks * MYFS_DATA_BLOCK_SIZE - SLACK;
+    char *data = malloc(len), path[32];
+    int err, failed = 0;
+
+    memset(data, 'h', len);
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/hole%d", i);
+        __myfs_mknod_implem(fsptr, FS_SIZE, &err, path);
+    }
+    size_t before = free_blocks(fsptr);
+
+    // One block files, every other one removed, leave single free blocks
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/hole%d", i);
+        failed += __myfs_write_implem(fsptr, FS_SIZE, &err, path, data,
+                                      MYFS_DATA_BLOCK_SIZE - SLACK, 0) !=
+                  MYFS_DATA_BLOCK_SIZE - SLACK;
+    }
+    for (int i = 0; i < FILES; i += 2) {
+        sprintf(path, "/hole%d", i);
+        __myfs_truncate_implem(fsptr, FS_SIZE, &err, path, 0);
+    }
+    check(failed == 0 && free_blocks(fsptr) == before - FILES / 2, "single blocks are freed");
+
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/big");
+    check(__myfs_write_implem(fsptr, FS_SIZE, &err, "/big", data, len, 0) == (int)len &&
+          pieces(fsptr, "/big", data, len) == 1, "a large file still gets one run");
+
+    __myfs_unlink_implem(fsptr, FS_SIZE, &err, "/big");
+    for (int i = 1; i < FILES; i += 2) {
+        sprintf(path, "/hole%d", i);
+        __myfs_truncate_implem(fsptr, FS_SIZE, &err, path, 0);
+    }
+    check(free_blocks(fsptr) == before, "all blocks come back");
+    free(data);
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+
+    test_block_size(fsptr);
+    test_runs(fsptr);
+    test_runs_between_holes(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
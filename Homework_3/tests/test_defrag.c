@@ -0,0 +1,191 @@
+/*
+
+  Checks that defragmentation ticks merge the extents of a file written
+  in many small pieces and compact children arrays full of holes, a
+  little at a time and without changing what any file or directory
+  holds
+
+  gcc -Wall -pthread test_defrag.c ../implementation.c -o test_defrag
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+struct myfs_defrag_budget {
+    size_t nodes;
+    size_t bytes;
+    unsigned int interval_ms;
+};
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf);
+int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, char ***namesptr);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_read_iov_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, uint64_t fh, size_t size, off_t offset,
+                           struct iovec **iovptr, int *iovcntptr, void **pinptr);
+int __myfs_read_iov_done_implem(void *fsptr, size_t fssize, int *errnoptr, void *pin);
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf);
+int __myfs_defrag_tick_implem(void *fsptr, size_t fssize, int *errnoptr,
+                              const struct myfs_defrag_budget *budget, size_t *movedptr);
+
+#define FS_SIZE ((size_t)16 << 20)
+#define FILE_SIZE 300000
+#define PIECE 1000
+#define DIR_FILES 2000
+#define KEPT(i) ((i) % 10 < 3)  // Too many for removals to shrink the array
+#define MAX_TICKS 100000
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+static size_t free_blocks(void *fsptr) {
+    struct statvfs st;
+    int err;
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &st);
+    return st.f_bfree;
+}
+
+/* Returns the number of pieces the len bytes of the file at path are
+   kept in, or -1 if they do not hold expected
+*/
+static int pieces(void *fsptr, const char *path, const char *expected, size_t len) {
+    struct iovec *iov;
+    int cnt, err;
+    void *pin;
+
+    if (__myfs_read_iov_implem(fsptr, FS_SIZE, &err, path, 0, len, 0, &iov, &cnt, &pin) !=
+        (int)len) {
+        return -1;
+    }
+    size_t pos = 0;
+    for (int i = 0; i < cnt && pos <= len; i++) {
+        if (pos + iov[i].iov_len > len ||
+            memcmp(iov[i].iov_base, expected + pos, iov[i].iov_len) != 0) {
+            pos = len + 1;
+        }
+        pos += iov[i].iov_len;
+    }
+    __myfs_read_iov_done_implem(fsptr, FS_SIZE, &err, pin);
+    free(iov);
+    return pos == len ? cnt : -1;
+}
+
+/* Runs ticks with the given budget until a thousand in a row have
+   nothing left to move. Returns the number of ticks that moved anything, or -1 if
+   a tick fails or moves more than it may.
+*/
+static int defrag(void *fsptr, size_t nodes, size_t bytes, size_t largest) {
+    struct myfs_defrag_budget budget = { nodes, bytes, 0 };
+    size_t moved;
+    int err, ticks = 0, idle = 0;
+
+    // A full round over all nodes takes many ticks with a small budget
+    while (ticks < MAX_TICKS && idle < 1000) {
+        if (__myfs_defrag_tick_implem(fsptr, FS_SIZE, &err, &budget, &moved) != 0 ||
+            (moved > bytes && moved > largest)) {
+            return -1;
+        }
+        ticks += moved > 0;
+        idle = moved > 0 ? 0 : idle + 1;
+    }
+    return ticks;
+}
+
+void test_extents_are_merged(void *fsptr) {
+    char *data = malloc(FILE_SIZE);
+    int err, failed = 0;
+
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        data[i] = (char)(i * 31);
+    }
+    // Written back to front, every piece ends up in an extent of its own
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/frag");
+    for (size_t pos = FILE_SIZE; pos > 0;) {
+        size_t len = pos < PIECE ? pos : PIECE;
+        pos -= len;
+        failed += __myfs_write_implem(fsptr, FS_SIZE, &err, "/frag", data + pos, len, pos) !=
+                  (int)len;
+    }
+    // Reading with read_iov pins the file for a while; once the pin is
+    // dropped, the defragmenter must get to the file all the same
+    int before = pieces(fsptr, "/frag", data, FILE_SIZE);
+    check(failed == 0 && before >= FILE_SIZE / PIECE / 2, "a file written backwards is in pieces");
+    size_t free_before = free_blocks(fsptr);
+
+    int ticks = defrag(fsptr, 1, 16384, FILE_SIZE);
+    check(ticks > 0, "ticks with a small budget make progress");
+    // The last extent still has room to fill and is left alone
+    check(pieces(fsptr, "/frag", data, FILE_SIZE) <= 2, "its extents get merged");
+    check(free_blocks(fsptr) >= free_before, "merging takes no space");
+    check(defrag(fsptr, 1000, 1 << 20, 0) == 0, "then there is nothing left to do");
+    free(data);
+}
+
+void test_children_arrays_are_compacted(void *fsptr) {
+    char path[32];
+    int err;
+
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/dir");
+    for (int i = 0; i < DIR_FILES; i++) {
+        sprintf(path, "/dir/file%d", i);
+        __myfs_mknod_implem(fsptr, FS_SIZE, &err, path);
+    }
+    for (int i = 0; i < DIR_FILES; i++) {
+        if (!KEPT(i)) {
+            sprintf(path, "/dir/file%d", i);
+            __myfs_unlink_implem(fsptr, FS_SIZE, &err, path);
+        }
+    }
+    size_t free_before = free_blocks(fsptr);
+
+    check(defrag(fsptr, 10, 4096, DIR_FILES * sizeof(size_t)) > 0,
+          "a directory of holes is defragmented");
+    check(free_blocks(fsptr) > free_before, "its smaller array frees space");
+
+    int kept = 0, right = 0;
+    for (int i = 0; i < DIR_FILES; i++) {
+        struct stat st;
+        sprintf(path, "/dir/file%d", i);
+        kept += KEPT(i);
+        right += (__myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, path, &st) == 0) == KEPT(i);
+    }
+    char **names = NULL;
+    int n = __myfs_readdir_implem(fsptr, FS_SIZE, &err, "/dir", &names);
+    for (int i = 0; i < n; i++) {
+        free(names[i]);
+    }
+    free(names);
+    check(right == DIR_FILES && n == kept, "every child left is still found and listed");
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+
+    test_extents_are_merged(fsptr);
+    test_children_arrays_are_compacted(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
@@ -0,0 +1,152 @@
+/*
+
+  Checks that lookups in a large directory find every child and only
+  those, while its hash index grows and moves its entries over to a
+  larger table a few at a time, and when there is no space for an index
+
+  gcc -Wall -pthread test_dir_index.c ../implementation.c -o test_dir_index
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf);
+int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, char ***namesptr);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *from, const char *to);
+
+#define FS_SIZE ((size_t)16 << 20)
+#define SMALL_FS_SIZE ((size_t)256 << 10)
+#define FILES 3000
+#define MAX_FILES 10000
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+/* Returns 1 if looking up file i of /d finds it exactly if it exists */
+static int lookup_right(void *fsptr, size_t fssize, int i, int exists) {
+    char path[32];
+    struct stat st;
+    int err = 0;
+
+    sprintf(path, "/d/file%d", i);
+    int res = __myfs_getattr_implem(fsptr, fssize, &err, 0, 0, path, &st);
+    return exists ? res == 0 : res == -1 && err == ENOENT;
+}
+
+/* Returns the number of files i of /d below n that lookups get wrong */
+static int lookups_wrong(void *fsptr, size_t fssize, const char *exists, int n) {
+    int wrong = 0;
+    for (int i = 0; i < n; i++) {
+        wrong += !lookup_right(fsptr, fssize, i, exists[i]);
+    }
+    return wrong;
+}
+
+void test_lookups_while_index_grows(void *fsptr) {
+    static char exists[FILES];
+    unsigned int seed = 1;
+    char path[32], other[32];
+    int err, failed = 0, wrong = 0;
+
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/d");
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/d/file%d", i);
+        failed += __myfs_mknod_implem(fsptr, FS_SIZE, &err, path) != 0;
+        exists[i] = 1;
+
+        // Removals and renames move entries over to the new table too
+        if (i % 3 == 2) {
+            int victim = rand_r(&seed) % i;
+            if (exists[victim]) {
+                sprintf(path, "/d/file%d", victim);
+                failed += __myfs_unlink_implem(fsptr, FS_SIZE, &err, path) != 0;
+                exists[victim] = 0;
+            }
+        }
+        if (i % 5 == 4) {
+            int from = rand_r(&seed) % i;
+            if (exists[from] && !exists[i - 1]) {
+                sprintf(path, "/d/file%d", from);
+                sprintf(other, "/d/file%d", i - 1);
+                failed += __myfs_rename_implem(fsptr, FS_SIZE, &err, path, other) != 0;
+                exists[from] = 0;
+                exists[i - 1] = 1;
+            }
+        }
+
+        // The names most recently moved and a few others, every time
+        for (int k = 0; k < 20; k++) {
+            int j = k < 10 ? i - k : rand_r(&seed) % (i + 1);
+            if (j >= 0) {
+                wrong += !lookup_right(fsptr, FS_SIZE, j, exists[j]);
+            }
+        }
+        if (i % 500 == 0) {
+            wrong += lookups_wrong(fsptr, FS_SIZE, exists, FILES);
+        }
+    }
+    check(failed == 0, "every create, unlink and rename succeeds");
+    check(wrong == 0, "lookups are right while the index grows");
+    check(lookups_wrong(fsptr, FS_SIZE, exists, FILES) == 0, "lookups are right at the end");
+
+    char **names = NULL;
+    int listed = __myfs_readdir_implem(fsptr, FS_SIZE, &err, "/d", &names);
+    int present = 0;
+    for (int i = 0; i < FILES; i++) {
+        present += exists[i];
+    }
+    check(listed == present, "readdir lists every child once");
+    for (int i = 0; i < listed; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+void test_lookups_without_space_for_index() {
+    static char exists[MAX_FILES];
+    void *fsptr = calloc(1, SMALL_FS_SIZE);
+    char path[32];
+    int err, n = 0;
+
+    __myfs_mkdir_implem(fsptr, SMALL_FS_SIZE, &err, "/d");
+    while (n < MAX_FILES) {
+        sprintf(path, "/d/file%d", n);
+        if (__myfs_mknod_implem(fsptr, SMALL_FS_SIZE, &err, path) != 0) {
+            break;
+        }
+        exists[n++] = 1;
+    }
+    check(n > 0 && n < MAX_FILES && err == ENOSPC, "a small region fills up with files");
+    check(lookups_wrong(fsptr, SMALL_FS_SIZE, exists, n + 1) == 0,
+          "lookups in a full region are right, index or not");
+    free(fsptr);
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+
+    test_lookups_while_index_grows(fsptr);
+    test_lookups_without_space_for_index();
+
+    free(fsptr);
+    return failures != 0;
+}
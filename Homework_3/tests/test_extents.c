@@ -0,0 +1,135 @@
+/*
+
+  Checks that files kept in extents of the region read back what was
+  written, through overwrites, appends and truncations, and that
+  growing a file a little at a time does not take space out of
+  proportion to its size
+
+  gcc -Wall -pthread test_extents.c ../implementation.c -o test_extents
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, off_t offset);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path, char *buf, size_t size, off_t offset);
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf);
+
+#define FS_SIZE ((size_t)32 << 20)
+#define MAX_FILE ((size_t)2 << 20)
+#define OPERATIONS 2000
+#define APPEND_SIZE 1000
+#define APPENDS 2000
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+/* Returns 1 if the file at path is size bytes long and holds expected */
+static int holds(void *fsptr, const char *path, const char *expected, size_t size) {
+    static char buf[MAX_FILE + 1];
+    struct stat st;
+    int err;
+
+    return __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, path, &st) == 0 &&
+           (size_t)st.st_size == size &&
+           __myfs_read_implem(fsptr, FS_SIZE, &err, path, buf, MAX_FILE + 1, 0) == (int)size &&
+           memcmp(buf, expected, size) == 0;
+}
+
+void test_random_writes_and_truncations(void *fsptr) {
+    char *model = calloc(1, MAX_FILE), *buf = malloc(MAX_FILE);
+    unsigned int seed = 1;
+    size_t size = 0;
+    int err, failed = 0, bad = 0;
+
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/f");
+    for (int i = 0; i < OPERATIONS; i++) {
+        if (rand_r(&seed) % 8 == 0) {
+            size_t new_size = rand_r(&seed) % MAX_FILE;
+            failed += __myfs_truncate_implem(fsptr, FS_SIZE, &err, "/f", new_size) != 0;
+            if (new_size < size) {
+                memset(model + new_size, 0, size - new_size);
+            }
+            size = new_size;
+        } else {
+            // Small writes near the start, large ones anywhere
+            size_t len = 1 + rand_r(&seed) % (rand_r(&seed) % 2 ? 5000 : 300000);
+            size_t offset = rand_r(&seed) % (rand_r(&seed) % 2 ? 10000 : MAX_FILE - len);
+            for (size_t j = 0; j < len; j++) {
+                buf[j] = (char)rand_r(&seed);
+            }
+            failed += __myfs_write_implem(fsptr, FS_SIZE, &err, "/f", buf, len, offset) != (int)len;
+            memcpy(model + offset, buf, len);
+            if (offset + len > size) {
+                size = offset + len;
+            }
+        }
+        if (i % 100 == 0) {
+            bad += !holds(fsptr, "/f", model, size);
+        }
+    }
+    check(failed == 0, "every write and truncation succeeds");
+    check(bad == 0 && holds(fsptr, "/f", model, size), "file matches its model throughout");
+
+    __myfs_unlink_implem(fsptr, FS_SIZE, &err, "/f");
+    free(model);
+    free(buf);
+}
+
+void test_appends_take_little_space(void *fsptr) {
+    char *model = malloc(APPENDS * APPEND_SIZE);
+    struct statvfs before, after;
+    int err, failed = 0;
+
+    for (size_t i = 0; i < APPENDS * APPEND_SIZE; i++) {
+        model[i] = (char)(i % 251);
+    }
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &before);
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/log");
+    for (int i = 0; i < APPENDS; i++) {
+        failed += __myfs_write_implem(fsptr, FS_SIZE, &err, "/log", model + i * APPEND_SIZE,
+                                      APPEND_SIZE, i * APPEND_SIZE) != APPEND_SIZE;
+    }
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &after);
+    check(failed == 0 && holds(fsptr, "/log", model, APPENDS * APPEND_SIZE),
+          "appends read back in order");
+    check((before.f_bfree - after.f_bfree) * before.f_bsize <= 2 * APPENDS * APPEND_SIZE,
+          "appended file takes at most twice its size");
+
+    __myfs_unlink_implem(fsptr, FS_SIZE, &err, "/log");
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &after);
+    check(after.f_bfree == before.f_bfree, "removing it frees all its extents");
+    free(model);
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+
+    test_random_writes_and_truncations(fsptr);
+    test_appends_take_little_space(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
@@ -0,0 +1,187 @@
+/*
+
+  Checks that __myfs_fallocate_implem reserves space that reads as
+  zeros, grows the file unless asked to keep its size, makes later
+  writes into the reserved range take no more space, and refuses
+  what it cannot do
+
+  gcc -Wall -pthread test_fallocate.c ../implementation.c -o test_fallocate
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01  // As in <linux/falloc.h>
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path, char *buf, size_t size, off_t offset);
+int __myfs_fallocate_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path,
+                            uint64_t fh, int mode, off_t offset, off_t len);
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf);
+
+#define FS_SIZE ((size_t)16 << 20)
+#define RESERVED 1000000
+#define KEPT 1000
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+static size_t free_blocks(void *fsptr) {
+    struct statvfs st;
+    int err;
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &st);
+    return st.f_bfree;
+}
+
+static long file_size(void *fsptr, const char *path) {
+    struct stat st;
+    int err;
+    return __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, path, &st) == 0 ? st.st_size : -1;
+}
+
+/* Returns 1 if the size bytes at offset of the file at path read as zeros */
+static int reads_zeros(void *fsptr, const char *path, off_t offset, size_t size) {
+    char *buf = malloc(size);
+    int err, ok;
+
+    memset(buf, 'x', size);
+    ok = __myfs_read_implem(fsptr, FS_SIZE, &err, path, buf, size, offset) == (int)size;
+    for (size_t i = 0; ok && i < size; i++) {
+        ok = buf[i] == 0;
+    }
+    free(buf);
+    return ok;
+}
+
+void test_reserves_space(void *fsptr) {
+    static char data[RESERVED];
+    int err;
+
+    memset(data, 'r', sizeof(data));
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/f");
+    size_t before = free_blocks(fsptr);
+
+    check(__myfs_fallocate_implem(fsptr, FS_SIZE, &err, "/f", 0, 0, 0, RESERVED) == 0 &&
+          file_size(fsptr, "/f") == RESERVED, "fallocate grows the file");
+    struct statvfs st;
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &st);
+    size_t reserved = before - st.f_bfree;
+    check(reserved * st.f_bsize >= RESERVED && reserved * st.f_bsize <= 2 * RESERVED,
+          "and reserves its space");
+    check(reads_zeros(fsptr, "/f", 0, RESERVED), "the reserved bytes read as zeros");
+
+    check(__myfs_write_implem(fsptr, FS_SIZE, &err, "/f", data, RESERVED, 0) == RESERVED &&
+          before - free_blocks(fsptr) == reserved, "writing them takes no more space");
+
+    __myfs_unlink_implem(fsptr, FS_SIZE, &err, "/f");
+    check(free_blocks(fsptr) == before, "removing the file gives the space back");
+}
+
+void test_keep_size(void *fsptr) {
+    static char data[KEPT], buf[KEPT];
+    int err;
+
+    // Too large for the node, so that there are extents to reserve
+    for (size_t i = 0; i < KEPT; i++) {
+        data[i] = (char)(i * 3 + 1);
+    }
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/k");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/k", data, KEPT, 0);
+    size_t before = free_blocks(fsptr);
+
+    check(__myfs_fallocate_implem(fsptr, FS_SIZE, &err, "/k", 0, FALLOC_FL_KEEP_SIZE, 0,
+                                  RESERVED) == 0 && file_size(fsptr, "/k") == KEPT,
+          "with FALLOC_FL_KEEP_SIZE the size stays");
+    check(free_blocks(fsptr) < before, "but the space is reserved");
+    check(__myfs_read_implem(fsptr, FS_SIZE, &err, "/k", buf, KEPT, 0) == KEPT &&
+          memcmp(buf, data, KEPT) == 0 &&
+          __myfs_read_implem(fsptr, FS_SIZE, &err, "/k", buf, 10, KEPT) == 0,
+          "the contents stay, and reads still end at the size");
+
+    // Growing into the reserved range shows zeros, not what was there
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/k", "end", 3, RESERVED - 3);
+    check(file_size(fsptr, "/k") == RESERVED &&
+          reads_zeros(fsptr, "/k", KEPT, RESERVED - KEPT - 3),
+          "the reserved bytes read as zeros once the file grows");
+    __myfs_unlink_implem(fsptr, FS_SIZE, &err, "/k");
+}
+
+void test_small_files(void *fsptr) {
+    int err;
+
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/s");
+    size_t before = free_blocks(fsptr);
+    check(__myfs_fallocate_implem(fsptr, FS_SIZE, &err, "/s", 0, 0, 0, 100) == 0 &&
+          file_size(fsptr, "/s") == 100 && free_blocks(fsptr) == before &&
+          reads_zeros(fsptr, "/s", 0, 100), "a file small enough for its node takes no blocks");
+    __myfs_unlink_implem(fsptr, FS_SIZE, &err, "/s");
+}
+
+void test_errors(void *fsptr) {
+    int err;
+
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/e");
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/dir");
+    err = 0;
+    check(__myfs_fallocate_implem(fsptr, FS_SIZE, &err, "/e", 0, FALLOC_FL_PUNCH_HOLE |
+                                  FALLOC_FL_KEEP_SIZE, 0, 100) == -1 && err == EOPNOTSUPP,
+          "other modes fail with EOPNOTSUPP");
+    err = 0;
+    check(__myfs_fallocate_implem(fsptr, FS_SIZE, &err, "/e", 0, 0, 0, 0) == -1 && err == EINVAL,
+          "an empty range fails with EINVAL");
+    err = 0;
+    check(__myfs_fallocate_implem(fsptr, FS_SIZE, &err, "/e", 0, 0, -1, 10) == -1 &&
+          err == EINVAL, "a negative offset fails with EINVAL");
+    err = 0;
+    check(__myfs_fallocate_implem(fsptr, FS_SIZE, &err, "/dir", 0, 0, 0, 10) == -1 &&
+          err == EISDIR, "directories fail with EISDIR");
+    err = 0;
+    check(__myfs_fallocate_implem(fsptr, FS_SIZE, &err, "/missing", 0, 0, 0, 10) == -1 &&
+          err == ENOENT, "missing files fail with ENOENT");
+
+    size_t before = free_blocks(fsptr);
+    err = 0;
+    check(__myfs_fallocate_implem(fsptr, FS_SIZE, &err, "/e", 0, 0, 0, 2 * FS_SIZE) == -1 &&
+          err == ENOSPC, "more than the region holds fails with ENOSPC");
+    check(file_size(fsptr, "/e") == 0 && free_blocks(fsptr) == before,
+          "and leaves the file as it was");
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+
+    test_reserves_space(fsptr);
+    test_keep_size(fsptr);
+    test_small_files(fsptr);
+    test_errors(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
@@ -0,0 +1,103 @@
+/*
+
+  Checks that a region flushed to its backup-file can be read back
+  into the same buffer and used again, from the flushing thread and
+  from another one
+
+  gcc -Wall -pthread test_flush.c ../implementation.c -o test_flush
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_flush_implem(void *fsptr, size_t fssize, int *errnoptr, int fd);
+
+#define FS_SIZE ((size_t)8 << 20)
+
+static void *fsptr;
+static int backup_fd;
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+static void *flush_thread(void *arg) {
+    int err;
+    *(int *)arg = __myfs_flush_implem(fsptr, FS_SIZE, &err, backup_fd);
+    return NULL;
+}
+
+/* Gives up on a test that hangs instead of hanging the whole run */
+static void watchdog(int sig) {
+    static const char message[] = "Failed: operation on a reloaded region hangs\n";
+    (void)sig;
+    write(STDOUT_FILENO, message, sizeof(message) - 1);
+    _exit(1);
+}
+
+void test_reload_after_flush_from_other_thread() {
+    int err, flushed = -1;
+    struct stat st;
+    pthread_t thread;
+
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/a");
+    pthread_create(&thread, NULL, flush_thread, &flushed);
+    pthread_join(thread, NULL);
+    check(flushed == 0, "flush from another thread");
+
+    pread(backup_fd, fsptr, FS_SIZE, 0);
+    check(__myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, "/a", &st) == 0,
+          "getattr after reloading a region flushed by another thread");
+}
+
+void test_reload_after_flush_from_same_thread() {
+    int err;
+    struct stat st;
+
+    check(__myfs_flush_implem(fsptr, FS_SIZE, &err, backup_fd) == 0, "flush");
+    pread(backup_fd, fsptr, FS_SIZE, 0);
+    check(__myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, "/a", &st) == 0,
+          "getattr after reloading a region flushed by this thread");
+    check(__myfs_mknod_implem(fsptr, FS_SIZE, &err, "/b") == 0 &&
+          __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, "/b", &st) == 0,
+          "mknod after reloading");
+}
+
+int main() {
+    char path[] = "/tmp/myfs_test_flush_XXXXXX";
+    backup_fd = mkstemp(path);
+    if (backup_fd < 0 || ftruncate(backup_fd, FS_SIZE) < 0) {
+        printf("Cannot create a backup-file, error %d\n", errno);
+        return 1;
+    }
+    unlink(path);
+    fsptr = calloc(1, FS_SIZE);
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    signal(SIGALRM, watchdog);
+    alarm(10);
+    test_reload_after_flush_from_other_thread();
+    test_reload_after_flush_from_same_thread();
+
+    free(fsptr);
+    close(backup_fd);
+    return failures != 0;
+}
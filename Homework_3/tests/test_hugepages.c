@@ -0,0 +1,136 @@
+/*
+
+  Checks that in a region laid out along 2 MB huge pages, every extent
+  of at least a quarter of a huge page sits inside a single huge page,
+  also after files come and go, and that the region can be advised to
+  use transparent huge pages without changing what it holds
+
+  gcc -Wall -pthread test_hugepages.c ../implementation.c -o test_hugepages
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path, char *buf, size_t size, off_t offset);
+int __myfs_read_iov_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, uint64_t fh, size_t size, off_t offset,
+                           struct iovec **iovptr, int *iovcntptr, void **pinptr);
+int __myfs_read_iov_done_implem(void *fsptr, size_t fssize, int *errnoptr, void *pin);
+int __myfs_hugepages_implem(void *fsptr, size_t fssize, int *errnoptr);
+
+#define HUGE_PAGE ((size_t)2 << 20)
+#define FS_SIZE ((size_t)64 << 20)  // Large enough for the huge page layout
+#define FILES 24
+#define SMALL 3000
+#define LARGE(i) ((size_t)(512 << 10) + (size_t)(i) * 20000)
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+/* Returns the number of pieces of at least a quarter huge page of the
+   len bytes of the file at path that cross a huge page boundary, or -1
+   if they cannot be read
+*/
+static int crossing(void *fsptr, const char *path, size_t len) {
+    struct iovec *iov;
+    int cnt, err, crossed = 0;
+    void *pin;
+
+    if (__myfs_read_iov_implem(fsptr, FS_SIZE, &err, path, 0, len, 0, &iov, &cnt, &pin) !=
+        (int)len) {
+        return -1;
+    }
+    for (int i = 0; i < cnt; i++) {
+        size_t start = (size_t)((char *)iov[i].iov_base - (char *)fsptr);
+        size_t end = start + iov[i].iov_len - 1;
+        crossed += iov[i].iov_len >= HUGE_PAGE / 4 && start / HUGE_PAGE != end / HUGE_PAGE;
+    }
+    __myfs_read_iov_done_implem(fsptr, FS_SIZE, &err, pin);
+    free(iov);
+    return crossed;
+}
+
+void test_large_extents_stay_in_a_huge_page(void *fsptr) {
+    char *data = malloc(LARGE(FILES)), path[32];
+    int err, crossed = 0;
+
+    memset(data, 'l', LARGE(FILES));
+    // Small files between the large ones push them off any alignment
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/small%d", i);
+        __myfs_mknod_implem(fsptr, FS_SIZE, &err, path);
+        __myfs_write_implem(fsptr, FS_SIZE, &err, path, data, SMALL, 0);
+        sprintf(path, "/large%d", i);
+        __myfs_mknod_implem(fsptr, FS_SIZE, &err, path);
+        __myfs_write_implem(fsptr, FS_SIZE, &err, path, data, LARGE(i), 0);
+    }
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/large%d", i);
+        crossed += crossing(fsptr, path, LARGE(i)) != 0;
+    }
+    check(crossed == 0, "large extents do not cross a huge page boundary");
+
+    // Refill the gaps every other file leaves with files of other sizes
+    for (int i = 0; i < FILES; i += 2) {
+        sprintf(path, "/large%d", i);
+        __myfs_unlink_implem(fsptr, FS_SIZE, &err, path);
+    }
+    for (int i = 0; i < FILES; i += 2) {
+        sprintf(path, "/large%d", i);
+        __myfs_mknod_implem(fsptr, FS_SIZE, &err, path);
+        __myfs_write_implem(fsptr, FS_SIZE, &err, path, data, LARGE(FILES - i), 0);
+    }
+    crossed = 0;
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/large%d", i);
+        crossed += crossing(fsptr, path, i % 2 == 0 ? LARGE(FILES - i) : LARGE(i)) != 0;
+    }
+    check(crossed == 0, "nor do those of files written into the gaps");
+    free(data);
+}
+
+void test_advice(void *fsptr) {
+    char buf[SMALL], expected[SMALL];
+    int err = 0;
+
+    memset(expected, 'l', SMALL);
+    int result = __myfs_hugepages_implem(fsptr, FS_SIZE, &err);
+    // Kernels without transparent huge pages refuse the advice
+    check(result == 0 || err == EINVAL, "the region can be advised to use huge pages");
+    check(__myfs_read_implem(fsptr, FS_SIZE, &err, "/small0", buf, SMALL, 0) == SMALL &&
+          memcmp(buf, expected, SMALL) == 0, "which leaves its contents alone");
+
+    err = 0;
+    check(__myfs_hugepages_implem(NULL, FS_SIZE, &err) == -1 && err == EFAULT,
+          "without a region it fails with EFAULT");
+}
+
+int main() {
+    // Aligned like a MAP_HUGETLB mapping, so offsets and huge pages match
+    void *fsptr = aligned_alloc(HUGE_PAGE, FS_SIZE);
+    memset(fsptr, 0, FS_SIZE);
+
+    test_large_extents_stay_in_a_huge_page(fsptr);
+    test_advice(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
@@ -0,0 +1,165 @@
+/*
+
+  Checks that files of up to 200 bytes keep their contents in their
+  node without taking any space of their own, and that files crossing
+  that size move into extents and back without losing any bytes
+
+  gcc -Wall -pthread test_inline.c ../implementation.c -o test_inline
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, off_t offset);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path, char *buf, size_t size, off_t offset);
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf);
+
+#define FS_SIZE ((size_t)8 << 20)
+#define INLINE_MAX 200
+#define FILES 500
+#define MAX_FILE 1000
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+static size_t free_blocks(void *fsptr) {
+    struct statvfs st;
+    int err;
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &st);
+    return st.f_bfree;
+}
+
+/* Returns 1 if the file at path is size bytes long and holds expected */
+static int holds(void *fsptr, const char *path, const char *expected, size_t size) {
+    char buf[MAX_FILE + 1];
+    struct stat st;
+    int err;
+
+    return __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, path, &st) == 0 &&
+           (size_t)st.st_size == size &&
+           __myfs_read_implem(fsptr, FS_SIZE, &err, path, buf, MAX_FILE + 1, 0) == (int)size &&
+           memcmp(buf, expected, size) == 0;
+}
+
+void test_small_files_take_no_space(void *fsptr) {
+    char data[INLINE_MAX + 1], path[32];
+    int err, failed = 0;
+
+    memset(data, 'x', sizeof(data));
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/small");
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/small/file%d", i);
+        __myfs_mknod_implem(fsptr, FS_SIZE, &err, path);
+    }
+    size_t empty = free_blocks(fsptr);
+
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/small/file%d", i);
+        failed += __myfs_write_implem(fsptr, FS_SIZE, &err, path, data, INLINE_MAX, 0) !=
+                  INLINE_MAX;
+    }
+    check(failed == 0 && holds(fsptr, "/small/file7", data, INLINE_MAX),
+          "files of 200 bytes read back");
+    check(free_blocks(fsptr) == empty, "and take no more space than empty files");
+
+    struct stat st;
+    __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, "/small/file7", &st);
+    check(st.st_blocks == 0, "nor do they report any blocks");
+
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/small/file%d", i);
+        __myfs_write_implem(fsptr, FS_SIZE, &err, path, data, INLINE_MAX + 1, 0);
+    }
+    struct statvfs stfs;
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &stfs);
+    check((empty - stfs.f_bfree) * stfs.f_bsize >= FILES * (INLINE_MAX + 1),
+          "files of 201 bytes take space of their own");
+    __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, "/small/file7", &st);
+    check(st.st_blocks > 0 && holds(fsptr, "/small/file7", data, INLINE_MAX + 1),
+          "and report blocks");
+
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/small/file%d", i);
+        __myfs_truncate_implem(fsptr, FS_SIZE, &err, path, INLINE_MAX);
+    }
+    check(free_blocks(fsptr) == empty && holds(fsptr, "/small/file7", data, INLINE_MAX),
+          "truncating them to 200 bytes gives the space back");
+}
+
+void test_contents_cross_the_limit(void *fsptr) {
+    char model[MAX_FILE], buf[MAX_FILE];
+    unsigned int seed = 1;
+    size_t size = 0;
+    int err, failed = 0, bad = 0;
+
+    // Writes and truncations that keep crossing 200 bytes either way
+    memset(model, 0, sizeof(model));
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/f");
+    for (int i = 0; i < 2000; i++) {
+        size_t offset = INLINE_MAX - 50 + rand_r(&seed) % 100;
+        if (rand_r(&seed) % 4 == 0) {
+            failed += __myfs_truncate_implem(fsptr, FS_SIZE, &err, "/f", offset) != 0;
+            if (offset < size) {
+                memset(model + offset, 0, size - offset);
+            }
+            size = offset;
+        } else {
+            size_t len = 1 + rand_r(&seed) % 60;
+            if (rand_r(&seed) % 8 == 0) {
+                offset += MAX_FILE - INLINE_MAX - 100;  // Past the end, leaving a hole
+            }
+            for (size_t j = 0; j < len; j++) {
+                buf[j] = (char)rand_r(&seed);
+            }
+            failed += __myfs_write_implem(fsptr, FS_SIZE, &err, "/f", buf, len, offset) !=
+                      (int)len;
+            memcpy(model + offset, buf, len);
+            if (offset + len > size) {
+                size = offset + len;
+            }
+        }
+        bad += !holds(fsptr, "/f", model, size);
+    }
+    check(failed == 0, "every write and truncation succeeds");
+    check(bad == 0, "contents survive every move between node and extents");
+
+    size_t before = free_blocks(fsptr);
+    __myfs_truncate_implem(fsptr, FS_SIZE, &err, "/f", 0);
+    size_t after = free_blocks(fsptr);
+    __myfs_unlink_implem(fsptr, FS_SIZE, &err, "/f");
+    check(after >= before && free_blocks(fsptr) == after,
+          "an empty file holds no extents to free");
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+
+    test_small_files_take_no_space(fsptr);
+    test_contents_cross_the_limit(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
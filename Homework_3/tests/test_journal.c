@@ -0,0 +1,241 @@
+/*
+
+  Checks that replaying the journal after a simulated crash brings a
+  region read back from its backup-file up to date
+
+  gcc -Wall -pthread test_journal.c ../implementation.c -o test_journal
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *from, const char *to);
+int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, off_t offset);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path, char *buf, size_t size, off_t offset);
+int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, const struct timespec ts[2]);
+int __myfs_flush_implem(void *fsptr, size_t fssize, int *errnoptr, int fd);
+int __myfs_journal_open_implem(void *fsptr, size_t fssize, int *errnoptr,
+                               const char *journal_path);
+int __myfs_journal_close_implem(void *fsptr, size_t fssize, int *errnoptr);
+
+#define FS_SIZE ((size_t)16 << 20)
+#define BUF_SIZE 300000
+
+static const char *paths[] = { "/a", "/b", "/d", "/d/c", "/d/e", "/d/f", "/gone", "/moved" };
+#define PATH_COUNT (sizeof(paths) / sizeof(paths[0]))
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+/* Returns 1 if every path in paths is the same in both regions: absent
+   in both, or present with the same type, size and contents. Times are
+   only journaled by utimens, so other operations replay with new ones.
+*/
+static int same_tree(void *fsptr, void *otherptr) {
+    static char buf[BUF_SIZE], other_buf[BUF_SIZE];
+    int err;
+
+    for (size_t i = 0; i < PATH_COUNT; i++) {
+        struct stat st, other_st;
+        int res = __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, paths[i], &st);
+        int other_res = __myfs_getattr_implem(otherptr, FS_SIZE, &err, 0, 0, paths[i], &other_st);
+        if (res != other_res) {
+            printf("%s exists in only one region\n", paths[i]);
+            return 0;
+        }
+        if (res != 0) {
+            continue;
+        }
+        if (st.st_mode != other_st.st_mode || st.st_size != other_st.st_size) {
+            printf("%s differs in mode or size\n", paths[i]);
+            return 0;
+        }
+        if (S_ISREG(st.st_mode)) {
+            int n = __myfs_read_implem(fsptr, FS_SIZE, &err, paths[i], buf, BUF_SIZE, 0);
+            int other_n = __myfs_read_implem(otherptr, FS_SIZE, &err, paths[i], other_buf,
+                                             BUF_SIZE, 0);
+            if (n != other_n || n < 0 || memcmp(buf, other_buf, n) != 0) {
+                printf("%s differs in contents\n", paths[i]);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Changes the tree with every kind of operation the journal records */
+static void operate(void *fsptr, int round) {
+    static char data[BUF_SIZE];
+    struct timespec ts[2] = { { 1000 + round, 0 }, { 2000 + round, 0 } };
+    int err;
+
+    for (size_t i = 0; i < BUF_SIZE; i++) {
+        data[i] = (char)(i * 17 + round);
+    }
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/a");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/a", data, 150 + round * 1000, round * 10);
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/d");
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/d/c");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/d/c", data, BUF_SIZE / 2, 0);
+    __myfs_truncate_implem(fsptr, FS_SIZE, &err, "/d/c", BUF_SIZE / 3 + round);
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/gone");
+    __myfs_unlink_implem(fsptr, FS_SIZE, &err, "/gone");
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/b");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/b", "journal", 7, 0);
+    __myfs_rename_implem(fsptr, FS_SIZE, &err, "/b", "/moved");
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/d/e");
+    __myfs_rmdir_implem(fsptr, FS_SIZE, &err, "/d/e");
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/d/f");
+    __myfs_utimens_implem(fsptr, FS_SIZE, &err, "/d/f", ts);
+}
+
+/* Returns 1 if the utimens of the given round was replayed */
+static int has_times(void *fsptr, int round) {
+    struct stat st;
+    int err;
+    return __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, "/d/f", &st) == 0 &&
+           st.st_atim.tv_sec == 1000 + round && st.st_mtim.tv_sec == 2000 + round;
+}
+
+/* Reads the backup-file into a fresh region, as after a crash, and
+   replays the journal into it. Returns the region, or NULL on failure.
+*/
+static void *recover(int backup_fd, const char *journal_path) {
+    void *fsptr = calloc(1, FS_SIZE);
+    int err;
+
+    if (pread(backup_fd, fsptr, FS_SIZE, 0) != (ssize_t)FS_SIZE ||
+        __myfs_journal_open_implem(fsptr, FS_SIZE, &err, journal_path) < 0) {
+        free(fsptr);
+        return NULL;
+    }
+    return fsptr;
+}
+
+void test_replay_after_crash(int backup_fd, const char *journal_path) {
+    void *fsptr = calloc(1, FS_SIZE);
+    int err;
+
+    check(__myfs_flush_implem(fsptr, FS_SIZE, &err, backup_fd) == 0, "flush empty region");
+    check(__myfs_journal_open_implem(fsptr, FS_SIZE, &err, journal_path) == 0, "open journal");
+    operate(fsptr, 1);
+
+    // Crash: the region is lost, only the backup-file and journal remain
+    void *recovered = recover(backup_fd, journal_path);
+    check(recovered != NULL, "replay journal into the backup-file image");
+    check(recovered != NULL && same_tree(fsptr, recovered), "replayed tree matches");
+    check(recovered != NULL && has_times(recovered, 1), "replayed times match");
+    if (recovered != NULL) {
+        __myfs_journal_close_implem(recovered, FS_SIZE, &err);
+        free(recovered);
+    }
+
+    // A flush makes the records so far part of the image; only later
+    // ones may be replayed on top of it
+    check(__myfs_flush_implem(fsptr, FS_SIZE, &err, backup_fd) == 0, "flush with open journal");
+    operate(fsptr, 2);
+    recovered = recover(backup_fd, journal_path);
+    check(recovered != NULL && same_tree(fsptr, recovered),
+          "replay after a flush skips the records already in the image");
+    check(recovered != NULL && has_times(recovered, 2), "replayed times after a flush match");
+    if (recovered != NULL) {
+        __myfs_journal_close_implem(recovered, FS_SIZE, &err);
+        free(recovered);
+    }
+
+    __myfs_journal_close_implem(fsptr, FS_SIZE, &err);
+    free(fsptr);
+}
+
+void test_replay_stops_at_failing_record(int backup_fd, const char *journal_path) {
+    void *fsptr = calloc(1, FS_SIZE);
+    struct stat st;
+    int err;
+
+    unlink(journal_path);
+    __myfs_flush_implem(fsptr, FS_SIZE, &err, backup_fd);
+    __myfs_journal_open_implem(fsptr, FS_SIZE, &err, journal_path);
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/a");
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/b");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/b", "lost", 4, 0);
+    __myfs_journal_close_implem(fsptr, FS_SIZE, &err);
+    free(fsptr);
+    stat(journal_path, &st);
+    off_t journal_len = st.st_size;
+
+    // An image in which the second record cannot be applied: /b exists
+    void *recovered = calloc(1, FS_SIZE);
+    pread(backup_fd, recovered, FS_SIZE, 0);
+    __myfs_mknod_implem(recovered, FS_SIZE, &err, "/b");
+
+    err = 0;
+    int res = __myfs_journal_open_implem(recovered, FS_SIZE, &err, journal_path);
+    check(res == -1 && err == EEXIST, "replay reports the error of a failing record");
+    check(__myfs_getattr_implem(recovered, FS_SIZE, &err, 0, 0, "/a", &st) == 0,
+          "records before the failing one are replayed");
+    check(__myfs_getattr_implem(recovered, FS_SIZE, &err, 0, 0, "/b", &st) == 0 && st.st_size == 0,
+          "records behind the failing one are not replayed");
+    stat(journal_path, &st);
+    check(st.st_size > 0 && st.st_size < journal_len, "journal is cut off at the failing record");
+    free(recovered);
+
+    // What is left of the journal replays into the backup-file image
+    recovered = recover(backup_fd, journal_path);
+    check(recovered != NULL, "cut off journal replays into a fresh region");
+    check(recovered != NULL &&
+          __myfs_getattr_implem(recovered, FS_SIZE, &err, 0, 0, "/a", &st) == 0 &&
+          __myfs_getattr_implem(recovered, FS_SIZE, &err, 0, 0, "/b", &st) == -1,
+          "cut off journal holds the records before the failing one");
+    if (recovered != NULL) {
+        __myfs_journal_close_implem(recovered, FS_SIZE, &err);
+        free(recovered);
+    }
+}
+
+int main() {
+    char backup_path[] = "/tmp/myfs_test_journal_XXXXXX";
+    int backup_fd = mkstemp(backup_path);
+    if (backup_fd < 0 || ftruncate(backup_fd, FS_SIZE) < 0) {
+        printf("Cannot create a backup-file, error %d\n", errno);
+        return 1;
+    }
+    char journal_path[sizeof(backup_path) + 8];
+    snprintf(journal_path, sizeof(journal_path), "%s.journal", backup_path);
+    unlink(journal_path);
+
+    test_replay_after_crash(backup_fd, journal_path);
+    test_replay_stops_at_failing_record(backup_fd, journal_path);
+
+    close(backup_fd);
+    unlink(backup_path);
+    unlink(journal_path);
+    return failures != 0;
+}
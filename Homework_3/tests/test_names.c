@@ -0,0 +1,160 @@
+/*
+
+  Checks that names of every length up to 255 bytes are kept exactly,
+  that renames between names kept in the node and names kept in a
+  block of their own work either way, and that the blocks of long
+  names are freed when they are no longer needed
+
+  gcc -Wall -pthread test_names.c ../implementation.c -o test_names
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf);
+int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, char ***namesptr);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *from, const char *to);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path, char *buf, size_t size, off_t offset);
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf);
+
+#define FS_SIZE ((size_t)8 << 20)
+#define NAME_MAX_LEN 255
+#define FILES 200
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+static size_t free_blocks(void *fsptr) {
+    struct statvfs st;
+    int err;
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &st);
+    return st.f_bfree;
+}
+
+/* Puts "/dir/" and a name of len bytes into path. The name starts with
+   as many digits of i as fit, so names of the same length differ.
+*/
+static void make_path(char *path, const char *dir, int i, size_t len) {
+    char digits[16];
+    size_t start = sprintf(path, "%s/", dir);
+    size_t n = sprintf(digits, "%d", i);
+    for (size_t j = 0; j < len; j++) {
+        path[start + j] = j < n ? digits[j] : 'a' + (i + j) % 26;
+    }
+    path[start + len] = '\0';
+}
+
+void test_every_length(void *fsptr) {
+    char path[NAME_MAX_LEN + 8];
+    char **names = NULL;
+    int err, failed = 0, missing = 0;
+
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/len");
+    for (size_t len = 1; len <= NAME_MAX_LEN; len++) {
+        make_path(path, "/len", len, len);
+        failed += __myfs_mknod_implem(fsptr, FS_SIZE, &err, path) != 0;
+    }
+    check(failed == 0, "names of every length can be created");
+
+    int n = __myfs_readdir_implem(fsptr, FS_SIZE, &err, "/len", &names);
+    for (size_t len = 1; len <= NAME_MAX_LEN; len++) {
+        struct stat st;
+        make_path(path, "/len", len, len);
+        int listed = 0;
+        for (int i = 0; i < n; i++) {
+            listed |= strcmp(names[i], path + strlen("/len/")) == 0;
+        }
+        missing += !listed || __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, path, &st) != 0;
+    }
+    check(n == NAME_MAX_LEN && missing == 0, "readdir and lookups give them back exactly");
+    for (int i = 0; i < n; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+void test_renames_between_lengths(void *fsptr) {
+    char from[NAME_MAX_LEN + 8], to[NAME_MAX_LEN + 8], buf[16];
+    struct stat st;
+    int err, failed = 0, wrong = 0;
+    static const size_t lengths[] = { 1, 23, 24, 100, NAME_MAX_LEN, 5, NAME_MAX_LEN, 24, 23, 7 };
+
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/ren");
+    make_path(from, "/ren", 0, lengths[0]);
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, from);
+    __myfs_write_implem(fsptr, FS_SIZE, &err, from, "contents", 8, 0);
+    for (size_t k = 1; k < sizeof(lengths) / sizeof(lengths[0]); k++) {
+        make_path(to, "/ren", k, lengths[k]);
+        failed += __myfs_rename_implem(fsptr, FS_SIZE, &err, from, to) != 0;
+        wrong += __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, from, &st) != -1 ||
+                 err != ENOENT;
+        wrong += __myfs_read_implem(fsptr, FS_SIZE, &err, to, buf, sizeof(buf), 0) != 8 ||
+                 memcmp(buf, "contents", 8) != 0;
+        strcpy(from, to);
+    }
+    check(failed == 0, "renames between short and long names succeed");
+    check(wrong == 0, "the old name is gone and the file keeps its contents");
+}
+
+void test_long_names_are_freed(void *fsptr) {
+    char from[NAME_MAX_LEN + 8], to[NAME_MAX_LEN + 8];
+    struct statvfs st;
+    int err, failed = 0;
+
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/free");
+    for (int i = 0; i < FILES; i++) {
+        make_path(from, "/free", i, 10);
+        __myfs_mknod_implem(fsptr, FS_SIZE, &err, from);
+    }
+    size_t short_names = free_blocks(fsptr);
+
+    for (int i = 0; i < FILES; i++) {
+        make_path(from, "/free", i, 10);
+        make_path(to, "/free", i, NAME_MAX_LEN);
+        failed += __myfs_rename_implem(fsptr, FS_SIZE, &err, from, to) != 0;
+    }
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &st);
+    check(failed == 0 && (short_names - st.f_bfree) * st.f_bsize >= FILES * NAME_MAX_LEN,
+          "long names take blocks of their own");
+
+    for (int i = 0; i < FILES; i++) {
+        make_path(from, "/free", i, NAME_MAX_LEN);
+        make_path(to, "/free", i, 10);
+        failed += __myfs_rename_implem(fsptr, FS_SIZE, &err, from, to) != 0;
+    }
+    check(failed == 0 && free_blocks(fsptr) == short_names,
+          "renaming back to short names frees them");
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+
+    test_every_length(fsptr);
+    test_renames_between_lengths(fsptr);
+    test_long_names_are_freed(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
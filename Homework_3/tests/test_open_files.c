@@ -0,0 +1,158 @@
+/*
+
+  Checks that the handles open hands out lead reads, writes and
+  truncations to the open file without its path, keep doing so after
+  the file is renamed, fall back to the path once it is removed, and
+  that their slots are reused and grow in number as needed
+
+  gcc -Wall -pthread test_open_files.c ../implementation.c -o test_open_files
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *from, const char *to);
+int __myfs_open_fh_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path,
+                          uint64_t *fhptr);
+int __myfs_release_implem(void *fsptr, size_t fssize, int *errnoptr, uint64_t fh);
+int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path, char *buf, size_t size, off_t offset);
+int __myfs_read_fh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, uint64_t fh, char *buf, size_t size, off_t offset);
+int __myfs_write_fh_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path,
+                           uint64_t fh, const char *buf, size_t size, off_t offset);
+int __myfs_truncate_fh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                              const char *path, uint64_t fh, off_t offset);
+
+#define FS_SIZE ((size_t)4 << 20)
+#define OPEN_FILES 100  // Well past the 16 slots the table starts with
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+static off_t size_of(void *fsptr, const char *path) {
+    struct stat st;
+    int err;
+    if (__myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, path, &st) != 0) {
+        return -1;
+    }
+    return st.st_size;
+}
+
+void test_handle_follows_the_file(void *fsptr) {
+    uint64_t fh = 0;
+    char buf[16];
+    int err;
+
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/a");
+    check(__myfs_open_fh_implem(fsptr, FS_SIZE, &err, "/a", &fh) == 0 && fh != 0,
+          "opening a file hands out a handle");
+
+    // A path that leads nowhere shows the handle is what gets used
+    check(__myfs_write_fh_implem(fsptr, FS_SIZE, &err, "/nowhere", fh, "hello", 5, 0) == 5 &&
+          __myfs_read_fh_implem(fsptr, FS_SIZE, &err, "/nowhere", fh, buf, 5, 0) == 5 &&
+          memcmp(buf, "hello", 5) == 0, "reads and writes go through the handle");
+
+    __myfs_rename_implem(fsptr, FS_SIZE, &err, "/a", "/b");
+    check(__myfs_write_fh_implem(fsptr, FS_SIZE, &err, "/a", fh, " world", 6, 5) == 6 &&
+          __myfs_read_implem(fsptr, FS_SIZE, &err, "/b", buf, 11, 0) == 11 &&
+          memcmp(buf, "hello world", 11) == 0, "a renamed file is still written through its handle");
+    check(__myfs_truncate_fh_implem(fsptr, FS_SIZE, &err, "/a", fh, 4) == 0 &&
+          size_of(fsptr, "/b") == 4, "and truncated");
+
+    // Once the file is gone, the handle no longer leads to it
+    __myfs_unlink_implem(fsptr, FS_SIZE, &err, "/b");
+    err = 0;
+    check(__myfs_read_fh_implem(fsptr, FS_SIZE, &err, "/b", fh, buf, 4, 0) == -1 && err == ENOENT,
+          "the handle of a removed file looks its path up");
+    err = 0;
+    check(__myfs_write_fh_implem(fsptr, FS_SIZE, &err, "/b", fh, "x", 1, 0) == -1 &&
+          err == ENOENT && size_of(fsptr, "/b") == -1, "writes through it create nothing");
+
+    // A new file at the path is what the lookup finds
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/b");
+    check(__myfs_write_fh_implem(fsptr, FS_SIZE, &err, "/b", fh, "new", 3, 0) == 3 &&
+          __myfs_read_implem(fsptr, FS_SIZE, &err, "/b", buf, 3, 0) == 3 &&
+          memcmp(buf, "new", 3) == 0, "and reach a new file at its path");
+
+    check(__myfs_release_implem(fsptr, FS_SIZE, &err, fh) == 0, "the handle is released");
+    uint64_t again = 0;
+    __myfs_open_fh_implem(fsptr, FS_SIZE, &err, "/b", &again);
+    check(again == fh, "and its slot is handed out again");
+    __myfs_release_implem(fsptr, FS_SIZE, &err, again);
+    __myfs_unlink_implem(fsptr, FS_SIZE, &err, "/b");
+}
+
+void test_directories_get_no_handle(void *fsptr) {
+    uint64_t fh = 1;
+    int err;
+
+    check(__myfs_open_fh_implem(fsptr, FS_SIZE, &err, "/", &fh) == 0 && fh == 0,
+          "directories open without a handle");
+    err = 0;
+    check(__myfs_open_fh_implem(fsptr, FS_SIZE, &err, "/missing", &fh) == -1 &&
+          err == ENOENT && fh == 0, "missing files do not open");
+}
+
+void test_many_open_files(void *fsptr) {
+    static uint64_t fh[OPEN_FILES];
+    char path[32], buf[32];
+    int err, distinct = 1, right = 0;
+
+    for (int i = 0; i < OPEN_FILES; i++) {
+        sprintf(path, "/f%d", i);
+        __myfs_mknod_implem(fsptr, FS_SIZE, &err, path);
+        __myfs_open_fh_implem(fsptr, FS_SIZE, &err, path, &fh[i]);
+        for (int j = 0; j < i; j++) {
+            distinct &= fh[i] != 0 && fh[i] != fh[j];
+        }
+    }
+    check(distinct, "every open file gets a handle of its own");
+
+    // Renaming every file makes the paths useless; only handles are left
+    for (int i = 0; i < OPEN_FILES; i++) {
+        char to[32];
+        sprintf(path, "/f%d", i);
+        sprintf(to, "/g%d", i);
+        __myfs_rename_implem(fsptr, FS_SIZE, &err, path, to);
+        __myfs_write_fh_implem(fsptr, FS_SIZE, &err, path, fh[i], path, strlen(path), 0);
+    }
+    for (int i = 0; i < OPEN_FILES; i++) {
+        sprintf(path, "/f%d", i);
+        memset(buf, 0, sizeof(buf));
+        right += __myfs_read_fh_implem(fsptr, FS_SIZE, &err, path, fh[i], buf, sizeof(buf), 0) ==
+                     (int)strlen(path) && strcmp(buf, path) == 0;
+        __myfs_release_implem(fsptr, FS_SIZE, &err, fh[i]);
+    }
+    check(right == OPEN_FILES, "each handle leads to its own file");
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+
+    test_handle_follows_the_file(fsptr);
+    test_directories_get_no_handle(fsptr);
+    test_many_open_files(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
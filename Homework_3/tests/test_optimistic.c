@@ -0,0 +1,186 @@
+/*
+
+  Checks that lookups, stat and reads, which do not lock the nodes
+  they look at, never see a change half done, while other threads
+  keep changing those nodes. Also meant to be run under
+  ThreadSanitizer:
+
+  gcc -Wall -pthread test_optimistic.c ../implementation.c -o test_optimistic
+  gcc -Wall -g -fsanitize=thread -pthread test_optimistic.c ../implementation.c -o test_optimistic
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, off_t offset);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path, char *buf, size_t size, off_t offset);
+
+#define FS_SIZE ((size_t)32 << 20)
+#define READERS 4
+#define LARGE_SIZE 300000
+#define SMALL_SIZE 150
+#define ROUNDS 400
+#define NAMES 2000
+
+static void *fsptr;
+static int done;
+static int created;  // Files /d/n0 to /d/n<created - 1> exist
+static int torn[READERS];
+static int lost[READERS];
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+/* Rewrites both files over and over, every byte of a file with the
+   number of the round. Every other round moves the small file out of
+   its node and back, and the large one changes its size; it is cut
+   before it is written when it shrinks, so that it always holds the
+   bytes of a single round.
+*/
+static void *rewrite(void *arg) {
+    char *buf = malloc(LARGE_SIZE);
+    int err;
+    (void)arg;
+
+    for (int round = 1; round <= ROUNDS; round++) {
+        memset(buf, round, LARGE_SIZE);
+        size_t size = LARGE_SIZE - (round % 2) * (LARGE_SIZE / 3);
+        if (round % 2 == 0) {
+            __myfs_write_implem(fsptr, FS_SIZE, &err, "/small", buf, 1000, 0);
+            __myfs_truncate_implem(fsptr, FS_SIZE, &err, "/small", SMALL_SIZE);
+        }
+        __myfs_write_implem(fsptr, FS_SIZE, &err, "/small", buf, SMALL_SIZE, 0);
+        if (size < LARGE_SIZE) {
+            __myfs_truncate_implem(fsptr, FS_SIZE, &err, "/large", size);
+        }
+        __myfs_write_implem(fsptr, FS_SIZE, &err, "/large", buf, size, 0);
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    free(buf);
+    return NULL;
+}
+
+/* Fills /d with files, which makes its children array and index grow */
+static void *create(void *arg) {
+    char path[32];
+    int err;
+    (void)arg;
+
+    for (int i = 0; i < NAMES && !__atomic_load_n(&done, __ATOMIC_ACQUIRE); i++) {
+        sprintf(path, "/d/n%d", i);
+        if (__myfs_mknod_implem(fsptr, FS_SIZE, &err, path) < 0) {
+            break;
+        }
+        __atomic_store_n(&created, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* Returns 1 if all n bytes at buf are the same */
+static int uniform(const char *buf, size_t n) {
+    for (size_t i = 1; i < n; i++) {
+        if (buf[i] != buf[0]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Reads both files and looks up created files until the writers are
+   done, counting reads that mix two rounds and files not found
+*/
+static void *look(void *arg) {
+    int r = (int)(long)arg;
+    unsigned int seed = r + 1;
+    char *buf = malloc(LARGE_SIZE);
+    char path[32];
+    struct stat st;
+    int err;
+
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+        int n = __myfs_read_implem(fsptr, FS_SIZE, &err, "/large", buf, LARGE_SIZE, 0);
+        if (n < 0 || !uniform(buf, n)) {
+            torn[r]++;
+        }
+        n = __myfs_read_implem(fsptr, FS_SIZE, &err, "/small", buf, SMALL_SIZE, 0);
+        if (n != SMALL_SIZE || !uniform(buf, n)) {
+            torn[r]++;
+        }
+        if (__myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, "/large", &st) < 0 ||
+            (st.st_size != LARGE_SIZE && st.st_size != LARGE_SIZE - LARGE_SIZE / 3)) {
+            torn[r]++;
+        }
+
+        int count = __atomic_load_n(&created, __ATOMIC_ACQUIRE);
+        if (count > 0) {
+            sprintf(path, "/d/n%d", rand_r(&seed) % count);
+            if (__myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, path, &st) < 0) {
+                lost[r]++;
+            }
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+void test_reads_during_changes() {
+    pthread_t writer, creator, readers[READERS];
+    char *buf = calloc(1, LARGE_SIZE);
+    int err;
+
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/large");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/large", buf, LARGE_SIZE, 0);
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/small");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/small", buf, SMALL_SIZE, 0);
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/d");
+    free(buf);
+
+    for (long r = 0; r < READERS; r++) {
+        pthread_create(&readers[r], NULL, look, (void *)r);
+    }
+    pthread_create(&creator, NULL, create, NULL);
+    pthread_create(&writer, NULL, rewrite, NULL);
+    pthread_join(writer, NULL);
+    pthread_join(creator, NULL);
+
+    int torn_reads = 0, lost_files = 0;
+    for (int r = 0; r < READERS; r++) {
+        pthread_join(readers[r], NULL);
+        torn_reads += torn[r];
+        lost_files += lost[r];
+    }
+    check(torn_reads == 0, "reads and stat never see a change half done");
+    check(lost_files == 0, "lookups find every file while the directory grows");
+    check(created > 0, "files get created alongside the lookups");
+}
+
+int main() {
+    fsptr = calloc(1, FS_SIZE);
+
+    test_reads_during_changes();
+
+    free(fsptr);
+    return failures != 0;
+}
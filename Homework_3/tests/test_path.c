@@ -0,0 +1,133 @@
+/*
+
+  Checks that paths are resolved component by component in place:
+  repeated and trailing slashes, names that are prefixes of each other,
+  names of the longest allowed length and files used as directories
+
+  gcc -Wall -pthread test_path.c ../implementation.c -o test_path
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+
+#define FS_SIZE ((size_t)4 << 20)
+#define NAME_MAX_LEN 255
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+/* Returns the size of the file at path, or -1 with *errnoptr set */
+static long file_size(void *fsptr, const char *path, int *errnoptr) {
+    struct stat st;
+    if (__myfs_getattr_implem(fsptr, FS_SIZE, errnoptr, 0, 0, path, &st) != 0) {
+        return -1;
+    }
+    return st.st_size;
+}
+
+void test_slashes(void *fsptr) {
+    int err;
+
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/a");
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/a/b");
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/a/b/c");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/a/b/c", "12345", 5, 0);
+
+    check(file_size(fsptr, "/a/b/c", &err) == 5, "plain path resolves");
+    check(file_size(fsptr, "//a///b//c", &err) == 5, "repeated slashes are skipped");
+    check(file_size(fsptr, "/a/b/", &err) >= 0 && file_size(fsptr, "/a//b//", &err) >= 0,
+          "trailing slashes are skipped");
+    check(file_size(fsptr, "/", &err) >= 0 && file_size(fsptr, "///", &err) >= 0,
+          "slashes alone name the root");
+}
+
+void test_prefixes(void *fsptr) {
+    int err;
+
+    // Each name is a prefix of the next: comparisons must use the length
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/p");
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/pp");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/pp", "xx", 2, 0);
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/ppp");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/ppp", "xxx", 3, 0);
+
+    check(file_size(fsptr, "/p", &err) == 0 && file_size(fsptr, "/pp", &err) == 2 &&
+          file_size(fsptr, "/ppp", &err) == 3, "names that are prefixes of each other differ");
+    check(file_size(fsptr, "/pppp", &err) == -1 && err == ENOENT,
+          "a longer name than any child does not exist");
+    check(file_size(fsptr, "/a/bb", &err) == -1 && err == ENOENT &&
+          file_size(fsptr, "/a/b/cc", &err) == -1 && err == ENOENT,
+          "a name extending a child does not exist");
+}
+
+void test_long_names(void *fsptr) {
+    char path[2 * NAME_MAX_LEN + 8];
+    int err;
+
+    path[0] = '/';
+    memset(path + 1, 'n', NAME_MAX_LEN);
+    path[NAME_MAX_LEN + 1] = '\0';
+    check(__myfs_mkdir_implem(fsptr, FS_SIZE, &err, path) == 0,
+          "a name of the longest allowed length can be created");
+    check(file_size(fsptr, path, &err) >= 0, "and found");
+
+    path[NAME_MAX_LEN + 1] = '/';
+    memset(path + NAME_MAX_LEN + 2, 'm', NAME_MAX_LEN);
+    path[2 * NAME_MAX_LEN + 2] = '\0';
+    check(__myfs_mknod_implem(fsptr, FS_SIZE, &err, path) == 0 &&
+          file_size(fsptr, path, &err) == 0, "in a directory of such a name, too");
+
+    path[2 * NAME_MAX_LEN + 2] = 'm';
+    path[2 * NAME_MAX_LEN + 3] = '\0';
+    err = 0;
+    check(__myfs_mknod_implem(fsptr, FS_SIZE, &err, path) == -1 && err == ENAMETOOLONG,
+          "creating a name one too long fails with ENAMETOOLONG");
+    err = 0;
+    check(file_size(fsptr, path, &err) == -1 && err == ENAMETOOLONG,
+          "looking it up fails with ENAMETOOLONG");
+}
+
+void test_files_are_not_directories(void *fsptr) {
+    int err = 0;
+
+    check(file_size(fsptr, "/a/b/c/d", &err) == -1 && err == ENOTDIR,
+          "a file in the middle of a path fails with ENOTDIR");
+    err = 0;
+    check(__myfs_mknod_implem(fsptr, FS_SIZE, &err, "/a/b/c/d") == -1 && err == ENOTDIR,
+          "creating below a file fails with ENOTDIR");
+    err = 0;
+    check(file_size(fsptr, "/x/b/c", &err) == -1 && err == ENOENT,
+          "a missing directory in the middle fails with ENOENT");
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+
+    test_slashes(fsptr);
+    test_prefixes(fsptr);
+    test_long_names(fsptr);
+    test_files_are_not_directories(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
@@ -0,0 +1,175 @@
+/*
+
+  Checks that the nodes of files created in many directories at once,
+  one directory after the other, end up next to their siblings rather
+  than next to the nodes created just before them, in few runs of
+  slots that files replaced later on stay in. Nodes are found by their
+  names, which short names keep inside the node.
+
+  gcc -Wall -pthread test_placement.c ../implementation.c -o test_placement
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+
+#define FS_SIZE ((size_t)16 << 20)
+#define DIRS 50
+#define DIR_FILES 60
+#define NAME_LEN 5      // As in file_name
+#define MAX_RUNS (DIR_FILES / 2)  // Interleaved, every file would be a run of its own
+
+static size_t offsets[DIRS][DIR_FILES];
+static char replaced = 'f';  // First letter of the files replaced last
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Names are unique, and those of removed nodes left in their free
+   slots never match, so that finding a name finds its node
+*/
+static void file_name(char *name, int d, int f) {
+    sprintf(name, "%c%02d%02d", f % 3 == 0 ? replaced : 'f', d, f);
+}
+
+/* Puts the offset of the node of file f of directory d into
+   offsets[d][f], sorted by offset for every d, and returns the
+   number of files found exactly once. One pass over the region finds
+   them all, since a name is followed by its null byte.
+*/
+static int find_nodes(void *fsptr) {
+    static int seen[DIRS][DIR_FILES];
+    const char *region = fsptr;
+    char name[NAME_LEN + 1];
+    int d, f, once = 0;
+
+    memset(seen, 0, sizeof(seen));
+    for (size_t i = 0; i + NAME_LEN < FS_SIZE; i++) {
+        if ((region[i] == 'f' || region[i] == replaced) && region[i + NAME_LEN] == '\0' &&
+            sscanf(region + i + 1, "%2d%2d", &d, &f) == 2 && d >= 0 && d < DIRS &&
+            f >= 0 && f < DIR_FILES) {
+            file_name(name, d, f);
+            if (memcmp(region + i, name, NAME_LEN) == 0) {
+                seen[d][f]++;
+                offsets[d][f] = i;
+            }
+        }
+    }
+    for (d = 0; d < DIRS; d++) {
+        for (f = 0; f < DIR_FILES; f++) {
+            once += seen[d][f] == 1;
+        }
+        qsort(offsets[d], DIR_FILES, sizeof(size_t), compare_offsets);
+    }
+    return once;
+}
+
+/* Returns the distance between nodes in adjacent slots */
+static size_t node_size(void) {
+    size_t size = FS_SIZE;
+    for (int d = 0; d < DIRS; d++) {
+        for (int f = 1; f < DIR_FILES; f++) {
+            if (offsets[d][f] - offsets[d][f - 1] < size) {
+                size = offsets[d][f] - offsets[d][f - 1];
+            }
+        }
+    }
+    return size;
+}
+
+/* Returns the number of directories whose files are spread over more
+   than MAX_RUNS runs of adjacent slots
+*/
+static int spread_out(size_t size) {
+    int spread = 0;
+    for (int d = 0; d < DIRS; d++) {
+        int runs = 1;
+        for (int f = 1; f < DIR_FILES; f++) {
+            runs += offsets[d][f] - offsets[d][f - 1] > size;
+        }
+        spread += runs > MAX_RUNS;
+    }
+    return spread;
+}
+
+/* Creates (create != 0) or removes the files f of every directory
+   with f % step == 0, one directory after the other
+*/
+static void interleaved(void *fsptr, int step, int create) {
+    char path[32], name[NAME_LEN + 1];
+    int err;
+
+    for (int f = 0; f < DIR_FILES; f += step) {
+        for (int d = 0; d < DIRS; d++) {
+            file_name(name, d, f);
+            sprintf(path, "/d%02d/%s", d, name);
+            if (create) {
+                __myfs_mknod_implem(fsptr, FS_SIZE, &err, path);
+            } else {
+                __myfs_unlink_implem(fsptr, FS_SIZE, &err, path);
+            }
+        }
+    }
+}
+
+void test_siblings_are_neighbors(void *fsptr) {
+    char path[32];
+    int err;
+
+    for (int d = 0; d < DIRS; d++) {
+        sprintf(path, "/d%02d", d);
+        __myfs_mkdir_implem(fsptr, FS_SIZE, &err, path);
+    }
+    // One file in every directory after the other, as untar or cp -r
+    // of several trees at once would
+    interleaved(fsptr, 1, 1);
+    check(find_nodes(fsptr) == DIRS * DIR_FILES, "every node is found by its name");
+
+    size_t size = node_size();
+    int neighbors = 0;
+    for (int d = 0; d < DIRS; d++) {
+        for (int f = 1; f < DIR_FILES; f++) {
+            neighbors += offsets[d][f] - offsets[d][f - 1] == size;
+        }
+    }
+    // Interleaved, hardly a file would be next to a sibling
+    check(neighbors >= DIRS * (DIR_FILES - 1) * 3 / 4, "most files are next to a sibling");
+    check(spread_out(size) == 0, "the files of a directory take few runs of slots");
+}
+
+void test_churn_keeps_siblings_together(void *fsptr) {
+    // Replaced files take slots their directory freed
+    interleaved(fsptr, 3, 0);
+    replaced = 'r';
+    interleaved(fsptr, 3, 1);
+    check(find_nodes(fsptr) == DIRS * DIR_FILES, "replaced nodes are found by their names");
+    check(spread_out(node_size()) == 0, "and stay with their siblings");
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+
+    test_siblings_are_neighbors(fsptr);
+    test_churn_keeps_siblings_together(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
@@ -0,0 +1,198 @@
+/*
+
+  Checks that the contents __myfs_read_iov_implem hands out stay as
+  they were until __myfs_read_iov_done_implem, without any lock held
+  in between, and that they are freed once no one needs them
+
+  gcc -Wall -pthread test_read_iov.c ../implementation.c -o test_read_iov
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/statvfs.h>
+
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, off_t offset);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_read_iov_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, uint64_t fh, size_t size, off_t offset,
+                           struct iovec **iovptr, int *iovcntptr, void **pinptr);
+int __myfs_read_iov_done_implem(void *fsptr, size_t fssize, int *errnoptr, void *pin);
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf);
+int __myfs_flush_implem(void *fsptr, size_t fssize, int *errnoptr, int fd);
+
+#define FS_SIZE ((size_t)16 << 20)
+#define BIG_SIZE 1000000
+#define SMALL_SIZE 100
+#define PINS 40
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+/* Returns 1 if the cnt iovecs at iov hold the len bytes at expected */
+static int iov_holds(const struct iovec *iov, int cnt, const char *expected, size_t len) {
+    size_t pos = 0;
+    for (int i = 0; i < cnt; i++) {
+        if (pos + iov[i].iov_len > len || memcmp(iov[i].iov_base, expected + pos, iov[i].iov_len) != 0) {
+            return 0;
+        }
+        pos += iov[i].iov_len;
+    }
+    return pos == len;
+}
+
+static size_t free_blocks(void *fsptr) {
+    struct statvfs st;
+    int err;
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &st);
+    return st.f_bfree;
+}
+
+void test_contents_stay_until_done(void *fsptr) {
+    char *old_data = malloc(BIG_SIZE), *new_data = malloc(BIG_SIZE);
+    struct iovec *iov;
+    int cnt, err;
+    void *pin;
+
+    memset(old_data, 'a', BIG_SIZE);
+    memset(new_data, 'b', BIG_SIZE);
+    size_t before = free_blocks(fsptr);
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/f");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/f", old_data, BIG_SIZE, 0);
+    int n = __myfs_read_iov_implem(fsptr, FS_SIZE, &err, "/f", 0, BIG_SIZE, 0, &iov, &cnt, &pin);
+    check(n == BIG_SIZE && iov_holds(iov, cnt, old_data, BIG_SIZE), "read_iov describes the file");
+    check(pin != NULL, "read_iov pins a large file");
+
+    // The same thread may go on changing the file: no lock is held
+    check(__myfs_write_implem(fsptr, FS_SIZE, &err, "/f", new_data, BIG_SIZE, 0) == BIG_SIZE,
+          "write to a pinned file");
+    check(iov_holds(iov, cnt, old_data, BIG_SIZE), "pinned contents survive a write");
+    __myfs_truncate_implem(fsptr, FS_SIZE, &err, "/f", 10);
+    check(__myfs_unlink_implem(fsptr, FS_SIZE, &err, "/f") == 0, "unlink a pinned file");
+    check(iov_holds(iov, cnt, old_data, BIG_SIZE), "pinned contents survive truncate and unlink");
+    check(free_blocks(fsptr) < before - BIG_SIZE / 4096, "pinned contents stay allocated");
+
+    check(__myfs_read_iov_done_implem(fsptr, FS_SIZE, &err, pin) == 0, "drop the pin");
+    check(free_blocks(fsptr) + 2 >= before, "dropping the last pin frees the contents");
+    free(iov);
+    free(old_data);
+    free(new_data);
+}
+
+void test_small_files_are_copied(void *fsptr) {
+    char data[SMALL_SIZE];
+    struct iovec *iov;
+    int cnt, err;
+    void *pin;
+
+    memset(data, 's', SMALL_SIZE);
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/small");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/small", data, SMALL_SIZE, 0);
+    int n = __myfs_read_iov_implem(fsptr, FS_SIZE, &err, "/small", 0, 1000, 0, &iov, &cnt, &pin);
+    check(n == SMALL_SIZE && pin == NULL, "small files need no pin");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/small", "changed", 7, 0);
+    check(iov_holds(iov, cnt, data, SMALL_SIZE), "copied contents survive a write");
+    check(__myfs_read_iov_done_implem(fsptr, FS_SIZE, &err, pin) == 0, "done with a NULL pin");
+    free(iov);
+}
+
+void test_done_checks_pins(void *fsptr) {
+    char data[BIG_SIZE / 10];
+    struct iovec *iovs[PINS];
+    void *pins[PINS];
+    int cnt, err;
+
+    memset(data, 'p', sizeof(data));
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/p");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/p", data, sizeof(data), 0);
+    size_t before = free_blocks(fsptr);
+
+    // More pins than the pin table starts out with
+    int pinned = 0;
+    for (int i = 0; i < PINS; i++) {
+        pinned += __myfs_read_iov_implem(fsptr, FS_SIZE, &err, "/p", 0, 1000, i * 1000,
+                                         &iovs[i], &cnt, &pins[i]) == 1000;
+        __myfs_write_implem(fsptr, FS_SIZE, &err, "/p", "x", 1, i * 1000);
+    }
+    check(pinned == PINS, "many reads pin the same file at once");
+
+    int dropped = 0;
+    for (int i = 0; i < PINS; i++) {
+        dropped += __myfs_read_iov_done_implem(fsptr, FS_SIZE, &err, pins[i]) == 0;
+        free(iovs[i]);
+    }
+    check(dropped == PINS, "drop all pins");
+    check(free_blocks(fsptr) + 2 >= before, "dropping all pins frees the copied contents");
+
+    err = 0;
+    int res = __myfs_read_iov_done_implem(fsptr, FS_SIZE, &err, pins[0]);
+    check(res == -1 && err == EINVAL, "dropping a pin twice fails with EINVAL");
+    err = 0;
+    res = __myfs_read_iov_done_implem(fsptr, FS_SIZE, &err, (void *)(uintptr_t)123456);
+    check(res == -1 && err == EINVAL, "dropping a pin never handed out fails with EINVAL");
+}
+
+void test_attach_drops_pins(void *fsptr, int backup_fd) {
+    char data[BIG_SIZE / 2];
+    struct iovec *iov;
+    int cnt, err;
+    void *pin;
+
+    memset(data, 'm', sizeof(data));
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/m");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/m", data, sizeof(data), 0);
+    __myfs_read_iov_implem(fsptr, FS_SIZE, &err, "/m", 0, sizeof(data), 0, &iov, &cnt, &pin);
+    __myfs_flush_implem(fsptr, FS_SIZE, &err, backup_fd);
+    __myfs_read_iov_done_implem(fsptr, FS_SIZE, &err, pin);
+    free(iov);
+
+    // A new mount of the flushed image, in which the pin is still taken
+    void *mounted = calloc(1, FS_SIZE);
+    pread(backup_fd, mounted, FS_SIZE, 0);
+    size_t before = free_blocks(mounted);
+    __myfs_unlink_implem(mounted, FS_SIZE, &err, "/m");
+    check(free_blocks(mounted) >= before + sizeof(data) / 4096,
+          "pins of an earlier mount are dropped on attach");
+    err = 0;
+    int res = __myfs_read_iov_done_implem(mounted, FS_SIZE, &err, pin);
+    check(res == -1 && err == EINVAL, "pins of an earlier mount are no longer valid");
+    free(mounted);
+}
+
+int main() {
+    char backup_path[] = "/tmp/myfs_test_read_iov_XXXXXX";
+    int backup_fd = mkstemp(backup_path);
+    if (backup_fd < 0) {
+        printf("Cannot create a backup-file, error %d\n", errno);
+        return 1;
+    }
+    void *fsptr = calloc(1, FS_SIZE);
+
+    test_contents_stay_until_done(fsptr);
+    test_small_files_are_copied(fsptr);
+    test_done_checks_pins(fsptr);
+    test_attach_drops_pins(fsptr, backup_fd);
+
+    free(fsptr);
+    close(backup_fd);
+    unlink(backup_path);
+    return failures != 0;
+}
@@ -0,0 +1,178 @@
+/*
+
+  Checks that a listing with __myfs_readdir_filler_implem can be
+  resumed from the cookie of the last entry taken, and that children
+  added or removed between the calls, even when that squeezes the
+  holes out of the children array, do not make it skip or repeat any
+  of the others
+
+  gcc -Wall -pthread test_readdir_filler.c ../implementation.c -o test_readdir_filler
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+typedef int (*myfs_fill_dir_t)(void *buf, const char *name, const struct stat *stbuf,
+                               off_t off);
+
+int __myfs_readdir_filler_implem(void *fsptr, size_t fssize, int *errnoptr,
+                                 const char *path, void *buf, myfs_fill_dir_t filler,
+                                 off_t offset);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+
+#define FS_SIZE ((size_t)16 << 20)
+#define FILES 1000
+#define MAX_FILES 4000
+#define CHUNK 37
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+/* What the filler saw of a listing */
+struct listing {
+    int taken;                 // Entries taken in the current call
+    int limit;                 // Entries to take per call
+    off_t cookie;              // Cookie of the last entry taken
+    int out_of_order;          // Cookies that did not increase
+    int bad_mode;              // Entries not reported as regular files
+    int seen[MAX_FILES];       // Times each file was listed
+};
+
+static int fill(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+    struct listing *listing = buf;
+    if (listing->taken == listing->limit) {
+        return 1;
+    }
+    listing->taken++;
+    listing->out_of_order += off <= listing->cookie;
+    listing->cookie = off;
+    listing->bad_mode += !S_ISREG(stbuf->st_mode);
+    int i = atoi(name + strlen("file"));
+    if (i >= 0 && i < MAX_FILES) {
+        listing->seen[i]++;
+    }
+    return 0;
+}
+
+static void create(void *fsptr, int i) {
+    char path[32];
+    int err;
+    sprintf(path, "/d/file%d", i);
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, path);
+}
+
+static void remove_file(void *fsptr, int i) {
+    char path[32];
+    int err;
+    sprintf(path, "/d/file%d", i);
+    __myfs_unlink_implem(fsptr, FS_SIZE, &err, path);
+}
+
+void test_listing_in_chunks(void *fsptr) {
+    static struct listing listing;
+    int err, failed = 0, calls = 0;
+
+    listing.limit = CHUNK;
+    do {
+        listing.taken = 0;
+        failed += __myfs_readdir_filler_implem(fsptr, FS_SIZE, &err, "/d", &listing, fill,
+                                               listing.cookie) != 0;
+        calls++;
+    } while (listing.taken == CHUNK);
+
+    int once = 1;
+    for (int i = 0; i < FILES; i++) {
+        once &= listing.seen[i] == 1;
+    }
+    check(failed == 0 && once, "every file is listed once over several calls");
+    check(calls == FILES / CHUNK + 1, "each call takes as many entries as the filler wants");
+    check(listing.out_of_order == 0 && listing.bad_mode == 0, "cookies increase, modes are right");
+}
+
+void test_listing_while_changing(void *fsptr) {
+    static struct listing listing;
+    static char removed[MAX_FILES];
+    unsigned int seed = 1;
+    int err, next = FILES;
+
+    listing.limit = CHUNK;
+    do {
+        listing.taken = 0;
+        __myfs_readdir_filler_implem(fsptr, FS_SIZE, &err, "/d", &listing, fill, listing.cookie);
+
+        // Remove files listed or not yet listed, and enough of them for
+        // the array to be compacted when the new ones are added
+        for (int k = 0; k < 3 * CHUNK; k++) {
+            int i = rand_r(&seed) % FILES;
+            if (!removed[i]) {
+                remove_file(fsptr, i);
+                removed[i] = 1;
+            }
+        }
+        for (int k = 0; k < CHUNK && next < MAX_FILES; k++) {
+            create(fsptr, next++);
+        }
+    } while (listing.taken == CHUNK);
+
+    int repeated = 0, skipped = 0;
+    for (int i = 0; i < MAX_FILES; i++) {
+        repeated += listing.seen[i] > 1;
+    }
+    // Files that were there all along
+    for (int i = 0; i < FILES; i++) {
+        skipped += !removed[i] && listing.seen[i] == 0;
+    }
+    check(repeated == 0, "no entry is listed twice while the directory changes");
+    check(skipped == 0, "no entry present throughout is skipped");
+    check(listing.out_of_order == 0, "cookies keep increasing");
+}
+
+void test_errors(void *fsptr) {
+    static struct listing listing;
+    int err;
+
+    listing.limit = CHUNK;
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/empty");
+    check(__myfs_readdir_filler_implem(fsptr, FS_SIZE, &err, "/empty", &listing, fill, 0) == 0 &&
+          listing.taken == 0, "an empty directory lists nothing");
+
+    err = 0;
+    check(__myfs_readdir_filler_implem(fsptr, FS_SIZE, &err, "/d", &listing, fill, -1) == -1 &&
+          err == EINVAL, "a negative cookie fails with EINVAL");
+    err = 0;
+    check(__myfs_readdir_filler_implem(fsptr, FS_SIZE, &err, "/d/file1000", &listing, fill, 0) == -1
+          && err == ENOTDIR, "a file fails with ENOTDIR");
+    err = 0;
+    check(__myfs_readdir_filler_implem(fsptr, FS_SIZE, &err, "/none", &listing, fill, 0) == -1 &&
+          err == ENOENT, "a missing directory fails with ENOENT");
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+    int err;
+
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/d");
+    for (int i = 0; i < FILES; i++) {
+        create(fsptr, i);
+    }
+    test_listing_in_chunks(fsptr);
+    test_listing_while_changing(fsptr);
+    test_errors(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
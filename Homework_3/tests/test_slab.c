@@ -0,0 +1,122 @@
+/*
+
+  Checks that nodes take one slab slot each, that statfs reports the
+  slots in use, and that freed slots are reused before new slabs are
+  allocated
+
+  gcc -Wall -pthread test_slab.c ../implementation.c -o test_slab
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/statvfs.h>
+
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf);
+
+#define FS_SIZE ((size_t)4 << 20)
+#define DIRS 40
+#define DIR_FILES 7  // Too few for a directory to start slabs of its own
+#define FILES (DIRS * DIR_FILES)
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+static struct statvfs statfs(void *fsptr) {
+    struct statvfs st;
+    int err;
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &st);
+    return st;
+}
+
+/* File i of all FILES goes into directory i / DIR_FILES */
+static int create(void *fsptr, int from, int to) {
+    char path[32];
+    int err, created = 0;
+    for (int i = from; i < to; i++) {
+        sprintf(path, "/d%d/f%d", i / DIR_FILES, i);
+        created += __myfs_mknod_implem(fsptr, FS_SIZE, &err, path) == 0;
+    }
+    return created;
+}
+
+static int remove_files(void *fsptr, int from, int to) {
+    char path[32];
+    int err, removed = 0;
+    for (int i = from; i < to; i++) {
+        sprintf(path, "/d%d/f%d", i / DIR_FILES, i);
+        removed += __myfs_unlink_implem(fsptr, FS_SIZE, &err, path) == 0;
+    }
+    return removed;
+}
+
+void test_statfs_counts_nodes(void *fsptr) {
+    char path[32];
+    int err;
+
+    struct statvfs st = statfs(fsptr);
+    check(st.f_files - st.f_ffree == 2, "a new filesystem uses two nodes, / and /.snapshots");
+
+    for (int d = 0; d < DIRS; d++) {
+        sprintf(path, "/d%d", d);
+        __myfs_mkdir_implem(fsptr, FS_SIZE, &err, path);
+    }
+    struct statvfs before = statfs(fsptr);
+    create(fsptr, 0, 1);
+    st = statfs(fsptr);
+    check(st.f_ffree == before.f_ffree - 1 && st.f_files == before.f_files,
+          "a node takes one free slot of a slab");
+
+    check(create(fsptr, 1, FILES) == FILES - 1, "create files over several slabs");
+    st = statfs(fsptr);
+    check(st.f_files - st.f_ffree == 2 + DIRS + FILES, "statfs counts the nodes in use");
+}
+
+void test_slots_are_reused(void *fsptr) {
+    struct statvfs before = statfs(fsptr);
+
+    // Free every other slot, then take them again
+    int removed = 0;
+    for (int i = 0; i < FILES; i += 2) {
+        removed += remove_files(fsptr, i, i + 1);
+    }
+    struct statvfs st = statfs(fsptr);
+    check(st.f_ffree == before.f_ffree + removed, "removed nodes free their slots");
+
+    int created = 0;
+    for (int i = 0; i < FILES; i += 2) {
+        created += create(fsptr, i, i + 1);
+    }
+    st = statfs(fsptr);
+    // A new slab would take far more than the block or two by which the
+    // children arrays grow as they fill up behind their holes
+    check(created == removed && st.f_files - st.f_ffree == before.f_files - before.f_ffree &&
+          st.f_bfree + 2 >= before.f_bfree, "new nodes go into the freed slots, not into new slabs");
+
+    remove_files(fsptr, 0, FILES);
+    st = statfs(fsptr);
+    check(st.f_files - st.f_ffree == 2 + DIRS, "removing the files frees their nodes");
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+
+    test_statfs_counts_nodes(fsptr);
+    test_slots_are_reused(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
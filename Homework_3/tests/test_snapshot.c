@@ -0,0 +1,241 @@
+/*
+
+  Checks that snapshots under /.snapshots keep the tree as it was and
+  cannot be changed
+
+  gcc -Wall -pthread test_snapshot.c ../implementation.c -o test_snapshot
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf);
+int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, char ***namesptr);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *from, const char *to);
+int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, off_t offset);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path, char *buf, size_t size, off_t offset);
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf);
+
+#define FS_SIZE ((size_t)16 << 20)
+#define BIG_SIZE 100000
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+/* Returns 1 if the file at path holds exactly the size bytes at data */
+static int holds(void *fsptr, const char *path, const char *data, size_t size) {
+    char *buf = malloc(size + 1);
+    int err;
+    int n = __myfs_read_implem(fsptr, FS_SIZE, &err, path, buf, size + 1, 0);
+    int same = n == (int)size && memcmp(buf, data, size) == 0;
+    free(buf);
+    return same;
+}
+
+static int exists(void *fsptr, const char *path) {
+    struct stat st;
+    int err;
+    return __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, path, &st) == 0;
+}
+
+void test_snapshot_keeps_old_tree(void *fsptr, const char *big, const char *big2) {
+    int err;
+
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/d");
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/d/small");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/d/small", "before", 6, 0);
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/big");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/big", big, BIG_SIZE, 0);
+
+    check(__myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/.snapshots/s1") == 0, "take a snapshot");
+
+    // Change the live tree in every way
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/d/small", "after!", 6, 0);
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/big", big2, BIG_SIZE / 2, 1000);
+    __myfs_truncate_implem(fsptr, FS_SIZE, &err, "/big", BIG_SIZE - 10);
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/d/new");
+    __myfs_rename_implem(fsptr, FS_SIZE, &err, "/d/small", "/d/moved");
+    __myfs_unlink_implem(fsptr, FS_SIZE, &err, "/big");
+
+    check(holds(fsptr, "/.snapshots/s1/d/small", "before", 6), "snapshot keeps small file");
+    check(holds(fsptr, "/.snapshots/s1/big", big, BIG_SIZE), "snapshot keeps large file");
+    check(!exists(fsptr, "/.snapshots/s1/d/new"), "snapshot does not see new file");
+    check(!exists(fsptr, "/.snapshots/s1/d/moved"), "snapshot does not see rename");
+    check(holds(fsptr, "/d/moved", "after!", 6), "live tree has the changes");
+    check(!exists(fsptr, "/big"), "live tree has the unlink");
+}
+
+void test_snapshot_is_read_only(void *fsptr) {
+    int err;
+    int res;
+
+    res = __myfs_write_implem(fsptr, FS_SIZE, &err, "/.snapshots/s1/d/small", "x", 1, 0);
+    check(res == -1 && err == EROFS, "write below /.snapshots fails with EROFS");
+    res = __myfs_truncate_implem(fsptr, FS_SIZE, &err, "/.snapshots/s1/big", 0);
+    check(res == -1 && err == EROFS, "truncate below /.snapshots fails with EROFS");
+    res = __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/.snapshots/s1/d/x");
+    check(res == -1 && err == EROFS, "mknod below /.snapshots fails with EROFS");
+    res = __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/.snapshots/s1/d/x");
+    check(res == -1 && err == EROFS, "mkdir below /.snapshots fails with EROFS");
+    res = __myfs_unlink_implem(fsptr, FS_SIZE, &err, "/.snapshots/s1/d/small");
+    check(res == -1 && err == EROFS, "unlink below /.snapshots fails with EROFS");
+    res = __myfs_rename_implem(fsptr, FS_SIZE, &err, "/.snapshots/s1/big", "/big");
+    check(res == -1 && err == EROFS, "rename out of /.snapshots fails with EROFS");
+    res = __myfs_rename_implem(fsptr, FS_SIZE, &err, "/d/moved", "/.snapshots/s1/d/moved");
+    check(res == -1 && err == EROFS, "rename into /.snapshots fails with EROFS");
+    check(holds(fsptr, "/.snapshots/s1/d/small", "before", 6), "snapshot unchanged");
+}
+
+void test_failing_mknod_copies_nothing(void *fsptr) {
+    struct statvfs before, after;
+    struct stat st_before, st_after;
+    int err;
+
+    check(__myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/.snapshots/s2") == 0, "take a second snapshot");
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &before);
+    __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, "/d/moved", &st_before);
+    int res = __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/d/moved");
+    check(res == -1 && err == EEXIST, "mknod of an existing file fails with EEXIST");
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &after);
+    __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, "/d/moved", &st_after);
+    check(after.f_bfree == before.f_bfree && after.f_ffree == before.f_ffree,
+          "failing mknod copies no shared node");
+    check(st_after.st_mtim.tv_sec == st_before.st_mtim.tv_sec &&
+          st_after.st_mtim.tv_nsec == st_before.st_mtim.tv_nsec,
+          "failing mknod leaves the file's times alone");
+    check(__myfs_rmdir_implem(fsptr, FS_SIZE, &err, "/.snapshots/s2") == 0, "remove second snapshot");
+}
+
+void test_snapshot_removal(void *fsptr) {
+    int err;
+    char **names = NULL;
+
+    int n = __myfs_readdir_implem(fsptr, FS_SIZE, &err, "/", &names);
+    int listed = 0;
+    for (int i = 0; i < n; i++) {
+        listed |= strcmp(names[i], ".snapshots") == 0;
+        free(names[i]);
+    }
+    free(names);
+    check(n >= 0 && !listed, "/.snapshots is not listed in /");
+
+    check(__myfs_rmdir_implem(fsptr, FS_SIZE, &err, "/.snapshots/s1") == 0, "remove snapshot");
+    check(!exists(fsptr, "/.snapshots/s1"), "snapshot is gone");
+    check(holds(fsptr, "/d/moved", "after!", 6), "live tree survives snapshot removal");
+}
+
+/* Returns 1 if the size bytes of the file at path match data, reading
+   in pieces to keep the buffer small
+*/
+static int holds_large(void *fsptr, const char *path, const char *data, size_t size) {
+    size_t piece = 1 << 20;
+    char *buf = malloc(piece);
+    int err;
+    int same = 1;
+    for (size_t pos = 0; pos < size && same; pos += piece) {
+        size_t n = size - pos < piece ? size - pos : piece;
+        same = __myfs_read_implem(fsptr, FS_SIZE, &err, path, buf, n, pos) == (int)n &&
+               memcmp(buf, data + pos, n) == 0;
+    }
+    struct stat st;
+    same = same && __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, path, &st) == 0 &&
+           st.st_size == (off_t)size;
+    free(buf);
+    return same;
+}
+
+void test_small_change_copies_little() {
+    size_t size = (size_t)6 << 20;
+    void *fsptr = calloc(1, FS_SIZE);
+    char *data = malloc(size);
+    char *live = malloc(size);
+    struct statvfs before, after;
+    int err;
+
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (char)(i * 11 + 3);
+    }
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/large");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/large", data, size, 0);
+    check(__myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/.snapshots/s") == 0,
+          "snapshot a large file");
+    memcpy(live, data, size);
+
+    // A write at the start needs a copy of the first extent only
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &before);
+    check(__myfs_write_implem(fsptr, FS_SIZE, &err, "/large", "x", 1, 5) == 1,
+          "1-byte write to a shared large file succeeds");
+    live[5] = 'x';
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &after);
+    check((before.f_bfree - after.f_bfree) * before.f_bsize <= ((size_t)2 << 20),
+          "1-byte write copies at most 2 MiB");
+
+    check(__myfs_write_implem(fsptr, FS_SIZE, &err, "/large", "yz", 2, size / 2) == 2,
+          "write to the middle of a partly shared file");
+    live[size / 2] = 'y';
+    live[size / 2 + 1] = 'z';
+    check(holds_large(fsptr, "/large", live, size), "live file has both writes");
+    check(holds_large(fsptr, "/.snapshots/s/large", data, size), "snapshot file is unchanged");
+
+    check(__myfs_truncate_implem(fsptr, FS_SIZE, &err, "/large", size / 4) == 0,
+          "truncate a partly shared file");
+    check(holds_large(fsptr, "/large", live, size / 4), "live file is cut");
+    check(__myfs_truncate_implem(fsptr, FS_SIZE, &err, "/large", 100) == 0 &&
+          holds_large(fsptr, "/large", live, 100), "shrink a partly shared file into its node");
+    check(holds_large(fsptr, "/.snapshots/s/large", data, size), "snapshot file is still unchanged");
+
+    check(__myfs_rmdir_implem(fsptr, FS_SIZE, &err, "/.snapshots/s") == 0, "remove the snapshot");
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &after);
+    check(after.f_bfree > before.f_bfree + size / 2 / before.f_bsize,
+          "removing the snapshot frees the old file");
+
+    free(live);
+    free(data);
+    free(fsptr);
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+    char *big = malloc(BIG_SIZE);
+    char *big2 = malloc(BIG_SIZE);
+    for (size_t i = 0; i < BIG_SIZE; i++) {
+        big[i] = (char)(i * 13);
+        big2[i] = (char)(i * 7 + 1);
+    }
+
+    test_snapshot_keeps_old_tree(fsptr, big, big2);
+    test_snapshot_is_read_only(fsptr);
+    test_failing_mknod_copies_nothing(fsptr);
+    test_snapshot_removal(fsptr);
+    test_small_change_copies_little();
+
+    free(big2);
+    free(big);
+    free(fsptr);
+    return failures != 0;
+}
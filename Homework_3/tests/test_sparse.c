@@ -0,0 +1,153 @@
+/*
+
+  Checks that extending a file with truncate or by writing past its
+  end leaves a hole that takes no space and reads as zeros, even for
+  files far larger than the region
+
+  gcc -Wall -pthread test_sparse.c ../implementation.c -o test_sparse
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, off_t offset);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path, char *buf, size_t size, off_t offset);
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf);
+
+#define FS_SIZE ((size_t)8 << 20)
+#define HUGE_SIZE ((off_t)10 << 30)
+#define BUF_SIZE 65536
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+static size_t free_blocks(void *fsptr) {
+    struct statvfs st;
+    int err;
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &st);
+    return st.f_bfree;
+}
+
+static struct stat stat_of(void *fsptr, const char *path) {
+    struct stat st;
+    int err;
+    memset(&st, 0xff, sizeof(st));
+    __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, path, &st);
+    return st;
+}
+
+/* Returns 1 if the size bytes at offset of the file at path read as zeros */
+static int reads_zeros(void *fsptr, const char *path, off_t offset, size_t size) {
+    static char buf[BUF_SIZE];
+    int err;
+
+    memset(buf, 'x', size);
+    if (__myfs_read_implem(fsptr, FS_SIZE, &err, path, buf, size, offset) != (int)size) {
+        return 0;
+    }
+    for (size_t i = 0; i < size; i++) {
+        if (buf[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void test_truncate_extends_with_a_hole(void *fsptr) {
+    int err;
+
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/t");
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/t", "0123456789", 10, 0);
+    size_t before = free_blocks(fsptr);
+
+    check(__myfs_truncate_implem(fsptr, FS_SIZE, &err, "/t", HUGE_SIZE) == 0,
+          "a file can be extended far beyond the size of the region");
+    struct stat st = stat_of(fsptr, "/t");
+    // The first bytes no longer fit into the node and take a block
+    check(st.st_size == HUGE_SIZE && st.st_blocks * 512 <= 4096,
+          "getattr reports its size, but just the blocks of its first bytes");
+    check(free_blocks(fsptr) == before, "the extension takes no space");
+
+    char buf[10];
+    check(__myfs_read_implem(fsptr, FS_SIZE, &err, "/t", buf, 10, 0) == 10 &&
+          memcmp(buf, "0123456789", 10) == 0, "the contents before the hole stay");
+    check(reads_zeros(fsptr, "/t", 10, BUF_SIZE) && reads_zeros(fsptr, "/t", HUGE_SIZE / 2, BUF_SIZE) &&
+          reads_zeros(fsptr, "/t", HUGE_SIZE - BUF_SIZE, BUF_SIZE), "the hole reads as zeros");
+    check(__myfs_read_implem(fsptr, FS_SIZE, &err, "/t", buf, 10, HUGE_SIZE) == 0,
+          "reads end at the new size");
+
+    __myfs_truncate_implem(fsptr, FS_SIZE, &err, "/t", 5);
+    check(stat_of(fsptr, "/t").st_size == 5 && free_blocks(fsptr) >= before,
+          "truncating it back gives nothing up but the size");
+}
+
+void test_writes_past_the_end(void *fsptr) {
+    static char data[BUF_SIZE];
+    int err;
+
+    memset(data, 'd', sizeof(data));
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/w");
+    size_t before = free_blocks(fsptr);
+
+    check(__myfs_write_implem(fsptr, FS_SIZE, &err, "/w", data, BUF_SIZE, HUGE_SIZE) == BUF_SIZE,
+          "a write far past the end succeeds");
+    struct stat st = stat_of(fsptr, "/w");
+    check(st.st_size == HUGE_SIZE + BUF_SIZE, "and extends the file");
+
+    struct statvfs stfs;
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &stfs);
+    size_t used = (before - stfs.f_bfree) * stfs.f_bsize;
+    check(used >= BUF_SIZE && used <= 2 * BUF_SIZE, "only the written bytes take space");
+    check((size_t)st.st_blocks * 512 >= BUF_SIZE && (size_t)st.st_blocks * 512 <= 2 * BUF_SIZE,
+          "and count as its blocks");
+
+    check(reads_zeros(fsptr, "/w", 0, BUF_SIZE) && reads_zeros(fsptr, "/w", HUGE_SIZE - 100, 100),
+          "the hole before them reads as zeros");
+
+    // A read spanning the end of the hole and the start of the data
+    static char buf[BUF_SIZE];
+    __myfs_read_implem(fsptr, FS_SIZE, &err, "/w", buf, 200, HUGE_SIZE - 100);
+    check(memcmp(buf + 100, data, 100) == 0 && reads_zeros(fsptr, "/w", HUGE_SIZE - 100, 100),
+          "reads across the edge of the hole see both");
+
+    // Writing into the hole fills just that part of it
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/w", "middle", 6, HUGE_SIZE / 2);
+    __myfs_read_implem(fsptr, FS_SIZE, &err, "/w", buf, 26, HUGE_SIZE / 2 - 10);
+    check(memcmp(buf + 10, "middle", 6) == 0 && reads_zeros(fsptr, "/w", HUGE_SIZE / 2 - 10, 10) &&
+          reads_zeros(fsptr, "/w", HUGE_SIZE / 2 + 6, 10), "a write into the hole fills only itself");
+
+    __myfs_unlink_implem(fsptr, FS_SIZE, &err, "/w");
+    check(free_blocks(fsptr) == before, "removing the file frees what was written");
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+
+    test_truncate_extends_with_a_hole(fsptr);
+    test_writes_past_the_end(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
@@ -0,0 +1,305 @@
+/*
+
+  Checks that operations from several threads, with online
+  defragmentation running alongside, leave every file as a
+  single-threaded model of it says it should be
+
+  gcc -Wall -pthread test_threads.c ../implementation.c -o test_threads
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+struct myfs_defrag_budget {
+    size_t nodes;
+    size_t bytes;
+    unsigned int interval_ms;
+};
+struct myfs_defrag;
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf);
+int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, char ***namesptr);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *from, const char *to);
+int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, off_t offset);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path, char *buf, size_t size, off_t offset);
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf);
+int __myfs_defrag_tick_implem(void *fsptr, size_t fssize, int *errnoptr,
+                              const struct myfs_defrag_budget *budget, size_t *movedptr);
+struct myfs_defrag *__myfs_defrag_start_implem(void *fsptr, size_t fssize, int *errnoptr,
+                                               const struct myfs_defrag_budget *budget);
+void __myfs_defrag_stop_implem(struct myfs_defrag *defrag);
+
+#define FS_SIZE ((size_t)64 << 20)
+#define THREADS 8
+#define FILES 6
+#define MAX_FILE 300000
+#define ITERATIONS 3000
+
+/* What a file of a thread should hold; size is -1 while it does not exist */
+struct model {
+    char *data;
+    long size;
+};
+
+static void *fsptr;
+static struct model models[THREADS][FILES];
+static size_t tick_moved[THREADS];
+static int op_failures[THREADS];
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+static void op_failed(int t, const char *op, const char *path, int err) {
+    printf("%s of %s failed, error %d\n", op, path, err);
+    op_failures[t]++;
+}
+
+/* Runs ITERATIONS random operations on the files of /t<t>, keeping
+   models[t] up to date, with reads and directory listings of the
+   other threads' files and defrag ticks of its own in between
+*/
+static void *worker(void *arg) {
+    int t = (int)(long)arg;
+    unsigned int seed = t * 7919 + 1;
+    char *buf = malloc(MAX_FILE);
+    char path[64], other[64];
+    struct stat st;
+    int err;
+
+    sprintf(path, "/t%d", t);
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, path);
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        int f = rand_r(&seed) % FILES;
+        struct model *m = &models[t][f];
+        sprintf(path, "/t%d/f%d", t, f);
+
+        switch (rand_r(&seed) % 10) {
+        case 0:
+            if (m->size < 0) {
+                if (__myfs_mknod_implem(fsptr, FS_SIZE, &err, path) < 0) {
+                    op_failed(t, "mknod", path, err);
+                } else {
+                    m->size = 0;
+                }
+            }
+            break;
+        case 1:
+        case 2:
+        case 3: {
+            // Mostly small writes near the start, to leave many extents
+            long offset = rand_r(&seed) % (rand_r(&seed) % 2 ? 300 : 200000);
+            long size = 1 + rand_r(&seed) % (rand_r(&seed) % 3 ? 3000 : 90000);
+            if (m->size < 0) {
+                break;
+            }
+            for (long j = 0; j < size; j++) {
+                buf[j] = (char)rand_r(&seed);
+            }
+            if (__myfs_write_implem(fsptr, FS_SIZE, &err, path, buf, size, offset) != size) {
+                op_failed(t, "write", path, err);
+                break;
+            }
+            memcpy(m->data + offset, buf, size);
+            if (offset + size > m->size) {
+                m->size = offset + size;
+            }
+            break;
+        }
+        case 4: {
+            long size = rand_r(&seed) % 250000;
+            if (m->size < 0) {
+                break;
+            }
+            if (__myfs_truncate_implem(fsptr, FS_SIZE, &err, path, size) < 0) {
+                op_failed(t, "truncate", path, err);
+                break;
+            }
+            if (size < m->size) {
+                memset(m->data + size, 0, m->size - size);
+            }
+            m->size = size;
+            break;
+        }
+        case 5: {
+            if (m->size < 0) {
+                break;
+            }
+            long offset = rand_r(&seed) % (m->size + 1);
+            long expected = m->size - offset;
+            if (__myfs_read_implem(fsptr, FS_SIZE, &err, path, buf, MAX_FILE, offset) != expected ||
+                memcmp(buf, m->data + offset, expected) != 0) {
+                op_failed(t, "read", path, err);
+            }
+            break;
+        }
+        case 6:
+            if (m->size < 0) {
+                break;
+            }
+            if (__myfs_unlink_implem(fsptr, FS_SIZE, &err, path) < 0) {
+                op_failed(t, "unlink", path, err);
+                break;
+            }
+            memset(m->data, 0, m->size);
+            m->size = -1;
+            break;
+        case 7: {
+            int g = rand_r(&seed) % FILES;
+            struct model *to = &models[t][g];
+            if (g == f || m->size < 0) {
+                break;
+            }
+            sprintf(other, "/t%d/f%d", t, g);
+            if (__myfs_rename_implem(fsptr, FS_SIZE, &err, path, other) < 0) {
+                op_failed(t, "rename", path, err);
+                break;
+            }
+            char *data = to->data;
+            if (to->size > 0) {
+                memset(data, 0, to->size);
+            }
+            *to = *m;
+            m->data = data;
+            m->size = -1;
+            break;
+        }
+        case 8: {
+            // Look at what the other threads are doing
+            char **names = NULL;
+            struct statvfs sv;
+            sprintf(other, "/t%d", rand_r(&seed) % THREADS);
+            int n = __myfs_readdir_implem(fsptr, FS_SIZE, &err, other, &names);
+            for (int j = 0; j < n; j++) {
+                free(names[j]);
+            }
+            free(names);
+            sprintf(other, "/t%d/f%d", rand_r(&seed) % THREADS, rand_r(&seed) % FILES);
+            __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, other, &st);
+            __myfs_read_implem(fsptr, FS_SIZE, &err, other, buf, 50000, rand_r(&seed) % 100000);
+            __myfs_statfs_implem(fsptr, FS_SIZE, &err, &sv);
+            break;
+        }
+        case 9: {
+            struct myfs_defrag_budget budget = { 4, 1 << 16, 0 };
+            size_t moved = 0;
+            if (__myfs_defrag_tick_implem(fsptr, FS_SIZE, &err, &budget, &moved) < 0) {
+                op_failed(t, "defrag tick", "/", err);
+            }
+            tick_moved[t] += moved;
+            break;
+        }
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Returns the number of files that differ from their model */
+static int verify() {
+    char *buf = malloc(MAX_FILE);
+    char path[64];
+    struct stat st;
+    int err;
+    int bad = 0;
+
+    for (int t = 0; t < THREADS; t++) {
+        for (int f = 0; f < FILES; f++) {
+            struct model *m = &models[t][f];
+            sprintf(path, "/t%d/f%d", t, f);
+            int res = __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, path, &st);
+            if (m->size < 0) {
+                bad += res == 0;
+                continue;
+            }
+            if (res < 0 || st.st_size != m->size ||
+                __myfs_read_implem(fsptr, FS_SIZE, &err, path, buf, MAX_FILE, 0) != m->size ||
+                memcmp(buf, m->data, m->size) != 0) {
+                printf("%s differs from its model\n", path);
+                bad++;
+            }
+        }
+    }
+    free(buf);
+    return bad;
+}
+
+void test_mixed_workload_with_defrag() {
+    struct myfs_defrag_budget budget = { 20, 1 << 18, 2 };
+    pthread_t threads[THREADS];
+    int err;
+
+    struct myfs_defrag *defrag = __myfs_defrag_start_implem(fsptr, FS_SIZE, &err, &budget);
+    check(defrag != NULL, "start defrag thread");
+    for (long t = 0; t < THREADS; t++) {
+        pthread_create(&threads[t], NULL, worker, (void *)t);
+    }
+    for (int t = 0; t < THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    if (defrag != NULL) {
+        __myfs_defrag_stop_implem(defrag);
+    }
+
+    int failed_ops = 0;
+    size_t moved = 0;
+    for (int t = 0; t < THREADS; t++) {
+        failed_ops += op_failures[t];
+        moved += tick_moved[t];
+    }
+    check(failed_ops == 0, "every operation of every thread succeeds");
+    check(moved > 0, "defrag ticks move data");
+    check(verify() == 0, "every file matches its model");
+
+    // Defragmenting the quiet filesystem must not change it either
+    size_t tick = 1;
+    for (int i = 0; i < 1000 && tick > 0; i++) {
+        __myfs_defrag_tick_implem(fsptr, FS_SIZE, &err, &budget, &tick);
+    }
+    check(verify() == 0, "every file matches its model after a full defrag");
+}
+
+int main() {
+    fsptr = calloc(1, FS_SIZE);
+    for (int t = 0; t < THREADS; t++) {
+        for (int f = 0; f < FILES; f++) {
+            models[t][f].data = calloc(1, MAX_FILE);
+            models[t][f].size = -1;
+        }
+    }
+
+    test_mixed_workload_with_defrag();
+
+    for (int t = 0; t < THREADS; t++) {
+        for (int f = 0; f < FILES; f++) {
+            free(models[t][f].data);
+        }
+    }
+    free(fsptr);
+    return failures != 0;
+}
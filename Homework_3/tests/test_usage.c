@@ -0,0 +1,153 @@
+/*
+
+  Checks that statfs reports sensible numbers for a new filesystem,
+  even in a region that held garbage before, and that the counters
+  behind it follow every allocation and free, back to where they
+  started once everything is removed again
+
+  gcc -Wall -pthread test_usage.c ../implementation.c -o test_usage
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/statvfs.h>
+
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *from, const char *to);
+int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, off_t offset);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf);
+
+#define FS_SIZE ((size_t)8 << 20)
+#define DIRS 8
+#define FILES 64
+#define OPERATIONS 5000
+#define WRITE_SIZE 100000
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+static struct statvfs statfs(void *fsptr) {
+    struct statvfs st;
+    int err;
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &st);
+    return st;
+}
+
+void test_new_filesystem(void *fsptr) {
+    struct statvfs st = statfs(fsptr);
+
+    check(st.f_bsize > 0 && st.f_frsize == st.f_bsize, "block size is set");
+    check(st.f_blocks * st.f_bsize <= FS_SIZE && st.f_blocks * st.f_bsize > FS_SIZE / 2,
+          "block count matches the size of the region");
+    check(st.f_bfree <= st.f_blocks && st.f_bfree > st.f_blocks * 9 / 10 &&
+          st.f_bavail == st.f_bfree, "nearly all blocks are free");
+    check(st.f_ffree <= st.f_files && st.f_files - st.f_ffree == 2, "two nodes are used");
+    check(st.f_namemax == 255, "names can have 255 bytes");
+}
+
+void test_writes_are_counted(void *fsptr) {
+    static char data[WRITE_SIZE];
+    int err;
+
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/w");
+    struct statvfs before = statfs(fsptr);
+    __myfs_write_implem(fsptr, FS_SIZE, &err, "/w", data, WRITE_SIZE, 0);
+    struct statvfs after = statfs(fsptr);
+    size_t used = (before.f_bfree - after.f_bfree) * before.f_bsize;
+    check(used >= WRITE_SIZE - before.f_bsize && used <= WRITE_SIZE + 2 * before.f_bsize,
+          "a write takes about as many blocks as it has bytes");
+
+    __myfs_unlink_implem(fsptr, FS_SIZE, &err, "/w");
+    after = statfs(fsptr);
+    check(after.f_bfree == before.f_bfree && after.f_files - after.f_ffree ==
+          before.f_files - before.f_ffree - 1, "removing the file gives them back with its node");
+}
+
+void test_counters_return(void *fsptr) {
+    static char data[WRITE_SIZE];
+    static char exists[DIRS][FILES];
+    unsigned int seed = 1;
+    char path[32], other[32];
+    int err;
+
+    struct statvfs before = statfs(fsptr);
+    for (int d = 0; d < DIRS; d++) {
+        sprintf(path, "/d%d", d);
+        __myfs_mkdir_implem(fsptr, FS_SIZE, &err, path);
+    }
+    for (int i = 0; i < OPERATIONS; i++) {
+        int d = rand_r(&seed) % DIRS, f = rand_r(&seed) % FILES;
+        sprintf(path, "/d%d/f%d", d, f);
+        switch (rand_r(&seed) % 5) {
+        case 0:
+            exists[d][f] |= __myfs_mknod_implem(fsptr, FS_SIZE, &err, path) == 0;
+            break;
+        case 1:
+            exists[d][f] &= __myfs_unlink_implem(fsptr, FS_SIZE, &err, path) != 0;
+            break;
+        case 2:
+            __myfs_write_implem(fsptr, FS_SIZE, &err, path, data, rand_r(&seed) % WRITE_SIZE,
+                                rand_r(&seed) % WRITE_SIZE);
+            break;
+        case 3:
+            __myfs_truncate_implem(fsptr, FS_SIZE, &err, path, rand_r(&seed) % WRITE_SIZE);
+            break;
+        default: {
+            int to_d = rand_r(&seed) % DIRS, to_f = rand_r(&seed) % FILES;
+            sprintf(other, "/d%d/f%d", to_d, to_f);
+            if (__myfs_rename_implem(fsptr, FS_SIZE, &err, path, other) == 0) {
+                exists[d][f] = 0;
+                exists[to_d][to_f] = 1;
+            }
+        }
+        }
+    }
+    struct statvfs during = statfs(fsptr);
+    check(during.f_bfree < before.f_bfree && during.f_ffree < before.f_ffree,
+          "files in use take blocks and nodes");
+
+    for (int d = 0; d < DIRS; d++) {
+        for (int f = 0; f < FILES; f++) {
+            if (exists[d][f]) {
+                sprintf(path, "/d%d/f%d", d, f);
+                __myfs_unlink_implem(fsptr, FS_SIZE, &err, path);
+            }
+        }
+        sprintf(path, "/d%d", d);
+        __myfs_rmdir_implem(fsptr, FS_SIZE, &err, path);
+    }
+    struct statvfs after = statfs(fsptr);
+    check(after.f_bfree == before.f_bfree && after.f_ffree == before.f_ffree &&
+          after.f_files == before.f_files, "removing everything brings the counts back");
+}
+
+int main() {
+    // Whatever the region held before, a new filesystem is set up in it
+    void *fsptr = malloc(FS_SIZE);
+    memset(fsptr, 0xab, FS_SIZE);
+
+    test_new_filesystem(fsptr);
+    test_writes_are_counted(fsptr);
+    test_counters_return(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
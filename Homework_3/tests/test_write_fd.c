@@ -0,0 +1,106 @@
+/*
+
+  Checks that __myfs_write_fd_implem only reads from non-blocking file
+  descriptors, and takes what they have ready without waiting for more
+
+  gcc -Wall -pthread test_write_fd.c ../implementation.c -o test_write_fd
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path, char *buf, size_t size, off_t offset);
+int __myfs_write_fd_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path,
+                           uint64_t fh, int fd, size_t size, off_t offset);
+
+#define FS_SIZE ((size_t)16 << 20)
+#define DATA_SIZE 50000
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+static long file_size(void *fsptr, const char *path) {
+    struct stat st;
+    int err;
+    return __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, path, &st) == 0 ? st.st_size : -1;
+}
+
+void test_blocking_fd_is_refused(void *fsptr) {
+    int pipefd[2];
+    int err = 0;
+
+    pipe(pipefd);
+    write(pipefd[1], "data", 4);
+    int res = __myfs_write_fd_implem(fsptr, FS_SIZE, &err, "/f", 0, pipefd[0], 4, 0);
+    check(res == -1 && err == EINVAL, "blocking file descriptor fails with EINVAL");
+    check(file_size(fsptr, "/f") == 0, "nothing gets written from it");
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    err = 0;
+    res = __myfs_write_fd_implem(fsptr, FS_SIZE, &err, "/f", 0, -1, 4, 0);
+    check(res == -1 && err == EBADF, "bad file descriptor fails with EBADF");
+}
+
+void test_takes_what_is_ready(void *fsptr) {
+    static char data[DATA_SIZE], buf[DATA_SIZE];
+    int pipefd[2];
+    int err;
+
+    for (size_t i = 0; i < DATA_SIZE; i++) {
+        data[i] = (char)(i * 7);
+    }
+    pipe(pipefd);
+    fcntl(pipefd[0], F_SETFL, fcntl(pipefd[0], F_GETFL) | O_NONBLOCK);
+
+    // The writing end stays open: a blocking read would wait forever
+    write(pipefd[1], data, DATA_SIZE);
+    int res = __myfs_write_fd_implem(fsptr, FS_SIZE, &err, "/f", 0, pipefd[0], 2 * DATA_SIZE, 0);
+    check(res == DATA_SIZE, "write takes the bytes ready and returns");
+    check(file_size(fsptr, "/f") == DATA_SIZE &&
+          __myfs_read_implem(fsptr, FS_SIZE, &err, "/f", buf, DATA_SIZE, 0) == DATA_SIZE &&
+          memcmp(buf, data, DATA_SIZE) == 0, "file holds the bytes taken");
+
+    err = 0;
+    res = __myfs_write_fd_implem(fsptr, FS_SIZE, &err, "/f", 0, pipefd[0], 10, DATA_SIZE);
+    check(res == -1 && err == EAGAIN, "empty pipe fails with EAGAIN");
+    check(file_size(fsptr, "/f") == DATA_SIZE, "and leaves the file alone");
+
+    close(pipefd[1]);
+    err = 0;
+    res = __myfs_write_fd_implem(fsptr, FS_SIZE, &err, "/f", 0, pipefd[0], 10, DATA_SIZE);
+    check(res == -1 && err == EIO, "closed pipe fails with EIO");
+    close(pipefd[0]);
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+    int err;
+
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/f");
+    test_blocking_fd_is_refused(fsptr);
+    test_takes_what_is_ready(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
@@ -0,0 +1,147 @@
+/*
+
+  Checks that __myfs_write_iov_implem writes the buffers of a vector
+  one after the other, over existing contents and past the end of a
+  file, and that large writes land in few extents
+
+  gcc -Wall -pthread test_write_iov.c ../implementation.c -o test_write_iov
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf);
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path, char *buf, size_t size, off_t offset);
+int __myfs_write_iov_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path,
+                            uint64_t fh, const struct iovec *iov, int iovcnt, off_t offset);
+int __myfs_read_iov_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, uint64_t fh, size_t size, off_t offset,
+                           struct iovec **iovptr, int *iovcntptr, void **pinptr);
+int __myfs_read_iov_done_implem(void *fsptr, size_t fssize, int *errnoptr, void *pin);
+
+#define FS_SIZE ((size_t)16 << 20)
+#define LARGE_SIZE ((size_t)4 << 20)
+#define CHUNK 4096  // As FUSE hands a large write over in pages
+#define MAX_PIECES 8
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+static long file_size(void *fsptr, const char *path) {
+    struct stat st;
+    int err;
+    return __myfs_getattr_implem(fsptr, FS_SIZE, &err, 0, 0, path, &st) == 0 ? st.st_size : -1;
+}
+
+/* Returns 1 if the len bytes at offset of the file at path are expected */
+static int holds(void *fsptr, const char *path, const char *expected, size_t len, off_t offset) {
+    char *buf = malloc(len);
+    int err;
+    int ok = __myfs_read_implem(fsptr, FS_SIZE, &err, path, buf, len, offset) == (int)len &&
+             memcmp(buf, expected, len) == 0;
+    free(buf);
+    return ok;
+}
+
+void test_buffers_in_order(void *fsptr) {
+    char one[] = "first,", two[] = "", three[] = "second,", four[] = "third";
+    struct iovec iov[] = {
+        { one, strlen(one) }, { two, 0 }, { three, strlen(three) }, { four, strlen(four) }
+    };
+    int err;
+
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/v");
+    check(__myfs_write_iov_implem(fsptr, FS_SIZE, &err, "/v", 0, iov, 4, 0) == 18 &&
+          holds(fsptr, "/v", "first,second,third", 18, 0), "buffers are written one after the other");
+
+    // Over what is there, and past the end
+    struct iovec over[] = { { "SECOND", 6 }, { ",fourth", 7 } };
+    check(__myfs_write_iov_implem(fsptr, FS_SIZE, &err, "/v", 0, over, 2, 6) == 13 &&
+          holds(fsptr, "/v", "first,SECOND,fourth", 19, 0) && file_size(fsptr, "/v") == 19,
+          "they overwrite and extend the file");
+
+    struct iovec far[] = { { "end", 3 } };
+    char zeros[100] = { 0 };
+    check(__myfs_write_iov_implem(fsptr, FS_SIZE, &err, "/v", 0, far, 1, 119) == 3 &&
+          holds(fsptr, "/v", zeros, 100, 19) && holds(fsptr, "/v", "end", 3, 119),
+          "a write past the end leaves zeros in between");
+
+    check(__myfs_write_iov_implem(fsptr, FS_SIZE, &err, "/v", 0, iov, 0, 0) == 0 &&
+          file_size(fsptr, "/v") == 122, "an empty vector writes nothing");
+}
+
+void test_errors(void *fsptr) {
+    struct iovec iov[] = { { "x", 1 } };
+    int err;
+
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/dir");
+    err = 0;
+    check(__myfs_write_iov_implem(fsptr, FS_SIZE, &err, "/dir", 0, iov, 1, 0) == -1 &&
+          err == EISDIR, "writing to a directory fails with EISDIR");
+    err = 0;
+    check(__myfs_write_iov_implem(fsptr, FS_SIZE, &err, "/missing", 0, iov, 1, 0) == -1 &&
+          err == ENOENT, "writing to a missing file fails with ENOENT");
+}
+
+void test_large_write(void *fsptr) {
+    char *data = malloc(LARGE_SIZE);
+    struct iovec *iov = malloc(LARGE_SIZE / CHUNK * sizeof(struct iovec));
+    int err;
+
+    for (size_t i = 0; i < LARGE_SIZE; i++) {
+        data[i] = (char)(i * 11 + i / 4096);
+    }
+    for (size_t i = 0; i < LARGE_SIZE / CHUNK; i++) {
+        iov[i].iov_base = data + i * CHUNK;
+        iov[i].iov_len = CHUNK;
+    }
+    __myfs_mknod_implem(fsptr, FS_SIZE, &err, "/large");
+    check(__myfs_write_iov_implem(fsptr, FS_SIZE, &err, "/large", 0, iov,
+                                  LARGE_SIZE / CHUNK, 0) == (int)LARGE_SIZE &&
+          holds(fsptr, "/large", data, LARGE_SIZE, 0), "a large vector is written whole");
+
+    // One write makes extents as large as they get, not one per buffer
+    struct iovec *out;
+    int cnt = 0;
+    void *pin;
+    if (__myfs_read_iov_implem(fsptr, FS_SIZE, &err, "/large", 0, LARGE_SIZE, 0, &out, &cnt,
+                               &pin) == (int)LARGE_SIZE) {
+        __myfs_read_iov_done_implem(fsptr, FS_SIZE, &err, pin);
+        free(out);
+    }
+    check(cnt > 0 && cnt <= MAX_PIECES, "it lands in a few large extents");
+    free(iov);
+    free(data);
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+
+    test_buffers_in_order(fsptr);
+    test_errors(fsptr);
+    test_large_write(fsptr);
+
+    free(fsptr);
+    return failures != 0;
+}
@@ -0,0 +1,202 @@
+/*
+
+  Checks that file contents of every size stay out of the metadata
+  heap at the front of the region: large extents take whole blocks of
+  the data zone, small ones share fragment blocks, and extents the heap
+  had to take while the zone was full get moved into the zone by the
+  defragmenter once it has room again
+
+  gcc -Wall -pthread test_zones.c ../implementation.c -o test_zones
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/statvfs.h>
+
+struct myfs_defrag_budget {
+    size_t nodes;
+    size_t bytes;
+    unsigned int interval_ms;
+};
+
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr, const char *path);
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset);
+int __myfs_read_iov_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, uint64_t fh, size_t size, off_t offset,
+                           struct iovec **iovptr, int *iovcntptr, void **pinptr);
+int __myfs_read_iov_done_implem(void *fsptr, size_t fssize, int *errnoptr, void *pin);
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr, struct statvfs *stbuf);
+int __myfs_defrag_tick_implem(void *fsptr, size_t fssize, int *errnoptr,
+                              const struct myfs_defrag_budget *budget, size_t *movedptr);
+
+#define FS_SIZE ((size_t)8 << 20)
+#define HEAP_SIZE (FS_SIZE / 8)  // What the heap starts out with
+#define FILES 300
+#define DIR_FILES 500
+#define DATA_SIZE 100201  // The largest file of test_contents_stay_out_of_the_heap
+#define SMALL_FILES 64
+#define SMALL 300
+#define LATE 3000
+#define TICKS 1000
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (ok) {
+        printf("Passed: %s\n", what);
+    } else {
+        printf("Failed: %s\n", what);
+        failures++;
+    }
+}
+
+/* Returns the lowest offset in the region of the len bytes of the file
+   at path, or 0 if they do not hold expected. Puts the offset of the
+   block each piece starts in into blocks, if it is not NULL.
+*/
+static size_t lowest(void *fsptr, const char *path, const char *expected, size_t len,
+                     size_t *blocks) {
+    struct statvfs st;
+    struct iovec *iov;
+    int cnt, err;
+    void *pin;
+
+    __myfs_statfs_implem(fsptr, FS_SIZE, &err, &st);
+    if (__myfs_read_iov_implem(fsptr, FS_SIZE, &err, path, 0, len, 0, &iov, &cnt, &pin) !=
+        (int)len) {
+        return 0;
+    }
+    size_t low = FS_SIZE, pos = 0;
+    for (int i = 0; i < cnt; i++) {
+        size_t start = (size_t)((char *)iov[i].iov_base - (char *)fsptr);
+        if (pos + iov[i].iov_len > len || memcmp(iov[i].iov_base, expected + pos,
+                                                 iov[i].iov_len) != 0) {
+            low = 0;
+        }
+        if (start < low) {
+            low = start;
+        }
+        if (blocks != NULL) {
+            blocks[i] = start / st.f_bsize;
+        }
+        pos += iov[i].iov_len;
+    }
+    __myfs_read_iov_done_implem(fsptr, FS_SIZE, &err, pin);
+    free(iov);
+    return pos == len ? low : 0;
+}
+
+void test_contents_stay_out_of_the_heap(void *fsptr, const char *data) {
+    char path[32];
+    int err, in_heap = 0;
+    unsigned int seed = 1;
+    static size_t sizes[FILES];
+
+    // Files of all sizes past those kept in the node, among a growing tree
+    __myfs_mkdir_implem(fsptr, FS_SIZE, &err, "/dir");
+    for (int i = 0; i < FILES; i++) {
+        sizes[i] = 201 + rand_r(&seed) % (i % 10 == 0 ? DATA_SIZE - 201 : 5000);
+        sprintf(path, "/file%d", i);
+        __myfs_mknod_implem(fsptr, FS_SIZE, &err, path);
+        __myfs_write_implem(fsptr, FS_SIZE, &err, path, data, sizes[i], 0);
+        sprintf(path, "/dir/empty%d", i);
+        __myfs_mknod_implem(fsptr, FS_SIZE, &err, path);
+    }
+    for (int i = FILES; i < DIR_FILES; i++) {
+        sprintf(path, "/dir/empty%d", i);
+        __myfs_mknod_implem(fsptr, FS_SIZE, &err, path);
+    }
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/file%d", i);
+        in_heap += lowest(fsptr, path, data, sizes[i], NULL) < HEAP_SIZE;
+    }
+    check(in_heap == 0, "no file contents are kept in the heap");
+
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/file%d", i);
+        __myfs_unlink_implem(fsptr, FS_SIZE, &err, path);
+    }
+}
+
+void test_small_extents_share_blocks(void *fsptr, const char *data) {
+    static size_t blocks[SMALL_FILES];
+    char path[32];
+    int err, distinct = 0;
+
+    for (int i = 0; i < SMALL_FILES; i++) {
+        sprintf(path, "/small%d", i);
+        __myfs_mknod_implem(fsptr, FS_SIZE, &err, path);
+        __myfs_write_implem(fsptr, FS_SIZE, &err, path, data, SMALL, 0);
+        lowest(fsptr, path, data, SMALL, &blocks[i]);
+        int seen = 0;
+        for (int j = 0; j < i; j++) {
+            seen |= blocks[j] == blocks[i];
+        }
+        distinct += !seen;
+    }
+    // At least four slots fit into every fragment block
+    check(distinct <= SMALL_FILES / 3, "small extents share fragment blocks");
+
+    for (int i = 0; i < SMALL_FILES; i++) {
+        sprintf(path, "/small%d", i);
+        __myfs_unlink_implem(fsptr, FS_SIZE, &err, path);
+    }
+}
+
+void test_defrag_moves_extents_out_of_the_heap(void *fsptr, const char *data) {
+    struct myfs_defrag_budget budget = { 100, 1 << 20, 0 };
+    char path[32];
+    size_t moved;
+    int err, fill = 0;
+
+    // Fill the zone until a file has to be kept in the heap
+    for (;;) {
+        sprintf(path, "/fill%d", fill);
+        __myfs_mknod_implem(fsptr, FS_SIZE, &err, path);
+        if (__myfs_write_implem(fsptr, FS_SIZE, &err, path, data, LATE, 0) != LATE) {
+            break;
+        }
+        fill++;
+        if (lowest(fsptr, path, data, LATE, NULL) < HEAP_SIZE) {
+            break;
+        }
+    }
+    char late[32];
+    strcpy(late, path);
+    size_t before = lowest(fsptr, late, data, LATE, NULL);
+    check(before > 0 && before < HEAP_SIZE, "once the zone is full, extents come from the heap");
+
+    for (int i = 0; i < fill - 1; i++) {
+        sprintf(path, "/fill%d", i);
+        __myfs_unlink_implem(fsptr, FS_SIZE, &err, path);
+    }
+    for (int i = 0; i < TICKS; i++) {
+        __myfs_defrag_tick_implem(fsptr, FS_SIZE, &err, &budget, &moved);
+    }
+    check(lowest(fsptr, late, data, LATE, NULL) >= HEAP_SIZE,
+          "the defragmenter moves them into the zone once it has room");
+}
+
+int main() {
+    void *fsptr = calloc(1, FS_SIZE);
+    char *data = malloc(DATA_SIZE);
+
+    for (size_t i = 0; i < DATA_SIZE; i++) {
+        data[i] = (char)(i * 7 + i / 251);
+    }
+    test_contents_stay_out_of_the_heap(fsptr, data);
+    test_small_extents_share_blocks(fsptr, data);
+    test_defrag_moves_extents_out_of_the_heap(fsptr, data);
+
+    free(data);
+    free(fsptr);
+    return failures != 0;
+}